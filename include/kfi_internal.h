@@ -13,6 +13,15 @@
 #include <linux/rbtree.h>
 #include <linux/hashtable.h>
 #include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/refcount.h>
+#include <linux/socket.h>
+#include <linux/xarray.h>
+#include <linux/topology.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/sunrpc/xprt.h>
+#include <linux/sunrpc/svc_xprt.h>
 #include <rdma/ib_verbs.h>
 #include <rdma/kfi/fabric.h>
 #include <rdma/kfi/endpoint.h>
@@ -34,10 +43,92 @@
 #define KFI_DEFAULT_QP_DEPTH    256
 #define KFI_PROGRESS_INTERVAL   100     /* usec */
 
+/* RPC busy-poll (cf. net.core.busy_poll) */
+#define KFI_BUSY_POLL_MAX_USEC  1000    /* Upper bound on per-wait budget */
+#define KFI_BUSY_POLL_BATCH     8       /* Completions reaped per pass */
+
 /* VNI defaults */
 #define KFI_DEFAULT_VNI         0       /* 0 = use system default */
 #define KFI_VNI_MAX             65535
 
+/* Shared address vector */
+#define KFI_AV_DEFAULT_COUNT    1024    /* Initial AV sizing hint */
+#define KFI_AV_HASH_BITS        10
+#define KFI_AV_IDLE_SECS        300     /* Lazy peer eviction (server) */
+
+/* Pre-created endpoint pool */
+#define KFI_EP_POOL_DEFAULT     8       /* Idle endpoints kept per device */
+#define KFI_EP_POOL_MAX         1024
+#define KFI_EP_POOL_QUIESCE_MS  100     /* Max wait for a released EP to drain */
+
+/* Scalable endpoints */
+#define KFI_SEP_OFF             0
+#define KFI_SEP_PER_CPU         1
+#define KFI_SEP_PER_NODE        2
+#define KFI_SEP_MAX_TX_CTX      64
+#define KFI_SEP_MAX_RX_CTX      16
+#define KFI_SEP_RX_CTX_BITS     4       /* order_base_2(KFI_SEP_MAX_RX_CTX) */
+
+/* Multi-rail */
+#define KFI_MAX_RAILS           KFI_MAX_DEVICES
+#define KFI_RAIL_REMOTE_PENALTY (1024 * 1024)   /* Cross-NUMA cost, in bytes */
+
+/* CXI traffic classes (auth key / communication profile) */
+#define KFI_TC_BEST_EFFORT      0
+#define KFI_TC_LOW_LATENCY      1
+#define KFI_TC_BULK_DATA        2
+#define KFI_TC_DEDICATED_ACCESS 3
+#define KFI_TC_MAX              KFI_TC_DEDICATED_ACCESS
+
+/* Metadata/data lanes */
+#define KFI_LANE_META_MAX       8192    /* Largest payload kept on the meta lane */
+
+/* Submission scheduler (deficit round robin) */
+#define KFI_SCHED_QUANTUM       (64 * 1024)         /* Bytes per round per unit weight */
+#define KFI_SCHED_INFLIGHT      (8 * 1024 * 1024)   /* Device-wide bytes in flight */
+#define KFI_SCHED_WEIGHT_DEFAULT 100
+#define KFI_SCHED_WEIGHT_MAX    10000
+#define KFI_SCHED_KEY_MOUNT     0
+#define KFI_SCHED_KEY_CGROUP    1
+
+/* Client transport (RPC-over-RDMA Version One) */
+#define KFI_XPRT_SLOTS          128     /* Slot table size and credits requested */
+#define KFI_XPRT_MAX_SLOTS      1024
+#define KFI_XPRT_EXTRA_RECVS    2       /* Receives posted beyond the credit limit */
+#define KFI_XPRT_INLINE_SIZE    4096    /* RFC 8166 default inline threshold */
+#define KFI_XPRT_INLINE_MIN     1024    /* Smallest inline threshold RFC 8166 allows */
+#define KFI_XPRT_MAX_SEGS       128     /* Registered segments per chunk */
+#define KFI_XPRT_POLL_BATCH     16      /* Completions reaped per CQ pass */
+#define KFI_XPRT_POLL_SPIN      64      /* Empty passes before the poller naps */
+#define KFI_XPRT_POLL_MIN_USEC  10
+#define KFI_XPRT_POLL_MAX_USEC  1000    /* Longest nap while RPCs are pending */
+#define KFI_XPRT_BIND_TO        (60U * HZ)
+#define KFI_XPRT_INIT_REEST_TO  (5U * HZ)
+#define KFI_XPRT_MAX_REEST_TO   (30U * HZ)
+#define KFI_XPRT_IDLE_DISC_TO   (5U * 60 * HZ)
+#define KFI_XPRT_INLINE_V2_SIZE 32768   /* Inline threshold offered in Version Two */
+#define KFI_XPRT_INLINE_V2_MAX  65536
+#define KFI_XPRT_MAX_CONT       8       /* Sends one continued reply may span */
+#define KFI_XPRT_NEGOTIATE_TO   (2U * HZ)       /* Wait for the server's properties */
+#define KFI_XPRT_COALESCE       16      /* Calls per multi-call envelope */
+#define KFI_XPRT_MULTI_BUFS     4       /* Envelopes per transport */
+#define KFI_XPRT_BC_SLOTS       8       /* Callbacks the server may have outstanding */
+#define KFI_XPRT_QUEUES         8       /* Default cap on queues per transport */
+#define KFI_XPRT_MAX_QUEUES     64
+
+/* Credits and congestion window */
+#define KFI_CWND_SRTT_SHIFT     3       /* srtt kept scaled by 8, as in TCP */
+#define KFI_CWND_RTT_SLACK_US   50      /* Queueing delay tolerated below min_rtt/2 */
+#define KFI_CWND_MIN_RTT_WIN_US (10ULL * USEC_PER_SEC)  /* min_rtt forgotten after */
+#define KFI_SVC_CREDIT_STEP     8       /* Largest grant increase per reply */
+
+/* Transfer size tuning */
+#define KFI_TUNE_MIN_SHIFT      10      /* Smallest size class: 1 KiB */
+#define KFI_TUNE_CLASSES        11      /* Power-of-two classes, up to 1 MiB */
+#define KFI_TUNE_PROBE          32      /* One READ in this many probes the other way */
+#define KFI_TUNE_MIN_SAMPLES    8       /* Samples before a class is trusted */
+#define KFI_TUNE_KNEE_PCT       90      /* Share of the best bandwidth that suffices */
+
 /* Memory registration cache sizes */
 #define KFI_MR_CACHE_SIZE       1024
 #define KFI_MR_MAX_REGIONS      8192
@@ -57,6 +148,23 @@
  * @name: Device name
  * @list: List entry for global device list
  * @mr_cache: Memory registration cache
+ * @av_cache: Shared address vector for all endpoints on this device
+ * @ep_pool: Pre-created, enabled endpoints with the device's default auth
+ *           key, ready for new connections
+ * @ep_pools: Every endpoint pool, one per (VNI, traffic class), @ep_pool
+ *            first
+ * @ep_pool_lock: Protects @ep_pools
+ * @qps: QP number allocator (synthetic qp_num -> kfi_qp)
+ * @numa_node: NUMA node the NIC is attached to, or NUMA_NO_NODE
+ * @sep_mode: KFI_SEP_* mode for QPs created on this device
+ * @sep_rx: Receive contexts per scalable endpoint
+ * @auth_keys: Cached auth keys, one per (VNI, service, traffic class)
+ * @auth_key_lock: Protects @auth_keys
+ * @nr_auth_keys: Number of entries in @auth_keys
+ * @default_vni: VNI from the CXI service, resolved at open (0 = none)
+ * @sched: Submission scheduler shared by every mount on the device
+ * @opening: Set while the first caller is still bringing the device up
+ * @ref: References from the device list, endpoint pools and transports
  * @default_cq: Default CQ for progress thread
  * @progress_thread: Progress thread handle
  */
@@ -71,11 +179,97 @@ struct kfi_device {
     /* Memory registration cache */
     struct kfi_mr_cache *mr_cache;
     
+    /* Peer addressing */
+    struct kfi_av_cache *av_cache;
+    
+    /* Connection setup */
+    struct kfi_ep_pool *ep_pool;
+    struct list_head ep_pools;
+    struct mutex ep_pool_lock;
+    struct xarray qps;
+    int numa_node;
+    int sep_mode;
+    int sep_rx;
+    
+    /* Authentication */
+    struct list_head auth_keys;
+    spinlock_t auth_key_lock;
+    atomic_t nr_auth_keys;
+    uint16_t default_vni;
+    
+    /* Multi-tenant fairness */
+    struct kfi_sched *sched;
+    bool opening;
+
+    /* Held by kfi_device_list, each endpoint pool and each transport */
+    refcount_t ref;
+    
     /* Progress engine */
     struct kfid_cq *default_cq;
     struct task_struct *progress_thread;
 };
 
+/*
+ * ============================================================================
+ * ADDRESS VECTOR
+ * ============================================================================
+ */
+
+/**
+ * struct kfi_av_entry - Cached peer address in the shared AV
+ * @key: Canonical peer address (lookup key)
+ * @keylen: Significant bytes of @key
+ * @fi_addr: Provider address handle used for data transfers
+ * @refcount: Number of QPs using this peer (+1 if held by the cache)
+ * @flags: KFI_AV_F_* flags
+ * @last_used: Jiffies of last message from/to this peer
+ * @vers: RPC-over-RDMA version the server last answered an offer with
+ *        (0 = unknown)
+ * @node: Hash table node
+ * @rcu: Deferred free for lockless lookups
+ */
+struct kfi_av_entry {
+    struct sockaddr_storage key;
+    size_t keylen;
+    kfi_addr_t fi_addr;
+    refcount_t refcount;
+    unsigned long flags;
+    unsigned long last_used;
+    u32 vers;
+    struct hlist_node node;
+    struct rcu_head rcu;
+};
+
+/*
+ * Cache holds a ref until the peer goes idle: inserted lazily from an
+ * incoming message, or a server kept by kfi_av_linger()
+ */
+#define KFI_AV_F_LAZY           0
+
+/**
+ * struct kfi_av_cache - Shared address vector with peer address cache
+ * @av: kfabric AV (NULL in bookkeeping-only mode)
+ * @hash: Peer address -> entry
+ * @index: Compact AV table index (kfi_addr_t) -> entry
+ * @mutex: Serializes updates of @hash and @index
+ * @entries: Number of live entries
+ * @hits: Lookups satisfied from the cache
+ * @misses: Lookups that inserted into the AV
+ * @evictions: Idle entries held by the cache, removed by the reaper
+ * @reaper: Periodic idle-peer eviction
+ */
+struct kfi_av_cache {
+    struct kfid_av *av;
+    DECLARE_HASHTABLE(hash, KFI_AV_HASH_BITS);
+    struct xarray index;
+    struct mutex mutex;
+    atomic_t entries;
+    atomic64_t hits;
+    atomic64_t misses;
+    atomic64_t evictions;
+    struct delayed_work reaper;
+};
+
 /*
  * ============================================================================
  * PROTECTION DOMAIN
@@ -88,12 +282,15 @@ struct kfi_device {
  * @device: Parent device
  * @kfi_domain: kfabric domain
  * @usecnt: Usage counter
+ * @auth_key: Key the PD's endpoints are opened with, NULL for the
+ *            device default; the PD's owner holds the reference
  */
 struct kfi_pd {
     struct ib_pd pd;
     struct kfi_device *device;
     struct kfid_domain *kfi_domain;
     atomic_t usecnt;
+    struct kfi_cxi_auth_key *auth_key;
 };
 
 /*
@@ -113,6 +310,12 @@ struct kfi_pd {
  * @cqe: Number of CQ entries
  * @comp_wq: Workqueue for async completions
  * @comp_work: Work item for async completions
+ * @owner: QP this CQ is exclusive to (pooled endpoints), else NULL
+ * @poll_lock: Serializes reads of @kfi_cq
+ * @dispatch_lock: Held by the one context reaping and dispatching the
+ *                 CQ's completions (worker or busy-polling RPC task)
+ * @busy_poll_hits: Busy-poll waits satisfied without sleeping
+ * @busy_poll_misses: Busy-poll waits that ran out of budget
  */
 struct kfi_cq {
     struct ib_cq cq;
@@ -126,6 +329,15 @@ struct kfi_cq {
     /* Async completion support */
     struct workqueue_struct *comp_wq;
     struct work_struct comp_work;
+
+    /* Exclusive owner, for per-QP outstanding-work accounting */
+    struct kfi_qp *owner;
+    
+    /* Direct polling support */
+    spinlock_t poll_lock;
+    struct mutex dispatch_lock;
+    atomic64_t busy_poll_hits;
+    atomic64_t busy_poll_misses;
 };
 
 /*
@@ -146,22 +358,62 @@ struct kfi_cxi_auth_key {
     uint8_t traffic_class;
 };
 
+/**
+ * struct kfi_auth_key_entry - Shared auth key in a device's cache
+ * @key: Resolved credentials (what QPs point at)
+ * @refcount: Number of QPs using @key
+ * @list: Entry in kfi_device.auth_keys
+ */
+struct kfi_auth_key_entry {
+    struct kfi_cxi_auth_key key;
+    refcount_t refcount;
+    struct list_head list;
+};
+
+/**
+ * struct kfi_qp_ctx - One transmit context of a queue pair
+ * @ep: Transmit context endpoint
+ * @lock: Serializes posting on @ep (uncontended unless CPUs share it)
+ * @peer_rx: Peer receive context this context sends to
+ */
+struct kfi_qp_ctx {
+    struct kfid_ep *ep;
+    spinlock_t lock;
+    u16 peer_rx;
+} ____cacheline_aligned_in_smp;
+
 /**
  * struct kfi_qp - Queue pair
  * @qp: IB QP structure
  * @pd: Protection domain
- * @ep: kfabric endpoint
+ * @ep: kfabric endpoint (the scalable endpoint itself for KFI_QP_F_SCALABLE)
  * @send_cq: Send completion queue
  * @recv_cq: Receive completion queue
- * @av: Address vector for connections
+ * @av_entry: Peer entry in the device's shared AV (NULL until connected)
+ * @dest_addr: Provider address of the connected peer
  * @event_handler: Event handler callback
  * @qp_context: Context for event handler
  * @qp_num: Synthetic QP number
  * @state: Current QP state
- * @auth_key: CXI authentication credentials
- * @sq_lock: Send queue lock
+ * @flags: KFI_QP_F_* flags
+ * @sq_outstanding: Posted sends not yet completed (exclusive CQs only)
+ * @rq_outstanding: Posted receives not yet completed (exclusive CQs only)
+ * @enable_work: Background kfi_enable() started at creation
+ * @enable_status: Result of @enable_work
+ * @tx_ctx: Transmit contexts, indexed by CPU or NUMA node
+ * @rx_ep: Receive contexts, posted to round-robin
+ * @nr_tx: Number of @tx_ctx entries
+ * @nr_rx: Number of @rx_ep entries
+ * @rx_next: Round-robin cursor over @rx_ep
+ * @tx_single: Backing context when @ep is a regular endpoint
+ * @auth_key: CXI authentication credentials (shared, from the device
+ *            cache) the endpoint was opened with; fixed from then on
+ * @service_id: CXI service ID for @auth_key
+ * @traffic_class: Traffic class for @auth_key
  * @rq_lock: Receive queue lock
- * @vni_from_mount: VNI specified in mount options (0 = not set)
+ * @vni_from_mount: VNI asked for by mount options, or the one a pooled
+ *                  endpoint was opened with (0 = device default)
+ * @busy_poll_usec: Busy-poll budget from mount options (0 = disabled)
  * @send_flags: Flags for send operations
  */
 struct kfi_qp {
@@ -170,24 +422,1021 @@ struct kfi_qp {
     struct kfid_ep *ep;
     struct ib_cq *send_cq;
     struct ib_cq *recv_cq;
-    struct kfid_av *av;
+    struct kfi_av_entry *av_entry;
+    kfi_addr_t dest_addr;
     void (*event_handler)(struct ib_event *, void *);
     void *qp_context;
     u32 qp_num;
     enum ib_qp_state state;
+    unsigned long flags;
+    atomic_t sq_outstanding;
+    atomic_t rq_outstanding;
+    struct work_struct enable_work;
+    int enable_status;
+    
+    /* Hardware contexts (one of each unless scalable) */
+    struct kfi_qp_ctx *tx_ctx;
+    struct kfid_ep **rx_ep;
+    u16 nr_tx;
+    u16 nr_rx;
+    atomic_t rx_next;
+    struct kfi_qp_ctx tx_single;
     
     /* CXI-specific */
     struct kfi_cxi_auth_key *auth_key;
+    uint16_t service_id;
+    uint8_t traffic_class;
     uint16_t vni_from_mount;
     
+    /* Latency tuning */
+    u32 busy_poll_usec;
+    
     /* Locking */
-    spinlock_t sq_lock;
     spinlock_t rq_lock;
     
     /* Send attributes */
     u32 send_flags;
 };
 
+/* kfi_qp flags */
+#define KFI_QP_F_ENABLED        0       /* kfi_enable() done on the endpoint */
+#define KFI_QP_F_POOLED         1       /* Owned by a kfi_ep_pool bundle */
+#define KFI_QP_F_ENABLING       2       /* enable_work queued, not yet waited on */
+#define KFI_QP_F_SCALABLE       3       /* @ep is a scalable endpoint */
+#define KFI_QP_F_SEP_PER_NODE   4       /* tx contexts indexed by NUMA node */
+
+/**
+ * struct kfi_ep_bundle - Pre-created endpoint with exclusive CQs
+ * @pd: Protection domain (owned by the pool)
+ * @send_cq: Send CQ, exclusive to @qp
+ * @recv_cq: Receive CQ, exclusive to @qp
+ * @qp: Queue pair, bound to both CQs and the shared AV, already enabled
+ * @pool: Pool the bundle came from
+ * @list: Entry in the pool's free list
+ */
+struct kfi_ep_bundle {
+    struct ib_pd *pd;
+    struct ib_cq *send_cq;
+    struct ib_cq *recv_cq;
+    struct ib_qp *qp;
+    struct kfi_ep_pool *pool;
+    struct list_head list;
+};
+
+/**
+ * struct kfi_ep_pool - Per-device pool of ready-to-connect endpoints
+ * @kdev: Owning device
+ * @pd: PD shared by all pooled endpoints
+ * @free: Idle bundles
+ * @lock: Protects @free and @nr_free
+ * @nr_free: Number of idle bundles
+ * @target: Idle bundles to keep (ep_pool_size)
+ * @refill_work: Background top-up of @free
+ * @hits: Connections served from the pool
+ * @misses: Connections that had to create an endpoint inline
+ * @recycled: Released endpoints returned to the pool
+ * @discarded: Released endpoints closed (pool full or failed to drain)
+ * @ref: One for the device, plus one per bundle, idle or handed out
+ * @dead: The device has let go of the pool; released bundles are closed
+ * @vni: VNI of the pool's endpoints (0 when the device has none)
+ * @traffic_class: Traffic class of the pool's endpoints
+ * @key: Auth key every endpoint in the pool is opened with, NULL when
+ *       the device has no VNI and the provider's default applies
+ * @list: Entry in kfi_device.ep_pools
+ *
+ * The auth key is fixed when an endpoint is opened, so a device keeps a
+ * pool for each (VNI, traffic class) in use and endpoints never move
+ * between them.
+ *
+ * A bundle still handed out when the device destroys its pool keeps the
+ * pool, and its PD, until it is released. The pool in turn holds the
+ * device, so the domain, AV and CQ tables its endpoints live in go only
+ * after the last bundle is closed.
+ */
+struct kfi_ep_pool {
+    struct kfi_device *kdev;
+    struct ib_pd *pd;
+    struct list_head free;
+    spinlock_t lock;
+    int nr_free;
+    int target;
+    struct work_struct refill_work;
+    atomic64_t hits;
+    atomic64_t misses;
+    atomic64_t recycled;
+    atomic64_t discarded;
+    refcount_t ref;
+    bool dead;
+    u16 vni;
+    u8 traffic_class;
+    struct kfi_cxi_auth_key *key;
+    struct list_head list;
+};
+
+/**
+ * struct kfi_rail - One NIC within a multi-rail mount
+ * @numa_node: NUMA node of the NIC, or NUMA_NO_NODE
+ * @flags: KFI_RAIL_F_* flags
+ * @outstanding_bytes: Bytes posted on this rail and not yet completed
+ * @ops: Operations sent on this rail
+ * @bytes: Bytes sent on this rail
+ * @errors: Operations that completed in error
+ */
+struct kfi_rail {
+    int numa_node;
+    unsigned long flags;
+    atomic64_t outstanding_bytes;
+    atomic64_t ops;
+    atomic64_t bytes;
+    atomic64_t errors;
+};
+
+/* kfi_rail flags */
+#define KFI_RAIL_F_FAILED       0       /* Out of service, not selected */
+
+/**
+ * struct kfi_rail_set - NICs a mount's endpoints are spread over
+ * @nr_rails: Rails added (including failed ones)
+ * @nr_active: Rails still in service
+ * @rails: Rail array, indexed by rail number
+ */
+struct kfi_rail_set {
+    int nr_rails;
+    atomic_t nr_active;
+    struct kfi_rail rails[KFI_MAX_RAILS];
+};
+
+/**
+ * enum kfi_lane_id - Lanes of a dual-lane mount
+ * @KFI_LANE_META: Metadata and small RPCs, low-latency traffic class
+ * @KFI_LANE_BULK: RPCs that move page data, bulk-data traffic class
+ */
+enum kfi_lane_id {
+    KFI_LANE_META,
+    KFI_LANE_BULK,
+    KFI_NR_LANES
+};
+
+/**
+ * struct kfi_lane - One lane of a mount
+ * @traffic_class: KFI_TC_* the lane's endpoints are opened with
+ * @ops: RPCs classified to this lane
+ * @bytes: Payload bytes classified to this lane
+ */
+struct kfi_lane {
+    u8 traffic_class;
+    atomic64_t ops;
+    atomic64_t bytes;
+};
+
+/**
+ * struct kfi_lane_set - A mount's lanes, split by traffic type
+ * @nr_lanes: 1 (everything on one lane) or KFI_NR_LANES
+ * @meta_max: Largest page payload still sent on the meta lane
+ * @lanes: Lanes, indexed by enum kfi_lane_id
+ */
+struct kfi_lane_set {
+    int nr_lanes;
+    size_t meta_max;
+    struct kfi_lane lanes[KFI_NR_LANES];
+};
+
+/*
+ * ============================================================================
+ * SUBMISSION SCHEDULER
+ * ============================================================================
+ */
+
+struct kfi_sched_req;
+struct kfi_sched_flow;
+
+/**
+ * struct kfi_sched_req - One submission waiting for the device
+ * @list: Entry in the flow's queue
+ * @flow: Flow whose queue holds the submission, NULL once dispatched
+ * @cost: Bytes the submission puts on the wire
+ * @queued_ns: When the submission was handed to the scheduler
+ * @submit: Posts the work to the provider; called without locks held.
+ *          A non-zero return releases @cost at once. The scheduler does
+ *          not touch the submission after this returns.
+ */
+struct kfi_sched_req {
+    struct list_head list;
+    struct kfi_sched_flow *flow;
+    u32 cost;
+    u64 queued_ns;
+    int (*submit)(struct kfi_sched_req *req);
+};
+
+/**
+ * struct kfi_sched_flow - A mount's or cgroup's share of a device
+ * @kobj: sysfs directory (/sys/kernel/kfi/<dev>/<name>)
+ * @sched: Owning scheduler
+ * @key: Mount cookie or cgroup id, depending on the caller
+ * @users: References from mounts using the flow
+ * @weight: Relative share (1..KFI_SCHED_WEIGHT_MAX)
+ * @deficit: DRR credit, in bytes
+ * @queue: Waiting submissions
+ * @active: Entry in the scheduler's round while @queue is not empty
+ * @list: Entry in the scheduler's flow list
+ * @nr_queued: Submissions currently in @queue
+ * @nr_sent: Submissions dispatched
+ * @bytes_sent: Bytes dispatched
+ * @delay_ns: Total time dispatched submissions spent queued
+ * @delay_max_ns: Longest time a submission spent queued
+ *
+ * Everything but @kobj and @users is protected by the scheduler lock.
+ */
+struct kfi_sched_flow {
+    struct kobject kobj;
+    struct kfi_sched *sched;
+    u64 key;
+    refcount_t users;
+    u32 weight;
+    s64 deficit;
+    struct list_head queue;
+    struct list_head active;
+    struct list_head list;
+    u64 nr_queued;
+    u64 nr_sent;
+    u64 bytes_sent;
+    u64 delay_ns;
+    u64 delay_max_ns;
+};
+
+/**
+ * struct kfi_sched - Per-device submission scheduler
+ * @kobj: sysfs directory (/sys/kernel/kfi/<dev>)
+ * @lock: Protects the flows and the counters below
+ * @flows: All flows
+ * @active: Flows with queued submissions, in round-robin order
+ * @nr_active: Number of flows on @active
+ * @quantum: Bytes added to a flow's deficit per round, per 100 weight
+ * @inflight: Bytes dispatched and not yet completed
+ * @max_inflight: Dispatch stops while @inflight is at or above this
+ */
+struct kfi_sched {
+    struct kobject kobj;
+    spinlock_t lock;
+    struct list_head flows;
+    struct list_head active;
+    int nr_active;
+    u32 quantum;
+    u64 inflight;
+    u64 max_inflight;
+};
+
+/*
+ * ============================================================================
+ * CLIENT TRANSPORT (RPC-over-RDMA Versions One and Two)
+ * ============================================================================
+ */
+
+/*
+ * RPC-over-RDMA Version Two (draft-ietf-nfsv4-rpcrdma-version-two). The
+ * header prefix gains a flags word after the message type, RDMA_ERROR is
+ * renumbered, and peers exchange transport properties in RDMA2_CONNPROP
+ * messages. Chunk lists are encoded as in Version One.
+ */
+#define KFI_RPCRDMA_V2          2
+#define KFI_RDMA2_ERROR         4
+#define KFI_RDMA2_CONNPROP      5
+#define KFI_RDMA2_F_RESPONSE    0x1
+#define KFI_RDMA2_F_MORE        0x2     /* Message continues in the next Send */
+
+/* Transport property IDs */
+#define KFI_RDMA2_PROP_SBSIZ    1       /* Largest Send the peer transmits */
+#define KFI_RDMA2_PROP_RBSIZ    2       /* Peer's receive buffer size */
+#define KFI_RDMA2_PROP_RSSIZ    3       /* Largest RDMA segment */
+#define KFI_RDMA2_PROP_RCSIZ    4       /* Segments per chunk */
+#define KFI_RDMA2_PROP_BRS      5       /* Reverse (backchannel) request support */
+
+/* KFI_RDMA2_PROP_BRS values */
+#define KFI_RDMA2_RVRSDIR_INLINE 1      /* Reverse calls and replies, inline only */
+
+/*
+ * Multi-call envelope, an extension private to these transports: several
+ * small inline calls in one Send. It is used only toward a peer that
+ * advertised KFI_RDMA2_PROP_MULTI, with the number of calls it splits
+ * per envelope; other peers ignore the property. After the Version Two
+ * header prefix comes a call count, then per call its length and the
+ * RPC message, XDR padded. Each call is handled as an RDMA_MSG without
+ * chunks and is answered by its own reply.
+ */
+#define KFI_RDMA2_MULTI         0x4b460001
+#define KFI_RDMA2_PROP_MULTI    0x4b460001
+
+/**
+ * struct kfi_rpcrdma_props - Transport properties of one peer
+ *
+ * A zero value means the property was not advertised.
+ */
+struct kfi_rpcrdma_props {
+    u32 sbsiz;
+    u32 rbsiz;
+    u32 rssiz;
+    u32 rcsiz;
+    u32 brs;
+    u32 multi;
+};
+
+/**
+ * enum kfi_chunk_type - How one direction of an RPC is conveyed
+ * @KFI_NOCH: Entirely inline in the Send
+ * @KFI_READCH: Call page data in a Read chunk, the rest inline (RDMA_MSG)
+ * @KFI_AREADCH: Whole call in a position-zero Read chunk (RDMA_NOMSG)
+ * @KFI_WRITECH: Reply page data in a Write chunk, the rest inline
+ * @KFI_REPLYCH: Whole reply in a Reply chunk
+ */
+enum kfi_chunk_type {
+    KFI_NOCH,
+    KFI_READCH,
+    KFI_AREADCH,
+    KFI_WRITECH,
+    KFI_REPLYCH,
+};
+
+/**
+ * struct kfi_seg - One registered, virtually contiguous piece of a chunk
+ * @mr: Registration backing the segment (NULL until registered)
+ * @handle: RDMA handle advertised to the server
+ * @length: Bytes in the segment
+ * @offset: Remote address of the first byte (the kernel virtual address)
+ */
+struct kfi_seg {
+    struct kfi_mr *mr;
+    u32 handle;
+    u32 length;
+    u64 offset;
+};
+
+/**
+ * struct kfi_chunk - Segments of one Read, Write or Reply chunk
+ * @position: XDR position of a Read chunk (0 for a position-zero chunk)
+ * @length: Sum of the segment lengths
+ * @nsegs: Segments in use
+ * @segs: Segment array (KFI_XPRT_MAX_SEGS entries)
+ */
+struct kfi_chunk {
+    u32 position;
+    u32 length;
+    int nsegs;
+    struct kfi_seg *segs;
+};
+
+/**
+ * struct kfi_rpcrdma_hdr - Decoded transport header of a received message
+ * @xid: RPC transaction ID
+ * @vers: Protocol version
+ * @credits: Credit grant
+ * @proc: RDMA_MSG, RDMA_NOMSG, RDMA_ERROR (for either version),
+ *        KFI_RDMA2_CONNPROP or KFI_RDMA2_MULTI
+ * @flags: Version Two KFI_RDMA2_F_* flags
+ * @nr_read: Read list entries
+ * @nr_write: Write chunks in the Write list
+ * @write_len: Bytes the server placed in the Write chunks
+ * @reply_chunk: A Reply chunk was returned
+ * @reply_len: Bytes the server placed in the Reply chunk
+ * @err: RDMA_ERROR code (ERR_VERS or ERR_CHUNK)
+ * @vers_low: Lowest version the server supports (ERR_VERS)
+ * @vers_high: Highest version the server supports (ERR_VERS)
+ * @props: Properties carried by KFI_RDMA2_CONNPROP
+ * @nr_calls: Calls in a KFI_RDMA2_MULTI envelope
+ * @hdrlen: Length of the transport header in bytes
+ */
+struct kfi_rpcrdma_hdr {
+    __be32 xid;
+    u32 vers;
+    u32 credits;
+    u32 proc;
+    u32 flags;
+    u32 nr_read;
+    u32 nr_write;
+    u32 write_len;
+    bool reply_chunk;
+    u32 reply_len;
+    u32 err;
+    u32 vers_low;
+    u32 vers_high;
+    struct kfi_rpcrdma_props props;
+    u32 nr_calls;
+    unsigned int hdrlen;
+};
+
+struct kfi_xprt;
+struct kfi_xprt_queue;
+
+/**
+ * struct kfi_rep - A posted receive buffer
+ * @cqe: Completion dispatch
+ * @kx: Owning transport
+ * @q: Queue the buffer is posted on
+ * @ep: Receive context the buffer is posted on
+ * @buf: Buffer (max_rsize bytes)
+ * @len: Bytes received
+ * @hdr: Decoded transport header
+ */
+struct kfi_rep {
+    struct ib_cqe cqe;
+    struct kfi_xprt *kx;
+    struct kfi_xprt_queue *q;
+    struct kfid_ep *ep;
+    void *buf;
+    u32 len;
+    struct kfi_rpcrdma_hdr hdr;
+};
+
+/**
+ * struct kfi_req - Per-slot RPC-over-RDMA state
+ * @rqst: Generic RPC slot (handed to SUNRPC)
+ * @kx: Owning transport
+ * @q: Queue the call was sent on, where its reply arrives
+ * @send_cqe: Completion dispatch for the Send
+ * @refs: Send completion and reply, both needed before the RPC completes
+ * @flags: KFI_REQ_F_* flags
+ * @hdr: Transport header buffer (max_wsize bytes; also the pull-up area)
+ * @hdr_size: Size of @hdr, 0 until the slot is first used
+ * @sendbuf: XDR call buffer (rq_buffer)
+ * @sendbuf_size: Size of @sendbuf
+ * @recvbuf: XDR reply buffer (rq_rbuffer); in a backchannel slot, the spare
+ *           receive buffer given back for the next call
+ * @recvbuf_size: Size of @recvbuf
+ * @rtype: How the call is conveyed
+ * @wtype: How the reply is conveyed
+ * @rchunk: Read chunk (KFI_READCH, KFI_AREADCH)
+ * @wchunk: Write or Reply chunk (KFI_WRITECH, KFI_REPLYCH)
+ * @cost: Bytes the RPC moves, charged to its queue's rail while in flight
+ * @sched: Submission to the scheduler of the queue's device
+ * @sched_dev: Scheduler @cost is charged to while KFI_REQ_F_CHARGED is set
+ * @iov: The marshalled Send, kept for a submission that waits its turn
+ * @niov: Entries in @iov
+ * @rep: Reply received, waiting for the Send to complete
+ * @cont: Earlier Sends of a continued reply, held until its last one
+ * @nr_cont: Entries in @cont
+ */
+struct kfi_req {
+    struct rpc_rqst rqst;
+    struct kfi_xprt *kx;
+    struct kfi_xprt_queue *q;
+    struct ib_cqe send_cqe;
+    atomic_t refs;
+    unsigned long flags;
+    void *hdr;
+    size_t hdr_size;
+    void *sendbuf;
+    size_t sendbuf_size;
+    void *recvbuf;
+    size_t recvbuf_size;
+    enum kfi_chunk_type rtype;
+    enum kfi_chunk_type wtype;
+    struct kfi_chunk rchunk;
+    struct kfi_chunk wchunk;
+    u32 cost;
+    struct kfi_sched_req sched;
+    struct kfi_sched *sched_dev;
+    struct kvec iov[KFI_MAX_SGE];
+    int niov;
+    struct kfi_rep *rep;
+    struct kfi_rep *cont[KFI_XPRT_MAX_CONT];
+    unsigned int nr_cont;
+};
+
+/* kfi_req flags */
+#define KFI_REQ_F_SEND_PENDING  0       /* Send posted, completion not reaped */
+#define KFI_REQ_F_REPLY_PENDING 1       /* Sent, reply not yet matched */
+#define KFI_REQ_F_INFLIGHT      2       /* Holds a credit on its queue */
+#define KFI_REQ_F_QUEUED        3       /* Send handed to the scheduler, not yet posted */
+#define KFI_REQ_F_CHARGED       4       /* Holds @cost of its device's scheduler */
+#define KFI_REQ_F_RESEND        5       /* Stranded on a failed rail, may go again */
+
+/**
+ * struct kfi_multi - A multi-call envelope, being filled or in flight
+ * @cqe: Completion dispatch for its Send
+ * @kx: Owning transport
+ * @free: Entry in the transport's free envelope list
+ * @buf: Envelope (max_wsize bytes)
+ * @len: Bytes used in @buf
+ * @nr: Calls in the envelope
+ *
+ * Calls are copied in, so their slots do not wait for the envelope's
+ * Send to complete.
+ */
+struct kfi_multi {
+    struct ib_cqe cqe;
+    struct kfi_xprt *kx;
+    struct list_head free;
+    void *buf;
+    u32 len;
+    unsigned int nr;
+};
+
+/**
+ * struct kfi_cwnd - Client congestion window
+ * @credits: Server's current grant, the hard upper bound
+ * @window: RPCs allowed in flight, at most @credits
+ * @ssthresh: Window below which it doubles per round trip
+ * @acked: Completions since the window last grew (congestion avoidance)
+ * @srtt_us: Smoothed RTT of inline RPCs, scaled by 1 << KFI_CWND_SRTT_SHIFT
+ * @min_rtt_us: Smallest recent RTT, the uncongested baseline
+ * @min_rtt_stamp: When @min_rtt_us was taken (usec)
+ * @shrink_stamp: When the window last shrank (usec)
+ *
+ * The window grows like TCP's toward the server's grant and shrinks
+ * by a quarter, at most once per round trip, when inline RPCs take
+ * clearly longer than the baseline: the server is queueing work, and
+ * sending more only lengthens its queue. Many clients sharing one
+ * server thus back off before its receive buffers run out, rather than
+ * after a timeout forces a reconnect and a retransmit.
+ */
+struct kfi_cwnd {
+    u32 credits;
+    u32 window;
+    u32 ssthresh;
+    u32 acked;
+    u32 srtt_us;
+    u32 min_rtt_us;
+    u64 min_rtt_stamp;
+    u64 shrink_stamp;
+};
+
+/**
+ * struct kfi_tune_class - Measurements for one power-of-two payload size
+ * @inline_us: Smoothed RTT of READs answered inline, scaled like srtt
+ * @ddp_us: Smoothed RTT of READs placed through a Write chunk, scaled
+ * @nr_inline: READs behind @inline_us
+ * @nr_ddp: READs behind @ddp_us
+ * @read_bw: Smoothed READ bandwidth (bytes/usec), scaled
+ * @write_bw: Smoothed WRITE bandwidth (bytes/usec), scaled
+ * @nr_read: READs behind @read_bw
+ * @nr_write: WRITEs behind @write_bw
+ */
+struct kfi_tune_class {
+    u32 inline_us;
+    u32 ddp_us;
+    u32 nr_inline;
+    u32 nr_ddp;
+    u32 read_bw;
+    u32 write_bw;
+    u32 nr_read;
+    u32 nr_write;
+};
+
+/**
+ * struct kfi_tune - Transfer sizes tuned from measured round trips
+ * @classes: Measurements by payload size class
+ * @ddp_min: Current READ inline/placement threshold
+ * @rsize: Smallest READ size reaching most of the best bandwidth, 0
+ *         until measured
+ * @wsize: Same for WRITE
+ * @segs: Smoothed segments per chunk, scaled like srtt
+ * @probe: READs marshaled, for steering every KFI_TUNE_PROBE-th one
+ * @enabled: @ddp_min follows the measurements
+ */
+struct kfi_tune {
+    struct kfi_tune_class classes[KFI_TUNE_CLASSES];
+    u32 ddp_min;
+    u32 rsize;
+    u32 wsize;
+    u32 segs;
+    u32 probe;
+    bool enabled;
+};
+
+/**
+ * struct kfi_svc_credit_state - What a server grant is computed from
+ * @requested: Credits the client asked for in its latest call
+ * @granted: Credits granted in the previous reply
+ * @outstanding: Calls received on the connection and not yet replied to
+ * @posted: Receives posted for the connection alone
+ * @srq_free: Free buffers in a shared receive queue (0 without an SRQ)
+ * @srq_conns: Connections sharing the SRQ
+ * @threads: Server threads in the pool
+ * @threads_idle: Threads waiting for work
+ */
+struct kfi_svc_credit_state {
+    u32 requested;
+    u32 granted;
+    u32 outstanding;
+    u32 posted;
+    u32 srq_free;
+    u32 srq_conns;
+    u32 threads;
+    u32 threads_idle;
+};
+
+/**
+ * struct kfi_svc_wspace_state - What a server's room to reply is judged from
+ * @sq_depth: Send queue slots of the endpoint the connection shares
+ * @sq_used: Slots taken by every connection on it
+ * @conn_sq_used: Slots taken by this connection's Reads, Writes and Sends
+ * @reply_ops: Slots a reply of this connection typically takes
+ * @rd_max: RDMA Reads the listener allows in flight
+ * @conn_rd_used: This connection's Reads in flight
+ * @conns: Connections sharing the endpoint
+ */
+struct kfi_svc_wspace_state {
+    u32 sq_depth;
+    u32 sq_used;
+    u32 conn_sq_used;
+    u32 reply_ops;
+    u32 rd_max;
+    u32 conn_rd_used;
+    u32 conns;
+};
+
+/**
+ * struct kfi_xprt_stats - Transport counters (reported in mountstats)
+ */
+struct kfi_xprt_stats {
+    unsigned long read_chunk_count;
+    unsigned long write_chunk_count;
+    unsigned long reply_chunk_count;
+    unsigned long long total_rdma_request;
+    unsigned long long total_rdma_reply;
+    unsigned long long pullup_copy_count;
+    unsigned long long fixup_copy_count;
+    unsigned long hardway_register_count;
+    unsigned long failed_marshal_count;
+    unsigned long bad_reply_count;
+    unsigned long nomsg_call_count;
+    unsigned long bcall_count;
+    unsigned long mrs_allocated;
+    unsigned long reply_waits_for_send;
+};
+
+/**
+ * struct kfi_xprt_queue - One hardware queue of a client transport
+ * @kx: Owning transport
+ * @bundle: Connected endpoint with its own CQs (NULL while disconnected)
+ * @kqp: QP of @bundle
+ * @rail: Rail (NIC) of @bundle, NULL on a single-rail mount
+ * @lane: Lane whose traffic class @bundle was connected with
+ * @flow: The mount's share of @bundle's device (kfi_sched.c), NULL when
+ *        the device has no scheduler
+ * @dma_mr: Local registration on @bundle's device; held by the first
+ *          queue of each rail, the others borrow its @desc
+ * @desc: Provider descriptor covering send and receive buffers
+ * @cpu: CPU that reaps the queue's CQs, spread over the NIC's node
+ * @credits: Server's grant on this queue's connection
+ * @inflight: RPCs sent on this queue and not yet answered
+ * @sends_pending: Sends posted and not yet reaped
+ * @reps: Receive buffers (kx->nr_reps entries)
+ * @nr_posted: Receives posted on this connection, @reps[0] onward
+ * @recv_lock: Serializes refilling @reps; replies are handled by the
+ *             queue's worker and by RPCs busy-polling the queue
+ * @poll_work: Reaps the queue's CQs while RPCs are outstanding
+ * @connprop_cqe: Completion dispatch for the RDMA2_CONNPROP Send
+ *
+ * Each queue is a connection of its own to the server, with its own
+ * credit grant; the server answers on the queue a call came in on.
+ */
+struct kfi_xprt_queue {
+    struct kfi_xprt *kx;
+    struct kfi_ep_bundle *bundle;
+    struct kfi_qp *kqp;
+    struct kfi_rail *rail;
+    enum kfi_lane_id lane;
+    struct kfi_sched_flow *flow;
+    struct ib_mr *dma_mr;
+    void *desc;
+    int cpu;
+    u32 credits;
+    atomic_t inflight;
+    atomic_t sends_pending;
+    struct kfi_rep *reps;
+    int nr_posted;
+    spinlock_t recv_lock;
+    struct work_struct poll_work;
+    struct ib_cqe connprop_cqe;
+} ____cacheline_aligned_in_smp;
+
+/**
+ * struct kfi_xprt - Client RPC transport over kfabric endpoints
+ * @xprt: Generic RPC transport (must be first, see xprt_alloc())
+ * @kdev: Device of the first rail, NULL while disconnected
+ * @kdevs: Devices of the rails, held while connected
+ * @nr_kdevs: Entries in @kdevs
+ * @rails: NICs the queues are spread over ("rails=" in mount_options),
+ *         NULL on a single-rail mount
+ * @nr_rails: Rails wanted
+ * @lanes: Metadata and bulk lanes ("lanes=2" in mount_options), NULL
+ *         when every queue carries every RPC
+ * @sched_key: Flow the mount's calls are scheduled in on every device,
+ *             see kfi_sched_flow_key()
+ * @vers: Protocol version in use on the current connection
+ * @inline_wsize: Largest message sent inline
+ * @inline_rsize: Largest message received inline
+ * @v1_wsize: @inline_wsize when the server speaks only Version One
+ * @v1_rsize: @inline_rsize when the server speaks only Version One
+ * @max_wsize: Size of the per-slot header buffers, the Version Two offer
+ * @max_rsize: Size of the receive buffers, the Version Two offer
+ * @peer: Properties the server advertised (Version Two)
+ * @negotiated: Completed when the server answers our properties
+ * @connprop: RDMA2_CONNPROP message sent on each queue after connecting
+ * @max_requests: Slots
+ * @queue_credits: Credits requested on each queue
+ * @cwnd_lock: Serializes @cwnd and @tune between the queues' workers
+ * @cwnd: Congestion window, driven by the sum of the queues' grants and
+ *        by RTT
+ * @tune: Smallest READ payload placed through a Write chunk even when
+ *        the reply fits inline, and the transfer sizes measured on this
+ *        mount
+ * @multi_max: Calls per envelope on this connection, 0 when not coalescing
+ * @multi: Envelopes (KFI_XPRT_MULTI_BUFS, or none when coalescing is off)
+ * @coal_lock: Protects @coal and @free_multi, and orders them against
+ *             the first queue's sends_pending
+ * @coal: Envelope collecting calls until the next Send completes
+ * @free_multi: Unused envelopes
+ * @flags: KFI_XPRT_F_* flags
+ * @node: NUMA node of the NIC, where slot and receive buffers live
+ * @reqs: Slot array
+ * @slots_busy: Slots handed to SUNRPC, by index
+ * @queues: Hardware queues (@nr_queues)
+ * @nr_queues: Queues per connection; scales with the CPUs, up to a cap
+ * @nr_reps: Most receives posted per queue
+ * @bc_reqs: Backchannel slots (KFI_XPRT_BC_SLOTS), once the NFS client
+ *           has set up its session
+ * @bc_slots: Receives reserved per queue for callbacks beyond the grant
+ * @connect_worker: Establishes the connection outside of rpciod
+ * @rail_work: Sends the RPCs stranded on a failed rail again
+ * @connect_status: Result of the last connection, 0 before the first
+ * @busy_pollers: RPCs reaping a queue's CQs while waiting for their reply
+ * @stats: Transport counters
+ * @debugfs: kfi_xprt/<n> in debugfs, the state mountstats has no room for
+ */
+struct kfi_xprt {
+    struct rpc_xprt xprt;
+    struct kfi_device *kdev;
+    struct kfi_device *kdevs[KFI_MAX_RAILS];
+    int nr_kdevs;
+    struct kfi_rail_set *rails;
+    int nr_rails;
+    struct kfi_lane_set *lanes;
+    u64 sched_key;
+    u32 vers;
+    u32 inline_wsize;
+    u32 inline_rsize;
+    u32 v1_wsize;
+    u32 v1_rsize;
+    u32 max_wsize;
+    u32 max_rsize;
+    struct kfi_rpcrdma_props peer;
+    struct completion negotiated;
+    __be32 connprop[24];
+    u32 max_requests;
+    u32 queue_credits;
+    spinlock_t cwnd_lock;
+    struct kfi_cwnd cwnd;
+    struct kfi_tune tune;
+    unsigned int multi_max;
+    struct kfi_multi *multi;
+    spinlock_t coal_lock;
+    struct kfi_multi *coal;
+    struct list_head free_multi;
+    unsigned long flags;
+    int node;
+    struct kfi_req *reqs;
+    DECLARE_BITMAP(slots_busy, KFI_XPRT_MAX_SLOTS);
+    struct kfi_xprt_queue *queues;
+    int nr_queues;
+    int nr_reps;
+    struct kfi_req *bc_reqs;
+    int bc_slots;
+    struct delayed_work connect_worker;
+    struct work_struct rail_work;
+    int connect_status;
+    atomic_t busy_pollers;
+    struct kfi_xprt_stats stats;
+    struct dentry *debugfs;
+};
+
+/* kfi_xprt flags */
+#define KFI_XPRT_F_CLOSING      0       /* Endpoint being torn down, stop polling */
+#define KFI_XPRT_F_NEGOTIATING  1       /* Waiting for the server's properties */
+
+#define kfi_xprt(x)             container_of(x, struct kfi_xprt, xprt)
+#define kfi_req(r)              container_of(r, struct kfi_req, rqst)
+
+/*
+ * ============================================================================
+ * SERVER TRANSPORT
+ * ============================================================================
+ */
+
+#define KFI_SVC_RECVS           KFI_DEFAULT_QP_DEPTH    /* Receives shared by a listener's clients */
+#define KFI_SVC_MAX_READS       64      /* RDMA Reads in flight per listener */
+#define KFI_SVC_MAX_PAGES       ((RPCSVC_MAXPAYLOAD_RDMA >> PAGE_SHIFT) + 4)
+/* Operations of a transfer end at page or segment boundaries */
+#define KFI_SVC_RW_OPS          (2 * (KFI_SVC_MAX_PAGES + KFI_XPRT_MAX_SEGS))
+
+struct svc_kfi_ep;
+struct svc_kfi_xprt;
+
+/**
+ * struct svc_kfi_rw_op - One RDMA Read or Write of a chunk transfer
+ * @buf: Local memory; a reply page may be a page cache page
+ * @len: Bytes to move
+ * @remote_addr: Address in the client's segment
+ * @rkey: Client's handle for the segment
+ */
+struct svc_kfi_rw_op {
+    void *buf;
+    u32 len;
+    u64 remote_addr;
+    u32 rkey;
+};
+
+/**
+ * struct svc_kfi_rw_ctxt - Moves data between local pages and a chunk
+ * @cqe: Completion dispatch of the transfer's Reads, or its closing Send
+ * @wcqe: Completion dispatch of its Writes, reported only on failure
+ * @sx: Connection of the client owning the chunk
+ * @done: Called once all operations have completed, with 0 or an error;
+ *        NULL to wait in svc_kfi_rw_wait()
+ * @write: RDMA Writes (and a closing Send) rather than RDMA Reads
+ * @pending: Signaled operations in flight, plus one while posting
+ * @status: First error seen
+ * @complete: Signalled in place of @done
+ * @ops: Planned operations, allocated on first use
+ * @nops: Entries used in @ops
+ * @ch: Chunk currently being filled in or drained
+ * @seg: Cursor: segment of @ch the next byte maps to
+ * @used: Cursor: bytes of that segment already mapped
+ *
+ * The server's counterpart of the kernel's rdma_rw_ctx. Operations are
+ * planned from page lists or XDR buffers against the client's segments,
+ * one per contiguous run on both sides, then posted together.
+ */
+struct svc_kfi_rw_ctxt {
+    struct ib_cqe cqe;
+    struct ib_cqe wcqe;
+    struct svc_kfi_xprt *sx;
+    void (*done)(struct svc_kfi_rw_ctxt *rw, int status);
+    bool write;
+    atomic_t pending;
+    int status;
+    struct completion complete;
+    struct svc_kfi_rw_op *ops;
+    int nops;
+    struct kfi_chunk *ch;
+    int seg;
+    u32 used;
+};
+
+/**
+ * struct svc_kfi_recv_ctxt - A receive buffer shared by a listener's clients
+ * @cqe: Completion dispatch
+ * @list: Entry in a connection's queue of calls, or the accept queue
+ * @ep: Endpoint the buffer belongs to
+ * @rx: Receive context the buffer is posted on (NULL while not posted)
+ * @src: Provider address of the client that sent the call
+ * @buf: Buffer (the listener's @inline_size bytes)
+ * @len: Bytes received
+ * @hdr: Decoded transport header
+ * @rchunk: Read chunk of the call; its segments are allocated on first use
+ * @wchunk: Write chunk of the call, likewise
+ * @rpchunk: Reply chunk of the call, likewise
+ * @pay_off: Offset in the reply of the data item bound for @wchunk
+ * @pay_len: Length of that item (0: none)
+ * @rw: Pulls @rchunk into the server thread's pages
+ */
+struct svc_kfi_recv_ctxt {
+    struct ib_cqe cqe;
+    struct list_head list;
+    struct svc_kfi_ep *ep;
+    struct kfid_ep *rx;
+    kfi_addr_t src;
+    void *buf;
+    u32 len;
+    struct kfi_rpcrdma_hdr hdr;
+    struct kfi_chunk rchunk;
+    struct kfi_chunk wchunk;
+    struct kfi_chunk rpchunk;
+    u32 pay_off;
+    u32 pay_len;
+    struct svc_kfi_rw_ctxt rw;
+};
+
+/**
+ * struct svc_kfi_send_ctxt - A reply on its way to the client
+ * @list: Entry in the listener's free list
+ * @buf: Transport header and inline reply (the listener's @inline_size
+ *       bytes, covered by its registration)
+ * @rw: RDMA Writes of the reply's chunks, followed by its Send; holds
+ *      the connection until all have completed
+ * @pages: Reply pages the Writes read from, released on completion
+ * @npages: Entries used in @pages
+ */
+struct svc_kfi_send_ctxt {
+    struct list_head list;
+    void *buf;
+    struct svc_kfi_rw_ctxt rw;
+    struct page *pages[KFI_SVC_MAX_PAGES];
+    int npages;
+};
+
+/**
+ * struct svc_kfi_ep - A listener's endpoint, shared by the clients it accepts
+ * @listener: Listening transport owning the endpoint
+ * @kdev: Device the endpoint lives on, held until the endpoint is freed
+ * @bundle: Pooled endpoint with its own CQs, kept until the last connection
+ *          on it is gone
+ * @kqp: QP of @bundle
+ * @dma_mr: Local registration covering receive buffers and svc_rqst pages
+ * @desc: Provider descriptor of @dma_mr
+ * @node: NUMA node of the NIC
+ * @inline_size: Size of receive and reply buffers; the inline threshold
+ *               offered to Version Two clients
+ * @cpu: CPU on @node that @poll_work is queued on
+ * @ctxts: Receive buffers (KFI_SVC_RECVS)
+ * @conns: Connections by client provider address
+ * @conn_lock: Protects @accept_q and changes to @conns
+ * @accept_q: Calls from clients that have no connection yet
+ * @rd_max: RDMA Reads allowed in flight (max_reads)
+ * @rd_avail: RDMA Reads that may still be posted
+ * @rd_wait: Server threads waiting for @rd_avail
+ * @nr_conns: Connections accepted on the endpoint
+ * @rx_posted: Receives posted and not yet completed; cancelled ones
+ *             count until their flush is reaped
+ * @sc_lock: Protects @sc_free
+ * @sc_free: Idle reply contexts, kept for reuse
+ * @poll_work: Reaps both CQs until the last connection is gone
+ * @flags: SVC_KFI_EP_F_* flags
+ *
+ * kfabric endpoints are connectionless: one endpoint and one set of
+ * receives serve every client, much like a shared receive queue, and a
+ * client is "connected" once the listener has accepted a connection
+ * transport for its source address.
+ */
+struct svc_kfi_ep {
+    struct svc_kfi_xprt *listener;
+    struct kfi_device *kdev;
+    struct kfi_ep_bundle *bundle;
+    struct kfi_qp *kqp;
+    struct ib_mr *dma_mr;
+    void *desc;
+    int node;
+    u32 inline_size;
+    int cpu;
+    struct svc_kfi_recv_ctxt *ctxts;
+    struct xarray conns;
+    spinlock_t conn_lock;
+    struct list_head accept_q;
+    u32 rd_max;
+    atomic_t rd_avail;
+    wait_queue_head_t rd_wait;
+    atomic_t nr_conns;
+    atomic_t rx_posted;
+    spinlock_t sc_lock;
+    struct list_head sc_free;
+    struct work_struct poll_work;
+    unsigned long flags;
+};
+
+/* svc_kfi_ep flags */
+#define SVC_KFI_EP_F_CLOSING    0       /* Listener closed: no more receives or Reads */
+#define SVC_KFI_EP_F_STOPPED    1       /* Last connection gone: stop polling */
+
+/**
+ * struct svc_kfi_xprt - Server transport: a listener or one client's connection
+ * @xprt: Generic server transport
+ * @ep: Endpoint (the listener's own, or the one the client was accepted on)
+ * @addr: Client's provider address (connections)
+ * @av_entry: Client's AV entry, held while connected
+ * @rq_lock: Protects @rq_dto_q
+ * @rq_dto_q: Received calls waiting for a server thread
+ * @credits: Credits the client asked for in its latest call
+ * @granted: Credits granted in the latest reply
+ * @calls: Calls received and not yet answered
+ * @rbsiz: Client's receive buffer size, bounding inline replies: the
+ *         RFC 8166 default until the client advertises its own
+ * @sq_used: Send queue slots taken by the connection's operations
+ * @rd_used: The connection's RDMA Reads in flight
+ * @reply_ops: Running average of the slots a reply takes
+ * @flags: SVC_KFI_XPRT_F_* flags
+ */
+struct svc_kfi_xprt {
+    struct svc_xprt xprt;
+    struct svc_kfi_ep *ep;
+    kfi_addr_t addr;
+    struct kfi_av_entry *av_entry;
+    spinlock_t rq_lock;
+    struct list_head rq_dto_q;
+    u32 credits;
+    u32 granted;
+    atomic_t calls;
+    u32 rbsiz;
+    atomic_t sq_used;
+    atomic_t rd_used;
+    u32 reply_ops;
+    unsigned long flags;
+};
+
+/* svc_kfi_xprt flags */
+#define SVC_KFI_XPRT_F_WSPACE   0       /* Held back for room to reply */
+
+#define svc_kfi_xprt(x)         container_of(x, struct svc_kfi_xprt, xprt)
+
 /*
  * ============================================================================
  * MEMORY REGISTRATION
@@ -339,6 +1588,8 @@ void kfi_verbs_compat_exit(void);
 /* Device enumeration */
 struct ib_device **kfi_get_devices(int *num_devices);
 void kfi_free_devices(struct ib_device **devices);
+void kfi_device_hold(struct kfi_device *kdev);
+void kfi_device_put(struct kfi_device *kdev);
 
 /* Protection domain */
 struct ib_pd *kfi_alloc_pd(struct ib_device *device,
@@ -360,6 +1611,7 @@ struct ib_qp *kfi_create_qp(struct ib_pd *pd,
 int kfi_modify_qp(struct ib_qp *qp, struct ib_qp_attr *attr,
                    int attr_mask, struct ib_udata *udata);
 int kfi_destroy_qp(struct ib_qp *qp);
+int kfi_qp_enable(struct kfi_qp *kqp);
 
 /*
  * ============================================================================
@@ -380,10 +1632,14 @@ int kfi_poll_cq(struct ib_cq *cq, int num_entries, struct ib_wc *wc);
 int kfi_req_notify_cq(struct ib_cq *cq, enum ib_cq_notify_flags flags);
 
 /* Helper functions */
-int kfi_do_send(struct kfi_qp *kqp, const struct ib_send_wr *wr);
-int kfi_do_rdma_write(struct kfi_qp *kqp, const struct ib_send_wr *wr);
-int kfi_do_rdma_read(struct kfi_qp *kqp, const struct ib_send_wr *wr);
-int kfi_do_send_with_inv(struct kfi_qp *kqp, const struct ib_send_wr *wr);
+int kfi_do_send(struct kfi_qp *kqp, struct kfi_qp_ctx *ctx,
+                const struct ib_send_wr *wr);
+int kfi_do_rdma_write(struct kfi_qp *kqp, struct kfi_qp_ctx *ctx,
+                      const struct ib_send_wr *wr);
+int kfi_do_rdma_read(struct kfi_qp *kqp, struct kfi_qp_ctx *ctx,
+                     const struct ib_send_wr *wr);
+int kfi_do_send_with_inv(struct kfi_qp *kqp, struct kfi_qp_ctx *ctx,
+                         const struct ib_send_wr *wr);
 int kfi_do_recv(struct kfi_qp *kqp, const struct ib_recv_wr *wr);
 
 /* Batching */
@@ -406,6 +1662,11 @@ struct ib_mr *kfi_reg_user_mr(struct ib_pd *pd, u64 start, u64 length,
                                u64 virt_addr, int mr_access_flags,
                                struct ib_udata *udata);
 
+/* Registrations advertised to a peer (RPC-over-RDMA chunks) */
+struct kfi_mr *kfi_reg_kva(struct ib_pd *pd, void *addr, size_t len,
+                           int mr_access_flags);
+void kfi_dereg_kva(struct kfi_mr *kmr);
+
 /* Memory region operations */
 int kfi_map_mr_sg(struct ib_mr *mr, struct scatterlist *sg,
                   int sg_nents, unsigned int *sg_offset,
@@ -436,10 +1697,262 @@ void kfi_mr_cache_flush(struct kfi_mr_cache *cache);
 int kfi_connect_ep(struct kfi_qp *kqp, struct sockaddr *remote_addr);
 int kfi_setup_av(struct kfi_qp *kqp, struct rdma_ah_attr *ah_attr);
 int kfi_get_auth_key(struct kfi_qp *kqp);
+void kfi_put_auth_key(struct kfi_qp *kqp);
+int kfi_ep_attr_set_auth_key(struct kfi_ep_attr *attr,
+                             const struct kfi_cxi_auth_key *key);
 int kfi_query_default_vni(uint16_t *vni);
+void kfi_qp_apply_mount_options(struct kfi_qp *kqp, const char *options);
 
-/* VNI parsing */
+/* Per-device auth-key cache */
+void kfi_auth_key_cache_init(struct kfi_device *kdev);
+void kfi_auth_key_cache_destroy(struct kfi_device *kdev);
+struct kfi_cxi_auth_key *kfi_auth_key_get(struct kfi_device *kdev,
+                                          uint16_t vni, uint16_t service_id,
+                                          uint8_t traffic_class);
+void kfi_auth_key_put(struct kfi_device *kdev, struct kfi_cxi_auth_key *key);
+
+/* Mount option parsing */
 int kfi_parse_vni_from_options(const char *options, uint16_t *vni_out);
+int kfi_parse_busy_poll_from_options(const char *options, u32 *usec_out);
+int kfi_parse_rails_from_options(const char *options, unsigned int *rails_out);
+int kfi_parse_lanes_from_options(const char *options, unsigned int *lanes_out);
+
+/*
+ * ============================================================================
+ * FUNCTION PROTOTYPES - Address Vector (kfi_av.c)
+ * ============================================================================
+ */
+
+struct kfi_av_cache *kfi_av_cache_create(struct kfid_domain *domain,
+                                         size_t count, int rx_ctx_bits);
+void kfi_av_cache_destroy(struct kfi_av_cache *cache);
+struct kfi_av_entry *kfi_av_get(struct kfi_av_cache *cache,
+                                const struct sockaddr *sa);
+void kfi_av_put(struct kfi_av_cache *cache, struct kfi_av_entry *entry);
+
+/* Entries held by the cache (lazy sources, lingering servers), idle eviction */
+int kfi_av_resolve_src(struct kfi_av_cache *cache, const struct sockaddr *sa,
+                       kfi_addr_t *fi_addr_out);
+void kfi_av_linger(struct kfi_av_cache *cache, struct kfi_av_entry *entry);
+bool kfi_av_touch(struct kfi_av_cache *cache, kfi_addr_t fi_addr);
+struct kfi_av_entry *kfi_av_get_addr(struct kfi_av_cache *cache,
+                                     kfi_addr_t fi_addr);
+int kfi_av_reap_idle(struct kfi_av_cache *cache, unsigned long idle);
+size_t kfi_av_cache_footprint(struct kfi_av_cache *cache);
+
+/*
+ * ============================================================================
+ * FUNCTION PROTOTYPES - Endpoint Pool (kfi_ep_pool.c)
+ * ============================================================================
+ */
+
+int kfi_ep_pool_init(struct kfi_device *kdev);
+void kfi_ep_pool_destroy(struct kfi_device *kdev);
+struct kfi_ep_bundle *kfi_ep_pool_get(struct kfi_device *kdev, u16 vni,
+                                      u8 traffic_class);
+void kfi_ep_pool_put(struct kfi_ep_bundle *bundle);
+
+/*
+ * ============================================================================
+ * FUNCTION PROTOTYPES - Multi-rail (kfi_rail.c)
+ * ============================================================================
+ */
+
+struct kfi_rail_set *kfi_rail_set_alloc(void);
+void kfi_rail_set_clear(struct kfi_rail_set *set);
+int kfi_rail_add(struct kfi_rail_set *set, int numa_node);
+void kfi_rail_set_destroy(struct kfi_rail_set *set);
+struct kfi_rail *kfi_rail_pick(struct kfi_rail_set *set, int numa_node);
+void kfi_rail_charge(struct kfi_rail *rail, size_t len);
+struct kfi_rail *kfi_rail_select(struct kfi_rail_set *set, size_t len,
+                                 int numa_node);
+void kfi_rail_complete(struct kfi_rail *rail, size_t len, bool ok);
+int kfi_rail_fail(struct kfi_rail_set *set, struct kfi_rail *rail);
+
+/*
+ * ============================================================================
+ * FUNCTION PROTOTYPES - Metadata/data lanes (kfi_lane.c)
+ * ============================================================================
+ */
+
+struct kfi_lane_set *kfi_lane_set_alloc(unsigned int nr_lanes);
+void kfi_lane_set_destroy(struct kfi_lane_set *set);
+enum kfi_lane_id kfi_lane_classify(const struct kfi_lane_set *set,
+                                   size_t call_pages, size_t reply_pages);
+struct kfi_lane *kfi_lane_select(struct kfi_lane_set *set,
+                                 const struct rpc_rqst *rqst);
+
+/*
+ * ============================================================================
+ * FUNCTION PROTOTYPES - Submission scheduler (kfi_sched.c)
+ * ============================================================================
+ */
+
+int kfi_sched_sysfs_init(void);
+void kfi_sched_sysfs_exit(void);
+struct kfi_sched *kfi_sched_create(const char *name);
+void kfi_sched_destroy(struct kfi_sched *s);
+u64 kfi_sched_flow_key(u64 mount_key);
+struct kfi_sched_flow *kfi_sched_flow_get(struct kfi_sched *s, u64 key,
+                                          const char *name);
+void kfi_sched_flow_put(struct kfi_sched_flow *flow);
+int kfi_sched_set_weight(struct kfi_sched_flow *flow, u32 weight);
+void kfi_sched_submit(struct kfi_sched_flow *flow, struct kfi_sched_req *req);
+bool kfi_sched_cancel(struct kfi_sched *s, struct kfi_sched_req *req);
+void kfi_sched_complete(struct kfi_sched *s, u32 cost);
+
+/*
+ * ============================================================================
+ * FUNCTION PROTOTYPES - Credits (kfi_credits.c)
+ * ============================================================================
+ */
+
+void kfi_cwnd_init(struct kfi_cwnd *cw);
+bool kfi_cwnd_grant(struct kfi_cwnd *cw, u32 grant);
+bool kfi_cwnd_complete(struct kfi_cwnd *cw, u32 rtt_us, u64 now_us);
+u32 kfi_svc_credit_grant(const struct kfi_svc_credit_state *st);
+bool kfi_svc_has_wspace(const struct kfi_svc_wspace_state *st);
+
+/*
+ * ============================================================================
+ * FUNCTION PROTOTYPES - Transfer size tuning (kfi_tune.c)
+ * ============================================================================
+ */
+
+void kfi_tune_init(struct kfi_tune *t, u32 ddp_min, bool enabled);
+u32 kfi_tune_ddp_min(struct kfi_tune *t);
+void kfi_tune_read(struct kfi_tune *t, u32 len, bool ddp, u32 rtt_us,
+                   u32 segs);
+void kfi_tune_write(struct kfi_tune *t, u32 len, u32 rtt_us, u32 segs);
+
+/*
+ * ============================================================================
+ * FUNCTION PROTOTYPES - RPC-over-RDMA (kfi_rpc_rdma.c, kfi_transport.c)
+ * ============================================================================
+ */
+
+/* Chunk construction */
+int kfi_chunk_add_range(struct kfi_chunk *ch, void *addr, u32 len);
+int kfi_chunk_add_xdr(struct kfi_chunk *ch, struct xdr_buf *xdr,
+                      bool whole);
+
+/* Transport header */
+enum kfi_chunk_type kfi_rpcrdma_reply_type(const struct rpc_rqst *rqst,
+                                           u32 inline_rsize, u32 ddp_min);
+enum kfi_chunk_type kfi_rpcrdma_call_type(const struct rpc_rqst *rqst,
+                                          u32 hdrlen, u32 inline_wsize);
+unsigned int kfi_rpcrdma_hdr_len(u32 vers, enum kfi_chunk_type rtype,
+                                 const struct kfi_chunk *rchunk,
+                                 enum kfi_chunk_type wtype,
+                                 const struct kfi_chunk *wchunk);
+int kfi_rpcrdma_encode_hdr(void *buf, size_t buflen, u32 vers, __be32 xid,
+                           u32 credits, enum kfi_chunk_type rtype,
+                           const struct kfi_chunk *rchunk,
+                           enum kfi_chunk_type wtype,
+                           const struct kfi_chunk *wchunk);
+int kfi_rpcrdma_encode_connprop(void *buf, size_t buflen, u32 credits,
+                                const struct kfi_rpcrdma_props *props);
+int kfi_rpcrdma_decode_hdr(const void *buf, size_t len,
+                           struct kfi_rpcrdma_hdr *hdr);
+int kfi_rpcrdma_decode_read_list(const void *buf,
+                                 const struct kfi_rpcrdma_hdr *hdr,
+                                 struct kfi_chunk *ch);
+int kfi_rpcrdma_decode_write_list(const void *buf,
+                                  const struct kfi_rpcrdma_hdr *hdr,
+                                  struct kfi_chunk *wchunk,
+                                  struct kfi_chunk *rpchunk);
+int kfi_rpcrdma_encode_reply(void *buf, size_t buflen, u32 vers, __be32 xid,
+                             u32 credits, const struct kfi_chunk *wchunk,
+                             const struct kfi_chunk *rpchunk);
+int kfi_rpcrdma_encode_error(void *buf, size_t buflen, u32 vers, __be32 xid,
+                             u32 credits, u32 err);
+int kfi_rpcrdma_encode_multi(void *buf, size_t buflen, __be32 xid,
+                             u32 credits);
+int kfi_rpcrdma_multi_add(void *buf, size_t buflen, u32 len,
+                          const struct xdr_buf *xdr);
+int kfi_rpcrdma_multi_next(const void *buf, size_t len, u32 *off,
+                           const void **call, u32 *call_len);
+unsigned int kfi_rpcrdma_fixup(struct rpc_rqst *rqst, u32 offset,
+                               const void *src, u32 len, u32 pad,
+                               bool pages_placed);
+bool kfi_rpcrdma_is_bcall(const struct kfi_rpcrdma_hdr *hdr, const void *buf,
+                          u32 len);
+
+/* Request path */
+int kfi_rpcrdma_marshal(struct kfi_xprt *kx, struct kfi_req *req,
+                        struct kvec *iov, int *niov);
+void kfi_rpcrdma_unmap(struct kfi_req *req);
+void kfi_rpcrdma_reply_handler(struct kfi_rep *rep);
+void kfi_rpcrdma_req_put(struct kfi_req *req);
+int kfi_rpcrdma_marshal_bc_reply(struct kfi_xprt *kx, struct kfi_req *req,
+                                 struct kvec *iov);
+
+/* Transport */
+int kfi_xprt_post_recv(struct kfi_xprt *kx, struct kfi_rep *rep);
+void kfi_xprt_post_recvs(struct kfi_xprt_queue *q, u32 credits, gfp_t gfp);
+int kfi_xprt_post_send(struct kfi_xprt_queue *q, struct ib_cqe *cqe,
+                       struct kvec *iov, int niov);
+void kfi_xprt_sent(struct kfi_xprt_queue *q);
+void kfi_xprt_send_error(struct kfi_xprt_queue *q, struct ib_wc *wc);
+void kfi_xprt_kick(struct kfi_xprt_queue *q);
+void kfi_xprt_retire(struct kfi_req *req);
+
+/* Backchannel (kfi_backchannel.c, with CONFIG_SUNRPC_BACKCHANNEL) */
+int kfi_xprt_bc_setup(struct rpc_xprt *xprt, unsigned int reqs);
+size_t kfi_xprt_bc_maxpayload(struct rpc_xprt *xprt);
+unsigned int kfi_xprt_bc_num_slots(struct rpc_xprt *xprt);
+void kfi_xprt_bc_free_rqst(struct rpc_rqst *rqst);
+void kfi_xprt_bc_destroy(struct rpc_xprt *xprt, unsigned int reqs);
+void kfi_xprt_bc_free(struct kfi_xprt *kx);
+void kfi_xprt_bc_disconnect(struct kfi_xprt *kx);
+void kfi_xprt_bc_receive_call(struct kfi_xprt *kx, struct kfi_rep *rep);
+int kfi_xprt_bc_send_reply(struct rpc_rqst *rqst);
+
+/*
+ * ============================================================================
+ * FUNCTION PROTOTYPES - Server transport (svc_kfi_*.c)
+ * ============================================================================
+ */
+
+/* Provider operations (svc_kfi_ops.c) */
+struct kfid_ep *svc_kfi_post_recv(struct kfi_qp *kqp, void *buf, size_t len,
+                                  void *desc, void *context);
+int svc_kfi_rdma_read(struct kfi_qp *kqp, kfi_addr_t peer, void *local_buf,
+                      size_t len, void *desc, u64 remote_addr, u32 rkey,
+                      void *context);
+int svc_kfi_poll_cq(struct kfi_qp *kqp, struct ib_cq *cq, struct ib_wc *wc,
+                    kfi_addr_t *src, int num_entries);
+int svc_kfi_post_chain(struct kfi_qp *kqp, kfi_addr_t peer, void *desc,
+                       const struct svc_kfi_rw_op *ops, int nops,
+                       void *buf, size_t len, void *wcontext,
+                       void *context);
+
+/* Chunk transfers (svc_kfi_rw.c) */
+void svc_kfi_rw_init(struct svc_kfi_rw_ctxt *rw, struct svc_kfi_xprt *sx,
+                     bool write,
+                     void (*done)(struct svc_kfi_rw_ctxt *rw, int status));
+void svc_kfi_rw_destroy(struct svc_kfi_rw_ctxt *rw);
+void svc_kfi_rw_chunk(struct svc_kfi_rw_ctxt *rw, struct kfi_chunk *ch);
+int svc_kfi_rw_add_pages(struct svc_kfi_rw_ctxt *rw, struct page **pages,
+                         unsigned int offset, u32 len);
+int svc_kfi_rw_add_xdr(struct svc_kfi_rw_ctxt *rw, const struct xdr_buf *xdr,
+                       u32 offset, u32 len);
+void svc_kfi_rw_trim(struct svc_kfi_rw_ctxt *rw);
+void svc_kfi_rw_post(struct svc_kfi_rw_ctxt *rw, void *buf, size_t len);
+void svc_kfi_wspace_wake(struct svc_kfi_xprt *sx);
+int svc_kfi_rw_wait(struct svc_kfi_rw_ctxt *rw);
+
+/* Receive path (svc_kfi_transport.c, svc_kfi_recvfrom.c) */
+void svc_kfi_recv_ctxt_put(struct svc_kfi_recv_ctxt *ctxt);
+int svc_rdma_kfi_recvfrom(struct svc_rqst *rqstp);
+
+/* Send path (svc_kfi_sendto.c) */
+int svc_rdma_kfi_sendto(struct svc_rqst *rqstp);
+int svc_rdma_kfi_result_payload(struct svc_rqst *rqstp, unsigned int offset,
+                                unsigned int length);
+int svc_kfi_send_connprop(struct svc_kfi_xprt *sx,
+                          const struct kfi_rpcrdma_hdr *hdr);
+void svc_kfi_send_ctxts_destroy(struct svc_kfi_ep *ep);
 
 /*
  * ============================================================================
@@ -451,6 +1964,12 @@ int kfi_parse_vni_from_options(const char *options, uint16_t *vni_out);
 enum ib_wc_status kfi_errno_to_ib_status(int kfi_err);
 enum ib_wc_opcode kfi_flags_to_ib_opcode(uint64_t flags);
 
+/* Direct completion processing (busy-poll) */
+int kfi_process_cq_direct(struct ib_cq *cq, int budget);
+bool kfi_cq_busy_poll(struct ib_cq *cq, u32 usec,
+                      bool (*done)(void *), void *arg);
+bool kfi_qp_busy_poll(struct ib_qp *qp, bool (*done)(void *), void *arg);
+
 /*
  * ============================================================================
  * FUNCTION PROTOTYPES - Key Mapping (kfi_key_mapping.c)
@@ -534,6 +2053,84 @@ static inline u64 ib_access_to_kfi(int ib_access)
     return kfi_access;
 }
 
+/* Transmit context for the submitting CPU; caller holds off migration */
+static inline struct kfi_qp_ctx *kfi_qp_tx_ctx(struct kfi_qp *kqp)
+{
+    unsigned int idx;
+
+    if (kqp->nr_tx == 1)
+        return kqp->tx_ctx;
+
+    if (test_bit(KFI_QP_F_SEP_PER_NODE, &kqp->flags))
+        idx = numa_node_id();
+    else
+        idx = raw_smp_processor_id();
+
+    return &kqp->tx_ctx[idx % kqp->nr_tx];
+}
+
+/*
+ * Lock the submitting CPU's tx context. With interrupts off the CPU
+ * cannot change, so a CPU keeps its own context for the whole post.
+ */
+static inline struct kfi_qp_ctx *kfi_qp_tx_lock(struct kfi_qp *kqp,
+                                                unsigned long *flags)
+{
+    struct kfi_qp_ctx *ctx;
+
+    local_irq_save(*flags);
+    ctx = kfi_qp_tx_ctx(kqp);
+    spin_lock(&ctx->lock);
+    return ctx;
+}
+
+static inline void kfi_qp_tx_unlock(struct kfi_qp_ctx *ctx,
+                                    unsigned long flags)
+{
+    spin_unlock(&ctx->lock);
+    local_irq_restore(flags);
+}
+
+/* @peer as seen from @ctx (targets the matching rx context) */
+static inline kfi_addr_t kfi_qp_peer_addr(struct kfi_qp *kqp,
+                                          struct kfi_qp_ctx *ctx,
+                                          kfi_addr_t peer)
+{
+    if (kqp->nr_rx == 1)
+        return peer;
+
+    return kfi_rx_addr(peer, ctx->peer_rx, KFI_SEP_RX_CTX_BITS);
+}
+
+/* Connected peer address as seen from @ctx */
+static inline kfi_addr_t kfi_qp_tx_addr(struct kfi_qp *kqp,
+                                        struct kfi_qp_ctx *ctx)
+{
+    return kfi_qp_peer_addr(kqp, ctx, kqp->dest_addr);
+}
+
+/* Receive context for the next posted buffer */
+static inline struct kfid_ep *kfi_qp_rx_ep(struct kfi_qp *kqp)
+{
+    if (kqp->nr_rx == 1)
+        return kqp->rx_ep[0];
+
+    return kqp->rx_ep[(unsigned int)atomic_inc_return(&kqp->rx_next) %
+                      kqp->nr_rx];
+}
+
+/* Retire one posted operation on a CQ's exclusive owner QP */
+static inline void kfi_cq_account(struct kfi_cq *kcq, uint64_t flags)
+{
+    if (!kcq->owner)
+        return;
+
+    if (flags & KFI_RECV)
+        atomic_dec(&kcq->owner->rq_outstanding);
+    else
+        atomic_dec(&kcq->owner->sq_outstanding);
+}
+
 /* Debug printing */
 #ifdef CONFIG_KFI_DEBUG
 #define kfi_dbg(fmt, ...) pr_debug("kfi: " fmt, ##__VA_ARGS__)
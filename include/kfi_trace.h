@@ -0,0 +1,136 @@
+/*
+ * kfi_trace.h - Tracepoints for the kfabric NFS transports
+ *
+ * Credit grants, congestion window changes and coalesced Sends, for
+ * following how a mount behaves under load:
+ *
+ *   echo 1 > /sys/kernel/tracing/events/kfi/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM kfi
+
+#if !defined(_KFI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _KFI_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "kfi_internal.h"
+
+/**
+ * kfi_xprt_credits - The server changed its credit grant
+ */
+TRACE_EVENT(kfi_xprt_credits,
+    TP_PROTO(const struct kfi_xprt *kx, u32 grant),
+    TP_ARGS(kx, grant),
+
+    TP_STRUCT__entry(
+        __field(const void *, kx)
+        __field(u32, grant)
+        __field(u32, old)
+        __field(u32, window)
+    ),
+
+    TP_fast_assign(
+        __entry->kx = kx;
+        __entry->grant = grant;
+        __entry->old = kx->cwnd.credits;
+        __entry->window = kx->cwnd.window;
+    ),
+
+    TP_printk("xprt=%p credits=%u->%u window=%u",
+              __entry->kx, __entry->old, __entry->grant, __entry->window)
+);
+
+/**
+ * kfi_xprt_cwnd - The client's congestion window changed
+ */
+TRACE_EVENT(kfi_xprt_cwnd,
+    TP_PROTO(const struct kfi_xprt *kx),
+    TP_ARGS(kx),
+
+    TP_STRUCT__entry(
+        __field(const void *, kx)
+        __field(u32, window)
+        __field(u32, ssthresh)
+        __field(u32, credits)
+        __field(u32, srtt_us)
+        __field(u32, min_rtt_us)
+    ),
+
+    TP_fast_assign(
+        __entry->kx = kx;
+        __entry->window = kx->cwnd.window;
+        __entry->ssthresh = kx->cwnd.ssthresh;
+        __entry->credits = kx->cwnd.credits;
+        __entry->srtt_us = kx->cwnd.srtt_us >> KFI_CWND_SRTT_SHIFT;
+        __entry->min_rtt_us = kx->cwnd.min_rtt_us;
+    ),
+
+    TP_printk("xprt=%p window=%u ssthresh=%u credits=%u srtt=%uus min_rtt=%uus",
+              __entry->kx, __entry->window, __entry->ssthresh,
+              __entry->credits, __entry->srtt_us, __entry->min_rtt_us)
+);
+
+/**
+ * kfi_xprt_multi - Calls that queued behind a Send went in one envelope
+ */
+TRACE_EVENT(kfi_xprt_multi,
+    TP_PROTO(const struct kfi_xprt *kx, const struct kfi_multi *m),
+    TP_ARGS(kx, m),
+
+    TP_STRUCT__entry(
+        __field(const void *, kx)
+        __field(unsigned int, nr)
+        __field(u32, len)
+    ),
+
+    TP_fast_assign(
+        __entry->kx = kx;
+        __entry->nr = m->nr;
+        __entry->len = m->len;
+    ),
+
+    TP_printk("xprt=%p calls=%u len=%u", __entry->kx, __entry->nr,
+              __entry->len)
+);
+
+/**
+ * kfi_svc_credits - A server computed the grant for one reply
+ */
+TRACE_EVENT(kfi_svc_credits,
+    TP_PROTO(const struct kfi_svc_credit_state *st, u32 grant),
+    TP_ARGS(st, grant),
+
+    TP_STRUCT__entry(
+        __field(u32, requested)
+        __field(u32, granted)
+        __field(u32, outstanding)
+        __field(u32, posted)
+        __field(u32, srq_free)
+        __field(u32, threads_idle)
+        __field(u32, grant)
+    ),
+
+    TP_fast_assign(
+        __entry->requested = st->requested;
+        __entry->granted = st->granted;
+        __entry->outstanding = st->outstanding;
+        __entry->posted = st->posted;
+        __entry->srq_free = st->srq_free;
+        __entry->threads_idle = st->threads_idle;
+        __entry->grant = grant;
+    ),
+
+    TP_printk("requested=%u outstanding=%u posted=%u srq_free=%u idle_threads=%u credits=%u->%u",
+              __entry->requested, __entry->outstanding, __entry->posted,
+              __entry->srq_free, __entry->threads_idle, __entry->granted,
+              __entry->grant)
+);
+
+#endif /* _KFI_TRACE_H */
+
+/* Out-of-tree module: the header lives on the include path, not in trace/ */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE kfi_trace
+#include <trace/define_trace.h>
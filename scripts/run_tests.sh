@@ -108,7 +108,7 @@ run_unit_tests() {
 
     cd "$TEST_DIR"
 
-    for test_ko in test_key_mapping.ko test_translate.ko test_memory.ko test_connection.ko test_errno.ko; do
+    for test_ko in test_key_mapping.ko test_translate.ko test_memory.ko test_connection.ko test_errno.ko test_av.ko test_rail.ko test_lane.ko test_sched.ko test_rpc_rdma.ko test_credits.ko test_tune.ko; do
         if [ -f "$test_ko" ]; then
             if run_test_module "$test_ko"; then
                 ((UNIT_PASSED++))
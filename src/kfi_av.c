@@ -0,0 +1,513 @@
+/*
+ * kfi_av.c - Shared address vector and peer address cache
+ *
+ * kfabric RDM endpoints reach their peers through an address vector.
+ * Rather than opening one AV per connection, each device owns a single
+ * AV that all of its endpoints are bound to. Peer addresses are cached
+ * in a hash so that a reconnect to a known peer reuses the existing
+ * kfi_addr_t without a provider round trip. Entries are refcounted by
+ * the QPs using them and removed from the AV when the last user goes.
+ *
+ * A server facing thousands of clients cannot afford to pre-insert every
+ * possible peer. Its sources are therefore inserted lazily, on the first
+ * message from an unknown address, and held only by the cache itself;
+ * an idle reaper drops them again once the client goes quiet. AV memory
+ * thus scales with active rather than total clients.
+ *
+ * A client's servers linger the same way once their last connection is
+ * gone. pNFS data-server connections come and go with layouts and idle
+ * timeouts; the next one to the same server finds it resolved, along
+ * with the protocol version it settled on. A miss inserts into the
+ * provider outside the cache mutex, so a layout naming dozens of data
+ * servers resolves them in parallel.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/jhash.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <linux/rculist.h>
+#include <linux/refcount.h>
+#include <linux/jiffies.h>
+#include <linux/xarray.h>
+
+#include "kfi_internal.h"
+
+static unsigned int av_idle_secs = KFI_AV_IDLE_SECS;
+module_param(av_idle_secs, uint, 0644);
+MODULE_PARM_DESC(av_idle_secs,
+                 "Evict lazily inserted peers idle this long (0 = never)");
+
+/*
+ * ============================================================================
+ * ADDRESS KEYS
+ * ============================================================================
+ */
+
+/**
+ * kfi_av_key_init - Build a canonical lookup key from a peer address
+ * @key: Key to fill (zeroed first)
+ * @sa: Peer address
+ *
+ * Only the meaningful fields are copied so that padding such as
+ * sin_zero never makes two equal addresses hash differently.
+ *
+ * Returns: Number of significant key bytes
+ */
+static size_t kfi_av_key_init(struct sockaddr_storage *key,
+                              const struct sockaddr *sa)
+{
+    memset(key, 0, sizeof(*key));
+
+    switch (sa->sa_family) {
+    case AF_INET: {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+        struct sockaddr_in *kin = (struct sockaddr_in *)key;
+
+        kin->sin_family = AF_INET;
+        kin->sin_port = sin->sin_port;
+        kin->sin_addr = sin->sin_addr;
+        return sizeof(*kin);
+    }
+    case AF_INET6: {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+        struct sockaddr_in6 *kin6 = (struct sockaddr_in6 *)key;
+
+        kin6->sin6_family = AF_INET6;
+        kin6->sin6_port = sin6->sin6_port;
+        kin6->sin6_addr = sin6->sin6_addr;
+        kin6->sin6_scope_id = sin6->sin6_scope_id;
+        return sizeof(*kin6);
+    }
+    default:
+        /* Provider-native fabric address (e.g. CXI NIC/PID) */
+        memcpy(key, sa, sizeof(struct sockaddr));
+        return sizeof(struct sockaddr);
+    }
+}
+
+/* Caller must hold rcu_read_lock() or cache->mutex */
+static struct kfi_av_entry *kfi_av_lookup(struct kfi_av_cache *cache,
+                                          const struct sockaddr_storage *key,
+                                          size_t keylen, u32 hash)
+{
+    struct kfi_av_entry *entry;
+
+    hash_for_each_possible_rcu(cache->hash, entry, node, hash,
+                               lockdep_is_held(&cache->mutex)) {
+        if (entry->keylen == keylen && !memcmp(&entry->key, key, keylen))
+            return entry;
+    }
+
+    return NULL;
+}
+
+/* Caller must hold cache->mutex; @entry must have no references left */
+static void kfi_av_unlink(struct kfi_av_cache *cache,
+                          struct kfi_av_entry *entry)
+{
+    hash_del_rcu(&entry->node);
+    xa_erase(&cache->index, entry->fi_addr);
+    atomic_dec(&cache->entries);
+    if (cache->av)
+        kfi_av_remove(cache->av, &entry->fi_addr, 1, 0);
+
+    pr_debug("kfi: AV remove %llu\n", (unsigned long long)entry->fi_addr);
+    kfree_rcu(entry, rcu);
+}
+
+static void kfi_av_reaper(struct work_struct *work);
+
+/*
+ * The reaper keeps running while eviction is off, so that setting
+ * av_idle_secs again takes effect; it looks at least every
+ * KFI_AV_IDLE_SECS, also after a long idle time is shortened.
+ */
+static unsigned long kfi_av_reap_interval(void)
+{
+    unsigned int idle_secs = READ_ONCE(av_idle_secs);
+
+    if (!idle_secs)
+        idle_secs = KFI_AV_IDLE_SECS;
+    return min_t(unsigned int, idle_secs, KFI_AV_IDLE_SECS) * HZ;
+}
+
+/*
+ * ============================================================================
+ * CACHE LIFETIME
+ * ============================================================================
+ */
+
+/**
+ * kfi_av_cache_create - Open a shared AV and its address cache
+ * @domain: Domain to open the AV on, or NULL for bookkeeping-only mode
+ * @count: Expected number of peers (sizing hint for the provider)
+ * @rx_ctx_bits: Address bits reserved for peers' receive context index
+ *               (non-zero when scalable endpoints are in use)
+ *
+ * With a NULL @domain no provider AV is opened and addresses are
+ * numbered locally; the unit tests use this to exercise the cache
+ * without hardware.
+ */
+struct kfi_av_cache *kfi_av_cache_create(struct kfid_domain *domain,
+                                         size_t count, int rx_ctx_bits)
+{
+    struct kfi_av_attr attr = {
+        .type = KFI_AV_TABLE,
+        .count = count ? count : KFI_AV_DEFAULT_COUNT,
+        .rx_ctx_bits = rx_ctx_bits,
+    };
+    struct kfi_av_cache *cache;
+    int ret;
+
+    cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+    if (!cache)
+        return ERR_PTR(-ENOMEM);
+
+    hash_init(cache->hash);
+    xa_init_flags(&cache->index, XA_FLAGS_ALLOC);
+    mutex_init(&cache->mutex);
+    atomic_set(&cache->entries, 0);
+    atomic64_set(&cache->hits, 0);
+    atomic64_set(&cache->misses, 0);
+    atomic64_set(&cache->evictions, 0);
+    INIT_DELAYED_WORK(&cache->reaper, kfi_av_reaper);
+
+    if (domain) {
+        ret = kfi_av_open(domain, &attr, &cache->av, NULL);
+        if (ret) {
+            pr_err("kfi_av_open failed: %d\n", ret);
+            kfree(cache);
+            return ERR_PTR(ret);
+        }
+    }
+
+    schedule_delayed_work(&cache->reaper, kfi_av_reap_interval());
+
+    pr_debug("kfi: Created shared AV (count=%zu)\n", attr.count);
+    return cache;
+}
+EXPORT_SYMBOL(kfi_av_cache_create);
+
+/**
+ * kfi_av_cache_destroy - Remove all entries and close the shared AV
+ */
+void kfi_av_cache_destroy(struct kfi_av_cache *cache)
+{
+    struct kfi_av_entry *entry;
+    struct hlist_node *tmp;
+    int bkt;
+
+    if (!cache)
+        return;
+
+    cancel_delayed_work_sync(&cache->reaper);
+
+    mutex_lock(&cache->mutex);
+    hash_for_each_safe(cache->hash, bkt, tmp, entry, node) {
+        /* Lazily inserted peers are only held by the cache itself */
+        if (refcount_read(&entry->refcount) >
+            (test_bit(KFI_AV_F_LAZY, &entry->flags) ? 1 : 0))
+            pr_warn("kfi: AV entry %llu still referenced at destroy\n",
+                    (unsigned long long)entry->fi_addr);
+        kfi_av_unlink(cache, entry);
+    }
+    mutex_unlock(&cache->mutex);
+    xa_destroy(&cache->index);
+
+    if (cache->av)
+        kfi_close(&cache->av->fid);
+
+    pr_debug("kfi: Destroyed shared AV (hits=%lld misses=%lld evictions=%lld)\n",
+             atomic64_read(&cache->hits), atomic64_read(&cache->misses),
+             atomic64_read(&cache->evictions));
+
+    kfree(cache);
+}
+EXPORT_SYMBOL(kfi_av_cache_destroy);
+
+/*
+ * ============================================================================
+ * ENTRY LOOKUP / RELEASE
+ * ============================================================================
+ */
+
+/**
+ * kfi_av_get - Resolve a peer address, inserting it if not yet known
+ * @cache: Shared AV cache
+ * @sa: Peer address
+ *
+ * The fast path is a lockless RCU lookup. Only a miss takes the cache
+ * mutex and calls into the provider.
+ *
+ * Returns: Referenced entry, or ERR_PTR on failure
+ */
+struct kfi_av_entry *kfi_av_get(struct kfi_av_cache *cache,
+                                const struct sockaddr *sa)
+{
+    struct kfi_av_entry *entry, *found;
+    struct sockaddr_storage key;
+    size_t keylen;
+    u32 hash;
+    int ret;
+
+    if (!cache || !sa)
+        return ERR_PTR(-EINVAL);
+
+    keylen = kfi_av_key_init(&key, sa);
+    hash = jhash(&key, keylen, 0);
+
+    rcu_read_lock();
+    entry = kfi_av_lookup(cache, &key, keylen, hash);
+    if (entry && refcount_inc_not_zero(&entry->refcount)) {
+        rcu_read_unlock();
+        atomic64_inc(&cache->hits);
+        return entry;
+    }
+    rcu_read_unlock();
+
+    entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+    if (!entry)
+        return ERR_PTR(-ENOMEM);
+
+    memcpy(&entry->key, &key, keylen);
+    entry->keylen = keylen;
+    entry->last_used = jiffies;
+
+    /* The provider round trip does not hold up lookups of other peers */
+    if (cache->av) {
+        ret = kfi_av_insert(cache->av, sa, 1, &entry->fi_addr, 0, NULL);
+        if (ret != 1) {
+            pr_err("kfi_av_insert failed: %d\n", ret);
+            kfree(entry);
+            return ERR_PTR(ret < 0 ? ret : -EINVAL);
+        }
+    }
+
+    mutex_lock(&cache->mutex);
+
+    /* A concurrent connector may have inserted it in the meantime */
+    found = kfi_av_lookup(cache, &key, keylen, hash);
+    if (found) {
+        refcount_inc(&found->refcount);
+        mutex_unlock(&cache->mutex);
+        if (cache->av)
+            kfi_av_remove(cache->av, &entry->fi_addr, 1, 0);
+        kfree(entry);
+        atomic64_inc(&cache->hits);
+        return found;
+    }
+
+    if (cache->av) {
+        ret = xa_err(xa_store(&cache->index, entry->fi_addr, entry,
+                              GFP_KERNEL));
+    } else {
+        u32 id;
+
+        /* Mimic KFI_AV_TABLE: lowest free slot */
+        ret = xa_alloc(&cache->index, &id, entry, xa_limit_32b, GFP_KERNEL);
+        entry->fi_addr = id;
+    }
+    if (ret) {
+        if (cache->av)
+            kfi_av_remove(cache->av, &entry->fi_addr, 1, 0);
+        mutex_unlock(&cache->mutex);
+        kfree(entry);
+        return ERR_PTR(ret);
+    }
+
+    refcount_set(&entry->refcount, 1);
+    hash_add_rcu(cache->hash, &entry->node, hash);
+    atomic_inc(&cache->entries);
+    mutex_unlock(&cache->mutex);
+
+    atomic64_inc(&cache->misses);
+    pr_debug("kfi: AV insert -> %llu\n", (unsigned long long)entry->fi_addr);
+    return entry;
+}
+EXPORT_SYMBOL(kfi_av_get);
+
+/**
+ * kfi_av_put - Drop a reference, removing the peer from the AV if unused
+ *
+ * A peer the cache holds as well stays until the idle reaper finds it,
+ * idle since its last user let go.
+ */
+void kfi_av_put(struct kfi_av_cache *cache, struct kfi_av_entry *entry)
+{
+    if (!cache || !entry)
+        return;
+
+    WRITE_ONCE(entry->last_used, jiffies);
+
+    if (!refcount_dec_and_mutex_lock(&entry->refcount, &cache->mutex))
+        return;
+
+    kfi_av_unlink(cache, entry);
+    mutex_unlock(&cache->mutex);
+}
+EXPORT_SYMBOL(kfi_av_put);
+
+/*
+ * ============================================================================
+ * LAZY (SERVER-SIDE) INSERTION
+ * ============================================================================
+ */
+
+/**
+ * kfi_av_resolve_src - Resolve the source of an incoming message
+ * @cache: Shared AV cache
+ * @sa: Source address reported by the provider
+ * @fi_addr_out: Returns the provider address handle for replies
+ *
+ * Called on the first message from a source the AV does not know yet.
+ * The first resolution leaves its reference with the cache, so the
+ * peer stays resolvable without any QP holding it until the idle
+ * reaper evicts it.
+ */
+int kfi_av_resolve_src(struct kfi_av_cache *cache, const struct sockaddr *sa,
+                       kfi_addr_t *fi_addr_out)
+{
+    struct kfi_av_entry *entry;
+
+    entry = kfi_av_get(cache, sa);
+    if (IS_ERR(entry))
+        return PTR_ERR(entry);
+
+    WRITE_ONCE(entry->last_used, jiffies);
+    *fi_addr_out = entry->fi_addr;
+
+    /* Keep the first reference as the cache's own; drop repeats */
+    if (test_and_set_bit(KFI_AV_F_LAZY, &entry->flags))
+        kfi_av_put(cache, entry);
+
+    return 0;
+}
+EXPORT_SYMBOL(kfi_av_resolve_src);
+
+/**
+ * kfi_av_linger - Keep a server resolved after its connections go
+ * @cache: Shared AV cache
+ * @entry: Entry the caller holds
+ *
+ * The cache takes a reference of its own, as for a lazily inserted
+ * source, and the idle reaper drops it once nobody has used the peer
+ * for av_idle_secs.
+ */
+void kfi_av_linger(struct kfi_av_cache *cache, struct kfi_av_entry *entry)
+{
+    WRITE_ONCE(entry->last_used, jiffies);
+    if (!test_and_set_bit(KFI_AV_F_LAZY, &entry->flags))
+        refcount_inc(&entry->refcount);
+}
+EXPORT_SYMBOL(kfi_av_linger);
+
+/**
+ * kfi_av_touch - Note activity from a known peer
+ * @cache: Shared AV cache
+ * @fi_addr: Source address handle from the completion
+ *
+ * Returns: true if @fi_addr is a live entry
+ */
+bool kfi_av_touch(struct kfi_av_cache *cache, kfi_addr_t fi_addr)
+{
+    struct kfi_av_entry *entry;
+
+    rcu_read_lock();
+    entry = xa_load(&cache->index, fi_addr);
+    if (entry)
+        WRITE_ONCE(entry->last_used, jiffies);
+    rcu_read_unlock();
+
+    return entry != NULL;
+}
+EXPORT_SYMBOL(kfi_av_touch);
+
+/**
+ * kfi_av_get_addr - Reference the peer behind a source address handle
+ * @cache: Shared AV cache
+ * @fi_addr: Source address handle from a completion
+ *
+ * A server holds its clients this way while it keeps a connection for
+ * them, so the idle reaper leaves them in the AV; the entry's key is
+ * the client's address.
+ *
+ * Returns: Referenced entry, or NULL if @fi_addr is not (or no longer)
+ * in the AV
+ */
+struct kfi_av_entry *kfi_av_get_addr(struct kfi_av_cache *cache,
+                                     kfi_addr_t fi_addr)
+{
+    struct kfi_av_entry *entry;
+
+    rcu_read_lock();
+    entry = xa_load(&cache->index, fi_addr);
+    if (entry && !refcount_inc_not_zero(&entry->refcount))
+        entry = NULL;
+    rcu_read_unlock();
+
+    if (entry)
+        WRITE_ONCE(entry->last_used, jiffies);
+    return entry;
+}
+EXPORT_SYMBOL(kfi_av_get_addr);
+
+/**
+ * kfi_av_reap_idle - Evict peers held by the cache that have gone quiet
+ * @cache: Shared AV cache
+ * @idle: Minimum idle time in jiffies
+ *
+ * Peers that a QP still holds are never evicted.
+ *
+ * Returns: Number of entries evicted
+ */
+int kfi_av_reap_idle(struct kfi_av_cache *cache, unsigned long idle)
+{
+    struct kfi_av_entry *entry;
+    struct hlist_node *tmp;
+    int bkt, evicted = 0;
+
+    mutex_lock(&cache->mutex);
+    hash_for_each_safe(cache->hash, bkt, tmp, entry, node) {
+        if (!test_bit(KFI_AV_F_LAZY, &entry->flags))
+            continue;
+        if (time_before(jiffies, READ_ONCE(entry->last_used) + idle))
+            continue;
+        /* Only the cache's own reference left? */
+        if (!refcount_dec_if_one(&entry->refcount))
+            continue;
+
+        kfi_av_unlink(cache, entry);
+        evicted++;
+    }
+    mutex_unlock(&cache->mutex);
+
+    if (evicted) {
+        atomic64_add(evicted, &cache->evictions);
+        pr_debug("kfi: AV reaper evicted %d idle peers\n", evicted);
+    }
+    return evicted;
+}
+EXPORT_SYMBOL(kfi_av_reap_idle);
+
+static void kfi_av_reaper(struct work_struct *work)
+{
+    struct kfi_av_cache *cache = container_of(to_delayed_work(work),
+                                              struct kfi_av_cache, reaper);
+    unsigned int idle_secs = READ_ONCE(av_idle_secs);
+
+    if (idle_secs)
+        kfi_av_reap_idle(cache, idle_secs * HZ);
+    schedule_delayed_work(&cache->reaper, kfi_av_reap_interval());
+}
+
+/**
+ * kfi_av_cache_footprint - Approximate host memory used by the cache
+ */
+size_t kfi_av_cache_footprint(struct kfi_av_cache *cache)
+{
+    return sizeof(*cache) +
+           atomic_read(&cache->entries) * sizeof(struct kfi_av_entry);
+}
+EXPORT_SYMBOL(kfi_av_cache_footprint);
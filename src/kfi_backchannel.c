@@ -0,0 +1,316 @@
+/*
+ * kfi_backchannel.c - NFSv4.1 backchannel over the client's endpoint
+ *
+ * The server sends callbacks (delegation and layout recalls) as reverse
+ * direction RPC-over-RDMA calls on the connection the client opened
+ * (RFC 8167), so no second connection is needed. Reverse calls and
+ * their replies are conveyed inline only, as RDMA_MSG without chunks.
+ *
+ * A fixed set of backchannel slots is allocated when the NFS client
+ * sets up its session, and each queue keeps one receive posted per slot
+ * beyond those backing its own credits. A call's receive buffer is
+ * exchanged for the slot's spare buffer and posted again at once, so
+ * the callback service decodes it at leisure and reconnects never find
+ * a receive buffer still in use.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/sunrpc/xprt.h>
+#include <linux/sunrpc/svc.h>
+#include <linux/sunrpc/svc_xprt.h>
+#include <linux/sunrpc/bc_xprt.h>
+
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+/* Reply Send completed: the slot may carry the next call */
+static void kfi_xprt_bc_put(struct kfi_req *req)
+{
+    struct rpc_xprt *xprt = &req->kx->xprt;
+
+    if (!atomic_dec_and_test(&req->refs))
+        return;
+
+    spin_lock(&xprt->bc_pa_lock);
+    list_add_tail(&req->rqst.rq_bc_pa_list, &xprt->bc_pa_list);
+    spin_unlock(&xprt->bc_pa_lock);
+}
+
+static void kfi_xprt_bc_send_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+    struct kfi_req *req = container_of(wc->wr_cqe, struct kfi_req, send_cqe);
+
+    kfi_xprt_sent(req->q);
+
+    if (wc->status != IB_WC_SUCCESS)
+        kfi_xprt_send_error(req->q, wc);
+
+    if (test_and_clear_bit(KFI_REQ_F_SEND_PENDING, &req->flags))
+        kfi_xprt_bc_put(req);
+}
+
+/**
+ * kfi_xprt_bc_setup - Allocate the backchannel slots
+ * @xprt: Transport
+ * @reqs: Slots the NFS client asked for (KFI_XPRT_BC_SLOTS are kept)
+ *
+ * The reserved receives are posted with the next credit grant, and the
+ * poll worker keeps reaping while the session lasts.
+ *
+ * Returns: 0 or -ENOMEM
+ */
+int kfi_xprt_bc_setup(struct rpc_xprt *xprt, unsigned int reqs)
+{
+    struct kfi_xprt *kx = kfi_xprt(xprt);
+    struct kfi_req *bc_reqs;
+    int i;
+
+    if (kx->bc_reqs) {
+        WRITE_ONCE(kx->bc_slots, KFI_XPRT_BC_SLOTS);
+        goto out_kick;
+    }
+
+    bc_reqs = kcalloc_node(KFI_XPRT_BC_SLOTS, sizeof(*bc_reqs), GFP_KERNEL,
+                           kx->node);
+    if (!bc_reqs)
+        return -ENOMEM;
+
+    for (i = 0; i < KFI_XPRT_BC_SLOTS; i++) {
+        struct kfi_req *req = &bc_reqs[i];
+
+        req->kx = kx;
+        req->send_cqe.done = kfi_xprt_bc_send_done;
+        req->hdr = kmalloc_node(kx->max_wsize, GFP_KERNEL, kx->node);
+        req->sendbuf = kmalloc_node(PAGE_SIZE, GFP_KERNEL, kx->node);
+        req->recvbuf = kmalloc_node(kx->max_rsize, GFP_KERNEL, kx->node);
+        if (!req->hdr || !req->sendbuf || !req->recvbuf)
+            goto out_free;
+        req->hdr_size = kx->max_wsize;
+        req->sendbuf_size = PAGE_SIZE;
+        req->recvbuf_size = kx->max_rsize;
+    }
+
+    spin_lock(&xprt->bc_pa_lock);
+    for (i = 0; i < KFI_XPRT_BC_SLOTS; i++) {
+        struct rpc_rqst *rqst = &bc_reqs[i].rqst;
+
+        rqst->rq_xprt = xprt;
+        __set_bit(RPC_BC_PA_IN_USE, &rqst->rq_bc_pa_state);
+        list_add_tail(&rqst->rq_bc_pa_list, &xprt->bc_pa_list);
+    }
+    xprt->bc_alloc_count = KFI_XPRT_BC_SLOTS;
+    spin_unlock(&xprt->bc_pa_lock);
+
+    kx->bc_reqs = bc_reqs;
+    WRITE_ONCE(kx->bc_slots, KFI_XPRT_BC_SLOTS);
+
+out_kick:
+    /* Callbacks are reaped from now on, not only alongside our RPCs */
+    for (i = 0; i < kx->nr_queues; i++)
+        kfi_xprt_kick(&kx->queues[i]);
+    return 0;
+
+out_free:
+    for (i = 0; i < KFI_XPRT_BC_SLOTS; i++) {
+        kfree(bc_reqs[i].hdr);
+        kfree(bc_reqs[i].sendbuf);
+        kfree(bc_reqs[i].recvbuf);
+    }
+    kfree(bc_reqs);
+    return -ENOMEM;
+}
+
+/**
+ * kfi_xprt_bc_maxpayload - Largest backchannel call or reply
+ *
+ * Both directions are inline, and a reply is built in one page.
+ */
+size_t kfi_xprt_bc_maxpayload(struct rpc_xprt *xprt)
+{
+    struct kfi_xprt *kx = kfi_xprt(xprt);
+    u32 max;
+
+    max = min(kx->inline_wsize, kx->inline_rsize);
+    max = min_t(u32, max, PAGE_SIZE);
+    return max - kfi_rpcrdma_hdr_len(kx->vers, KFI_NOCH, NULL, KFI_NOCH, NULL);
+}
+
+unsigned int kfi_xprt_bc_num_slots(struct rpc_xprt *xprt)
+{
+    return KFI_XPRT_BC_SLOTS;
+}
+
+/**
+ * kfi_xprt_bc_free_rqst - The callback service is done with a call
+ *
+ * The slot goes back to the pool once its reply Send has completed.
+ */
+void kfi_xprt_bc_free_rqst(struct rpc_rqst *rqst)
+{
+    struct rpc_xprt *xprt = rqst->rq_xprt;
+
+    kfi_xprt_bc_put(kfi_req(rqst));
+    xprt_put(xprt);
+}
+
+/**
+ * kfi_xprt_bc_destroy - The session no longer takes callbacks
+ *
+ * The slots are kept until the transport is destroyed: the session may
+ * be set up again, and slots still in use are returned meanwhile.
+ */
+void kfi_xprt_bc_destroy(struct rpc_xprt *xprt, unsigned int reqs)
+{
+    WRITE_ONCE(kfi_xprt(xprt)->bc_slots, 0);
+}
+
+/**
+ * kfi_xprt_bc_free - Release the backchannel slots with the transport
+ */
+void kfi_xprt_bc_free(struct kfi_xprt *kx)
+{
+    int i;
+
+    if (!kx->bc_reqs)
+        return;
+
+    for (i = 0; i < KFI_XPRT_BC_SLOTS; i++) {
+        kfree(kx->bc_reqs[i].hdr);
+        kfree(kx->bc_reqs[i].sendbuf);
+        kfree(kx->bc_reqs[i].recvbuf);
+    }
+    kfree(kx->bc_reqs);
+    kx->bc_reqs = NULL;
+}
+
+/**
+ * kfi_xprt_bc_disconnect - Finish replies whose Sends went with the endpoint
+ */
+void kfi_xprt_bc_disconnect(struct kfi_xprt *kx)
+{
+    int i;
+
+    for (i = 0; kx->bc_reqs && i < KFI_XPRT_BC_SLOTS; i++) {
+        struct kfi_req *req = &kx->bc_reqs[i];
+
+        if (test_and_clear_bit(KFI_REQ_F_SEND_PENDING, &req->flags))
+            kfi_xprt_bc_put(req);
+    }
+}
+
+/**
+ * kfi_xprt_bc_receive_call - Hand a reverse-direction call to the NFS client
+ * @kx: Transport
+ * @rep: Receive holding the call, posted again before returning
+ *
+ * A server with more calls outstanding than the slots it was offered
+ * has broken the session's contract; the connection is dropped, as
+ * xprtrdma does.
+ */
+void kfi_xprt_bc_receive_call(struct kfi_xprt *kx, struct kfi_rep *rep)
+{
+    struct rpc_xprt *xprt = &kx->xprt;
+    struct svc_serv *bc_serv = xprt->bc_serv;
+    struct rpc_rqst *rqst;
+    struct kfi_req *req;
+    struct xdr_buf *buf;
+    void *call;
+    u32 size;
+
+    /* No session takes callbacks on this transport */
+    if (!bc_serv || !READ_ONCE(kx->bc_slots))
+        goto out_repost;
+
+    spin_lock(&xprt->bc_pa_lock);
+    rqst = list_first_entry_or_null(&xprt->bc_pa_list, struct rpc_rqst,
+                                    rq_bc_pa_list);
+    if (rqst)
+        list_del(&rqst->rq_bc_pa_list);
+    spin_unlock(&xprt->bc_pa_lock);
+    if (!rqst) {
+        pr_warn_ratelimited("kfi: server %s overran the backchannel\n",
+                            xprt->address_strings[RPC_DISPLAY_ADDR]);
+        xprt_force_disconnect(xprt);
+        goto out_repost;
+    }
+
+    /* The call stays with the slot; the receive goes back with its spare */
+    req = kfi_req(rqst);
+    call = rep->buf;
+    rep->buf = req->recvbuf;
+    req->recvbuf = call;
+    size = rep->len - rep->hdr.hdrlen;
+    atomic_set(&req->refs, 1);
+
+    /* The server expects the reply on the connection the call came in on */
+    req->q = rep->q;
+
+    rqst->rq_reply_bytes_recvd = 0;
+    rqst->rq_xid = rep->hdr.xid;
+    rqst->rq_private_buf.len = size;
+
+    buf = &rqst->rq_rcv_buf;
+    memset(buf, 0, sizeof(*buf));
+    buf->head[0].iov_base = call + rep->hdr.hdrlen;
+    buf->head[0].iov_len = size;
+    buf->len = size;
+
+    xdr_buf_init(&rqst->rq_snd_buf, req->sendbuf, req->sendbuf_size);
+
+    kx->stats.bcall_count++;
+    kfi_xprt_post_recv(kx, rep);
+
+    xprt_get(xprt);
+    lwq_enqueue(&rqst->rq_bc_list, &bc_serv->sv_cb_list);
+    svc_pool_wake_idle_thread(&bc_serv->sv_pools[0]);
+    return;
+
+out_repost:
+    kfi_xprt_post_recv(kx, rep);
+}
+
+/**
+ * kfi_xprt_bc_send_reply - Send the reply to a callback
+ * @rqst: Backchannel slot holding the encoded reply
+ *
+ * Returns: 0, or a negative errno for SUNRPC
+ */
+int kfi_xprt_bc_send_reply(struct rpc_rqst *rqst)
+{
+    struct rpc_xprt *xprt = rqst->rq_xprt;
+    struct kfi_xprt *kx = kfi_xprt(xprt);
+    struct kfi_req *req = kfi_req(rqst);
+    struct kvec iov;
+    int rc;
+
+    if (!xprt_connected(xprt))
+        return -ENOTCONN;
+
+    if (!xprt_request_get_cong(xprt, rqst))
+        return -EBADSLT;
+
+    rc = kfi_rpcrdma_marshal_bc_reply(kx, req, &iov);
+    if (rc < 0) {
+        kx->stats.failed_marshal_count++;
+        return rc;
+    }
+
+    atomic_inc(&req->refs);
+    set_bit(KFI_REQ_F_SEND_PENDING, &req->flags);
+    rc = kfi_xprt_post_send(req->q, &req->send_cqe, &iov, 1);
+    if (rc) {
+        clear_bit(KFI_REQ_F_SEND_PENDING, &req->flags);
+        atomic_dec(&req->refs);
+        if (rc == -EAGAIN) {
+            kfi_xprt_kick(req->q);
+            return -ENOBUFS;
+        }
+        xprt_force_disconnect(xprt);
+        return -ENOTCONN;
+    }
+
+    rqst->rq_xmit_bytes_sent += rqst->rq_snd_buf.len;
+    kfi_xprt_kick(req->q);
+    return 0;
+}
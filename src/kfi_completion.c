@@ -1,3 +1,6 @@
+#include <linux/module.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/signal.h>
 #include "kfi_verbs_compat.h"
 #include "kfi_internal.h"
 
@@ -31,6 +34,7 @@ int kfi_poll_cq(struct ib_cq *cq, int num_entries, struct ib_wc *wc)
             wc[0].wr_id = (u64)err_entry.op_context;
             wc[0].status = kfi_errno_to_ib_status(err_entry.err);
             wc[0].vendor_err = err_entry.prov_errno;
+            kfi_cq_account(kcq, err_entry.flags);
             return 1;
         }
         return 0;
@@ -55,6 +59,8 @@ int kfi_poll_cq(struct ib_cq *cq, int num_entries, struct ib_wc *wc)
             wc[i].opcode = IB_WC_RDMA_WRITE;
         else
             wc[i].opcode = IB_WC_SEND; /* Default */
+
+        kfi_cq_account(kcq, cq_entry[i].flags);
     }
     
     return count;
@@ -76,3 +82,147 @@ enum ib_wc_status kfi_errno_to_ib_status(int kfi_err)
         return IB_WC_GENERAL_ERR;
     }
 }
+EXPORT_SYMBOL(kfi_errno_to_ib_status);
+
+/*
+ * Direct completion processing for busy-polling RPC tasks
+ *
+ * A synchronous RPC normally sleeps until its reply is reaped by the CQ
+ * worker and the task is woken. For small metadata operations that
+ * round trip costs more than the fabric latency itself, so a mount may
+ * opt in to letting the waiting task reap its own CQ for a bounded time
+ * first, in the spirit of net.core.busy_poll.
+ */
+
+/**
+ * kfi_process_cq_direct - Reap and dispatch completions in caller context
+ * @cq: Completion queue to poll
+ * @budget: Maximum number of completions to process
+ *
+ * Each completion is handed to its ib_cqe ->done() handler, exactly as
+ * the CQ worker would. Reaping and dispatching happen under the CQ's
+ * dispatch lock, which the worker takes too, so handlers for one CQ
+ * never run in two contexts at once; the lock is a mutex as reply
+ * handling may sleep. Returns the number of completions processed, or
+ * 0 if another context was reaping the CQ.
+ */
+int kfi_process_cq_direct(struct ib_cq *cq, int budget)
+{
+    struct kfi_cq *kcq = container_of(cq, struct kfi_cq, cq);
+    struct ib_wc wc[KFI_BUSY_POLL_BATCH];
+    int n, i, done = 0;
+
+    /*
+     * Another context is reaping, such as a poll worker on another CPU.
+     * It dispatches what it reaps itself; the caller keeps checking its
+     * condition and sleeps once its budget is spent.
+     */
+    if (!mutex_trylock(&kcq->dispatch_lock))
+        return 0;
+
+    while (done < budget) {
+        spin_lock_bh(&kcq->poll_lock);
+        n = kfi_poll_cq(cq, min_t(int, budget - done, KFI_BUSY_POLL_BATCH),
+                        wc);
+        spin_unlock_bh(&kcq->poll_lock);
+        if (n <= 0)
+            break;
+
+        for (i = 0; i < n; i++) {
+            if (wc[i].wr_cqe && wc[i].wr_cqe->done)
+                wc[i].wr_cqe->done(cq, &wc[i]);
+        }
+        done += n;
+    }
+
+    mutex_unlock(&kcq->dispatch_lock);
+    return done;
+}
+EXPORT_SYMBOL(kfi_process_cq_direct);
+
+static bool kfi_busy_poll_cqs(struct ib_cq **cqs, int ncqs, u32 usec,
+                              bool (*done)(void *), void *arg)
+{
+    u64 deadline;
+    int i;
+
+    usec = min_t(u32, usec, KFI_BUSY_POLL_MAX_USEC);
+    deadline = local_clock() + (u64)usec * NSEC_PER_USEC;
+
+    do {
+        for (i = 0; i < ncqs; i++)
+            kfi_process_cq_direct(cqs[i], KFI_BUSY_POLL_BATCH);
+
+        if (done(arg))
+            return true;
+
+        /* Never hold the CPU against the scheduler or a signal */
+        if (need_resched() || signal_pending(current))
+            break;
+
+        cpu_relax();
+    } while (local_clock() < deadline);
+
+    return false;
+}
+
+/**
+ * kfi_cq_busy_poll - Poll a CQ until a condition holds or budget expires
+ * @cq: Completion queue to poll
+ * @usec: Busy-poll budget in microseconds (capped at KFI_BUSY_POLL_MAX_USEC)
+ * @done: Condition to wait for (e.g. "reply received")
+ * @arg: Argument for @done
+ *
+ * Must be called from process context. Returns true if @done became
+ * true while polling; false means the caller should fall back to
+ * sleeping on its normal wait path.
+ */
+bool kfi_cq_busy_poll(struct ib_cq *cq, u32 usec,
+                      bool (*done)(void *), void *arg)
+{
+    struct kfi_cq *kcq = container_of(cq, struct kfi_cq, cq);
+    bool ret;
+
+    if (!usec)
+        return done(arg);
+
+    ret = kfi_busy_poll_cqs(&cq, 1, usec, done, arg);
+    if (ret)
+        atomic64_inc(&kcq->busy_poll_hits);
+    else
+        atomic64_inc(&kcq->busy_poll_misses);
+
+    return ret;
+}
+EXPORT_SYMBOL(kfi_cq_busy_poll);
+
+/**
+ * kfi_qp_busy_poll - Busy-poll both CQs of a QP using its mount budget
+ * @qp: Queue pair whose send/recv CQs should be polled
+ * @done: Condition to wait for
+ * @arg: Argument for @done
+ *
+ * Polls the receive CQ (where replies land) and, if distinct, the send
+ * CQ (so send buffers are released promptly) for up to
+ * kqp->busy_poll_usec. A zero budget simply evaluates @done once.
+ */
+bool kfi_qp_busy_poll(struct ib_qp *qp, bool (*done)(void *), void *arg)
+{
+    struct kfi_qp *kqp = container_of(qp, struct kfi_qp, qp);
+    struct kfi_cq *krecv_cq = container_of(kqp->recv_cq, struct kfi_cq, cq);
+    struct ib_cq *cqs[2] = { kqp->recv_cq, kqp->send_cq };
+    int ncqs = (kqp->send_cq == kqp->recv_cq) ? 1 : 2;
+    bool ret;
+
+    if (!kqp->busy_poll_usec || kqp->state != IB_QPS_RTS)
+        return done(arg);
+
+    ret = kfi_busy_poll_cqs(cqs, ncqs, kqp->busy_poll_usec, done, arg);
+    if (ret)
+        atomic64_inc(&krecv_cq->busy_poll_hits);
+    else
+        atomic64_inc(&krecv_cq->busy_poll_misses);
+
+    return ret;
+}
+EXPORT_SYMBOL(kfi_qp_busy_poll);
@@ -1,6 +1,7 @@
 #include "kfi_verbs_compat.h"
 #include "kfi_internal.h"
 #include <linux/limits.h>
+#include <linux/module.h>
 /* CXI driver headers would be needed for production CXI-specific features */
 /* #include <linux/cxi/cxi.h> */
 
@@ -28,17 +29,20 @@ int kfi_query_default_vni(uint16_t *vni)
     return 0;
 }
 
-/*
- * Create connection with proper CXI addressing
+/**
+ * kfi_connect_ep - Connect a QP to a peer with proper CXI addressing
+ * @kqp: Queue pair (endpoint already bound to the device's shared AV)
+ * @remote_addr: Peer fabric address
+ *
+ * The peer is resolved through the device's AV cache, so reconnecting
+ * to a known peer costs a hash lookup rather than an AV insertion, also
+ * after its last connection has gone (pNFS data servers come and go).
+ * Calling this again on a connected QP switches it to the new peer.
  */
 int kfi_connect_ep(struct kfi_qp *kqp, struct sockaddr *remote_addr)
 {
-    struct kfi_av_attr av_attr = {
-        .type = KFI_AV_TABLE,
-        .count = 1,
-    };
-    struct kfid_av *av;
-    kfi_addr_t fi_addr;
+    struct kfi_av_cache *av_cache = kqp->pd->device->av_cache;
+    struct kfi_av_entry *entry;
     int ret;
     
     /* Get authentication credentials */
@@ -46,50 +50,47 @@ int kfi_connect_ep(struct kfi_qp *kqp, struct sockaddr *remote_addr)
     if (ret)
         return ret;
         
-    /* Set up address vector for this connection */
-    ret = kfi_av_open(kqp->pd->kfi_domain, &av_attr, &av, NULL);
-    if (ret) {
-        pr_err("kfi_av_open failed: %d\n", ret);
-        return ret;
-    }
-    
-    /* Insert remote address */
-    ret = kfi_av_insert(av, remote_addr, 1, &fi_addr, 0, NULL);
-    if (ret != 1) {
-        pr_err("kfi_av_insert failed: %d\n", ret);
-        kfi_close(&av->fid);
-        return -EINVAL;
-    }
-    
-    /* Bind endpoint to AV */
-    ret = kfi_ep_bind(kqp->ep, &av->fid, 0);
-    if (ret) {
-        pr_err("kfi_ep_bind(av) failed: %d\n", ret);
-        kfi_close(&av->fid);
-        return ret;
+    /* Resolve remote address in the shared AV */
+    entry = kfi_av_get(av_cache, remote_addr);
+    if (IS_ERR(entry)) {
+        pr_err("kfi: AV lookup failed: %ld\n", PTR_ERR(entry));
+        return PTR_ERR(entry);
     }
+
+    /* Servers stay resolved between connections, for av_idle_secs */
+    kfi_av_linger(av_cache, entry);
+
+    if (kqp->av_entry)
+        kfi_av_put(av_cache, kqp->av_entry);
+    kqp->av_entry = entry;
+    kqp->dest_addr = entry->fi_addr;
     
-    /* Enable endpoint */
-    ret = kfi_enable(kqp->ep);
-    if (ret) {
-        pr_err("kfi_enable failed: %d\n", ret);
+    /* Enable endpoint (once - pooled endpoints arrive enabled) */
+    ret = kfi_qp_enable(kqp);
+    if (ret)
         return ret;
-    }
     
     kqp->state = IB_QPS_RTS; /* Mark as Ready To Send */
     return 0;
 }
+EXPORT_SYMBOL(kfi_connect_ep);
 
 /*
  * VNI configuration via mount options
  */
 
 /**
- * kfi_parse_vni_from_options - Parse VNI from mount options string
- * @options: Mount options string (e.g., "rdma,port=20049,vni=1234")
- * @vni_out: Returns parsed VNI
+ * kfi_parse_uint_option - Look up a numeric "key=value" in an options string
+ * @options: Comma-separated options string
+ * @key: Option name to look for
+ * @max: Largest accepted value
+ * @val_out: Returns parsed value
+ *
+ * Returns: 0 on success, -EINVAL if @key is absent or malformed,
+ * -ERANGE if the value exceeds @max, -ENOMEM on allocation failure
  */
-int kfi_parse_vni_from_options(const char *options, uint16_t *vni_out)
+static int kfi_parse_uint_option(const char *options, const char *key,
+                                 unsigned long max, unsigned long *val_out)
 {
     char *opt_copy, *opt, *p;
     int ret = -EINVAL;
@@ -101,25 +102,24 @@ int kfi_parse_vni_from_options(const char *options, uint16_t *vni_out)
     /* Parse comma-separated options */
     opt = opt_copy;
     while ((p = strsep(&opt, ",")) != NULL) {
-        char *key, *value;
+        char *value;
+        unsigned long val;
 
         if (*p == '\0')
             continue;
 
-        key = p;
         value = strchr(p, '=');
         if (!value)
             continue;
 
         *value++ = '\0';
 
-        if (strcmp(key, "vni") == 0) {
-            unsigned long vni;
-            ret = kstrtoul(value, 10, &vni);
-            if (ret == 0 && vni <= U16_MAX) {
-                *vni_out = (uint16_t)vni;
-                pr_info("kfi: Parsed VNI=%u from mount options\n", *vni_out);
-            }
+        if (strcmp(p, key) == 0) {
+            ret = kstrtoul(value, 10, &val);
+            if (ret == 0 && val > max)
+                ret = -ERANGE;
+            if (ret == 0)
+                *val_out = val;
             break;
         }
     }
@@ -128,39 +128,333 @@ int kfi_parse_vni_from_options(const char *options, uint16_t *vni_out)
     return ret;
 }
 
+/**
+ * kfi_parse_vni_from_options - Parse VNI from mount options string
+ * @options: Mount options string (e.g., "rdma,port=20049,vni=1234")
+ * @vni_out: Returns parsed VNI
+ */
+int kfi_parse_vni_from_options(const char *options, uint16_t *vni_out)
+{
+    unsigned long vni;
+    int ret;
+
+    ret = kfi_parse_uint_option(options, "vni", U16_MAX, &vni);
+    if (ret)
+        return ret;
+
+    *vni_out = (uint16_t)vni;
+    pr_info("kfi: Parsed VNI=%u from mount options\n", *vni_out);
+    return 0;
+}
+EXPORT_SYMBOL(kfi_parse_vni_from_options);
+
+/**
+ * kfi_parse_busy_poll_from_options - Parse RPC busy-poll budget
+ * @options: Mount options string (e.g., "vni=1234,busy_poll=50")
+ * @usec_out: Returns busy-poll budget in microseconds (0 = disabled)
+ *
+ * Budgets above KFI_BUSY_POLL_MAX_USEC are rejected rather than clamped
+ * so that a typo cannot silently pin CPUs for milliseconds per RPC.
+ */
+int kfi_parse_busy_poll_from_options(const char *options, u32 *usec_out)
+{
+    unsigned long usec;
+    int ret;
+
+    ret = kfi_parse_uint_option(options, "busy_poll",
+                                KFI_BUSY_POLL_MAX_USEC, &usec);
+    if (ret)
+        return ret;
+
+    *usec_out = (u32)usec;
+    pr_info("kfi: Parsed busy_poll=%uus from mount options\n", *usec_out);
+    return 0;
+}
+EXPORT_SYMBOL(kfi_parse_busy_poll_from_options);
+
+/**
+ * kfi_parse_rails_from_options - Parse number of NICs to stripe over
+ * @options: Mount options string (e.g., "vni=1234,rails=4")
+ * @rails_out: Returns rail count (1 = single-rail)
+ */
+int kfi_parse_rails_from_options(const char *options, unsigned int *rails_out)
+{
+    unsigned long rails;
+    int ret;
+
+    ret = kfi_parse_uint_option(options, "rails", KFI_MAX_RAILS, &rails);
+    if (ret)
+        return ret;
+
+    if (!rails)
+        return -EINVAL;
+
+    *rails_out = (unsigned int)rails;
+    pr_info("kfi: Parsed rails=%u from mount options\n", *rails_out);
+    return 0;
+}
+EXPORT_SYMBOL(kfi_parse_rails_from_options);
+
+/**
+ * kfi_parse_lanes_from_options - Parse metadata/data lane split
+ * @options: Mount options string (e.g., "vni=1234,lanes=2")
+ * @lanes_out: Returns 1 (single endpoint) or 2 (separate bulk lane)
+ */
+int kfi_parse_lanes_from_options(const char *options, unsigned int *lanes_out)
+{
+    unsigned long lanes;
+    int ret;
+
+    ret = kfi_parse_uint_option(options, "lanes", KFI_NR_LANES, &lanes);
+    if (ret)
+        return ret;
+
+    if (!lanes)
+        return -EINVAL;
+
+    *lanes_out = (unsigned int)lanes;
+    pr_info("kfi: Parsed lanes=%u from mount options\n", *lanes_out);
+    return 0;
+}
+EXPORT_SYMBOL(kfi_parse_lanes_from_options);
+
+/*
+ * Auth-key cache
+ *
+ * A device serves a handful of (VNI, service, traffic class) tuples but
+ * potentially thousands of QPs. Each tuple is resolved once and the key
+ * shared by every QP using it.
+ */
+
+/**
+ * kfi_auth_key_cache_init - Prepare a device's auth-key cache
+ * @kdev: Device being opened
+ *
+ * The default VNI is resolved from the CXI service here, once per
+ * device, so that connection setup never waits on the service.
+ */
+void kfi_auth_key_cache_init(struct kfi_device *kdev)
+{
+    uint16_t vni;
+
+    INIT_LIST_HEAD(&kdev->auth_keys);
+    spin_lock_init(&kdev->auth_key_lock);
+    atomic_set(&kdev->nr_auth_keys, 0);
+
+    kdev->default_vni = 0;
+    if (!kfi_query_default_vni(&vni))
+        kdev->default_vni = vni;
+}
+
+/**
+ * kfi_auth_key_cache_destroy - Check a device's auth-key cache is empty
+ */
+void kfi_auth_key_cache_destroy(struct kfi_device *kdev)
+{
+    WARN_ON(!list_empty(&kdev->auth_keys));
+}
+
+static bool kfi_auth_key_match(const struct kfi_cxi_auth_key *key,
+                               uint16_t vni, uint16_t service_id,
+                               uint8_t traffic_class)
+{
+    return key->vni == vni && key->service_id == service_id &&
+           key->traffic_class == traffic_class;
+}
+
+/* Caller holds kdev->auth_key_lock */
+static struct kfi_auth_key_entry *
+kfi_auth_key_find(struct kfi_device *kdev, uint16_t vni, uint16_t service_id,
+                  uint8_t traffic_class)
+{
+    struct kfi_auth_key_entry *entry;
+
+    list_for_each_entry(entry, &kdev->auth_keys, list) {
+        if (kfi_auth_key_match(&entry->key, vni, service_id, traffic_class))
+            return entry;
+    }
+    return NULL;
+}
+
+/**
+ * kfi_auth_key_get - Take a reference on the key for a tuple
+ * @kdev: Device
+ * @vni: Virtual Network Identifier
+ * @service_id: CXI service ID
+ * @traffic_class: Traffic class
+ *
+ * Returns: shared key (release with kfi_auth_key_put()) or ERR_PTR
+ */
+struct kfi_cxi_auth_key *kfi_auth_key_get(struct kfi_device *kdev,
+                                          uint16_t vni, uint16_t service_id,
+                                          uint8_t traffic_class)
+{
+    struct kfi_auth_key_entry *entry, *new;
+
+    spin_lock(&kdev->auth_key_lock);
+    entry = kfi_auth_key_find(kdev, vni, service_id, traffic_class);
+    if (entry)
+        refcount_inc(&entry->refcount);
+    spin_unlock(&kdev->auth_key_lock);
+
+    if (entry)
+        return &entry->key;
+
+    new = kzalloc(sizeof(*new), GFP_KERNEL);
+    if (!new)
+        return ERR_PTR(-ENOMEM);
+
+    new->key.vni = vni;
+    new->key.service_id = service_id;
+    new->key.traffic_class = traffic_class;
+    refcount_set(&new->refcount, 1);
+
+    /* Someone may have added the same tuple while we allocated */
+    spin_lock(&kdev->auth_key_lock);
+    entry = kfi_auth_key_find(kdev, vni, service_id, traffic_class);
+    if (entry) {
+        refcount_inc(&entry->refcount);
+    } else {
+        list_add(&new->list, &kdev->auth_keys);
+        atomic_inc(&kdev->nr_auth_keys);
+        entry = new;
+        new = NULL;
+    }
+    spin_unlock(&kdev->auth_key_lock);
+
+    kfree(new);
+    return &entry->key;
+}
+EXPORT_SYMBOL(kfi_auth_key_get);
+
+/**
+ * kfi_auth_key_put - Drop a reference from kfi_auth_key_get()
+ */
+void kfi_auth_key_put(struct kfi_device *kdev, struct kfi_cxi_auth_key *key)
+{
+    struct kfi_auth_key_entry *entry;
+
+    entry = container_of(key, struct kfi_auth_key_entry, key);
+    if (!refcount_dec_and_lock(&entry->refcount, &kdev->auth_key_lock))
+        return;
+
+    list_del(&entry->list);
+    atomic_dec(&kdev->nr_auth_keys);
+    spin_unlock(&kdev->auth_key_lock);
+    kfree(entry);
+}
+EXPORT_SYMBOL(kfi_auth_key_put);
+
 /**
  * kfi_get_auth_key - Get authentication key (tries multiple sources)
+ * @kqp: Queue pair
+ *
+ * Called at modify_qp(INIT) and again at connect; the second call
+ * reuses the key resolved by the first unless the tuple changed. Once
+ * the endpoint is open its key is fixed, so a QP asking for another
+ * tuple by then is refused.
  */
 int kfi_get_auth_key(struct kfi_qp *kqp)
 {
+    struct kfi_device *kdev = kqp->pd->device;
+    struct kfi_cxi_auth_key *key;
     uint16_t vni;
-    int ret;
-
-    kqp->auth_key = kzalloc(sizeof(*kqp->auth_key), GFP_KERNEL);
-    if (!kqp->auth_key)
-        return -ENOMEM;
 
     /* Priority 1: Mount option (if set via transport setup) */
-    if (kqp->vni_from_mount != 0) {
-        kqp->auth_key->vni = kqp->vni_from_mount;
-        pr_info("kfi: Using VNI %u from mount option\n", kqp->auth_key->vni);
-        return 0;
-    }
+    vni = kqp->vni_from_mount;
 
     /* Priority 2: SLINGSHOT_VNIS environment variable */
     /* Note: In kernel, we'd need to read from /proc/self/environ or
      * have userspace pass this via netlink/ioctl */
 
-    /* Priority 3: Query CXI service API */
-    ret = kfi_query_default_vni(&vni);
-    if (ret == 0) {
-        kqp->auth_key->vni = vni;
-        pr_info("kfi: Using VNI %u from CXI service\n", kqp->auth_key->vni);
+    /* Priority 3: CXI service default, resolved at device open */
+    if (!vni)
+        vni = kdev->default_vni;
+
+    if (!vni) {
+        pr_err("kfi: No VNI source available - connection will fail\n");
+        return -EACCES;
+    }
+
+    if (kqp->auth_key &&
+        kfi_auth_key_match(kqp->auth_key, vni, kqp->service_id,
+                           kqp->traffic_class))
         return 0;
+
+    if (kqp->ep) {
+        pr_err("kfi: QP %u was opened with VNI %u tc %u, not VNI %u tc %u\n",
+               kqp->qp_num, kqp->auth_key ? kqp->auth_key->vni : 0,
+               kqp->auth_key ? kqp->auth_key->traffic_class : 0, vni,
+               kqp->traffic_class);
+        return -EINVAL;
     }
 
-    pr_err("kfi: No VNI source available - connection will fail\n");
-    kfree(kqp->auth_key);
+    key = kfi_auth_key_get(kdev, vni, kqp->service_id, kqp->traffic_class);
+    if (IS_ERR(key))
+        return PTR_ERR(key);
+
+    if (kqp->auth_key)
+        kfi_auth_key_put(kdev, kqp->auth_key);
+    kqp->auth_key = key;
+
+    pr_debug("kfi: QP %u using VNI %u (%s)\n", kqp->qp_num, vni,
+             kqp->vni_from_mount ? "mount option" : "CXI service");
+    return 0;
+}
+
+/**
+ * kfi_put_auth_key - Release a QP's authentication key
+ */
+void kfi_put_auth_key(struct kfi_qp *kqp)
+{
+    if (!kqp->auth_key)
+        return;
+
+    kfi_auth_key_put(kqp->pd->device, kqp->auth_key);
     kqp->auth_key = NULL;
-    return -EACCES;
 }
+
+/**
+ * kfi_ep_attr_set_auth_key - Open an endpoint with an auth key
+ * @attr: Endpoint attributes passed to kfi_endpoint()
+ * @key: Key to open it with
+ *
+ * @attr gets its own copy, freed with the kfi_info it belongs to.
+ */
+int kfi_ep_attr_set_auth_key(struct kfi_ep_attr *attr,
+                             const struct kfi_cxi_auth_key *key)
+{
+    void *copy;
+
+    copy = kmemdup(key, sizeof(*key), GFP_KERNEL);
+    if (!copy)
+        return -ENOMEM;
+
+    kfree(attr->auth_key);
+    attr->auth_key = copy;
+    attr->auth_key_size = sizeof(*key);
+    return 0;
+}
+EXPORT_SYMBOL(kfi_ep_attr_set_auth_key);
+
+/**
+ * kfi_qp_apply_mount_options - Carry per-mount settings onto a QP
+ * @kqp: Queue pair about to be connected
+ * @options: Mount options string, may be NULL
+ *
+ * Options that are absent leave the QP's current setting alone.
+ */
+void kfi_qp_apply_mount_options(struct kfi_qp *kqp, const char *options)
+{
+    uint16_t vni;
+    u32 usec;
+
+    if (!options)
+        return;
+
+    if (!kfi_parse_vni_from_options(options, &vni))
+        kqp->vni_from_mount = vni;
+    if (!kfi_parse_busy_poll_from_options(options, &usec))
+        kqp->busy_poll_usec = usec;
+}
+EXPORT_SYMBOL(kfi_qp_apply_mount_options);
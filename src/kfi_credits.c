@@ -0,0 +1,218 @@
+/*
+ * kfi_credits.c - RPC-over-RDMA credit grants and congestion window
+ *
+ * RPC-over-RDMA flow control is receiver-driven: a call may only be sent
+ * when the server has a receive posted for it, and the server says how
+ * many it can take in the credit field of every reply (RFC 8166,
+ * Section 4.3). Two halves live here:
+ *
+ *   - the server's grant, computed per reply from the receives it can
+ *     actually back (its own, or a fair share of a shared receive
+ *     queue) and from whether its threads keep up;
+ *
+ *   - the client's congestion window, which never exceeds the grant but
+ *     also backs off when round trips grow, so that many clients of one
+ *     server converge on a share of it instead of each driving the full
+ *     grant into the server's queue.
+ *
+ * Both are plain computations on caller-owned state; the caller
+ * serializes access. The kfi tracepoints are defined here.
+ */
+
+#include <linux/module.h>
+#include <linux/string.h>
+
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+#define CREATE_TRACE_POINTS
+#include "kfi_trace.h"
+
+/*
+ * ============================================================================
+ * CLIENT CONGESTION WINDOW
+ * ============================================================================
+ */
+
+/**
+ * kfi_cwnd_init - Reset the window for a new connection
+ *
+ * One RPC at a time until the server grants credits, then slow start.
+ */
+void kfi_cwnd_init(struct kfi_cwnd *cw)
+{
+    memset(cw, 0, sizeof(*cw));
+    cw->credits = 1;
+    cw->window = 1;
+    cw->ssthresh = U32_MAX;
+}
+EXPORT_SYMBOL(kfi_cwnd_init);
+
+/**
+ * kfi_cwnd_grant - Apply a new credit grant
+ * @cw: Window
+ * @grant: Credits granted by the server (at least 1)
+ *
+ * A smaller grant caps the window at once; a larger one only raises the
+ * ceiling the window grows toward.
+ *
+ * Returns: true if the window changed
+ */
+bool kfi_cwnd_grant(struct kfi_cwnd *cw, u32 grant)
+{
+    u32 old = cw->window;
+
+    cw->credits = grant;
+    if (cw->window > grant)
+        cw->window = grant;
+    if (cw->ssthresh > grant && cw->ssthresh != U32_MAX)
+        cw->ssthresh = grant;
+
+    return cw->window != old;
+}
+EXPORT_SYMBOL(kfi_cwnd_grant);
+
+/* Fold in an RTT sample; returns true if it shows queueing at the server */
+static bool kfi_cwnd_sample(struct kfi_cwnd *cw, u32 rtt_us, u64 now_us)
+{
+    u32 srtt;
+
+    if (!cw->min_rtt_us || rtt_us <= cw->min_rtt_us ||
+        now_us - cw->min_rtt_stamp > KFI_CWND_MIN_RTT_WIN_US) {
+        cw->min_rtt_us = rtt_us;
+        cw->min_rtt_stamp = now_us;
+    }
+
+    if (!cw->srtt_us)
+        cw->srtt_us = rtt_us << KFI_CWND_SRTT_SHIFT;
+    else
+        cw->srtt_us = cw->srtt_us - (cw->srtt_us >> KFI_CWND_SRTT_SHIFT) +
+                      rtt_us;
+
+    srtt = cw->srtt_us >> KFI_CWND_SRTT_SHIFT;
+    return srtt > cw->min_rtt_us + max(cw->min_rtt_us / 2,
+                                       (u32)KFI_CWND_RTT_SLACK_US);
+}
+
+/**
+ * kfi_cwnd_complete - Account one completed RPC
+ * @cw: Window
+ * @rtt_us: Round trip of the RPC, or 0 if it is not a useful sample
+ * @now_us: Current time
+ *
+ * Only RPCs sent and answered inline should be sampled: their round
+ * trip is mostly queueing, while a bulk transfer's is mostly the
+ * transfer itself.
+ *
+ * Returns: true if the window changed
+ */
+bool kfi_cwnd_complete(struct kfi_cwnd *cw, u32 rtt_us, u64 now_us)
+{
+    u32 old = cw->window;
+
+    if (rtt_us && kfi_cwnd_sample(cw, rtt_us, now_us)) {
+        /* Shrink by a quarter, at most once per round trip */
+        if (now_us - cw->shrink_stamp >= cw->srtt_us >> KFI_CWND_SRTT_SHIFT) {
+            cw->window -= min(max(cw->window / 4, 1U), cw->window - 1);
+            cw->ssthresh = cw->window;
+            cw->acked = 0;
+            cw->shrink_stamp = now_us;
+        }
+        return cw->window != old;
+    }
+
+    if (cw->window >= cw->credits)
+        return false;
+
+    if (cw->window < cw->ssthresh) {
+        cw->window++;
+    } else if (++cw->acked >= cw->window) {
+        cw->window++;
+        cw->acked = 0;
+    }
+
+    return cw->window != old;
+}
+EXPORT_SYMBOL(kfi_cwnd_complete);
+
+/*
+ * ============================================================================
+ * SERVER CREDIT GRANT
+ * ============================================================================
+ */
+
+/**
+ * kfi_svc_credit_grant - Credits to grant in a reply
+ * @st: Connection and server state at the time of the reply
+ *
+ * The grant covers the calls the client may have in flight once it has
+ * this reply: those the server still holds plus those it has receives
+ * for. With a shared receive queue each connection counts on its fair
+ * share of the free buffers only, so one busy client cannot take the
+ * buffers others are about to need. Growth is limited per reply, which
+ * keeps a crowd of newly mounted clients from claiming the whole queue
+ * at once. While every server thread is busy the grant does not grow,
+ * and shrinks when calls are already queued behind the threads: more
+ * credits would only lengthen the queue.
+ *
+ * Returns: the grant, at least 1 so the client can always make progress
+ */
+u32 kfi_svc_credit_grant(const struct kfi_svc_credit_state *st)
+{
+    u32 avail, grant, hold;
+
+    avail = st->posted;
+    if (st->srq_conns)
+        avail += st->srq_free / st->srq_conns;
+
+    grant = min(st->requested, st->outstanding + avail);
+    grant = min(grant, st->granted + KFI_SVC_CREDIT_STEP);
+
+    if (st->threads && !st->threads_idle) {
+        hold = st->granted;
+        if (st->outstanding >= st->threads)
+            hold -= hold / 4;
+        grant = min(grant, hold);
+    }
+
+    grant = max(grant, 1U);
+    trace_kfi_svc_credits(st, grant);
+    return grant;
+}
+EXPORT_SYMBOL(kfi_svc_credit_grant);
+
+/**
+ * kfi_svc_has_wspace - Whether a connection's next reply can be posted
+ * @st: Connection and endpoint state
+ *
+ * A server thread should take a call only if it can send the reply
+ * without waiting for the send queue. The queue must have room for a
+ * typical reply of this connection, and the connection must stay within
+ * its fair share of the queue, so one client streaming large READ
+ * replies cannot starve the others' Sends. A connection whose Reads
+ * already hold its share of the listener's read budget is held back too:
+ * its next call would only wait for the budget in a server thread.
+ * A connection with nothing posted always has room, so it is never
+ * stalled by its own accounting.
+ *
+ * Returns: true when the connection may take another call
+ */
+bool kfi_svc_has_wspace(const struct kfi_svc_wspace_state *st)
+{
+    u32 conns = max(st->conns, 1U);
+    u32 need, share;
+
+    if (!st->conn_sq_used)
+        return true;
+
+    need = clamp(st->reply_ops, 1U, st->sq_depth);
+    if (st->sq_used >= st->sq_depth || st->sq_depth - st->sq_used < need)
+        return false;
+
+    share = max(st->sq_depth / conns, need);
+    if (st->conn_sq_used + need > share)
+        return false;
+
+    return st->conn_rd_used < max(st->rd_max / conns, 1U);
+}
+EXPORT_SYMBOL(kfi_svc_has_wspace);
@@ -0,0 +1,484 @@
+/*
+ * kfi_ep_pool.c - Pre-created endpoint pool for fast connection setup
+ *
+ * Bringing up a connection the verbs way costs a CQ pair, kfi_endpoint(),
+ * two CQ binds, an AV bind and kfi_enable(), and all of it is torn down
+ * again on disconnect. At job start thousands of mounts do this at once.
+ *
+ * Each device therefore keeps a pool of "bundles": an endpoint with its
+ * own send/recv CQs, bound to the device's shared AV and already enabled.
+ * Connecting a bundle only resolves the peer in the AV. On disconnect the
+ * bundle is drained and recycled instead of destroyed.
+ *
+ * CXI takes an endpoint's auth key, and with it the VNI and traffic
+ * class, when the endpoint is opened. A device therefore keeps one pool
+ * per (VNI, traffic class) in use, each opening its endpoints with its
+ * own key; the pool for the device's default VNI is created and filled
+ * with the device, the others on first use.
+ *
+ * Every bundle holds a reference on its pool, so a connection that
+ * outlives the device's pool can still release its endpoint; the pool
+ * and its PD go with the last bundle. The pool holds the device, whose
+ * domain, AV and QP table the bundles need until they are closed.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+static int ep_pool_size = KFI_EP_POOL_DEFAULT;
+module_param(ep_pool_size, int, 0444);
+MODULE_PARM_DESC(ep_pool_size,
+                 "Idle pre-created endpoints kept per device (0 = disable)");
+
+/*
+ * ============================================================================
+ * BUNDLE LIFETIME
+ * ============================================================================
+ */
+
+static void kfi_ep_pool_unref(struct kfi_ep_pool *pool)
+{
+    struct kfi_device *kdev = pool->kdev;
+
+    if (!refcount_dec_and_test(&pool->ref))
+        return;
+
+    pr_info("kfi: EP pool for %s: hits=%lld misses=%lld recycled=%lld discarded=%lld\n",
+            pool->kdev->name, atomic64_read(&pool->hits),
+            atomic64_read(&pool->misses), atomic64_read(&pool->recycled),
+            atomic64_read(&pool->discarded));
+
+    if (kfi_dealloc_pd(pool->pd))
+        pr_warn("kfi: EP pool for %s: PD still in use\n", pool->kdev->name);
+    if (pool->key)
+        kfi_auth_key_put(kdev, pool->key);
+    kfree(pool);
+    kfi_device_put(kdev);
+}
+
+/**
+ * kfi_ep_bundle_create - Run the full endpoint bring-up once, ahead of time
+ * @pool: Pool the bundle belongs to
+ */
+static struct kfi_ep_bundle *kfi_ep_bundle_create(struct kfi_ep_pool *pool)
+{
+    struct ib_cq_init_attr cq_attr = { .cqe = KFI_DEFAULT_CQ_SIZE };
+    struct ib_qp_init_attr qp_attr;
+    struct kfi_ep_bundle *b;
+    struct kfi_qp *kqp;
+    int ret;
+
+    b = kzalloc(sizeof(*b), GFP_KERNEL);
+    if (!b)
+        return ERR_PTR(-ENOMEM);
+
+    b->pool = pool;
+    b->pd = pool->pd;
+    INIT_LIST_HEAD(&b->list);
+
+    b->send_cq = kfi_create_cq(kfi_to_ibdev(pool->kdev), &cq_attr, NULL, NULL);
+    if (IS_ERR(b->send_cq)) {
+        ret = PTR_ERR(b->send_cq);
+        goto err_free;
+    }
+
+    b->recv_cq = kfi_create_cq(kfi_to_ibdev(pool->kdev), &cq_attr, NULL, NULL);
+    if (IS_ERR(b->recv_cq)) {
+        ret = PTR_ERR(b->recv_cq);
+        goto err_send_cq;
+    }
+
+    memset(&qp_attr, 0, sizeof(qp_attr));
+    qp_attr.send_cq = b->send_cq;
+    qp_attr.recv_cq = b->recv_cq;
+    qp_attr.cap.max_send_wr = KFI_DEFAULT_QP_DEPTH;
+    qp_attr.cap.max_recv_wr = KFI_DEFAULT_QP_DEPTH;
+    qp_attr.cap.max_send_sge = KFI_MAX_SGE;
+    qp_attr.cap.max_recv_sge = KFI_MAX_SGE;
+    qp_attr.qp_type = IB_QPT_RC;
+
+    b->qp = kfi_create_qp(b->pd, &qp_attr);
+    if (IS_ERR(b->qp)) {
+        ret = PTR_ERR(b->qp);
+        goto err_recv_cq;
+    }
+
+    kqp = ibqp_to_kfi(b->qp);
+    set_bit(KFI_QP_F_POOLED, &kqp->flags);
+    ibcq_to_kfi(b->send_cq)->owner = kqp;
+    ibcq_to_kfi(b->recv_cq)->owner = kqp;
+
+    ret = kfi_qp_enable(kqp);
+    if (ret)
+        goto err_qp;
+
+    refcount_inc(&pool->ref);
+    return b;
+
+err_qp:
+    kfi_destroy_qp(b->qp);
+err_recv_cq:
+    kfi_destroy_cq(b->recv_cq);
+err_send_cq:
+    kfi_destroy_cq(b->send_cq);
+err_free:
+    kfree(b);
+    return ERR_PTR(ret);
+}
+
+static void kfi_ep_bundle_destroy(struct kfi_ep_bundle *b)
+{
+    struct kfi_ep_pool *pool = b->pool;
+
+    kfi_destroy_qp(b->qp);
+    kfi_destroy_cq(b->recv_cq);
+    kfi_destroy_cq(b->send_cq);
+    kfree(b);
+    kfi_ep_pool_unref(pool);
+}
+
+/**
+ * kfi_ep_bundle_quiesce - Wait for a released endpoint to go idle
+ * @b: Bundle being released
+ *
+ * The previous owner must have cancelled its posted receives. Whatever
+ * completions are still in flight belong to it and are discarded
+ * without calling any handler.
+ *
+ * Returns: true if nothing is outstanding on the endpoint
+ */
+static bool kfi_ep_bundle_quiesce(struct kfi_ep_bundle *b)
+{
+    struct kfi_qp *kqp = ibqp_to_kfi(b->qp);
+    struct kfi_cq *ksend_cq = ibcq_to_kfi(b->send_cq);
+    struct kfi_cq *krecv_cq = ibcq_to_kfi(b->recv_cq);
+    unsigned long deadline = jiffies + msecs_to_jiffies(KFI_EP_POOL_QUIESCE_MS);
+    struct ib_wc wc[KFI_BUSY_POLL_BATCH];
+
+    for (;;) {
+        spin_lock_bh(&ksend_cq->poll_lock);
+        while (kfi_poll_cq(b->send_cq, ARRAY_SIZE(wc), wc) > 0)
+            ;
+        spin_unlock_bh(&ksend_cq->poll_lock);
+
+        spin_lock_bh(&krecv_cq->poll_lock);
+        while (kfi_poll_cq(b->recv_cq, ARRAY_SIZE(wc), wc) > 0)
+            ;
+        spin_unlock_bh(&krecv_cq->poll_lock);
+
+        if (!atomic_read(&kqp->sq_outstanding) &&
+            !atomic_read(&kqp->rq_outstanding))
+            return true;
+
+        if (time_after(jiffies, deadline))
+            return false;
+
+        usleep_range(50, 100);
+    }
+}
+
+/* Forget everything the previous owner attached to the bundle */
+static void kfi_ep_bundle_reset(struct kfi_ep_bundle *b)
+{
+    struct kfi_qp *kqp = ibqp_to_kfi(b->qp);
+    struct kfi_cq *ksend_cq = ibcq_to_kfi(b->send_cq);
+    struct kfi_cq *krecv_cq = ibcq_to_kfi(b->recv_cq);
+
+    if (kqp->av_entry) {
+        kfi_av_put(b->pool->kdev->av_cache, kqp->av_entry);
+        kqp->av_entry = NULL;
+    }
+    kqp->dest_addr = KFI_ADDR_NOTAVAIL;
+
+    /* The endpoint keeps the key it was opened with */
+    kqp->service_id = 0;
+    kqp->traffic_class = b->pool->traffic_class;
+    kqp->vni_from_mount = b->pool->vni;
+    kqp->busy_poll_usec = 0;
+
+    kqp->event_handler = NULL;
+    kqp->qp_context = NULL;
+    kqp->state = IB_QPS_RESET;
+
+    ksend_cq->comp_handler = NULL;
+    ksend_cq->cq_context = NULL;
+    krecv_cq->comp_handler = NULL;
+    krecv_cq->cq_context = NULL;
+}
+
+/*
+ * ============================================================================
+ * POOL OPERATIONS
+ * ============================================================================
+ */
+
+static void kfi_ep_pool_refill(struct work_struct *work)
+{
+    struct kfi_ep_pool *pool = container_of(work, struct kfi_ep_pool,
+                                            refill_work);
+    struct kfi_ep_bundle *b;
+    bool need;
+
+    for (;;) {
+        spin_lock(&pool->lock);
+        need = !pool->dead && pool->nr_free < pool->target;
+        spin_unlock(&pool->lock);
+
+        if (!need)
+            break;
+
+        b = kfi_ep_bundle_create(pool);
+        if (IS_ERR(b)) {
+            pr_warn_ratelimited("kfi: EP pool refill failed: %ld\n",
+                                PTR_ERR(b));
+            break;
+        }
+
+        spin_lock(&pool->lock);
+        if (pool->dead) {
+            spin_unlock(&pool->lock);
+            kfi_ep_bundle_destroy(b);
+            break;
+        }
+        list_add_tail(&b->list, &pool->free);
+        pool->nr_free++;
+        spin_unlock(&pool->lock);
+    }
+}
+
+/* Caller holds kdev->ep_pool_lock; @vni is resolved (0 = none) */
+static struct kfi_ep_pool *kfi_ep_pool_create(struct kfi_device *kdev,
+                                              u16 vni, u8 traffic_class)
+{
+    struct kfi_ep_pool *pool;
+    int ret;
+
+    pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+    if (!pool)
+        return ERR_PTR(-ENOMEM);
+
+    pool->vni = vni;
+    pool->traffic_class = traffic_class;
+    if (vni) {
+        pool->key = kfi_auth_key_get(kdev, vni, 0, traffic_class);
+        if (IS_ERR(pool->key)) {
+            ret = PTR_ERR(pool->key);
+            kfree(pool);
+            return ERR_PTR(ret);
+        }
+    }
+
+    pool->pd = kfi_alloc_pd(kfi_to_ibdev(kdev), NULL, NULL);
+    if (IS_ERR(pool->pd)) {
+        ret = PTR_ERR(pool->pd);
+        if (pool->key)
+            kfi_auth_key_put(kdev, pool->key);
+        kfree(pool);
+        return ERR_PTR(ret);
+    }
+    /* Every endpoint created on the PD is opened with the pool's key */
+    ibpd_to_kfi(pool->pd)->auth_key = pool->key;
+
+    pool->kdev = kdev;
+    kfi_device_hold(kdev);
+    refcount_set(&pool->ref, 1);
+    INIT_LIST_HEAD(&pool->free);
+    spin_lock_init(&pool->lock);
+    pool->target = clamp(ep_pool_size, 0, KFI_EP_POOL_MAX);
+    INIT_WORK(&pool->refill_work, kfi_ep_pool_refill);
+    atomic64_set(&pool->hits, 0);
+    atomic64_set(&pool->misses, 0);
+    atomic64_set(&pool->recycled, 0);
+    atomic64_set(&pool->discarded, 0);
+    list_add_tail(&pool->list, &kdev->ep_pools);
+
+    if (pool->target)
+        queue_work(system_unbound_wq, &pool->refill_work);
+
+    pr_debug("kfi: EP pool for %s, VNI %u tc %u (target=%d)\n", kdev->name,
+             vni, traffic_class, pool->target);
+    return pool;
+}
+
+/* The pool for a (VNI, traffic class), created on first use */
+static struct kfi_ep_pool *kfi_ep_pool_lookup(struct kfi_device *kdev,
+                                              u16 vni, u8 traffic_class)
+{
+    struct kfi_ep_pool *pool;
+
+    if (!vni)
+        vni = kdev->default_vni;
+
+    mutex_lock(&kdev->ep_pool_lock);
+    if (!kdev->ep_pool) {
+        /* No default pool: not set up, or the device is closing */
+        pool = ERR_PTR(-EOPNOTSUPP);
+        goto out;
+    }
+    list_for_each_entry(pool, &kdev->ep_pools, list) {
+        if (pool->vni == vni && pool->traffic_class == traffic_class)
+            goto out;
+    }
+    pool = kfi_ep_pool_create(kdev, vni, traffic_class);
+out:
+    mutex_unlock(&kdev->ep_pool_lock);
+    return pool;
+}
+
+/**
+ * kfi_ep_pool_get - Take a ready-to-connect endpoint
+ * @kdev: Device to take the endpoint from
+ * @vni: VNI the endpoint must carry (0 = the device default)
+ * @traffic_class: KFI_TC_* the endpoint must carry
+ *
+ * The returned bundle's QP is enabled with the auth key for @vni and
+ * @traffic_class and bound to the shared AV, so kfi_connect_ep() on it
+ * is a single AV lookup. If the pool is empty a bundle is created
+ * inline. Either way the pool is topped up again in the background.
+ */
+struct kfi_ep_bundle *kfi_ep_pool_get(struct kfi_device *kdev, u16 vni,
+                                      u8 traffic_class)
+{
+    struct kfi_ep_pool *pool;
+    struct kfi_ep_bundle *b;
+
+    pool = kfi_ep_pool_lookup(kdev, vni, traffic_class);
+    if (IS_ERR(pool))
+        return ERR_CAST(pool);
+
+    spin_lock(&pool->lock);
+    b = list_first_entry_or_null(&pool->free, struct kfi_ep_bundle, list);
+    if (b) {
+        list_del_init(&b->list);
+        pool->nr_free--;
+    }
+    spin_unlock(&pool->lock);
+
+    if (pool->target)
+        queue_work(system_unbound_wq, &pool->refill_work);
+
+    if (b) {
+        atomic64_inc(&pool->hits);
+        return b;
+    }
+
+    atomic64_inc(&pool->misses);
+    return kfi_ep_bundle_create(pool);
+}
+EXPORT_SYMBOL(kfi_ep_pool_get);
+
+/**
+ * kfi_ep_pool_put - Release an endpoint on disconnect
+ * @b: Bundle from kfi_ep_pool_get()
+ *
+ * The endpoint is quiesced and parked for reuse. It is closed instead
+ * if it does not drain in time, the pool is already full, or the device
+ * has destroyed the pool meanwhile.
+ */
+void kfi_ep_pool_put(struct kfi_ep_bundle *b)
+{
+    struct kfi_ep_pool *pool;
+
+    if (!b)
+        return;
+
+    pool = b->pool;
+
+    if (!kfi_ep_bundle_quiesce(b)) {
+        pr_warn("kfi: QP %u did not drain, closing instead of recycling\n",
+                ibqp_to_kfi(b->qp)->qp_num);
+        goto discard;
+    }
+
+    kfi_ep_bundle_reset(b);
+
+    spin_lock(&pool->lock);
+    if (!pool->dead && pool->nr_free < pool->target) {
+        list_add(&b->list, &pool->free);
+        pool->nr_free++;
+        spin_unlock(&pool->lock);
+        atomic64_inc(&pool->recycled);
+        return;
+    }
+    spin_unlock(&pool->lock);
+
+discard:
+    atomic64_inc(&pool->discarded);
+    kfi_ep_bundle_destroy(b);
+}
+EXPORT_SYMBOL(kfi_ep_pool_put);
+
+/**
+ * kfi_ep_pool_init - Create a device's default endpoint pool and fill it
+ * @kdev: Device (domain, shared AV and default VNI already set up)
+ */
+int kfi_ep_pool_init(struct kfi_device *kdev)
+{
+    struct kfi_ep_pool *pool;
+
+    INIT_LIST_HEAD(&kdev->ep_pools);
+    mutex_init(&kdev->ep_pool_lock);
+
+    mutex_lock(&kdev->ep_pool_lock);
+    pool = kfi_ep_pool_create(kdev, kdev->default_vni, KFI_TC_BEST_EFFORT);
+    mutex_unlock(&kdev->ep_pool_lock);
+    if (IS_ERR(pool))
+        return PTR_ERR(pool);
+
+    kdev->ep_pool = pool;
+    return 0;
+}
+
+/* Close a pool's idle endpoints and drop the device's reference */
+static void kfi_ep_pool_release(struct kfi_ep_pool *pool)
+{
+    struct kfi_device *kdev = pool->kdev;
+    struct kfi_ep_bundle *b, *tmp;
+    LIST_HEAD(idle);
+
+    spin_lock(&pool->lock);
+    pool->dead = true;
+    list_splice_init(&pool->free, &idle);
+    pool->nr_free = 0;
+    spin_unlock(&pool->lock);
+
+    cancel_work_sync(&pool->refill_work);
+
+    list_for_each_entry_safe(b, tmp, &idle, list) {
+        list_del(&b->list);
+        kfi_ep_bundle_destroy(b);
+    }
+
+    if (refcount_read(&pool->ref) > 1)
+        pr_warn("kfi: EP pool for %s, VNI %u tc %u still has endpoints in use\n",
+                kdev->name, pool->vni, pool->traffic_class);
+    kfi_ep_pool_unref(pool);
+}
+
+/**
+ * kfi_ep_pool_destroy - Close all idle endpoints and let go of the pools
+ *
+ * Bundles still handed out keep their pool until they are released; the
+ * last one frees it.
+ */
+void kfi_ep_pool_destroy(struct kfi_device *kdev)
+{
+    struct kfi_ep_pool *pool, *tmp;
+    LIST_HEAD(pools);
+
+    mutex_lock(&kdev->ep_pool_lock);
+    list_splice_init(&kdev->ep_pools, &pools);
+    kdev->ep_pool = NULL;
+    mutex_unlock(&kdev->ep_pool_lock);
+
+    list_for_each_entry_safe(pool, tmp, &pools, list) {
+        list_del_init(&pool->list);
+        kfi_ep_pool_release(pool);
+    }
+}
@@ -0,0 +1,160 @@
+/*
+ * kfi_lane.c - Metadata/data lane separation
+ *
+ * With one endpoint per mount, a GETATTR posted behind a few multi-MB
+ * READ/WRITE chunks waits for them on the wire and in the NIC's queues.
+ * A dual-lane mount ("lanes=2") connects two endpoints to the server:
+ *
+ *   - the meta lane carries metadata and small RPCs on the low-latency
+ *     traffic class;
+ *   - the bulk lane carries RPCs that move page data (READ, WRITE,
+ *     large READDIR) on the bulk-data traffic class.
+ *
+ * Each lane's endpoints are opened with an auth key for its own traffic
+ * class, so the two never share a CXI communication profile. RPCs are classified
+ * from the page payload the XDR encoder set up, which is what separates
+ * data procedures from metadata ones without a per-program table.
+ *
+ * The client transport has a queue per CPU rather than one endpoint per
+ * lane: the set only carries each lane's class and counters. Each queue
+ * takes its endpoint from the pool for its lane's class, and each RPC
+ * goes out on a queue of the lane kfi_lane_select() picks.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/sunrpc/xprt.h>
+
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+static unsigned int lane_meta_tc = KFI_TC_LOW_LATENCY;
+module_param(lane_meta_tc, uint, 0644);
+MODULE_PARM_DESC(lane_meta_tc, "Traffic class of the metadata lane");
+
+static unsigned int lane_bulk_tc = KFI_TC_BULK_DATA;
+module_param(lane_bulk_tc, uint, 0644);
+MODULE_PARM_DESC(lane_bulk_tc, "Traffic class of the bulk data lane");
+
+static unsigned int lane_meta_max = KFI_LANE_META_MAX;
+module_param(lane_meta_max, uint, 0644);
+MODULE_PARM_DESC(lane_meta_max,
+                 "Largest page payload (bytes) sent on the metadata lane");
+
+static const char * const kfi_lane_names[KFI_NR_LANES] = {
+    [KFI_LANE_META] = "meta",
+    [KFI_LANE_BULK] = "bulk",
+};
+
+/*
+ * ============================================================================
+ * LANE SET LIFETIME
+ * ============================================================================
+ */
+
+/**
+ * kfi_lane_set_alloc - Allocate a mount's lane set
+ * @nr_lanes: 1 or KFI_NR_LANES
+ */
+struct kfi_lane_set *kfi_lane_set_alloc(unsigned int nr_lanes)
+{
+    struct kfi_lane_set *set;
+    int i;
+
+    if (!nr_lanes || nr_lanes > KFI_NR_LANES)
+        return ERR_PTR(-EINVAL);
+
+    set = kzalloc(sizeof(*set), GFP_KERNEL);
+    if (!set)
+        return ERR_PTR(-ENOMEM);
+
+    set->nr_lanes = nr_lanes;
+    set->meta_max = lane_meta_max;
+
+    for (i = 0; i < KFI_NR_LANES; i++) {
+        atomic64_set(&set->lanes[i].ops, 0);
+        atomic64_set(&set->lanes[i].bytes, 0);
+    }
+
+    /* A single-lane set keeps the device's default class */
+    if (nr_lanes > 1) {
+        set->lanes[KFI_LANE_META].traffic_class =
+            min_t(unsigned int, lane_meta_tc, KFI_TC_MAX);
+        set->lanes[KFI_LANE_BULK].traffic_class =
+            min_t(unsigned int, lane_bulk_tc, KFI_TC_MAX);
+    }
+
+    return set;
+}
+EXPORT_SYMBOL(kfi_lane_set_alloc);
+
+/**
+ * kfi_lane_set_destroy - Free a lane set
+ */
+void kfi_lane_set_destroy(struct kfi_lane_set *set)
+{
+    int i;
+
+    if (IS_ERR_OR_NULL(set))
+        return;
+
+    for (i = 0; i < set->nr_lanes; i++) {
+        struct kfi_lane *lane = &set->lanes[i];
+
+        pr_debug("kfi: %s lane: ops=%lld bytes=%lld\n", kfi_lane_names[i],
+                 atomic64_read(&lane->ops), atomic64_read(&lane->bytes));
+    }
+
+    kfree(set);
+}
+EXPORT_SYMBOL(kfi_lane_set_destroy);
+
+/*
+ * ============================================================================
+ * CLASSIFICATION
+ * ============================================================================
+ */
+
+/**
+ * kfi_lane_classify - Pick the lane for an RPC
+ * @set: Lane set
+ * @call_pages: Page data in the call (WRITE payload)
+ * @reply_pages: Page data expected in the reply (READ/READDIR payload)
+ *
+ * Procedures that carry no page data are metadata by construction; those
+ * that do go to the bulk lane once the payload is larger than meta_max,
+ * so a small READ is not stuck behind a large one.
+ */
+enum kfi_lane_id kfi_lane_classify(const struct kfi_lane_set *set,
+                                   size_t call_pages, size_t reply_pages)
+{
+    if (set->nr_lanes < KFI_NR_LANES)
+        return KFI_LANE_META;
+
+    if (max(call_pages, reply_pages) > set->meta_max)
+        return KFI_LANE_BULK;
+
+    return KFI_LANE_META;
+}
+EXPORT_SYMBOL(kfi_lane_classify);
+
+/**
+ * kfi_lane_select - Classify an encoded RPC and account it to its lane
+ * @set: Lane set
+ * @rqst: RPC whose call has been marshalled
+ *
+ * Returns: lane whose endpoint the RPC must be sent on
+ */
+struct kfi_lane *kfi_lane_select(struct kfi_lane_set *set,
+                                 const struct rpc_rqst *rqst)
+{
+    size_t call_pages = rqst->rq_snd_buf.page_len;
+    size_t reply_pages = rqst->rq_rcv_buf.page_len;
+    struct kfi_lane *lane;
+
+    lane = &set->lanes[kfi_lane_classify(set, call_pages, reply_pages)];
+    atomic64_inc(&lane->ops);
+    atomic64_add(max(call_pages, reply_pages), &lane->bytes);
+    return lane;
+}
+EXPORT_SYMBOL(kfi_lane_select);
@@ -193,6 +193,81 @@ struct ib_mr *kfi_reg_user_mr(struct ib_pd *pd, u64 start, u64 length,
 }
 EXPORT_SYMBOL(kfi_reg_user_mr);
 
+/**
+ * kfi_reg_kva - Register a kernel virtual range for remote access
+ * @pd: Protection domain
+ * @addr: Start of the range (lowmem or vmalloc-free kernel address)
+ * @len: Length of the range
+ * @mr_access_flags: IB_ACCESS_* flags
+ *
+ * Used for RPC-over-RDMA chunks, whose handles go on the wire. A peer
+ * has no access to our key mapping table, so the handle must be the
+ * provider key itself; registrations whose key does not fit the
+ * protocol's 32-bit handle are refused.
+ */
+struct kfi_mr *kfi_reg_kva(struct ib_pd *pd, void *addr, size_t len,
+                           int mr_access_flags)
+{
+    struct kfi_pd *kpd = ibpd_to_kfi(pd);
+    struct kfi_mr *kmr;
+    u64 kfi_key;
+    int ret;
+
+    kmr = kzalloc(sizeof(*kmr), GFP_NOFS);
+    if (!kmr)
+        return ERR_PTR(-ENOMEM);
+
+    ret = kfi_mr_reg(kpd->kfi_domain, addr, len,
+                     ib_access_to_kfi(mr_access_flags),
+                     0, /* offset */
+                     0, /* Let provider choose key */
+                     0, /* flags */
+                     &kmr->kfi_mr,
+                     NULL, /* context */
+                     NULL); /* event */
+    if (ret) {
+        kfi_dbg("reg_kva: kfi_mr_reg failed: %d\n", ret);
+        kfree(kmr);
+        return ERR_PTR(ret);
+    }
+
+    kfi_key = kfi_mr_key(kmr->kfi_mr);
+    if (kfi_key > U32_MAX) {
+        kfi_err("reg_kva: provider key 0x%llx exceeds 32 bits\n", kfi_key);
+        kfi_close(&kmr->kfi_mr->fid);
+        kfree(kmr);
+        return ERR_PTR(-EOVERFLOW);
+    }
+
+    kmr->pd = kpd;
+    atomic_set(&kmr->usecnt, 1);
+    kmr->access_flags = mr_access_flags;
+    kmr->iova = (u64)(uintptr_t)addr;
+    kmr->length = len;
+    kmr->lkey = (u32)kfi_key;
+    kmr->rkey = (u32)kfi_key;
+
+    atomic_inc(&kpd->usecnt);
+    return kmr;
+}
+EXPORT_SYMBOL(kfi_reg_kva);
+
+/**
+ * kfi_dereg_kva - Release a registration made by kfi_reg_kva()
+ */
+void kfi_dereg_kva(struct kfi_mr *kmr)
+{
+    int ret;
+
+    ret = kfi_close(&kmr->kfi_mr->fid);
+    if (ret)
+        kfi_err("kfi_close(mr) failed: %d\n", ret);
+
+    atomic_dec(&kmr->pd->usecnt);
+    kfree(kmr);
+}
+EXPORT_SYMBOL(kfi_dereg_kva);
+
 /*
  * ============================================================================
  * MEMORY REGION MAPPING
@@ -8,7 +8,8 @@
  * Helper functions for individual operations
  */
 
-int kfi_do_send(struct kfi_qp *kqp, const struct ib_send_wr *wr)
+int kfi_do_send(struct kfi_qp *kqp, struct kfi_qp_ctx *ctx,
+                const struct ib_send_wr *wr)
 {
     struct kfi_mr *kmr;
     void *desc = NULL;
@@ -34,8 +35,8 @@ int kfi_do_send(struct kfi_qp *kqp, const struct ib_send_wr *wr)
             descs[i] = kfi_mr_desc(kmr->kfi_mr);
         }
 
-        ret = kfi_sendv(kqp->ep, iov, descs, wr->num_sge,
-                        0, /* kfi_addr */
+        ret = kfi_sendv(ctx->ep, iov, descs, wr->num_sge,
+                        kfi_qp_tx_addr(kqp, ctx),
                         (void *)wr->wr_id);
     } else {
         /* Single segment */
@@ -45,8 +46,8 @@ int kfi_do_send(struct kfi_qp *kqp, const struct ib_send_wr *wr)
         kmr = (struct kfi_mr *)(uintptr_t)wr->sg_list[0].lkey;
         desc = kfi_mr_desc(kmr->kfi_mr);
 
-        ret = kfi_send(kqp->ep, buf, len, desc,
-                       0, /* kfi_addr */
+        ret = kfi_send(ctx->ep, buf, len, desc,
+                       kfi_qp_tx_addr(kqp, ctx),
                        (void *)wr->wr_id);
     }
 
@@ -58,7 +59,8 @@ int kfi_do_send(struct kfi_qp *kqp, const struct ib_send_wr *wr)
     return (ret == -KFI_EAGAIN) ? -EAGAIN : 0;
 }
 
-int kfi_do_rdma_read(struct kfi_qp *kqp, const struct ib_send_wr *wr)
+int kfi_do_rdma_read(struct kfi_qp *kqp, struct kfi_qp_ctx *ctx,
+                     const struct ib_send_wr *wr)
 {
     struct ib_rdma_wr *rdma_wr = container_of(wr, struct ib_rdma_wr, wr);
     struct kfi_mr *kmr;
@@ -85,8 +87,8 @@ int kfi_do_rdma_read(struct kfi_qp *kqp, const struct ib_send_wr *wr)
             descs[i] = kfi_mr_desc(kmr->kfi_mr);
         }
 
-        ret = kfi_readv(kqp->ep, iov, descs, wr->num_sge,
-                        0, /* kfi_addr */
+        ret = kfi_readv(ctx->ep, iov, descs, wr->num_sge,
+                        kfi_qp_tx_addr(kqp, ctx),
                         rdma_wr->remote_addr,
                         rdma_wr->rkey,
                         (void *)wr->wr_id);
@@ -98,8 +100,8 @@ int kfi_do_rdma_read(struct kfi_qp *kqp, const struct ib_send_wr *wr)
         kmr = (struct kfi_mr *)(uintptr_t)wr->sg_list[0].lkey;
         desc = kfi_mr_desc(kmr->kfi_mr);
 
-        ret = kfi_read(kqp->ep, buf, len, desc,
-                       0, /* kfi_addr */
+        ret = kfi_read(ctx->ep, buf, len, desc,
+                       kfi_qp_tx_addr(kqp, ctx),
                        rdma_wr->remote_addr,
                        rdma_wr->rkey,
                        (void *)wr->wr_id);
@@ -113,14 +115,15 @@ int kfi_do_rdma_read(struct kfi_qp *kqp, const struct ib_send_wr *wr)
     return (ret == -KFI_EAGAIN) ? -EAGAIN : 0;
 }
 
-int kfi_do_send_with_inv(struct kfi_qp *kqp, const struct ib_send_wr *wr)
+int kfi_do_send_with_inv(struct kfi_qp *kqp, struct kfi_qp_ctx *ctx,
+                         const struct ib_send_wr *wr)
 {
     /* CXI doesn't have invalidate semantics like InfiniBand
      * For now, just do a regular send and log the invalidate request
      * TODO: Implement proper invalidation handling if needed
      */
     pr_debug("kfi_do_send_with_inv: invalidation not supported, doing regular send\n");
-    return kfi_do_send(kqp, wr);
+    return kfi_do_send(kqp, ctx, wr);
 }
 
 int kfi_do_recv(struct kfi_qp *kqp, const struct ib_recv_wr *wr)
@@ -149,8 +152,8 @@ int kfi_do_recv(struct kfi_qp *kqp, const struct ib_recv_wr *wr)
             descs[i] = kfi_mr_desc(kmr->kfi_mr);
         }
 
-        ret = kfi_recvv(kqp->ep, iov, descs, wr->num_sge,
-                        0, /* kfi_addr */
+        ret = kfi_recvv(kfi_qp_rx_ep(kqp), iov, descs, wr->num_sge,
+                        KFI_ADDR_UNSPEC, /* any source */
                         (void *)wr->wr_id);
     } else {
         /* Single segment */
@@ -160,8 +163,8 @@ int kfi_do_recv(struct kfi_qp *kqp, const struct ib_recv_wr *wr)
         kmr = (struct kfi_mr *)(uintptr_t)wr->sg_list[0].lkey;
         desc = kfi_mr_desc(kmr->kfi_mr);
 
-        ret = kfi_recv(kqp->ep, buf, len, desc,
-                       0, /* kfi_addr */
+        ret = kfi_recv(kfi_qp_rx_ep(kqp), buf, len, desc,
+                       KFI_ADDR_UNSPEC, /* any source */
                        (void *)wr->wr_id);
     }
 
@@ -170,7 +173,11 @@ int kfi_do_recv(struct kfi_qp *kqp, const struct ib_recv_wr *wr)
         return (int)ret;
     }
 
-    return (ret == -KFI_EAGAIN) ? -EAGAIN : 0;
+    if (ret == -KFI_EAGAIN)
+        return -EAGAIN;
+
+    atomic_inc(&kqp->rq_outstanding);
+    return 0;
 }
 
 /*
@@ -184,6 +191,7 @@ int kfi_post_send(struct ib_qp *qp,
 {
     struct kfi_qp *kqp = container_of(qp, struct kfi_qp, qp);
     const struct ib_send_wr *cur_wr;
+    struct kfi_qp_ctx *ctx;
     int ret = 0;
     unsigned long flags;
     
@@ -193,28 +201,29 @@ int kfi_post_send(struct ib_qp *qp,
         return -EINVAL;
     }
     
-    spin_lock_irqsave(&kqp->sq_lock, flags);
+    /* Per-CPU (or per-node) context: no lock shared across CPUs */
+    ctx = kfi_qp_tx_lock(kqp, &flags);
     
     /* Process each work request in the chain */
     for (cur_wr = wr; cur_wr; cur_wr = cur_wr->next) {
         switch (cur_wr->opcode) {
         case IB_WR_SEND:
-            ret = kfi_do_send(kqp, cur_wr);
+            ret = kfi_do_send(kqp, ctx, cur_wr);
             break;
             
         case IB_WR_RDMA_WRITE:
         case IB_WR_RDMA_WRITE_WITH_IMM:
-            ret = kfi_do_rdma_write(kqp, cur_wr);
+            ret = kfi_do_rdma_write(kqp, ctx, cur_wr);
             break;
             
         case IB_WR_RDMA_READ:
-            ret = kfi_do_rdma_read(kqp, cur_wr);
+            ret = kfi_do_rdma_read(kqp, ctx, cur_wr);
             break;
             
         case IB_WR_SEND_WITH_INV:
             /* CXI doesn't have invalidate semantics like IB
              * Need to handle this differently */
-            ret = kfi_do_send_with_inv(kqp, cur_wr);
+            ret = kfi_do_send_with_inv(kqp, ctx, cur_wr);
             break;
             
         default:
@@ -228,14 +237,16 @@ int kfi_post_send(struct ib_qp *qp,
                 *bad_wr = cur_wr;
             goto out_unlock;
         }
+
+        atomic_inc(&kqp->sq_outstanding);
     }
     
 out_unlock:
-    spin_unlock_irqrestore(&kqp->sq_lock, flags);
+    kfi_qp_tx_unlock(ctx, flags);
     return ret;
 }
 
-int kfi_do_rdma_write(struct kfi_qp *kqp,
+int kfi_do_rdma_write(struct kfi_qp *kqp, struct kfi_qp_ctx *ctx,
                       const struct ib_send_wr *wr)
 {
     struct ib_rdma_wr *rdma_wr = container_of(wr, struct ib_rdma_wr, wr);
@@ -271,8 +282,8 @@ int kfi_do_rdma_write(struct kfi_qp *kqp,
             descs[i] = kfi_mr_desc(kmr->kfi_mr);
         }
         
-        ret = kfi_writev(kqp->ep, iov, descs, wr->num_sge,
-                         0, /* kfi_addr - need to resolve this */
+        ret = kfi_writev(ctx->ep, iov, descs, wr->num_sge,
+                         kfi_qp_tx_addr(kqp, ctx),
                          rdma_wr->remote_addr,
                          rdma_wr->rkey,
                          (void *)wr->wr_id);
@@ -284,8 +295,8 @@ int kfi_do_rdma_write(struct kfi_qp *kqp,
         kmr = (struct kfi_mr *)(uintptr_t)wr->sg_list[0].lkey;
         desc = kfi_mr_desc(kmr->kfi_mr);
         
-        ret = kfi_write(kqp->ep, buf, len, desc,
-                        0, /* kfi_addr */
+        ret = kfi_write(ctx->ep, buf, len, desc,
+                        kfi_qp_tx_addr(kqp, ctx),
                         rdma_wr->remote_addr,
                         rdma_wr->rkey,
                         (void *)wr->wr_id);
@@ -317,6 +328,7 @@ int kfi_do_rdma_write(struct kfi_qp *kqp,
  */
 int kfi_batch_send(struct kfi_qp *kqp, struct kfi_batch_ctx *batch)
 {
+    struct kfi_qp_ctx *ctx;
     int i;
     ssize_t ret;
 
@@ -327,9 +339,11 @@ int kfi_batch_send(struct kfi_qp *kqp, struct kfi_batch_ctx *batch)
      * Note: KFI_MORE flag would indicate batching but is not directly
      * supported in this kfabric API - batching happens implicitly
      */
+    ctx = kfi_qp_tx_ctx(kqp);
+
     for (i = 0; i < batch->count; i++) {
-        ret = kfi_sendv(kqp->ep, &batch->iovs[i], &batch->descs[i], 1,
-                        0, batch->contexts[i]);
+        ret = kfi_sendv(ctx->ep, &batch->iovs[i], &batch->descs[i], 1,
+                        kfi_qp_tx_addr(kqp, ctx), batch->contexts[i]);
         if (ret < 0 && ret != -KFI_EAGAIN) {
             pr_err("kfi_sendv[%d] failed: %zd\n", i, ret);
             return (int)ret;
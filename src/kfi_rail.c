@@ -0,0 +1,233 @@
+/*
+ * kfi_rail.c - Multi-rail selection (one rail per CXI NIC)
+ *
+ * A node typically has several Slingshot NICs, but a single endpoint only
+ * ever drives one of them. A rail set accounts for the NICs a mount's
+ * endpoints are spread over and spreads work across them:
+ *
+ *   - each RPC goes to the rail with the fewest bytes in flight, with a
+ *     penalty for NICs on a different NUMA node than the buffer;
+ *   - a failed rail is taken out of selection immediately, so I/O keeps
+ *     flowing over the rest while its endpoints drain.
+ *
+ * The client transport ("rails=" in mount_options) spreads its queues
+ * over the rails and places each RPC with kfi_rail_pick(); since the
+ * server addresses a chunk through the endpoint the call came from, a
+ * mount stripes at RPC granularity, i.e. over the rsize/wsize RPCs that
+ * large I/O is split into. The set holds no endpoints: each of the
+ * transport's queues owns its own.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/numa.h>
+
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+/*
+ * ============================================================================
+ * RAIL SET LIFETIME
+ * ============================================================================
+ */
+
+/**
+ * kfi_rail_set_alloc - Allocate an empty rail set
+ *
+ * Rails are added with kfi_rail_add().
+ */
+struct kfi_rail_set *kfi_rail_set_alloc(void)
+{
+    struct kfi_rail_set *set;
+
+    set = kzalloc(sizeof(*set), GFP_KERNEL);
+    if (!set)
+        return ERR_PTR(-ENOMEM);
+
+    atomic_set(&set->nr_active, 0);
+    return set;
+}
+EXPORT_SYMBOL(kfi_rail_set_alloc);
+
+/**
+ * kfi_rail_add - Add a NIC as a new rail
+ * @set: Rail set
+ * @numa_node: NUMA node of the NIC, or NUMA_NO_NODE
+ *
+ * Returns: rail index, or -ENOSPC if the set is full
+ */
+int kfi_rail_add(struct kfi_rail_set *set, int numa_node)
+{
+    struct kfi_rail *rail;
+
+    if (set->nr_rails >= KFI_MAX_RAILS)
+        return -ENOSPC;
+
+    rail = &set->rails[set->nr_rails];
+    rail->numa_node = numa_node;
+    rail->flags = 0;
+    atomic64_set(&rail->outstanding_bytes, 0);
+    atomic64_set(&rail->ops, 0);
+    atomic64_set(&rail->bytes, 0);
+    atomic64_set(&rail->errors, 0);
+
+    atomic_inc(&set->nr_active);
+    return set->nr_rails++;
+}
+EXPORT_SYMBOL(kfi_rail_add);
+
+/**
+ * kfi_rail_set_clear - Drop every rail, e.g. before reconnecting
+ */
+void kfi_rail_set_clear(struct kfi_rail_set *set)
+{
+    set->nr_rails = 0;
+    atomic_set(&set->nr_active, 0);
+}
+EXPORT_SYMBOL(kfi_rail_set_clear);
+
+/**
+ * kfi_rail_set_destroy - Free a rail set
+ */
+void kfi_rail_set_destroy(struct kfi_rail_set *set)
+{
+    struct kfi_rail *rail;
+    int i;
+
+    if (IS_ERR_OR_NULL(set))
+        return;
+
+    for (i = 0; i < set->nr_rails; i++) {
+        rail = &set->rails[i];
+
+        pr_debug("kfi: rail %d%s: ops=%lld bytes=%lld errors=%lld\n", i,
+                 test_bit(KFI_RAIL_F_FAILED, &rail->flags) ? " (failed)" : "",
+                 atomic64_read(&rail->ops), atomic64_read(&rail->bytes),
+                 atomic64_read(&rail->errors));
+    }
+
+    kfree(set);
+}
+EXPORT_SYMBOL(kfi_rail_set_destroy);
+
+/*
+ * ============================================================================
+ * RAIL SELECTION
+ * ============================================================================
+ */
+
+/* Bytes in flight, plus a penalty if the buffer lives on another node */
+static u64 kfi_rail_cost(struct kfi_rail *rail, int numa_node)
+{
+    u64 cost = atomic64_read(&rail->outstanding_bytes);
+
+    if (numa_node != NUMA_NO_NODE && rail->numa_node != NUMA_NO_NODE &&
+        rail->numa_node != numa_node)
+        cost += KFI_RAIL_REMOTE_PENALTY;
+
+    return cost;
+}
+
+/**
+ * kfi_rail_pick - Pick the rail for an operation without charging it
+ * @set: Rail set
+ * @numa_node: Node of the data buffer, or NUMA_NO_NODE
+ *
+ * For callers that may still go elsewhere, e.g. when the rail has no
+ * room; whichever rail is used is then charged with kfi_rail_charge().
+ *
+ * Returns: the cheapest rail, or ERR_PTR(-ENOTCONN) if every rail failed
+ */
+struct kfi_rail *kfi_rail_pick(struct kfi_rail_set *set, int numa_node)
+{
+    struct kfi_rail *best = NULL;
+    u64 cost, best_cost = U64_MAX;
+    int i;
+
+    for (i = 0; i < set->nr_rails; i++) {
+        struct kfi_rail *rail = &set->rails[i];
+
+        if (test_bit(KFI_RAIL_F_FAILED, &rail->flags))
+            continue;
+
+        cost = kfi_rail_cost(rail, numa_node);
+        if (cost < best_cost) {
+            best = rail;
+            best_cost = cost;
+        }
+    }
+
+    return best ?: ERR_PTR(-ENOTCONN);
+}
+EXPORT_SYMBOL(kfi_rail_pick);
+
+/**
+ * kfi_rail_charge - Account an operation to a rail
+ * @rail: Rail the operation is posted on
+ * @len: Bytes the operation moves, handed back with kfi_rail_complete()
+ */
+void kfi_rail_charge(struct kfi_rail *rail, size_t len)
+{
+    atomic64_add(len, &rail->outstanding_bytes);
+    atomic64_inc(&rail->ops);
+    atomic64_add(len, &rail->bytes);
+}
+EXPORT_SYMBOL(kfi_rail_charge);
+
+/**
+ * kfi_rail_select - Pick the rail for an operation and charge it
+ * @set: Rail set
+ * @len: Bytes the operation moves
+ * @numa_node: Node of the data buffer, or NUMA_NO_NODE
+ *
+ * The caller must hand @len back with kfi_rail_complete() once the
+ * operation completes.
+ *
+ * Returns: the chosen rail, or ERR_PTR(-ENOTCONN) if every rail failed
+ */
+struct kfi_rail *kfi_rail_select(struct kfi_rail_set *set, size_t len,
+                                 int numa_node)
+{
+    struct kfi_rail *rail = kfi_rail_pick(set, numa_node);
+
+    if (!IS_ERR(rail))
+        kfi_rail_charge(rail, len);
+    return rail;
+}
+EXPORT_SYMBOL(kfi_rail_select);
+
+/**
+ * kfi_rail_complete - Return an operation's bytes to its rail
+ * @rail: Rail from kfi_rail_select(), or charged with kfi_rail_charge()
+ * @len: Bytes charged at selection
+ * @ok: Whether the operation succeeded
+ */
+void kfi_rail_complete(struct kfi_rail *rail, size_t len, bool ok)
+{
+    atomic64_sub(len, &rail->outstanding_bytes);
+    if (!ok)
+        atomic64_inc(&rail->errors);
+}
+EXPORT_SYMBOL(kfi_rail_complete);
+
+/**
+ * kfi_rail_fail - Take a rail out of service
+ * @set: Rail set
+ * @rail: Rail whose endpoint reported a fatal error
+ *
+ * New work goes to the remaining rails straight away. Operations already
+ * posted on @rail are left to the caller, which moves them to the
+ * remaining rails; the client transport sends its stranded RPCs again.
+ *
+ * Returns: number of rails still in service
+ */
+int kfi_rail_fail(struct kfi_rail_set *set, struct kfi_rail *rail)
+{
+    if (test_and_set_bit(KFI_RAIL_F_FAILED, &rail->flags))
+        return atomic_read(&set->nr_active);
+
+    pr_warn("kfi: rail %td failed, %d rail(s) left\n", rail - set->rails,
+            atomic_read(&set->nr_active) - 1);
+    return atomic_dec_return(&set->nr_active);
+}
+EXPORT_SYMBOL(kfi_rail_fail);
@@ -0,0 +1,1579 @@
+/*
+ * kfi_rpc_rdma.c - RPC-over-RDMA marshalling (RFC 8166 and Version Two)
+ *
+ * Every RPC is conveyed by one Send carrying the transport header, plus
+ * whatever chunks the header advertises:
+ *
+ *   - small calls and replies travel inline, gathered straight from the
+ *     XDR buffers (no copy unless the gather list is too long);
+ *   - call page data (NFS WRITE) is left in the page cache and offered
+ *     to the server as a Read chunk;
+ *   - reply page data (NFS READ) is placed by the server straight into
+ *     the page cache through a Write chunk, also when it would fit
+ *     inline: the client never copies READ payload;
+ *   - anything else too large for the inline threshold goes whole in a
+ *     position-zero Read chunk or a Reply chunk.
+ *
+ * Chunks are registered per virtually contiguous run of the XDR buffer,
+ * so a folio-backed page cache range costs one registration, not one per
+ * page. The header codec below is independent of the endpoint and is
+ * exercised directly by the unit tests.
+ *
+ * Version Two is used when the server answers our RDMA2_CONNPROP with
+ * its own properties. It changes the header prefix only; what it buys is
+ * a negotiated inline threshold, so mid-size calls and replies (small
+ * WRITEs, READDIR) need no chunk registration at all. A server may also
+ * continue one reply over several Sends (RDMA2_F_MORE); the earlier
+ * pieces are held until the last one arrives and are then copied into
+ * the reply buffer in order.
+ *
+ * A server that advertises the private multi-call property also takes
+ * several small calls in one Send, which the transport uses while a
+ * Send is already in flight (see kfi_transport.c).
+ *
+ * Callbacks from the server arrive on the same receives as replies and
+ * are handed to kfi_backchannel.c.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/ktime.h>
+#include <linux/sunrpc/xdr.h>
+#include <linux/sunrpc/xprt.h>
+#include <linux/sunrpc/rpc_rdma.h>
+
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+#include "kfi_trace.h"
+
+/*
+ * ============================================================================
+ * CHUNK CONSTRUCTION
+ * ============================================================================
+ */
+
+/**
+ * kfi_chunk_add_range - Append a kernel virtual range to a chunk
+ * @ch: Chunk being built
+ * @addr: Start of the range
+ * @len: Length of the range
+ *
+ * A range that continues the previous segment extends it instead of
+ * taking a new one.
+ *
+ * Returns: 0, or -EMSGSIZE if the chunk is out of segments
+ */
+int kfi_chunk_add_range(struct kfi_chunk *ch, void *addr, u32 len)
+{
+    u64 start = (u64)(uintptr_t)addr;
+    struct kfi_seg *seg;
+
+    if (!len)
+        return 0;
+
+    if (ch->nsegs) {
+        seg = &ch->segs[ch->nsegs - 1];
+        if (seg->offset + seg->length == start &&
+            (u64)seg->length + len <= U32_MAX) {
+            seg->length += len;
+            ch->length += len;
+            return 0;
+        }
+    }
+
+    if (ch->nsegs == KFI_XPRT_MAX_SEGS)
+        return -EMSGSIZE;
+
+    seg = &ch->segs[ch->nsegs++];
+    seg->mr = NULL;
+    seg->handle = 0;
+    seg->offset = start;
+    seg->length = len;
+    ch->length += len;
+    return 0;
+}
+EXPORT_SYMBOL(kfi_chunk_add_range);
+
+/**
+ * kfi_chunk_add_xdr - Append an XDR buffer to a chunk
+ * @ch: Chunk being built
+ * @xdr: Buffer to convey
+ * @whole: Head, pages and tail (position-zero Read or Reply chunk);
+ *         otherwise only the page data (Read or Write chunk)
+ */
+int kfi_chunk_add_xdr(struct kfi_chunk *ch, struct xdr_buf *xdr, bool whole)
+{
+    unsigned int base, remaining, len;
+    struct page **ppages;
+    int ret;
+
+    if (whole) {
+        ret = kfi_chunk_add_range(ch, xdr->head[0].iov_base,
+                                  xdr->head[0].iov_len);
+        if (ret)
+            return ret;
+    }
+
+    ppages = xdr->pages + (xdr->page_base >> PAGE_SHIFT);
+    base = offset_in_page(xdr->page_base);
+    remaining = xdr->page_len;
+    while (remaining) {
+        /* GETACL and friends leave the pages for the transport to fill */
+        if (!*ppages && (xdr->flags & XDRBUF_SPARSE_PAGES))
+            *ppages = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+        if (!*ppages)
+            return -ENOBUFS;
+
+        len = min_t(unsigned int, PAGE_SIZE - base, remaining);
+        ret = kfi_chunk_add_range(ch, page_address(*ppages) + base, len);
+        if (ret)
+            return ret;
+
+        ppages++;
+        base = 0;
+        remaining -= len;
+    }
+
+    if (whole)
+        return kfi_chunk_add_range(ch, xdr->tail[0].iov_base,
+                                   xdr->tail[0].iov_len);
+    return 0;
+}
+EXPORT_SYMBOL(kfi_chunk_add_xdr);
+
+static int kfi_chunk_register(struct kfi_xprt *kx, struct ib_pd *pd,
+                              struct kfi_chunk *ch, int access)
+{
+    struct kfi_seg *seg;
+    struct kfi_mr *kmr;
+    int i;
+
+    for (i = 0; i < ch->nsegs; i++) {
+        seg = &ch->segs[i];
+        kmr = kfi_reg_kva(pd, (void *)(uintptr_t)seg->offset,
+                          seg->length, access);
+        if (IS_ERR(kmr))
+            return PTR_ERR(kmr);
+
+        seg->mr = kmr;
+        seg->handle = kmr->rkey;
+        kx->stats.mrs_allocated++;
+    }
+
+    return 0;
+}
+
+static void kfi_chunk_unmap(struct kfi_chunk *ch)
+{
+    int i;
+
+    for (i = 0; i < ch->nsegs; i++) {
+        if (ch->segs[i].mr) {
+            kfi_dereg_kva(ch->segs[i].mr);
+            ch->segs[i].mr = NULL;
+        }
+    }
+
+    ch->nsegs = 0;
+    ch->length = 0;
+    ch->position = 0;
+}
+
+/**
+ * kfi_rpcrdma_unmap - Release the chunk registrations of a request
+ *
+ * Called once the reply has been received, before a retransmission is
+ * marshalled, and when an RPC ends without a reply.
+ */
+void kfi_rpcrdma_unmap(struct kfi_req *req)
+{
+    if (!req->rchunk.segs)
+        return;
+
+    kfi_chunk_unmap(&req->rchunk);
+    kfi_chunk_unmap(&req->wchunk);
+}
+EXPORT_SYMBOL(kfi_rpcrdma_unmap);
+
+/*
+ * ============================================================================
+ * CHUNK DECISIONS
+ * ============================================================================
+ */
+
+/**
+ * kfi_rpcrdma_reply_type - Decide how the server returns the reply
+ * @rqst: RPC with its receive buffer set up by the XDR encoder
+ * @inline_rsize: Our receive buffer size
+ * @ddp_min: Smallest READ payload placed through a Write chunk even when
+ *           the reply would fit inline
+ *
+ * The page data of a READ-like reply goes into a Write chunk, so the
+ * server places it straight into the page cache, as long as the rest of
+ * the reply still fits inline. Below @inline_rsize that trades one
+ * registration for a copy out of the receive buffer, which @ddp_min
+ * bounds. Other replies that fit the receive buffer come back inline;
+ * everything else needs a Reply chunk.
+ */
+enum kfi_chunk_type kfi_rpcrdma_reply_type(const struct rpc_rqst *rqst,
+                                           u32 inline_rsize, u32 ddp_min)
+{
+    const struct xdr_buf *rcv = &rqst->rq_rcv_buf;
+    u32 max_inline = inline_rsize - RPCRDMA_HDRLEN_MIN;
+    bool ddp;
+
+    ddp = (rcv->flags & XDRBUF_READ) && rcv->page_len &&
+          rcv->head[0].iov_len + rcv->tail[0].iov_len < max_inline;
+    if (ddp && rcv->page_len >= ddp_min)
+        return KFI_WRITECH;
+
+    if (rcv->buflen <= max_inline)
+        return KFI_NOCH;
+
+    return ddp ? KFI_WRITECH : KFI_REPLYCH;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_reply_type);
+
+/**
+ * kfi_rpcrdma_call_type - Decide how the call reaches the server
+ * @rqst: RPC with its call encoded
+ * @hdrlen: Transport header length without a Read list
+ * @inline_wsize: Largest message we may send inline
+ */
+enum kfi_chunk_type kfi_rpcrdma_call_type(const struct rpc_rqst *rqst,
+                                          u32 hdrlen, u32 inline_wsize)
+{
+    const struct xdr_buf *snd = &rqst->rq_snd_buf;
+
+    if (hdrlen + snd->len <= inline_wsize)
+        return KFI_NOCH;
+
+    if ((snd->flags & XDRBUF_WRITE) && snd->page_len)
+        return KFI_READCH;
+
+    return KFI_AREADCH;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_call_type);
+
+/*
+ * ============================================================================
+ * TRANSPORT HEADER
+ * ============================================================================
+ */
+
+/**
+ * kfi_rpcrdma_hdr_len - Size of the transport header for a request
+ */
+unsigned int kfi_rpcrdma_hdr_len(u32 vers, enum kfi_chunk_type rtype,
+                                 const struct kfi_chunk *rchunk,
+                                 enum kfi_chunk_type wtype,
+                                 const struct kfi_chunk *wchunk)
+{
+    unsigned int words = 4;     /* xid, vers, credits, proc */
+
+    if (vers == KFI_RPCRDMA_V2)
+        words += 1;             /* flags */
+
+    /* Read list: (present, position, segment) per entry, then a zero */
+    if (rtype == KFI_READCH || rtype == KFI_AREADCH)
+        words += rchunk->nsegs * 6;
+    words += 1;
+
+    /* Write list: one chunk (present, count, segments), then a zero */
+    if (wtype == KFI_WRITECH)
+        words += 2 + wchunk->nsegs * 4;
+    words += 1;
+
+    /* Reply chunk: discriminator, then (count, segments) if present */
+    words += 1;
+    if (wtype == KFI_REPLYCH)
+        words += 1 + wchunk->nsegs * 4;
+
+    return words * sizeof(__be32);
+}
+EXPORT_SYMBOL(kfi_rpcrdma_hdr_len);
+
+static __be32 *kfi_encode_seg(__be32 *p, const struct kfi_seg *seg)
+{
+    *p++ = cpu_to_be32(seg->handle);
+    *p++ = cpu_to_be32(seg->length);
+    return xdr_encode_hyper(p, seg->offset);
+}
+
+static __be32 *kfi_encode_chunk_segs(__be32 *p, const struct kfi_chunk *ch)
+{
+    int i;
+
+    *p++ = cpu_to_be32(ch->nsegs);
+    for (i = 0; i < ch->nsegs; i++)
+        p = kfi_encode_seg(p, &ch->segs[i]);
+    return p;
+}
+
+/**
+ * kfi_rpcrdma_encode_hdr - Build the transport header of a call
+ * @buf: Output buffer
+ * @buflen: Size of @buf
+ * @vers: RPCRDMA_VERSION or KFI_RPCRDMA_V2
+ * @xid: RPC transaction ID
+ * @credits: Credits requested
+ * @rtype: How the call is conveyed
+ * @rchunk: Read chunk for KFI_READCH / KFI_AREADCH
+ * @wtype: How the reply is conveyed
+ * @wchunk: Write or Reply chunk for KFI_WRITECH / KFI_REPLYCH
+ *
+ * Returns: header length in bytes, or -EMSGSIZE
+ */
+int kfi_rpcrdma_encode_hdr(void *buf, size_t buflen, u32 vers, __be32 xid,
+                           u32 credits, enum kfi_chunk_type rtype,
+                           const struct kfi_chunk *rchunk,
+                           enum kfi_chunk_type wtype,
+                           const struct kfi_chunk *wchunk)
+{
+    __be32 *p = buf;
+    int i;
+
+    if (kfi_rpcrdma_hdr_len(vers, rtype, rchunk, wtype, wchunk) > buflen)
+        return -EMSGSIZE;
+
+    *p++ = xid;
+    *p++ = cpu_to_be32(vers);
+    *p++ = cpu_to_be32(credits);
+    *p++ = rtype == KFI_AREADCH ? rdma_nomsg : rdma_msg;
+    if (vers == KFI_RPCRDMA_V2)
+        *p++ = xdr_zero;        /* a call, not continued */
+
+    if (rtype == KFI_READCH || rtype == KFI_AREADCH) {
+        for (i = 0; i < rchunk->nsegs; i++) {
+            *p++ = xdr_one;
+            *p++ = cpu_to_be32(rchunk->position);
+            p = kfi_encode_seg(p, &rchunk->segs[i]);
+        }
+    }
+    *p++ = xdr_zero;
+
+    if (wtype == KFI_WRITECH) {
+        *p++ = xdr_one;
+        p = kfi_encode_chunk_segs(p, wchunk);
+    }
+    *p++ = xdr_zero;
+
+    if (wtype == KFI_REPLYCH) {
+        *p++ = xdr_one;
+        p = kfi_encode_chunk_segs(p, wchunk);
+    } else {
+        *p++ = xdr_zero;
+    }
+
+    return (char *)p - (char *)buf;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_encode_hdr);
+
+static __be32 *kfi_encode_prop(__be32 *p, u32 id, u32 val)
+{
+    *p++ = cpu_to_be32(id);
+    *p++ = cpu_to_be32(sizeof(__be32));
+    *p++ = cpu_to_be32(val);
+    return p;
+}
+
+/**
+ * kfi_rpcrdma_encode_connprop - Build an RDMA2_CONNPROP message
+ * @buf: Output buffer
+ * @buflen: Size of @buf
+ * @credits: Credits requested
+ * @props: Our properties; zero values are not advertised
+ *
+ * The XID is zero: the message belongs to no RPC. A Version One server
+ * answers it with RDMA_ERROR/ERR_VERS, which is how we learn to fall
+ * back.
+ *
+ * Returns: message length in bytes, or -EMSGSIZE
+ */
+int kfi_rpcrdma_encode_connprop(void *buf, size_t buflen, u32 credits,
+                                const struct kfi_rpcrdma_props *props)
+{
+    const u32 vals[] = {
+        [KFI_RDMA2_PROP_SBSIZ] = props->sbsiz,
+        [KFI_RDMA2_PROP_RBSIZ] = props->rbsiz,
+        [KFI_RDMA2_PROP_RSSIZ] = props->rssiz,
+        [KFI_RDMA2_PROP_RCSIZ] = props->rcsiz,
+        [KFI_RDMA2_PROP_BRS] = props->brs,
+    };
+    __be32 *p = buf, *count;
+    u32 id, n = 0;
+
+    if (buflen < (6 + ARRAY_SIZE(vals) * 3) * sizeof(__be32))
+        return -EMSGSIZE;
+
+    *p++ = xdr_zero;
+    *p++ = cpu_to_be32(KFI_RPCRDMA_V2);
+    *p++ = cpu_to_be32(credits);
+    *p++ = cpu_to_be32(KFI_RDMA2_CONNPROP);
+    *p++ = xdr_zero;
+
+    count = p++;
+    for (id = 1; id < ARRAY_SIZE(vals); id++) {
+        if (!vals[id])
+            continue;
+        p = kfi_encode_prop(p, id, vals[id]);
+        n++;
+    }
+    if (props->multi) {
+        p = kfi_encode_prop(p, KFI_RDMA2_PROP_MULTI, props->multi);
+        n++;
+    }
+    *count = cpu_to_be32(n);
+
+    return (char *)p - (char *)buf;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_encode_connprop);
+
+static bool kfi_decode_u32(const __be32 **p, const __be32 *end, u32 *val)
+{
+    if (*p >= end)
+        return false;
+    *val = be32_to_cpup((*p)++);
+    return true;
+}
+
+/* Decode (count, segments) and return the sum of the segment lengths */
+static int kfi_decode_chunk_segs(const __be32 **p, const __be32 *end,
+                                 u32 *len)
+{
+    u32 count, i;
+    u64 total = 0;
+
+    if (!kfi_decode_u32(p, end, &count))
+        return -EIO;
+    if (count > KFI_XPRT_MAX_SEGS || end - *p < count * 4)
+        return -EIO;
+
+    for (i = 0; i < count; i++) {
+        total += be32_to_cpup(*p + 1);  /* handle, length, offset */
+        *p += 4;
+    }
+
+    if (total > U32_MAX)
+        return -EIO;
+    *len = total;
+    return 0;
+}
+
+/* Property list of RDMA2_CONNPROP; unknown properties are skipped */
+static int kfi_decode_props(const __be32 **p, const __be32 *end,
+                            struct kfi_rpcrdma_props *props)
+{
+    u32 count, id, len, val;
+
+    if (!kfi_decode_u32(p, end, &count))
+        return -EIO;
+
+    while (count--) {
+        if (!kfi_decode_u32(p, end, &id) || !kfi_decode_u32(p, end, &len))
+            return -EIO;
+        if (len > (end - *p) * sizeof(__be32))
+            return -EIO;
+
+        val = len >= sizeof(__be32) ? be32_to_cpup(*p) : 0;
+        *p += XDR_QUADLEN(len);
+
+        switch (id) {
+        case KFI_RDMA2_PROP_SBSIZ:
+            props->sbsiz = val;
+            break;
+        case KFI_RDMA2_PROP_RBSIZ:
+            props->rbsiz = val;
+            break;
+        case KFI_RDMA2_PROP_RSSIZ:
+            props->rssiz = val;
+            break;
+        case KFI_RDMA2_PROP_RCSIZ:
+            props->rcsiz = val;
+            break;
+        case KFI_RDMA2_PROP_BRS:
+            props->brs = val;
+            break;
+        case KFI_RDMA2_PROP_MULTI:
+            props->multi = val;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * kfi_rpcrdma_decode_hdr - Parse the transport header of a received message
+ * @buf: Received message
+ * @len: Bytes received
+ * @hdr: Decoded header
+ *
+ * Version Two message types are reported with their Version One
+ * numbers where one exists, so callers handle errors the same way for
+ * both versions.
+ *
+ * Returns: 0, -EPROTONOSUPPORT for a version we do not speak, or -EIO
+ * for a malformed header
+ */
+int kfi_rpcrdma_decode_hdr(const void *buf, size_t len,
+                           struct kfi_rpcrdma_hdr *hdr)
+{
+    const __be32 *p = buf;
+    const __be32 *end = p + len / sizeof(__be32);
+    u32 val, chunk_len;
+
+    memset(hdr, 0, sizeof(*hdr));
+
+    if (len < RPCRDMA_HDRLEN_ERR)
+        return -EIO;
+
+    hdr->xid = *p++;
+    hdr->vers = be32_to_cpup(p++);
+    hdr->credits = be32_to_cpup(p++);
+    hdr->proc = be32_to_cpup(p++);
+
+    if (hdr->vers == KFI_RPCRDMA_V2) {
+        if (!kfi_decode_u32(&p, end, &hdr->flags))
+            return -EIO;
+        if (hdr->proc == KFI_RDMA2_ERROR)
+            hdr->proc = RDMA_ERROR;
+        else if (hdr->proc == RDMA_ERROR)
+            return -EIO;            /* not a Version Two type */
+    } else if (hdr->vers != RPCRDMA_VERSION) {
+        return -EPROTONOSUPPORT;
+    }
+
+    if (hdr->proc == RDMA_ERROR) {
+        kfi_decode_u32(&p, end, &hdr->err);
+        /* ERR_VERS carries the server's version range */
+        if (hdr->err == ERR_VERS && end - p >= 2) {
+            hdr->vers_low = be32_to_cpup(p++);
+            hdr->vers_high = be32_to_cpup(p++);
+        }
+        goto out;
+    }
+
+    if (hdr->vers == KFI_RPCRDMA_V2 && hdr->proc == KFI_RDMA2_CONNPROP) {
+        if (kfi_decode_props(&p, end, &hdr->props))
+            return -EIO;
+        goto out;
+    }
+
+    if (hdr->vers == KFI_RPCRDMA_V2 && hdr->proc == KFI_RDMA2_MULTI) {
+        if (!kfi_decode_u32(&p, end, &hdr->nr_calls))
+            return -EIO;
+        goto out;
+    }
+
+    if (hdr->proc != RDMA_MSG && hdr->proc != RDMA_NOMSG)
+        return -EIO;
+
+    /* Read list */
+    for (;;) {
+        if (!kfi_decode_u32(&p, end, &val))
+            return -EIO;
+        if (!val)
+            break;
+        if (end - p < 5)
+            return -EIO;
+        p += 5;
+        hdr->nr_read++;
+    }
+
+    /* Write list */
+    for (;;) {
+        if (!kfi_decode_u32(&p, end, &val))
+            return -EIO;
+        if (!val)
+            break;
+        if (kfi_decode_chunk_segs(&p, end, &chunk_len))
+            return -EIO;
+        if ((u64)hdr->write_len + chunk_len > U32_MAX)
+            return -EIO;
+        hdr->write_len += chunk_len;
+        hdr->nr_write++;
+    }
+
+    /* Reply chunk */
+    if (!kfi_decode_u32(&p, end, &val))
+        return -EIO;
+    if (val) {
+        if (kfi_decode_chunk_segs(&p, end, &hdr->reply_len))
+            return -EIO;
+        hdr->reply_chunk = true;
+    }
+
+out:
+    hdr->hdrlen = (const char *)p - (const char *)buf;
+    return 0;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_decode_hdr);
+
+static const __be32 *kfi_decode_seg(const __be32 *p, struct kfi_seg *seg)
+{
+    seg->mr = NULL;
+    seg->handle = be32_to_cpup(p++);
+    seg->length = be32_to_cpup(p++);
+    seg->offset = (u64)be32_to_cpup(p) << 32 | be32_to_cpup(p + 1);
+    return p + 2;
+}
+
+/* (count, segments) of a chunk checked by kfi_decode_chunk_segs() */
+static const __be32 *kfi_decode_chunk(const __be32 *p, struct kfi_chunk *ch)
+{
+    u32 i, count = be32_to_cpup(p++);
+
+    for (i = 0; i < count; i++) {
+        p = kfi_decode_seg(p, &ch->segs[i]);
+        ch->length += ch->segs[i].length;
+    }
+    ch->nsegs = count;
+    return p;
+}
+
+/**
+ * kfi_rpcrdma_decode_read_list - Collect the Read chunk of a received call
+ * @buf: Received message
+ * @hdr: Its header, as decoded by kfi_rpcrdma_decode_hdr()
+ * @ch: Chunk to fill; @ch->segs holds KFI_XPRT_MAX_SEGS entries
+ *
+ * Used by the server. The Read list entries must all share one XDR
+ * position, as they do in every call this client and the in-tree one
+ * send: one data item, or the whole call at position zero.
+ *
+ * Returns: 0 (an empty chunk when there is no Read list), or -EIO for
+ * entries at more than one position or too many of them
+ */
+int kfi_rpcrdma_decode_read_list(const void *buf,
+                                 const struct kfi_rpcrdma_hdr *hdr,
+                                 struct kfi_chunk *ch)
+{
+    const __be32 *p = buf;
+    u64 total = 0;
+    u32 i, position;
+
+    ch->position = 0;
+    ch->length = 0;
+    ch->nsegs = 0;
+
+    if (!hdr->nr_read)
+        return 0;
+    if (hdr->nr_read > KFI_XPRT_MAX_SEGS)
+        return -EIO;
+
+    /* Bounds were checked by kfi_rpcrdma_decode_hdr() */
+    p += hdr->vers == KFI_RPCRDMA_V2 ? 5 : 4;
+    for (i = 0; i < hdr->nr_read; i++) {
+        struct kfi_seg *seg = &ch->segs[i];
+
+        p++;                            /* list item present */
+        position = be32_to_cpup(p++);
+        if (i && position != ch->position)
+            return -EIO;
+        ch->position = position;
+
+        p = kfi_decode_seg(p, seg);
+        total += seg->length;
+    }
+
+    if (total > U32_MAX)
+        return -EIO;
+    ch->length = total;
+    ch->nsegs = hdr->nr_read;
+    return 0;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_decode_read_list);
+
+/**
+ * kfi_rpcrdma_decode_write_list - Collect the Write and Reply chunks of a call
+ * @buf: Received message
+ * @hdr: Its header, as decoded by kfi_rpcrdma_decode_hdr()
+ * @wchunk: Write chunk to fill; @wchunk->segs holds KFI_XPRT_MAX_SEGS
+ *          entries when the call has one
+ * @rpchunk: Reply chunk to fill, likewise
+ *
+ * Used by the server, which takes one Write chunk per call: neither this
+ * client nor the in-tree one sends more.
+ *
+ * Returns: 0 (empty chunks where the call has none), or -EIO for more
+ * than one Write chunk
+ */
+int kfi_rpcrdma_decode_write_list(const void *buf,
+                                  const struct kfi_rpcrdma_hdr *hdr,
+                                  struct kfi_chunk *wchunk,
+                                  struct kfi_chunk *rpchunk)
+{
+    const __be32 *p = buf;
+
+    memset(wchunk, 0, offsetof(struct kfi_chunk, segs));
+    memset(rpchunk, 0, offsetof(struct kfi_chunk, segs));
+
+    if (hdr->nr_write > 1)
+        return -EIO;
+
+    /* Bounds were checked by kfi_rpcrdma_decode_hdr() */
+    p += hdr->vers == KFI_RPCRDMA_V2 ? 5 : 4;
+    p += hdr->nr_read * 6 + 1;          /* Read list */
+
+    if (hdr->nr_write)
+        p = kfi_decode_chunk(p + 1, wchunk);
+    p++;                                /* end of Write list */
+
+    if (hdr->reply_chunk)
+        kfi_decode_chunk(p + 1, rpchunk);
+    return 0;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_decode_write_list);
+
+/**
+ * kfi_rpcrdma_encode_reply - Build the transport header of a server reply
+ * @buf: Output buffer
+ * @buflen: Size of @buf
+ * @vers: Version of the call being answered
+ * @xid: RPC transaction ID
+ * @credits: Credits granted
+ * @wchunk: The call's Write chunk, segment lengths trimmed to the bytes
+ *          written, or NULL
+ * @rpchunk: The call's Reply chunk, trimmed likewise, when the reply was
+ *           written there; NULL for an inline reply
+ *
+ * Returns: header length in bytes, or -EMSGSIZE
+ */
+int kfi_rpcrdma_encode_reply(void *buf, size_t buflen, u32 vers, __be32 xid,
+                             u32 credits, const struct kfi_chunk *wchunk,
+                             const struct kfi_chunk *rpchunk)
+{
+    unsigned int words = 4 + 1 + 1 + 1;     /* prefix, three list ends */
+    __be32 *p = buf;
+
+    if (vers == KFI_RPCRDMA_V2)
+        words += 1;
+    if (wchunk)
+        words += 2 + wchunk->nsegs * 4;
+    if (rpchunk)
+        words += 1 + rpchunk->nsegs * 4;
+    if (words * sizeof(__be32) > buflen)
+        return -EMSGSIZE;
+
+    *p++ = xid;
+    *p++ = cpu_to_be32(vers);
+    *p++ = cpu_to_be32(credits);
+    *p++ = rpchunk ? rdma_nomsg : rdma_msg;
+    if (vers == KFI_RPCRDMA_V2)
+        *p++ = cpu_to_be32(KFI_RDMA2_F_RESPONSE);
+
+    *p++ = xdr_zero;                    /* Read list */
+
+    if (wchunk) {
+        *p++ = xdr_one;
+        p = kfi_encode_chunk_segs(p, wchunk);
+    }
+    *p++ = xdr_zero;
+
+    if (rpchunk) {
+        *p++ = xdr_one;
+        p = kfi_encode_chunk_segs(p, rpchunk);
+    } else {
+        *p++ = xdr_zero;
+    }
+
+    return (char *)p - (char *)buf;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_encode_reply);
+
+/**
+ * kfi_rpcrdma_encode_error - Build an RDMA_ERROR answering a call
+ * @buf: Output buffer
+ * @buflen: Size of @buf
+ * @vers: Version of the call being answered
+ * @xid: RPC transaction ID
+ * @credits: Credits granted
+ * @err: ERR_CHUNK; ERR_VERS would need the version range as well
+ *
+ * Returns: header length in bytes, or -EMSGSIZE
+ */
+int kfi_rpcrdma_encode_error(void *buf, size_t buflen, u32 vers, __be32 xid,
+                             u32 credits, u32 err)
+{
+    unsigned int words = 4 + 1;         /* prefix, error code */
+    __be32 *p = buf;
+
+    if (vers == KFI_RPCRDMA_V2)
+        words += 1;
+    if (words * sizeof(__be32) > buflen)
+        return -EMSGSIZE;
+
+    *p++ = xid;
+    *p++ = cpu_to_be32(vers);
+    *p++ = cpu_to_be32(credits);
+    if (vers == KFI_RPCRDMA_V2) {
+        *p++ = cpu_to_be32(KFI_RDMA2_ERROR);
+        *p++ = cpu_to_be32(KFI_RDMA2_F_RESPONSE);
+    } else {
+        *p++ = rdma_error;
+    }
+    *p++ = cpu_to_be32(err);
+
+    return (char *)p - (char *)buf;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_encode_error);
+
+/*
+ * ============================================================================
+ * CALL MARSHALLING
+ * ============================================================================
+ */
+
+static int kfi_rpcrdma_alloc_segs(struct kfi_req *req)
+{
+    struct kfi_seg *segs;
+
+    if (req->rchunk.segs)
+        return 0;
+
+    segs = kcalloc_node(2 * KFI_XPRT_MAX_SEGS, sizeof(*segs), GFP_NOFS,
+                        req->kx->node);
+    if (!segs)
+        return -ENOMEM;
+
+    req->rchunk.segs = segs;
+    req->wchunk.segs = segs + KFI_XPRT_MAX_SEGS;
+    return 0;
+}
+
+static int kfi_iov_add(struct kvec *iov, int n, void *base, size_t len)
+{
+    if (n < 0 || !len)
+        return n;
+    if (n == KFI_MAX_SGE)
+        return -E2BIG;
+
+    iov[n].iov_base = base;
+    iov[n].iov_len = len;
+    return n + 1;
+}
+
+/* Gather list for an inline call: head, each page piece, tail */
+static int kfi_rpcrdma_map_inline(struct xdr_buf *xdr, struct kvec *iov,
+                                  int n)
+{
+    unsigned int base, remaining, len;
+    struct page **ppages;
+
+    n = kfi_iov_add(iov, n, xdr->head[0].iov_base, xdr->head[0].iov_len);
+
+    ppages = xdr->pages + (xdr->page_base >> PAGE_SHIFT);
+    base = offset_in_page(xdr->page_base);
+    remaining = xdr->page_len;
+    while (remaining && n >= 0) {
+        len = min_t(unsigned int, PAGE_SIZE - base, remaining);
+        n = kfi_iov_add(iov, n, page_address(*ppages) + base, len);
+        ppages++;
+        base = 0;
+        remaining -= len;
+    }
+
+    return kfi_iov_add(iov, n, xdr->tail[0].iov_base, xdr->tail[0].iov_len);
+}
+
+/* Copy a whole XDR buffer behind the header when it cannot be gathered */
+static unsigned int kfi_rpcrdma_pullup(const struct xdr_buf *xdr, char *dst)
+{
+    unsigned int base, remaining, len;
+    struct page **ppages;
+    char *p = dst;
+
+    memcpy(p, xdr->head[0].iov_base, xdr->head[0].iov_len);
+    p += xdr->head[0].iov_len;
+
+    ppages = xdr->pages + (xdr->page_base >> PAGE_SHIFT);
+    base = offset_in_page(xdr->page_base);
+    remaining = xdr->page_len;
+    while (remaining) {
+        len = min_t(unsigned int, PAGE_SIZE - base, remaining);
+        memcpy_from_page(p, *ppages, base, len);
+        p += len;
+        ppages++;
+        base = 0;
+        remaining -= len;
+    }
+
+    memcpy(p, xdr->tail[0].iov_base, xdr->tail[0].iov_len);
+    p += xdr->tail[0].iov_len;
+
+    return p - dst;
+}
+
+/**
+ * kfi_rpcrdma_marshal - Prepare the Send for an RPC call
+ * @kx: Transport
+ * @req: Request whose call has been XDR-encoded, with req->q set
+ * @iov: Gather list for the Send (KFI_MAX_SGE entries)
+ * @niov: Returns the entries used in @iov
+ *
+ * Decides how each direction is conveyed, registers the chunks on the
+ * device of the queue the call goes out on (the server reaches them
+ * through that endpoint) and writes the transport header into req->hdr.
+ */
+int kfi_rpcrdma_marshal(struct kfi_xprt *kx, struct kfi_req *req,
+                        struct kvec *iov, int *niov)
+{
+    struct rpc_rqst *rqst = &req->rqst;
+    struct xdr_buf *snd = &rqst->rq_snd_buf;
+    struct xdr_buf *rcv = &rqst->rq_rcv_buf;
+    unsigned int hdrlen;
+    u32 ddp_min = 0;
+    int ret, n;
+
+    ret = kfi_rpcrdma_alloc_segs(req);
+    if (ret)
+        return ret;
+
+    /* Chunks left over from a previous transmission */
+    kfi_rpcrdma_unmap(req);
+
+    if (rcv->flags & XDRBUF_READ)
+        ddp_min = kfi_tune_ddp_min(&kx->tune);
+
+    /* The Version Two flags word comes out of the inline budget */
+    req->wtype = kfi_rpcrdma_reply_type(rqst, kx->inline_rsize -
+                                        (kx->vers == KFI_RPCRDMA_V2 ?
+                                         sizeof(__be32) : 0), ddp_min);
+    if (req->wtype == KFI_WRITECH)
+        ret = kfi_chunk_add_xdr(&req->wchunk, rcv, false);
+    else if (req->wtype == KFI_REPLYCH)
+        ret = kfi_chunk_add_xdr(&req->wchunk, rcv, true);
+    if (ret)
+        goto out_unmap;
+
+    hdrlen = kfi_rpcrdma_hdr_len(kx->vers, KFI_NOCH, &req->rchunk,
+                                 req->wtype, &req->wchunk);
+    req->rtype = kfi_rpcrdma_call_type(rqst, hdrlen, kx->inline_wsize);
+    if (req->rtype == KFI_READCH) {
+        req->rchunk.position = snd->head[0].iov_len;
+        ret = kfi_chunk_add_xdr(&req->rchunk, snd, false);
+    } else if (req->rtype == KFI_AREADCH) {
+        ret = kfi_chunk_add_xdr(&req->rchunk, snd, true);
+    }
+    if (ret)
+        goto out_unmap;
+
+    /* More segments than the server accepts would earn an ERR_CHUNK */
+    if (kx->peer.rcsiz && (req->rchunk.nsegs > kx->peer.rcsiz ||
+                           req->wchunk.nsegs > kx->peer.rcsiz)) {
+        ret = -EMSGSIZE;
+        goto out_unmap;
+    }
+
+    ret = kfi_chunk_register(kx, req->q->bundle->pd, &req->wchunk,
+                             IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_WRITE);
+    if (ret)
+        goto out_unmap;
+    ret = kfi_chunk_register(kx, req->q->bundle->pd, &req->rchunk,
+                             IB_ACCESS_REMOTE_READ);
+    if (ret)
+        goto out_unmap;
+
+    ret = kfi_rpcrdma_encode_hdr(req->hdr, kx->inline_wsize, kx->vers,
+                                 rqst->rq_xid, kx->queue_credits, req->rtype,
+                                 &req->rchunk, req->wtype, &req->wchunk);
+    if (ret < 0)
+        goto out_unmap;
+    hdrlen = ret;
+
+    iov[0].iov_base = req->hdr;
+    iov[0].iov_len = hdrlen;
+    n = 1;
+
+    switch (req->rtype) {
+    case KFI_NOCH:
+        n = kfi_rpcrdma_map_inline(snd, iov, n);
+        if (n < 0) {
+            /* Fits inline by construction, so it fits behind the header */
+            iov[0].iov_len += kfi_rpcrdma_pullup(snd, req->hdr + hdrlen);
+            kx->stats.pullup_copy_count += snd->len;
+            n = 1;
+        }
+        break;
+    case KFI_READCH:
+        n = kfi_iov_add(iov, n, snd->head[0].iov_base, snd->head[0].iov_len);
+        /*
+         * xdr_write_pages() pads odd-length page data at the front of
+         * the tail; the pad is not part of the Read chunk or the
+         * inline stream.
+         */
+        if (snd->tail[0].iov_len > 3) {
+            unsigned int pad = snd->tail[0].iov_len & 3;
+
+            n = kfi_iov_add(iov, n, snd->tail[0].iov_base + pad,
+                            snd->tail[0].iov_len - pad);
+        }
+        kx->stats.read_chunk_count++;
+        break;
+    case KFI_AREADCH:
+        kx->stats.read_chunk_count++;
+        kx->stats.nomsg_call_count++;
+        break;
+    default:
+        break;
+    }
+    if (n < 0) {
+        ret = n;
+        goto out_unmap;
+    }
+
+    if (req->wtype == KFI_WRITECH)
+        kx->stats.write_chunk_count++;
+    else if (req->wtype == KFI_REPLYCH)
+        kx->stats.reply_chunk_count++;
+    kx->stats.total_rdma_request += req->rchunk.length;
+
+    *niov = n;
+    return 0;
+
+out_unmap:
+    kfi_rpcrdma_unmap(req);
+    return ret;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_marshal);
+
+/**
+ * kfi_rpcrdma_marshal_bc_reply - Prepare the Send for a callback's reply
+ * @kx: Transport
+ * @req: Backchannel slot whose reply has been XDR-encoded
+ * @iov: Returns the Send buffer
+ *
+ * Reverse-direction replies are sent inline, without chunks (RFC 8167),
+ * copied behind the header in req->hdr.
+ *
+ * Returns: 1, or -EMSGSIZE if the reply does not fit inline
+ */
+int kfi_rpcrdma_marshal_bc_reply(struct kfi_xprt *kx, struct kfi_req *req,
+                                 struct kvec *iov)
+{
+    struct xdr_buf *snd = &req->rqst.rq_snd_buf;
+    int hdrlen;
+
+    hdrlen = kfi_rpcrdma_encode_hdr(req->hdr, req->hdr_size, kx->vers,
+                                    req->rqst.rq_xid, KFI_XPRT_BC_SLOTS,
+                                    KFI_NOCH, NULL, KFI_NOCH, NULL);
+    if (hdrlen < 0)
+        return hdrlen;
+    if (hdrlen + snd->len > kx->inline_wsize)
+        return -EMSGSIZE;
+
+    if (kx->vers == KFI_RPCRDMA_V2)
+        ((__be32 *)req->hdr)[4] = cpu_to_be32(KFI_RDMA2_F_RESPONSE);
+
+    iov->iov_base = req->hdr;
+    iov->iov_len = hdrlen + kfi_rpcrdma_pullup(snd, req->hdr + hdrlen);
+    kx->stats.pullup_copy_count += snd->len;
+    return 1;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_marshal_bc_reply);
+
+/*
+ * ============================================================================
+ * MULTI-CALL ENVELOPES
+ * ============================================================================
+ */
+
+#define KFI_MULTI_HDRLEN        (6 * sizeof(__be32))
+
+/**
+ * kfi_rpcrdma_encode_multi - Start an empty multi-call envelope
+ * @buf: Envelope buffer
+ * @buflen: Size of @buf
+ * @xid: XID of the first call, for tracing on the wire
+ * @credits: Credits requested
+ *
+ * Returns: envelope length in bytes, or -EMSGSIZE
+ */
+int kfi_rpcrdma_encode_multi(void *buf, size_t buflen, __be32 xid,
+                             u32 credits)
+{
+    __be32 *p = buf;
+
+    if (buflen < KFI_MULTI_HDRLEN)
+        return -EMSGSIZE;
+
+    *p++ = xid;
+    *p++ = cpu_to_be32(KFI_RPCRDMA_V2);
+    *p++ = cpu_to_be32(credits);
+    *p++ = cpu_to_be32(KFI_RDMA2_MULTI);
+    *p++ = xdr_zero;
+    *p++ = xdr_zero;            /* calls */
+
+    return KFI_MULTI_HDRLEN;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_encode_multi);
+
+/**
+ * kfi_rpcrdma_multi_add - Copy one call into an envelope
+ * @buf: Envelope started by kfi_rpcrdma_encode_multi()
+ * @buflen: Size of @buf, the peer's inline threshold at most
+ * @len: Bytes of @buf in use
+ * @xdr: Encoded call
+ *
+ * Returns: the new envelope length, or -EMSGSIZE if the call does not fit
+ */
+int kfi_rpcrdma_multi_add(void *buf, size_t buflen, u32 len,
+                          const struct xdr_buf *xdr)
+{
+    __be32 *p = buf + len;
+    u32 pad = xdr_pad_size(xdr->len);
+
+    if (len + sizeof(__be32) + xdr->len + pad > buflen)
+        return -EMSGSIZE;
+
+    *p++ = cpu_to_be32(xdr->len);
+    kfi_rpcrdma_pullup(xdr, (char *)p);
+    memset((char *)p + xdr->len, 0, pad);
+    be32_add_cpu((__be32 *)buf + 5, 1);
+
+    return len + sizeof(__be32) + xdr->len + pad;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_multi_add);
+
+/**
+ * kfi_rpcrdma_multi_next - Split the next call out of a received envelope
+ * @buf: Received envelope
+ * @len: Bytes received
+ * @off: Cursor; start at the decoded header length
+ * @call: Returns the RPC message
+ * @call_len: Returns its length
+ *
+ * The caller iterates hdr->nr_calls times.
+ *
+ * Returns: 0, or -EIO if the envelope ends early
+ */
+int kfi_rpcrdma_multi_next(const void *buf, size_t len, u32 *off,
+                           const void **call, u32 *call_len)
+{
+    u32 n;
+
+    if (*off > len || len - *off < sizeof(__be32))
+        return -EIO;
+
+    n = be32_to_cpup(buf + *off);
+    if (n > len - *off - sizeof(__be32) ||
+        xdr_align_size(n) > len - *off - sizeof(__be32))
+        return -EIO;
+
+    *call = buf + *off + sizeof(__be32);
+    *call_len = n;
+    *off += sizeof(__be32) + xdr_align_size(n);
+    return 0;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_multi_next);
+
+/*
+ * ============================================================================
+ * REPLY HANDLING
+ * ============================================================================
+ */
+
+/**
+ * kfi_rpcrdma_fixup - Copy the inline part of a reply into rq_rcv_buf
+ * @rqst: RPC being completed
+ * @offset: Position of @src in the inline stream (non-zero for the later
+ *          pieces of a continued reply)
+ * @src: Inline RPC message (after the transport header)
+ * @len: Length of @src
+ * @pad: XDR pad of Write chunk data, which the server leaves out of
+ *       the inline stream (RFC 8166, Section 3.4.5)
+ * @pages_placed: The page data already arrived through a Write chunk
+ *
+ * Returns: bytes copied into the page list
+ */
+unsigned int kfi_rpcrdma_fixup(struct rpc_rqst *rqst, u32 offset,
+                               const void *src, u32 len, u32 pad,
+                               bool pages_placed)
+{
+    struct xdr_buf *rcv = &rqst->rq_rcv_buf;
+    unsigned int cur, base, remaining, copied = 0;
+    struct page **ppages;
+    u32 room;
+
+    room = rcv->head[0].iov_len;
+    if (offset < room) {
+        cur = min(len, room - offset);
+        memcpy(rcv->head[0].iov_base + offset, src, cur);
+        src += cur;
+        len -= cur;
+        offset = room;
+    }
+    offset -= room;
+
+    if (rcv->page_len && !pages_placed) {
+        room = rcv->page_len;
+        if (offset < room) {
+            base = rcv->page_base + offset;
+            ppages = rcv->pages + (base >> PAGE_SHIFT);
+            base = offset_in_page(base);
+            remaining = min(len, room - offset);
+            while (remaining) {
+                cur = min_t(unsigned int, PAGE_SIZE - base, remaining);
+                memcpy_to_page(*ppages, base, src, cur);
+                src += cur;
+                len -= cur;
+                copied += cur;
+                remaining -= cur;
+                ppages++;
+                base = 0;
+            }
+            offset = room;
+        }
+        offset -= room;
+    }
+
+    room = rcv->tail[0].iov_len;
+    if (pad) {
+        cur = min(pad, room);
+        memset(rcv->tail[0].iov_base, 0, cur);
+        room -= cur;
+    }
+    if (len && offset < room)
+        memcpy(rcv->tail[0].iov_base + (rcv->tail[0].iov_len - room) + offset,
+               src, min(len, room - offset));
+
+    return copied;
+}
+EXPORT_SYMBOL(kfi_rpcrdma_fixup);
+
+/* Copy a reply continued over several Sends, in order */
+static int kfi_rpcrdma_fixup_cont(struct kfi_xprt *kx, struct kfi_req *req,
+                                  struct kfi_rep *last, u32 pad, bool placed)
+{
+    struct kfi_rep *piece;
+    u32 len = 0, n;
+    unsigned int i;
+
+    for (i = 0; i <= req->nr_cont; i++) {
+        piece = i < req->nr_cont ? req->cont[i] : last;
+
+        /* Only the first piece may carry chunk lists */
+        if (i && (piece->hdr.nr_write || piece->hdr.reply_chunk ||
+                  piece->hdr.proc != RDMA_MSG))
+            return -EIO;
+
+        n = piece->len - piece->hdr.hdrlen;
+        kx->stats.fixup_copy_count +=
+            kfi_rpcrdma_fixup(&req->rqst, len, piece->buf + piece->hdr.hdrlen,
+                              n, pad, placed);
+        len += n;
+    }
+
+    return len;
+}
+
+/* Returns the length of the reply, or a negative errno */
+static int kfi_rpcrdma_decode_reply(struct kfi_xprt *kx, struct kfi_req *req,
+                                    struct kfi_rep *rep)
+{
+    struct kfi_rep *first = req->nr_cont ? req->cont[0] : rep;
+    struct kfi_rpcrdma_hdr *hdr = &first->hdr;
+    int len;
+
+    switch (hdr->proc) {
+    case RDMA_MSG:
+        if (hdr->reply_chunk || hdr->nr_read)
+            return -EIO;
+        if (hdr->nr_write &&
+            (req->wtype != KFI_WRITECH || hdr->write_len > req->wchunk.length))
+            return -EIO;
+
+        len = kfi_rpcrdma_fixup_cont(kx, req, rep,
+                                     hdr->nr_write ?
+                                     xdr_pad_size(hdr->write_len) : 0,
+                                     hdr->nr_write != 0);
+        if (len < 0)
+            return len;
+        kx->stats.total_rdma_reply += hdr->write_len;
+        return len + xdr_align_size(hdr->write_len);
+
+    case RDMA_NOMSG:
+        if (hdr->nr_write || hdr->nr_read || !hdr->reply_chunk ||
+            req->nr_cont)
+            return -EIO;
+        if (req->wtype != KFI_REPLYCH || hdr->reply_len > req->wchunk.length)
+            return -EIO;
+
+        kx->stats.total_rdma_reply += hdr->reply_len;
+        return hdr->reply_len;
+
+    case RDMA_ERROR:
+        if (hdr->err == ERR_VERS)
+            pr_err_ratelimited("kfi: server %s reports a version error\n",
+                               kx->xprt.address_strings[RPC_DISPLAY_ADDR]);
+        else if (hdr->err == ERR_CHUNK)
+            pr_err_ratelimited("kfi: server %s reports a chunk error\n",
+                               kx->xprt.address_strings[RPC_DISPLAY_ADDR]);
+        return -EIO;
+
+    default:
+        return -EIO;
+    }
+}
+
+/* Publish the window to SUNRPC; the next released slot wakes a waiter */
+static void kfi_rpcrdma_set_cwnd(struct kfi_xprt *kx)
+{
+    struct rpc_xprt *xprt = &kx->xprt;
+
+    spin_lock(&xprt->transport_lock);
+    xprt->cwnd = kx->cwnd.window << RPC_CWNDSHIFT;
+    spin_unlock(&xprt->transport_lock);
+    trace_kfi_xprt_cwnd(kx);
+}
+
+static void kfi_rpcrdma_update_credits(struct kfi_xprt *kx,
+                                       struct kfi_xprt_queue *q, u32 grant)
+{
+    u32 total = 0;
+    int i;
+
+    /* A zero grant would stall the queue; treat it as one */
+    grant = clamp_t(u32, grant, 1, kx->queue_credits);
+
+    /* Receives first; the queue's share of the window may not outgrow them */
+    kfi_xprt_post_recvs(q, grant, GFP_NOWAIT | __GFP_NOWARN);
+    grant = min_t(u32, grant,
+                  max(READ_ONCE(q->nr_posted) - KFI_XPRT_EXTRA_RECVS -
+                      READ_ONCE(kx->bc_slots), 1));
+    if (grant == READ_ONCE(q->credits))
+        return;
+    WRITE_ONCE(q->credits, grant);
+
+    /* The window covers the grants of all queues together */
+    spin_lock(&kx->cwnd_lock);
+    for (i = 0; i < kx->nr_queues; i++)
+        total += READ_ONCE(kx->queues[i].credits);
+    if (total != kx->cwnd.credits) {
+        trace_kfi_xprt_credits(kx, total);
+        if (kfi_cwnd_grant(&kx->cwnd, total))
+            kfi_rpcrdma_set_cwnd(kx);
+    }
+    spin_unlock(&kx->cwnd_lock);
+}
+
+/*
+ * Feed the round trip of an RPC answered inline into the window, and
+ * that of a READ or WRITE, whatever its chunks, into the tuner
+ */
+static void kfi_rpcrdma_update_cwnd(struct kfi_xprt *kx, struct kfi_req *req,
+                                    bool sample, u32 nsegs)
+{
+    const struct rpc_rqst *rqst = &req->rqst;
+    ktime_t now = ktime_get();
+    u32 rtt_us = 0, rtt;
+
+    rtt = max_t(s64, ktime_us_delta(now, rqst->rq_xtime), 1);
+    if (sample && req->rtype == KFI_NOCH && req->wtype == KFI_NOCH)
+        rtt_us = rtt;
+
+    spin_lock(&kx->cwnd_lock);
+    if (kfi_cwnd_complete(&kx->cwnd, rtt_us, ktime_to_us(now)))
+        kfi_rpcrdma_set_cwnd(kx);
+
+    if (sample && (rqst->rq_rcv_buf.flags & XDRBUF_READ) &&
+        rqst->rq_rcv_buf.page_len)
+        kfi_tune_read(&kx->tune, rqst->rq_rcv_buf.page_len,
+                      req->wtype == KFI_WRITECH, rtt, nsegs);
+    else if (sample && (rqst->rq_snd_buf.flags & XDRBUF_WRITE) &&
+             rqst->rq_snd_buf.page_len)
+        kfi_tune_write(&kx->tune, rqst->rq_snd_buf.page_len, rtt, nsegs);
+    spin_unlock(&kx->cwnd_lock);
+}
+
+/* Give the held pieces of a continued reply back to the receive queue */
+static void kfi_rpcrdma_repost_cont(struct kfi_xprt *kx, struct kfi_req *req)
+{
+    while (req->nr_cont)
+        kfi_xprt_post_recv(kx, req->cont[--req->nr_cont]);
+}
+
+/* Both the reply and the Send completion are in: finish the RPC */
+static void kfi_rpcrdma_complete(struct kfi_req *req)
+{
+    struct kfi_xprt *kx = req->kx;
+    struct rpc_xprt *xprt = &kx->xprt;
+    struct rpc_rqst *rqst = &req->rqst;
+    struct kfi_rep *rep = req->rep;
+    u32 nsegs;
+    int status;
+
+    /* The RPC ended before its reply came back; nothing to complete */
+    if (!rep)
+        return;
+    req->rep = NULL;
+
+    /* The server is done with our memory once it has replied */
+    nsegs = req->rchunk.nsegs + req->wchunk.nsegs;
+    kfi_rpcrdma_unmap(req);
+
+    status = kfi_rpcrdma_decode_reply(kx, req, rep);
+    kfi_rpcrdma_update_cwnd(kx, req, status >= 0, nsegs);
+    if (status < 0) {
+        kx->stats.bad_reply_count++;
+        rqst->rq_task->tk_status = status;
+        status = 0;
+    }
+
+    kfi_rpcrdma_repost_cont(kx, req);
+    kfi_xprt_post_recv(kx, rep);
+
+    spin_lock(&xprt->queue_lock);
+    xprt_complete_rqst(rqst->rq_task, status);
+    xprt_unpin_rqst(rqst);
+    spin_unlock(&xprt->queue_lock);
+}
+
+/**
+ * kfi_rpcrdma_req_put - Drop the Send or reply reference of a request
+ */
+void kfi_rpcrdma_req_put(struct kfi_req *req)
+{
+    if (atomic_dec_and_test(&req->refs))
+        kfi_rpcrdma_complete(req);
+}
+EXPORT_SYMBOL(kfi_rpcrdma_req_put);
+
+/*
+ * The server answered our RDMA2_CONNPROP, with its own properties or with
+ * ERR_VERS. Properties are fixed for the life of a connection, so later
+ * ones are ignored.
+ */
+static void kfi_rpcrdma_negotiated(struct kfi_xprt *kx,
+                                   const struct kfi_rpcrdma_hdr *hdr)
+{
+    if (!test_and_clear_bit(KFI_XPRT_F_NEGOTIATING, &kx->flags))
+        return;
+
+    if (hdr->proc == KFI_RDMA2_CONNPROP) {
+        kx->peer = hdr->props;
+        kx->vers = KFI_RPCRDMA_V2;
+    } else {
+        kx->vers = RPCRDMA_VERSION;
+    }
+    complete(&kx->negotiated);
+}
+
+/**
+ * kfi_rpcrdma_is_bcall - Whether a received message is a callback
+ * @hdr: Decoded transport header
+ * @buf: Received message
+ * @len: Length of @buf
+ *
+ * The server sends reverse-direction calls as RDMA_MSG without chunks
+ * (RFC 8167), and in Version Two without RDMA2_F_RESPONSE. They are told
+ * apart from replies by the RPC message type, which follows the XID.
+ */
+bool kfi_rpcrdma_is_bcall(const struct kfi_rpcrdma_hdr *hdr, const void *buf,
+                          u32 len)
+{
+    const __be32 *p = buf + hdr->hdrlen;
+
+    if (hdr->proc != RDMA_MSG || hdr->flags || hdr->nr_read ||
+        hdr->nr_write || hdr->reply_chunk)
+        return false;
+
+    if (len < hdr->hdrlen + 2 * sizeof(__be32))
+        return false;
+
+    return p[0] == hdr->xid && p[1] == cpu_to_be32(RPC_CALL);
+}
+EXPORT_SYMBOL(kfi_rpcrdma_is_bcall);
+
+/**
+ * kfi_rpcrdma_reply_handler - Process one received message
+ * @rep: Receive buffer that completed
+ *
+ * Matches the reply to its RPC. The RPC completes once its Send has
+ * completed as well, since until then the NIC may still be reading the
+ * call buffers. Pieces of a continued reply are held on the request
+ * until the last one arrives.
+ */
+void kfi_rpcrdma_reply_handler(struct kfi_rep *rep)
+{
+    struct kfi_xprt *kx = rep->kx;
+    struct rpc_xprt *xprt = &kx->xprt;
+    struct rpc_rqst *rqst;
+    struct kfi_req *req;
+
+    if (kfi_rpcrdma_decode_hdr(rep->buf, rep->len, &rep->hdr)) {
+        kx->stats.bad_reply_count++;
+        goto out_repost;
+    }
+
+#if defined(CONFIG_SUNRPC_BACKCHANNEL)
+    /* A callback's credits are for the reverse direction, not ours */
+    if (kfi_rpcrdma_is_bcall(&rep->hdr, rep->buf, rep->len)) {
+        kfi_xprt_bc_receive_call(kx, rep);
+        return;
+    }
+#endif
+
+    kfi_rpcrdma_update_credits(kx, rep->q, rep->hdr.credits);
+
+    if (rep->hdr.proc == KFI_RDMA2_CONNPROP ||
+        (rep->hdr.proc == RDMA_ERROR && rep->hdr.err == ERR_VERS &&
+         test_bit(KFI_XPRT_F_NEGOTIATING, &kx->flags))) {
+        kfi_rpcrdma_negotiated(kx, &rep->hdr);
+        goto out_repost;
+    }
+
+    spin_lock(&xprt->queue_lock);
+    rqst = xprt_lookup_rqst(xprt, rep->hdr.xid);
+    if (!rqst) {
+        spin_unlock(&xprt->queue_lock);
+        goto out_repost;
+    }
+    xprt_pin_rqst(rqst);
+    spin_unlock(&xprt->queue_lock);
+
+    req = kfi_req(rqst);
+
+    /* Pieces left by an RPC that ended before its reply was complete */
+    if (req->nr_cont && req->cont[0]->hdr.xid != rep->hdr.xid)
+        kfi_rpcrdma_repost_cont(kx, req);
+
+    if (rep->hdr.flags & KFI_RDMA2_F_MORE) {
+        if (!test_bit(KFI_REQ_F_REPLY_PENDING, &req->flags)) {
+            xprt_unpin_rqst(rqst);
+            goto out_repost;
+        }
+        if (req->nr_cont == KFI_XPRT_MAX_CONT) {
+            pr_err_ratelimited("kfi: server %s continued a reply over too many Sends\n",
+                               xprt->address_strings[RPC_DISPLAY_ADDR]);
+            kx->stats.bad_reply_count++;
+            kfi_rpcrdma_repost_cont(kx, req);
+            xprt_unpin_rqst(rqst);
+            xprt_force_disconnect(xprt);
+            goto out_repost;
+        }
+        req->cont[req->nr_cont++] = rep;
+        xprt_unpin_rqst(rqst);
+        return;
+    }
+
+    if (!test_and_clear_bit(KFI_REQ_F_REPLY_PENDING, &req->flags)) {
+        kfi_rpcrdma_repost_cont(kx, req);
+        xprt_unpin_rqst(rqst);
+        goto out_repost;
+    }
+
+    /* The server has let go of the receive the call took */
+    kfi_xprt_retire(req);
+    req->rep = rep;
+    if (test_bit(KFI_REQ_F_SEND_PENDING, &req->flags))
+        kx->stats.reply_waits_for_send++;
+    kfi_rpcrdma_req_put(req);
+    return;
+
+out_repost:
+    kfi_xprt_post_recv(kx, rep);
+}
+EXPORT_SYMBOL(kfi_rpcrdma_reply_handler);
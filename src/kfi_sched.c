@@ -0,0 +1,635 @@
+/*
+ * kfi_sched.c - Weighted fair submission scheduler (deficit round robin)
+ *
+ * Every mount on a node shares the device's send queues, so one job
+ * streaming large WRITEs can keep them full and starve everybody else.
+ * Submissions are therefore funnelled through a per-device scheduler:
+ *
+ *   - each mount (or each cgroup, with sched_key=1) is a flow with a
+ *     weight, tunable in /sys/kernel/kfi/<dev>/<flow>/weight;
+ *   - while the device has room (bytes in flight below max_inflight) a
+ *     submission with nothing queued ahead of it is posted directly;
+ *   - otherwise it is queued on its flow, and flows are served by
+ *     deficit round robin as completions free up room, so each gets
+ *     bandwidth in proportion to its weight regardless of request size;
+ *   - per-flow queueing delay is recorded and exported next to the
+ *     weight.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/cgroup.h>
+#include <linux/ktime.h>
+
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+static int sched_key = KFI_SCHED_KEY_MOUNT;
+module_param(sched_key, int, 0444);
+MODULE_PARM_DESC(sched_key,
+                 "Fair-share submissions per mount (0) or per cgroup (1)");
+
+/* /sys/kernel/kfi */
+static struct kobject *kfi_sysfs_root;
+
+/*
+ * ============================================================================
+ * SYSFS
+ * ============================================================================
+ */
+
+#define to_sched(k)     container_of(k, struct kfi_sched, kobj)
+#define to_flow(k)      container_of(k, struct kfi_sched_flow, kobj)
+
+/* Read a u64 counter under the scheduler lock */
+static ssize_t kfi_sched_show_u64(struct kfi_sched *s, const u64 *val,
+                                  char *buf)
+{
+    u64 v;
+
+    spin_lock_bh(&s->lock);
+    v = *val;
+    spin_unlock_bh(&s->lock);
+
+    return sysfs_emit(buf, "%llu\n", v);
+}
+
+static ssize_t quantum_show(struct kobject *kobj, struct kobj_attribute *attr,
+                            char *buf)
+{
+    return sysfs_emit(buf, "%u\n", READ_ONCE(to_sched(kobj)->quantum));
+}
+
+static ssize_t quantum_store(struct kobject *kobj, struct kobj_attribute *attr,
+                             const char *buf, size_t count)
+{
+    u32 val;
+    int ret;
+
+    ret = kstrtou32(buf, 0, &val);
+    if (ret)
+        return ret;
+    if (val < PAGE_SIZE)
+        return -EINVAL;
+
+    WRITE_ONCE(to_sched(kobj)->quantum, val);
+    return count;
+}
+
+static ssize_t max_inflight_show(struct kobject *kobj,
+                                 struct kobj_attribute *attr, char *buf)
+{
+    struct kfi_sched *s = to_sched(kobj);
+
+    return kfi_sched_show_u64(s, &s->max_inflight, buf);
+}
+
+static ssize_t max_inflight_store(struct kobject *kobj,
+                                  struct kobj_attribute *attr,
+                                  const char *buf, size_t count)
+{
+    struct kfi_sched *s = to_sched(kobj);
+    u64 val;
+    int ret;
+
+    ret = kstrtou64(buf, 0, &val);
+    if (ret)
+        return ret;
+    if (!val)
+        return -EINVAL;
+
+    spin_lock_bh(&s->lock);
+    s->max_inflight = val;
+    spin_unlock_bh(&s->lock);
+    return count;
+}
+
+static ssize_t inflight_show(struct kobject *kobj, struct kobj_attribute *attr,
+                             char *buf)
+{
+    struct kfi_sched *s = to_sched(kobj);
+
+    return kfi_sched_show_u64(s, &s->inflight, buf);
+}
+
+static struct kobj_attribute kfi_sched_attr_quantum = __ATTR_RW(quantum);
+static struct kobj_attribute kfi_sched_attr_max_inflight = __ATTR_RW(max_inflight);
+static struct kobj_attribute kfi_sched_attr_inflight = __ATTR_RO(inflight);
+
+static struct attribute *kfi_sched_attrs[] = {
+    &kfi_sched_attr_quantum.attr,
+    &kfi_sched_attr_max_inflight.attr,
+    &kfi_sched_attr_inflight.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(kfi_sched);
+
+static void kfi_sched_release(struct kobject *kobj)
+{
+    kfree(to_sched(kobj));
+}
+
+static struct kobj_type kfi_sched_ktype = {
+    .release        = kfi_sched_release,
+    .sysfs_ops      = &kobj_sysfs_ops,
+    .default_groups = kfi_sched_groups,
+};
+
+static ssize_t weight_show(struct kobject *kobj, struct kobj_attribute *attr,
+                           char *buf)
+{
+    return sysfs_emit(buf, "%u\n", READ_ONCE(to_flow(kobj)->weight));
+}
+
+static ssize_t weight_store(struct kobject *kobj, struct kobj_attribute *attr,
+                            const char *buf, size_t count)
+{
+    u32 val;
+    int ret;
+
+    ret = kstrtou32(buf, 0, &val);
+    if (ret)
+        return ret;
+
+    ret = kfi_sched_set_weight(to_flow(kobj), val);
+    return ret ? ret : count;
+}
+
+#define KFI_FLOW_COUNTER_ATTR(_name, _field)                                \
+static ssize_t _name##_show(struct kobject *kobj,                           \
+                            struct kobj_attribute *attr, char *buf)         \
+{                                                                           \
+    struct kfi_sched_flow *flow = to_flow(kobj);                            \
+                                                                            \
+    return kfi_sched_show_u64(flow->sched, &flow->_field, buf);             \
+}                                                                           \
+static struct kobj_attribute kfi_flow_attr_##_name = __ATTR_RO(_name)
+
+KFI_FLOW_COUNTER_ATTR(queued, nr_queued);
+KFI_FLOW_COUNTER_ATTR(sent, nr_sent);
+KFI_FLOW_COUNTER_ATTR(bytes, bytes_sent);
+
+static ssize_t delay_us_show(struct kobject *kobj, struct kobj_attribute *attr,
+                             char *buf)
+{
+    struct kfi_sched_flow *flow = to_flow(kobj);
+    struct kfi_sched *s = flow->sched;
+    u64 sent, total, max;
+
+    spin_lock_bh(&s->lock);
+    sent = flow->nr_sent;
+    total = flow->delay_ns;
+    max = flow->delay_max_ns;
+    spin_unlock_bh(&s->lock);
+
+    /* "<average> <maximum>" queueing delay */
+    return sysfs_emit(buf, "%llu %llu\n",
+                      sent ? div64_u64(total, sent) / NSEC_PER_USEC : 0,
+                      max / NSEC_PER_USEC);
+}
+
+static struct kobj_attribute kfi_flow_attr_weight = __ATTR_RW(weight);
+static struct kobj_attribute kfi_flow_attr_delay_us = __ATTR_RO(delay_us);
+
+static struct attribute *kfi_flow_attrs[] = {
+    &kfi_flow_attr_weight.attr,
+    &kfi_flow_attr_queued.attr,
+    &kfi_flow_attr_sent.attr,
+    &kfi_flow_attr_bytes.attr,
+    &kfi_flow_attr_delay_us.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(kfi_flow);
+
+static void kfi_flow_release(struct kobject *kobj)
+{
+    kfree(to_flow(kobj));
+}
+
+static struct kobj_type kfi_flow_ktype = {
+    .release        = kfi_flow_release,
+    .sysfs_ops      = &kobj_sysfs_ops,
+    .default_groups = kfi_flow_groups,
+};
+
+/**
+ * kfi_sched_sysfs_init - Create /sys/kernel/kfi
+ */
+int kfi_sched_sysfs_init(void)
+{
+    kfi_sysfs_root = kobject_create_and_add("kfi", kernel_kobj);
+    return kfi_sysfs_root ? 0 : -ENOMEM;
+}
+
+void kfi_sched_sysfs_exit(void)
+{
+    kobject_put(kfi_sysfs_root);
+    kfi_sysfs_root = NULL;
+}
+
+/*
+ * ============================================================================
+ * SCHEDULER AND FLOW LIFETIME
+ * ============================================================================
+ */
+
+/**
+ * kfi_sched_create - Create a device's scheduler
+ * @name: sysfs directory name (the device name)
+ */
+struct kfi_sched *kfi_sched_create(const char *name)
+{
+    struct kfi_sched *s;
+    int ret;
+
+    s = kzalloc(sizeof(*s), GFP_KERNEL);
+    if (!s)
+        return ERR_PTR(-ENOMEM);
+
+    spin_lock_init(&s->lock);
+    INIT_LIST_HEAD(&s->flows);
+    INIT_LIST_HEAD(&s->active);
+    s->quantum = KFI_SCHED_QUANTUM;
+    s->max_inflight = KFI_SCHED_INFLIGHT;
+
+    ret = kobject_init_and_add(&s->kobj, &kfi_sched_ktype, kfi_sysfs_root,
+                               "%s", name);
+    if (ret) {
+        kobject_put(&s->kobj);
+        return ERR_PTR(ret);
+    }
+
+    return s;
+}
+EXPORT_SYMBOL(kfi_sched_create);
+
+/**
+ * kfi_sched_destroy - Remove a device's scheduler
+ *
+ * Every flow must have been put by now.
+ */
+void kfi_sched_destroy(struct kfi_sched *s)
+{
+    if (IS_ERR_OR_NULL(s))
+        return;
+
+    WARN_ON(!list_empty(&s->flows));
+    kobject_del(&s->kobj);
+    kobject_put(&s->kobj);
+}
+EXPORT_SYMBOL(kfi_sched_destroy);
+
+/**
+ * kfi_sched_flow_key - Key to share a device by
+ * @mount_key: Cookie identifying the calling mount
+ *
+ * Returns @mount_key, or the calling task's cgroup id with sched_key=1.
+ */
+u64 kfi_sched_flow_key(u64 mount_key)
+{
+    u64 key = mount_key;
+
+#ifdef CONFIG_CGROUPS
+    if (sched_key == KFI_SCHED_KEY_CGROUP) {
+        rcu_read_lock();
+        key = cgroup_id(task_dfl_cgroup(current));
+        rcu_read_unlock();
+    }
+#endif
+    return key;
+}
+EXPORT_SYMBOL(kfi_sched_flow_key);
+
+/* Caller holds s->lock */
+static struct kfi_sched_flow *kfi_sched_flow_find(struct kfi_sched *s, u64 key)
+{
+    struct kfi_sched_flow *flow;
+
+    list_for_each_entry(flow, &s->flows, list) {
+        if (flow->key == key)
+            return flow;
+    }
+    return NULL;
+}
+
+/**
+ * kfi_sched_flow_get - Look up or create the flow for a key
+ * @s: Scheduler
+ * @key: From kfi_sched_flow_key()
+ * @name: sysfs directory name, or NULL to use @key
+ *
+ * Returns: flow (release with kfi_sched_flow_put()) or ERR_PTR
+ */
+struct kfi_sched_flow *kfi_sched_flow_get(struct kfi_sched *s, u64 key,
+                                          const char *name)
+{
+    struct kfi_sched_flow *flow, *new;
+    int ret;
+
+    spin_lock_bh(&s->lock);
+    flow = kfi_sched_flow_find(s, key);
+    if (flow)
+        refcount_inc(&flow->users);
+    spin_unlock_bh(&s->lock);
+
+    if (flow)
+        return flow;
+
+    new = kzalloc(sizeof(*new), GFP_KERNEL);
+    if (!new)
+        return ERR_PTR(-ENOMEM);
+
+    new->sched = s;
+    new->key = key;
+    new->weight = KFI_SCHED_WEIGHT_DEFAULT;
+    refcount_set(&new->users, 1);
+    INIT_LIST_HEAD(&new->queue);
+    INIT_LIST_HEAD(&new->active);
+
+    kobject_init(&new->kobj, &kfi_flow_ktype);
+
+    /* Someone may have added the same key while we allocated */
+    spin_lock_bh(&s->lock);
+    flow = kfi_sched_flow_find(s, key);
+    if (flow) {
+        refcount_inc(&flow->users);
+    } else {
+        list_add_tail(&new->list, &s->flows);
+        flow = new;
+        new = NULL;
+    }
+    spin_unlock_bh(&s->lock);
+
+    if (new) {
+        kobject_put(&new->kobj);
+        return flow;
+    }
+
+    if (name)
+        ret = kobject_add(&flow->kobj, &s->kobj, "%s", name);
+    else
+        ret = kobject_add(&flow->kobj, &s->kobj, "%llu", key);
+    if (ret)
+        pr_warn("kfi: no sysfs entry for flow %llu: %d\n", key, ret);
+
+    return flow;
+}
+EXPORT_SYMBOL(kfi_sched_flow_get);
+
+/**
+ * kfi_sched_flow_put - Drop a reference from kfi_sched_flow_get()
+ *
+ * The caller must not have submissions still queued on the flow.
+ */
+void kfi_sched_flow_put(struct kfi_sched_flow *flow)
+{
+    struct kfi_sched *s;
+    unsigned long flags;
+
+    if (IS_ERR_OR_NULL(flow))
+        return;
+
+    s = flow->sched;
+    if (!refcount_dec_and_lock_irqsave(&flow->users, &s->lock, &flags))
+        return;
+
+    WARN_ON(!list_empty(&flow->queue));
+    list_del(&flow->list);
+    spin_unlock_irqrestore(&s->lock, flags);
+
+    pr_debug("kfi: flow %llu: sent=%llu bytes=%llu max delay=%lluus\n",
+             flow->key, flow->nr_sent, flow->bytes_sent,
+             flow->delay_max_ns / NSEC_PER_USEC);
+
+    kobject_del(&flow->kobj);
+    kobject_put(&flow->kobj);
+}
+EXPORT_SYMBOL(kfi_sched_flow_put);
+
+/**
+ * kfi_sched_set_weight - Change a flow's share of the device
+ * @flow: Flow
+ * @weight: 1..KFI_SCHED_WEIGHT_MAX; KFI_SCHED_WEIGHT_DEFAULT is one share
+ */
+int kfi_sched_set_weight(struct kfi_sched_flow *flow, u32 weight)
+{
+    if (!weight || weight > KFI_SCHED_WEIGHT_MAX)
+        return -EINVAL;
+
+    spin_lock_bh(&flow->sched->lock);
+    flow->weight = weight;
+    spin_unlock_bh(&flow->sched->lock);
+    return 0;
+}
+EXPORT_SYMBOL(kfi_sched_set_weight);
+
+/*
+ * ============================================================================
+ * DISPATCH
+ * ============================================================================
+ */
+
+static u64 kfi_sched_flow_quantum(struct kfi_sched *s,
+                                  struct kfi_sched_flow *flow)
+{
+    return max_t(u64, div_u64((u64)s->quantum * flow->weight,
+                              KFI_SCHED_WEIGHT_DEFAULT), 1);
+}
+
+/*
+ * Nobody in the round can afford their head request: give every flow
+ * the smallest whole number of rounds that lets one of them send, so
+ * that low weights and large requests do not cost a lap per quantum.
+ * Caller holds s->lock.
+ */
+static void kfi_sched_refill(struct kfi_sched *s)
+{
+    struct kfi_sched_flow *flow;
+    struct kfi_sched_req *req;
+    u64 q, need, rounds = U64_MAX;
+
+    list_for_each_entry(flow, &s->active, active) {
+        req = list_first_entry(&flow->queue, struct kfi_sched_req, list);
+        q = kfi_sched_flow_quantum(s, flow);
+        need = req->cost > flow->deficit ? req->cost - flow->deficit : 0;
+        rounds = min(rounds, div64_u64(need + q - 1, q));
+    }
+
+    rounds = max_t(u64, rounds, 1);
+    list_for_each_entry(flow, &s->active, active)
+        flow->deficit += rounds * kfi_sched_flow_quantum(s, flow);
+}
+
+/* Caller holds s->lock */
+static void kfi_sched_account(struct kfi_sched *s, struct kfi_sched_flow *flow,
+                              struct kfi_sched_req *req, u64 now)
+{
+    u64 delay = now - req->queued_ns;
+
+    s->inflight += req->cost;
+    flow->nr_sent++;
+    flow->bytes_sent += req->cost;
+    flow->delay_ns += delay;
+    flow->delay_max_ns = max(flow->delay_max_ns, delay);
+}
+
+static void kfi_sched_post(struct kfi_sched *s, struct list_head *batch)
+{
+    struct kfi_sched_req *req, *tmp;
+    u32 cost;
+
+    list_for_each_entry_safe(req, tmp, batch, list) {
+        list_del_init(&req->list);
+        /* @req belongs to its owner again once it is submitted */
+        cost = req->cost;
+        if (req->submit(req))
+            kfi_sched_complete(s, cost);
+    }
+}
+
+/*
+ * Move as much queued work as the device has room for onto @batch, in
+ * DRR order. Each visit to the head flow either sends its head request
+ * out of the flow's deficit or tops the deficit up and moves the flow
+ * to the back of the round.
+ */
+static void kfi_sched_dispatch(struct kfi_sched *s)
+{
+    struct kfi_sched_flow *flow;
+    struct kfi_sched_req *req;
+    LIST_HEAD(batch);
+    int idle = 0;
+    u64 now;
+
+    spin_lock_bh(&s->lock);
+    now = ktime_get_ns();
+
+    while (s->nr_active && s->inflight < s->max_inflight) {
+        flow = list_first_entry(&s->active, struct kfi_sched_flow, active);
+        req = list_first_entry(&flow->queue, struct kfi_sched_req, list);
+
+        if (req->cost > flow->deficit) {
+            if (++idle >= s->nr_active) {
+                kfi_sched_refill(s);
+                idle = 0;
+                continue;
+            }
+            list_move_tail(&flow->active, &s->active);
+            continue;
+        }
+
+        idle = 0;
+        flow->deficit -= req->cost;
+        req->flow = NULL;
+        list_move_tail(&req->list, &batch);
+        flow->nr_queued--;
+        kfi_sched_account(s, flow, req, now);
+
+        if (list_empty(&flow->queue)) {
+            /* An idle flow does not bank credit */
+            list_del_init(&flow->active);
+            flow->deficit = 0;
+            s->nr_active--;
+        }
+    }
+
+    spin_unlock_bh(&s->lock);
+
+    kfi_sched_post(s, &batch);
+}
+
+/**
+ * kfi_sched_submit - Hand a submission to the device's scheduler
+ * @flow: Flow the submission is charged to
+ * @req: Submission; @req->cost and @req->submit must be set
+ *
+ * @req->submit runs either before this returns (the device has room and
+ * nothing is queued) or later from kfi_sched_complete(). The caller
+ * reports the work done with kfi_sched_complete(@req->cost).
+ */
+void kfi_sched_submit(struct kfi_sched_flow *flow, struct kfi_sched_req *req)
+{
+    struct kfi_sched *s = flow->sched;
+    LIST_HEAD(batch);
+
+    req->queued_ns = ktime_get_ns();
+
+    spin_lock_bh(&s->lock);
+
+    /* Fast path: uncontended device, post straight away */
+    if (!s->nr_active && s->inflight < s->max_inflight) {
+        req->flow = NULL;
+        kfi_sched_account(s, flow, req, req->queued_ns);
+        list_add_tail(&req->list, &batch);
+        spin_unlock_bh(&s->lock);
+        kfi_sched_post(s, &batch);
+        return;
+    }
+
+    req->flow = flow;
+    list_add_tail(&req->list, &flow->queue);
+    flow->nr_queued++;
+    if (list_empty(&flow->active)) {
+        list_add_tail(&flow->active, &s->active);
+        s->nr_active++;
+    }
+
+    spin_unlock_bh(&s->lock);
+
+    kfi_sched_dispatch(s);
+}
+EXPORT_SYMBOL(kfi_sched_submit);
+
+/**
+ * kfi_sched_cancel - Take back a submission that is still queued
+ * @s: Scheduler it was submitted to
+ * @req: Submission
+ *
+ * Returns: true if @req was taken off its flow and will not be
+ * submitted; false if it has been dispatched, in which case @req->submit
+ * has run or is about to.
+ */
+bool kfi_sched_cancel(struct kfi_sched *s, struct kfi_sched_req *req)
+{
+    struct kfi_sched_flow *flow;
+
+    spin_lock_bh(&s->lock);
+    flow = req->flow;
+    if (flow) {
+        req->flow = NULL;
+        list_del_init(&req->list);
+        flow->nr_queued--;
+        if (list_empty(&flow->queue)) {
+            list_del_init(&flow->active);
+            flow->deficit = 0;
+            s->nr_active--;
+        }
+    }
+    spin_unlock_bh(&s->lock);
+
+    return flow;
+}
+EXPORT_SYMBOL(kfi_sched_cancel);
+
+/**
+ * kfi_sched_complete - Return a submission's bytes to the device
+ * @s: Scheduler
+ * @cost: The completed submission's @cost
+ *
+ * Called from completion context; dispatches queued work that now fits.
+ */
+void kfi_sched_complete(struct kfi_sched *s, u32 cost)
+{
+    bool more;
+
+    spin_lock_bh(&s->lock);
+    s->inflight -= min_t(u64, cost, s->inflight);
+    more = s->nr_active && s->inflight < s->max_inflight;
+    spin_unlock_bh(&s->lock);
+
+    if (more)
+        kfi_sched_dispatch(s);
+}
+EXPORT_SYMBOL(kfi_sched_complete);
@@ -1,9 +1,143 @@
-#include <linux/sunrpc/xprt.h>
+/*
+ * kfi_transport.c - SUNRPC client transport over kfabric
+ *
+ * Registers the "rdma" transport class and implements rpc_xprt on top of
+ * a pooled kfabric endpoint, speaking RPC-over-RDMA Version One or Two (see
+ * kfi_rpc_rdma.c for the wire format). The structure follows the in-tree
+ * xprtrdma client: fixed slots with per-slot buffers, a congestion window
+ * bounded by the server's credit grant (kfi_credits.c), no retransmission
+ * on a live connection, and a connect worker that backs off between
+ * attempts.
+ *
+ * A transport runs several hardware queues, one per CPU up to a cap.
+ * Each is an endpoint of its own with its own CQs, receive buffers and
+ * credit grant, and each CPU sends on its own queue while that queue has
+ * credit, so CPUs do not share a Send queue, a CQ or the cache lines
+ * that account for them. Replies are matched by XID whatever queue they
+ * arrive on; the congestion window covers the grants of all queues.
+ *
+ * CXI endpoints make progress only when their CQs are read, so each
+ * queue runs a poll worker for as long as it has Sends in flight or
+ * RPCs waiting for replies; it spins briefly and then naps with growing
+ * intervals, and exits when the transport goes idle. The workers are
+ * spread over the CPUs of the NIC's node, the way completion vectors
+ * are spread over interrupt CPUs.
+ *
+ * With rails= in mount_options the queues are spread over that many
+ * NICs (kfi_rail.c), each rail's queues registering their buffers on
+ * its device. Each RPC goes to a queue on the rail with the fewest bytes
+ * in flight, preferring the NIC on its pages' node, and is accounted
+ * there until it retires. A rail whose endpoint fails is taken out of
+ * selection while the others carry on, and the RPCs stranded on it are
+ * sent again on the others. With lanes=2 the queues are also
+ * split into a metadata and a bulk lane (kfi_lane.c), each connected with
+ * its lane's traffic class, and RPCs that move page data stay off the
+ * metadata lane's queues.
+ *
+ * Every mount on a node shares the NICs, so each call's Send is handed
+ * to the device's submission scheduler (kfi_sched.c) in the mount's flow
+ * (or its cgroup's, with sched_key=1). It goes at once while the device
+ * has room and otherwise waits its turn by weight, after the call has
+ * been accepted. With busy_poll= in mount_options, a
+ * synchronous RPC reaps its queue's CQs itself for a while before it
+ * sleeps for its reply (kfi_completion.c).
+ *
+ * Each connection starts by offering Version Two: the client sends its
+ * transport properties and waits briefly for the server's. A Version One
+ * server answers with ERR_VERS (or not at all), and the connection then
+ * runs Version One with the RFC 8166 inline thresholds.
+ *
+ * When the server splits multi-call envelopes, small inline calls that
+ * arrive while a Send is in flight are copied into an envelope instead
+ * of each taking their own Send and completion; the envelope goes when
+ * that Send completes, or when it is full. An idle Send queue is never
+ * held up, so this costs latency only under load, where it saves the
+ * most Sends.
+ *
+ * NFSv4.1 callbacks come back over the same endpoint; the backchannel
+ * slots and their reserved receives are in kfi_backchannel.c.
+ */
+
 #include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/wait_bit.h>
+#include <linux/sunrpc/xprt.h>
+#include <linux/sunrpc/addr.h>
+#include <linux/sunrpc/sched.h>
+#include <linux/sunrpc/clnt.h>
+#include <linux/sunrpc/rpc_rdma.h>
+
 #include "kfi_verbs_compat.h"
 #include "kfi_internal.h"
+#include "kfi_trace.h"
+
+static unsigned int slot_table_entries = KFI_XPRT_SLOTS;
+module_param(slot_table_entries, uint, 0644);
+MODULE_PARM_DESC(slot_table_entries,
+                 "RPC slots per mount, also the credits requested");
+
+static unsigned int inline_write_size = KFI_XPRT_INLINE_SIZE;
+module_param(inline_write_size, uint, 0644);
+MODULE_PARM_DESC(inline_write_size, "Largest call sent inline (bytes)");
+
+static unsigned int inline_read_size = KFI_XPRT_INLINE_SIZE;
+module_param(inline_read_size, uint, 0644);
+MODULE_PARM_DESC(inline_read_size, "Largest reply received inline (bytes)");
+
+static unsigned int max_version = KFI_RPCRDMA_V2;
+module_param(max_version, uint, 0644);
+MODULE_PARM_DESC(max_version,
+                 "Highest RPC-over-RDMA version offered (1 or 2)");
+
+static unsigned int inline_v2_size = KFI_XPRT_INLINE_V2_SIZE;
+module_param(inline_v2_size, uint, 0444);
+MODULE_PARM_DESC(inline_v2_size,
+                 "Inline threshold offered to Version Two servers (bytes)");
+
+static unsigned int ddp_min_read;
+module_param(ddp_min_read, uint, 0644);
+MODULE_PARM_DESC(ddp_min_read,
+                 "Smallest READ placed in the page cache by the server even when it fits inline (bytes)");
+
+static bool autotune = true;
+module_param(autotune, bool, 0644);
+MODULE_PARM_DESC(autotune,
+                 "Move the READ placement threshold to where measured round trips put it (new mounts)");
+
+static unsigned int idle_timeout = KFI_XPRT_IDLE_DISC_TO / HZ;
+module_param(idle_timeout, uint, 0644);
+MODULE_PARM_DESC(idle_timeout,
+                 "Seconds a connection may sit idle before it is closed and its endpoints go back to the pool (0 = never)");
+
+static unsigned int max_queues = KFI_XPRT_QUEUES;
+module_param(max_queues, uint, 0644);
+MODULE_PARM_DESC(max_queues,
+                 "Hardware queues per mount, at most one per CPU (1 disables)");
+
+static unsigned int send_coalesce = KFI_XPRT_COALESCE;
+module_param(send_coalesce, uint, 0644);
+MODULE_PARM_DESC(send_coalesce,
+                 "Calls per Send while a Send is in flight, with one queue (0 or 1 disables)");
+
+static char *mount_options;
+module_param(mount_options, charp, 0444);
+MODULE_PARM_DESC(mount_options,
+                 "Options applied to every mount's endpoints, e.g. \"vni=1234,busy_poll=50,rails=2,lanes=2\"");
+
+static atomic64_t kfi_xprt_ids = ATOMIC64_INIT(0);
+
+static struct workqueue_struct *kfi_xprt_wq;
+static struct workqueue_struct *kfi_xprt_poll_wq;
+static struct dentry *kfi_xprt_debugfs;
+
+static const struct rpc_timeout kfi_xprt_default_timeout = {
+    .to_initval = 60 * HZ,
+    .to_maxval = 60 * HZ,
+};
 
-/* Forward declaration */
 static struct rpc_xprt *xs_setup_rdma_kfi(struct xprt_create *args);
 
 static struct xprt_class xprt_rdma_kfi = {
@@ -15,13 +149,1761 @@ static struct xprt_class xprt_rdma_kfi = {
     .netid          = { "rdma", "rdma6", "" },
 };
 
-/* Placeholder setup function - to be implemented */
+/*
+ * ============================================================================
+ * POSTING AND COMPLETION
+ * ============================================================================
+ */
+
+/*
+ * A queue's endpoint failed. On a multi-rail mount the other rails carry
+ * on: the rail is taken out of selection and the RPCs stranded on it are
+ * sent again on the others. Otherwise the connection is dropped.
+ */
+static void kfi_xprt_queue_error(struct kfi_xprt_queue *q)
+{
+    struct kfi_xprt *kx = q->kx;
+
+    if (q->rail && kfi_rail_fail(kx->rails, q->rail) > 0) {
+        queue_work(kfi_xprt_wq, &kx->rail_work);
+        return;
+    }
+    xprt_force_disconnect(&kx->xprt);
+}
+
+/* The call was sent on a queue whose rail has failed */
+static bool kfi_xprt_req_stranded(struct kfi_req *req)
+{
+    struct kfi_xprt_queue *q = READ_ONCE(req->q);
+
+    return q && q->rail && test_bit(KFI_RAIL_F_FAILED, &q->rail->flags);
+}
+
+/*
+ * Send the calls stranded on a failed rail again. A call whose Send is
+ * still pending is left for its completion, which runs this again: its
+ * slot must not take a new Send before the old one is reaped. The reply
+ * is taken from the failed queue by clearing REPLY_PENDING, as a late
+ * one would, and the task is woken without a reply, so the RPC client
+ * encodes and transmits it again; the queue picked then is on a rail
+ * still in service. The failed queue's credit went with its rail.
+ */
+static void kfi_xprt_rail_requeue(struct work_struct *work)
+{
+    struct kfi_xprt *kx = container_of(work, struct kfi_xprt, rail_work);
+    struct rpc_xprt *xprt = &kx->xprt;
+    struct rpc_rqst *rqst;
+    int i, n = 0;
+
+    for (i = 0; i < kx->max_requests; i++) {
+        struct kfi_req *req = &kx->reqs[i];
+
+        if (test_bit(KFI_XPRT_F_CLOSING, &kx->flags))
+            break;
+        if (!test_bit(KFI_REQ_F_REPLY_PENDING, &req->flags) ||
+            test_bit(KFI_REQ_F_SEND_PENDING, &req->flags) ||
+            !kfi_xprt_req_stranded(req))
+            continue;
+
+        /* Pinned, the slot stays with its task until we are done */
+        spin_lock(&xprt->queue_lock);
+        rqst = xprt_lookup_rqst(xprt, req->rqst.rq_xid);
+        if (rqst != &req->rqst)
+            rqst = NULL;
+        if (rqst)
+            xprt_pin_rqst(rqst);
+        spin_unlock(&xprt->queue_lock);
+        if (!rqst)
+            continue;
+
+        if (test_and_clear_bit(KFI_REQ_F_REPLY_PENDING, &req->flags)) {
+            kfi_rpcrdma_unmap(req);
+            kfi_xprt_retire(req);
+            set_bit(KFI_REQ_F_RESEND, &req->flags);
+            rpc_wake_up_queued_task(&xprt->pending, rqst->rq_task);
+            n++;
+        }
+        xprt_unpin_rqst(rqst);
+    }
+
+    if (n)
+        pr_info_ratelimited("kfi: xprt %s: %d RPC(s) moved off a failed rail\n",
+                            xprt->address_strings[RPC_DISPLAY_ADDR], n);
+}
+
+/**
+ * kfi_xprt_post_recv - Post a receive buffer on the connected endpoint
+ *
+ * Returns: 0, or -ENOTCONN if the transport lost its endpoint meanwhile;
+ * the buffer is posted again by the next connect.
+ */
+int kfi_xprt_post_recv(struct kfi_xprt *kx, struct kfi_rep *rep)
+{
+    struct kfi_qp *kqp = READ_ONCE(rep->q->kqp);
+    struct kfid_ep *ep;
+    ssize_t ret;
+
+    if (!kqp || test_bit(KFI_XPRT_F_CLOSING, &kx->flags))
+        return -ENOTCONN;
+
+    ep = kfi_qp_rx_ep(kqp);
+    ret = kfi_recv(ep, rep->buf, kx->max_rsize, rep->q->desc,
+                   KFI_ADDR_UNSPEC, &rep->cqe);
+    if (ret) {
+        pr_err_ratelimited("kfi: xprt recv post failed: %zd\n", ret);
+        kfi_xprt_queue_error(rep->q);
+        return ret == -KFI_EAGAIN ? -EAGAIN : (int)ret;
+    }
+
+    rep->ep = ep;
+    atomic_inc(&kqp->rq_outstanding);
+    return 0;
+}
+EXPORT_SYMBOL(kfi_xprt_post_recv);
+
+/**
+ * kfi_xprt_post_recvs - Post receives to cover a queue's credit grant
+ * @q: Queue
+ * @credits: Credits granted by the server on @q
+ * @gfp: Allocation flags for receive buffers not allocated yet
+ *
+ * Receives follow the grant up, with KFI_XPRT_EXTRA_RECVS to spare and
+ * one more per backchannel slot, and their buffers are allocated on
+ * first use. A receive that cannot be posted is left for the next grant;
+ * the caller keeps the window within what was posted.
+ *
+ * Replies are handled both by the queue's worker and by RPCs busy-polling
+ * the queue, so the refill is serialized by @q->recv_lock. A buffer
+ * allocated with @gfp that may sleep is allocated outside of it.
+ */
+void kfi_xprt_post_recvs(struct kfi_xprt_queue *q, u32 credits, gfp_t gfp)
+{
+    struct kfi_xprt *kx = q->kx;
+    int want = min_t(int, credits + KFI_XPRT_EXTRA_RECVS +
+                     READ_ONCE(kx->bc_slots), kx->nr_reps);
+    void *buf;
+
+    spin_lock(&q->recv_lock);
+    while (q->nr_posted < want) {
+        struct kfi_rep *rep = &q->reps[q->nr_posted];
+
+        if (!rep->buf && gfpflags_allow_blocking(gfp)) {
+            spin_unlock(&q->recv_lock);
+            buf = kmalloc_node(kx->max_rsize, gfp, kx->node);
+            spin_lock(&q->recv_lock);
+            if (!buf)
+                break;
+            /* Another refill may have got there first */
+            if (rep->buf)
+                kfree(buf);
+            else
+                rep->buf = buf;
+            continue;
+        }
+
+        if (!rep->buf)
+            rep->buf = kmalloc_node(kx->max_rsize, gfp, kx->node);
+        if (!rep->buf || kfi_xprt_post_recv(kx, rep))
+            break;
+        q->nr_posted++;
+    }
+    spin_unlock(&q->recv_lock);
+}
+EXPORT_SYMBOL(kfi_xprt_post_recvs);
+
+int kfi_xprt_post_send(struct kfi_xprt_queue *q, struct ib_cqe *cqe,
+                       struct kvec *iov, int niov)
+{
+    struct kfi_qp *kqp = q->kqp;
+    void *descs[KFI_MAX_SGE];
+    struct kfi_qp_ctx *ctx;
+    unsigned long flags;
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < niov; i++)
+        descs[i] = q->desc;
+
+    ctx = kfi_qp_tx_lock(kqp, &flags);
+    ret = kfi_sendv(ctx->ep, iov, descs, niov, kfi_qp_tx_addr(kqp, ctx),
+                    cqe);
+    kfi_qp_tx_unlock(ctx, flags);
+    if (ret)
+        return ret == -KFI_EAGAIN ? -EAGAIN : (int)ret;
+
+    atomic_inc(&kqp->sq_outstanding);
+    atomic_inc(&q->sends_pending);
+    return 0;
+}
+
+/*
+ * Post the envelope collecting calls, if any. Called with coal_lock held.
+ * The calls in it were already accepted, so a failure to post is handled
+ * like a lost connection: the reconnect retransmits them. Envelopes are
+ * used with a single queue only.
+ */
+static void kfi_xprt_flush(struct kfi_xprt *kx)
+{
+    struct kfi_multi *m = kx->coal;
+    struct kvec iov;
+
+    if (!m)
+        return;
+    kx->coal = NULL;
+
+    iov.iov_base = m->buf;
+    iov.iov_len = m->len;
+    if (kfi_xprt_post_send(&kx->queues[0], &m->cqe, &iov, 1)) {
+        list_add(&m->free, &kx->free_multi);
+        xprt_force_disconnect(&kx->xprt);
+        return;
+    }
+
+    trace_kfi_xprt_multi(kx, m);
+}
+
+/* One Send fewer in flight; calls that queued behind it go now */
+void kfi_xprt_sent(struct kfi_xprt_queue *q)
+{
+    struct kfi_xprt *kx = q->kx;
+
+    if (!kx->multi_max) {
+        atomic_dec(&q->sends_pending);
+        return;
+    }
+
+    spin_lock(&kx->coal_lock);
+    atomic_dec(&q->sends_pending);
+    kfi_xprt_flush(kx);
+    spin_unlock(&kx->coal_lock);
+}
+
+void kfi_xprt_send_error(struct kfi_xprt_queue *q, struct ib_wc *wc)
+{
+    if (wc->status != IB_WC_WR_FLUSH_ERR)
+        pr_err_ratelimited("kfi: xprt send failed: status %d (vendor %u)\n",
+                           wc->status, wc->vendor_err);
+    kfi_xprt_queue_error(q);
+}
+
+static void kfi_xprt_send_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+    struct kfi_req *req = container_of(wc->wr_cqe, struct kfi_req, send_cqe);
+    struct kfi_xprt_queue *q = req->q;
+
+    kfi_xprt_sent(q);
+
+    if (test_and_clear_bit(KFI_REQ_F_SEND_PENDING, &req->flags))
+        kfi_rpcrdma_req_put(req);
+
+    /* Once its Send is reaped, a call on a failed rail can go again */
+    if (wc->status != IB_WC_SUCCESS)
+        kfi_xprt_send_error(q, wc);
+    else if (q->rail && test_bit(KFI_RAIL_F_FAILED, &q->rail->flags))
+        kfi_xprt_queue_error(q);
+}
+
+static void kfi_xprt_multi_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+    struct kfi_multi *m = container_of(wc->wr_cqe, struct kfi_multi, cqe);
+    struct kfi_xprt *kx = m->kx;
+
+    if (wc->status != IB_WC_SUCCESS)
+        kfi_xprt_send_error(&kx->queues[0], wc);
+
+    spin_lock(&kx->coal_lock);
+    list_add(&m->free, &kx->free_multi);
+    atomic_dec(&kx->queues[0].sends_pending);
+    kfi_xprt_flush(kx);
+    spin_unlock(&kx->coal_lock);
+}
+
+static void kfi_xprt_connprop_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+    struct kfi_xprt_queue *q = container_of(wc->wr_cqe,
+                                            struct kfi_xprt_queue,
+                                            connprop_cqe);
+
+    kfi_xprt_sent(q);
+
+    /* Negotiation times out and the first RPC finds the broken endpoint */
+    if (wc->status != IB_WC_SUCCESS && wc->status != IB_WC_WR_FLUSH_ERR)
+        pr_err_ratelimited("kfi: xprt property send failed: status %d\n",
+                           wc->status);
+}
+
+static void kfi_xprt_recv_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+    struct kfi_rep *rep = container_of(wc->wr_cqe, struct kfi_rep, cqe);
+
+    rep->ep = NULL;
+
+    if (wc->status != IB_WC_SUCCESS) {
+        if (wc->status != IB_WC_WR_FLUSH_ERR) {
+            pr_err_ratelimited("kfi: xprt recv failed: status %d (vendor %u)\n",
+                               wc->status, wc->vendor_err);
+            kfi_xprt_queue_error(rep->q);
+        }
+        return;
+    }
+
+    rep->len = wc->byte_len;
+    kfi_rpcrdma_reply_handler(rep);
+}
+
+/*
+ * Reap a batch from one CQ and run the handlers outside the poll lock:
+ * reply handling registers and releases memory, which may sleep. The
+ * dispatch lock keeps a busy-polling RPC from handling completions of
+ * the same CQ meanwhile; while one is, it dispatches what it reaps and
+ * the worker finds nothing.
+ */
+static int kfi_xprt_reap(struct ib_cq *cq)
+{
+    struct kfi_cq *kcq = ibcq_to_kfi(cq);
+    struct ib_wc wc[KFI_XPRT_POLL_BATCH];
+    int n, i;
+
+    if (!mutex_trylock(&kcq->dispatch_lock))
+        return 0;
+
+    spin_lock_bh(&kcq->poll_lock);
+    n = kfi_poll_cq(cq, ARRAY_SIZE(wc), wc);
+    spin_unlock_bh(&kcq->poll_lock);
+
+    for (i = 0; i < n; i++) {
+        if (wc[i].wr_cqe && wc[i].wr_cqe->done)
+            wc[i].wr_cqe->done(cq, &wc[i]);
+    }
+
+    mutex_unlock(&kcq->dispatch_lock);
+    return max(n, 0);
+}
+
+/*
+ * A queue is busy while RPCs sent on it await their replies. While a
+ * session takes callbacks they may arrive at any time, so the worker
+ * keeps reaping, at its longest nap, when nothing else is due.
+ */
+static bool kfi_xprt_busy(struct kfi_xprt_queue *q)
+{
+    struct kfi_xprt *kx = q->kx;
+
+    return atomic_read(&q->sends_pending) ||
+           test_bit(KFI_XPRT_F_NEGOTIATING, &kx->flags) ||
+           atomic_read(&q->inflight) ||
+           READ_ONCE(kx->bc_slots);
+}
+
+static void kfi_xprt_poll_worker(struct work_struct *work)
+{
+    struct kfi_xprt_queue *q = container_of(work, struct kfi_xprt_queue,
+                                            poll_work);
+    struct kfi_xprt *kx = q->kx;
+    struct kfi_ep_bundle *bundle = READ_ONCE(q->bundle);
+    unsigned int nap = KFI_XPRT_POLL_MIN_USEC;
+    int idle = 0, n;
+
+    if (!bundle)
+        return;
+
+    while (!test_bit(KFI_XPRT_F_CLOSING, &kx->flags)) {
+        n = kfi_xprt_reap(bundle->recv_cq);
+        n += kfi_xprt_reap(bundle->send_cq);
+        if (n) {
+            idle = 0;
+            nap = KFI_XPRT_POLL_MIN_USEC;
+            cond_resched();
+            continue;
+        }
+
+        if (!kfi_xprt_busy(q))
+            break;
+
+        if (++idle < KFI_XPRT_POLL_SPIN) {
+            cpu_relax();
+            continue;
+        }
+
+        usleep_range(nap, nap * 2);
+        nap = min_t(unsigned int, nap * 2, KFI_XPRT_POLL_MAX_USEC);
+    }
+}
+
+/*
+ * Make sure a queue's CQs are being reaped; a running worker is queued
+ * again. The poll workqueue is per-CPU, so the worker runs on q->cpu,
+ * or where the kick came from if that CPU has gone offline.
+ */
+void kfi_xprt_kick(struct kfi_xprt_queue *q)
+{
+    int cpu = q->cpu;
+
+    if (!cpu_online(cpu))
+        cpu = WORK_CPU_UNBOUND;
+    queue_work_on(cpu, kfi_xprt_poll_wq, &q->poll_work);
+}
+
+/*
+ * ============================================================================
+ * CONNECTION MANAGEMENT
+ * ============================================================================
+ */
+
+/*
+ * Up to @max NICs: one on the local NUMA node first if there is one,
+ * then the others in enumeration order. Each is held for the caller.
+ */
+static int kfi_xprt_pick_devices(struct kfi_device **kdevs, int max)
+{
+    struct ib_device **devices;
+    int i, n = 0, nr = 0, local = 0;
+
+    devices = kfi_get_devices(&n);
+    if (!devices)
+        return 0;
+
+    for (i = 0; i < n; i++) {
+        if (ibdev_to_kfi(devices[i])->numa_node == numa_node_id()) {
+            local = i;
+            break;
+        }
+    }
+
+    for (i = 0; i < n && nr < max; i++) {
+        kdevs[nr] = ibdev_to_kfi(devices[(local + i) % n]);
+        kfi_device_hold(kdevs[nr++]);
+    }
+
+    kfi_free_devices(devices);
+    return nr;
+}
+
+/* Give back what a call took of its device's scheduler */
+static void kfi_xprt_uncharge(struct kfi_req *req)
+{
+    if (test_and_clear_bit(KFI_REQ_F_CHARGED, &req->flags))
+        kfi_sched_complete(req->sched_dev, req->sched.cost);
+}
+
+/*
+ * Take a call back from its device's scheduler before its Send is
+ * posted, or wait until it has been. The transport holds its devices
+ * until it has disconnected, so @sched_dev stays valid whatever happens
+ * to the queue meanwhile.
+ */
+static void kfi_xprt_unqueue(struct kfi_req *req)
+{
+    if (!test_bit(KFI_REQ_F_QUEUED, &req->flags))
+        return;
+
+    if (kfi_sched_cancel(req->sched_dev, &req->sched)) {
+        if (test_and_clear_bit(KFI_REQ_F_SEND_PENDING, &req->flags))
+            kfi_rpcrdma_req_put(req);
+        clear_bit_unlock(KFI_REQ_F_QUEUED, &req->flags);
+        smp_mb__after_atomic();
+        wake_up_bit(&req->flags, KFI_REQ_F_QUEUED);
+        return;
+    }
+
+    wait_on_bit(&req->flags, KFI_REQ_F_QUEUED, TASK_UNINTERRUPTIBLE);
+}
+
+/* Take a queue off its endpoint; its worker has been stopped */
+static void kfi_xprt_queue_disconnect(struct kfi_xprt_queue *q)
+{
+    struct kfi_ep_bundle *bundle = q->bundle;
+    struct kfi_xprt *kx = q->kx;
+    int i;
+
+    if (!bundle)
+        return;
+
+    /* Receives are ours to cancel; the pool drains the rest */
+    for (i = 0; i < kx->nr_reps; i++) {
+        struct kfi_rep *rep = &q->reps[i];
+
+        if (rep->ep)
+            kfi_cancel(&rep->ep->fid, &rep->cqe);
+        rep->ep = NULL;
+    }
+    q->nr_posted = 0;
+
+    WRITE_ONCE(q->kqp, NULL);
+    q->bundle = NULL;
+    kfi_ep_pool_put(bundle);
+    kfi_sched_flow_put(q->flow);
+    q->flow = NULL;
+}
+
+/* Each rail's registration goes once all of its queues are off the device */
+static void kfi_xprt_queue_dereg(struct kfi_xprt_queue *q)
+{
+    if (q->dma_mr) {
+        kfi_dereg_mr(q->dma_mr);
+        q->dma_mr = NULL;
+    }
+    q->desc = NULL;
+}
+
+static void kfi_xprt_disconnect(struct kfi_xprt *kx)
+{
+    int i;
+
+    if (!kx->kdev)
+        return;
+
+    set_bit(KFI_XPRT_F_CLOSING, &kx->flags);
+    smp_mb__after_atomic();
+    wait_var_event(&kx->busy_pollers, !atomic_read(&kx->busy_pollers));
+    for (i = 0; i < kx->nr_queues; i++)
+        cancel_work_sync(&kx->queues[i].poll_work);
+    /* Calls still waiting for their device go with the connection */
+    for (i = 0; i < kx->max_requests; i++)
+        kfi_xprt_unqueue(&kx->reqs[i]);
+    cancel_work_sync(&kx->rail_work);
+    for (i = 0; i < kx->nr_queues; i++)
+        kfi_xprt_queue_disconnect(&kx->queues[i]);
+    for (i = 0; i < kx->nr_queues; i++)
+        kfi_xprt_queue_dereg(&kx->queues[i]);
+    kx->kdev = NULL;
+
+    /* Send completions went with the endpoints; finish what they held up */
+    spin_lock(&kx->coal_lock);
+    for (i = 0; i < kx->nr_queues; i++)
+        atomic_set(&kx->queues[i].sends_pending, 0);
+    kx->coal = NULL;
+    kx->multi_max = 0;
+    INIT_LIST_HEAD(&kx->free_multi);
+    for (i = 0; kx->multi && i < KFI_XPRT_MULTI_BUFS; i++)
+        list_add_tail(&kx->multi[i].free, &kx->free_multi);
+    spin_unlock(&kx->coal_lock);
+    for (i = 0; i < kx->max_requests; i++) {
+        struct kfi_req *req = &kx->reqs[i];
+
+        /* Held reply pieces are posted again by the next connect */
+        req->nr_cont = 0;
+
+        /* Credits are granted afresh on the next connection */
+        clear_bit(KFI_REQ_F_INFLIGHT, &req->flags);
+        clear_bit(KFI_REQ_F_RESEND, &req->flags);
+        kfi_xprt_uncharge(req);
+
+        if (test_and_clear_bit(KFI_REQ_F_SEND_PENDING, &req->flags))
+            kfi_rpcrdma_req_put(req);
+    }
+#if defined(CONFIG_SUNRPC_BACKCHANNEL)
+    kfi_xprt_bc_disconnect(kx);
+#endif
+    for (i = 0; i < kx->nr_queues; i++) {
+        kx->queues[i].credits = 0;
+        atomic_set(&kx->queues[i].inflight, 0);
+    }
+
+    /* Nothing refers to the devices' schedulers or endpoints any more */
+    for (i = 0; i < kx->nr_kdevs; i++)
+        kfi_device_put(kx->kdevs[i]);
+    kx->nr_kdevs = 0;
+
+    kx->connect_status = -ENOTCONN;
+    clear_bit(KFI_XPRT_F_CLOSING, &kx->flags);
+}
+
+/*
+ * Offer Version Two and wait for the server's answer. Falls back to
+ * Version One on ERR_VERS, on silence, and when Version Two is disabled.
+ * An answer is kept with the server's AV entry, so the next connection
+ * to a Version One server, such as a pNFS data server reconnecting after
+ * its idle timeout, does not wait for an answer again. Silence is not
+ * kept: the offer may only have been lost, and the next connection
+ * makes it again.
+ */
+static void kfi_xprt_negotiate(struct kfi_xprt *kx)
+{
+    struct kfi_rpcrdma_props props = {
+        .sbsiz = kx->max_wsize,
+        .rbsiz = kx->max_rsize,
+        .rcsiz = KFI_XPRT_MAX_SEGS,
+        .brs = IS_ENABLED(CONFIG_SUNRPC_BACKCHANNEL) ?
+               KFI_RDMA2_RVRSDIR_INLINE : 0,
+    };
+    struct kfi_xprt_queue *q = &kx->queues[0];
+    struct kfi_av_entry *server = q->kqp->av_entry;
+    struct kvec iov;
+    bool answered;
+    int len, i;
+
+    kx->vers = RPCRDMA_VERSION;
+    kx->multi_max = 0;
+    memset(&kx->peer, 0, sizeof(kx->peer));
+
+    if (READ_ONCE(max_version) >= KFI_RPCRDMA_V2 &&
+        READ_ONCE(server->vers) != RPCRDMA_VERSION) {
+        len = kfi_rpcrdma_encode_connprop(kx->connprop, sizeof(kx->connprop),
+                                          kx->queue_credits, &props);
+        iov.iov_base = kx->connprop;
+        iov.iov_len = len;
+
+        reinit_completion(&kx->negotiated);
+        set_bit(KFI_XPRT_F_NEGOTIATING, &kx->flags);
+        if (len > 0 && !kfi_xprt_post_send(q, &q->connprop_cqe, &iov, 1)) {
+            kfi_xprt_kick(q);
+            wait_for_completion_timeout(&kx->negotiated,
+                                        KFI_XPRT_NEGOTIATE_TO);
+        }
+
+        /* Answered, possibly late: the answer has set kx->vers */
+        answered = !test_and_clear_bit(KFI_XPRT_F_NEGOTIATING, &kx->flags);
+        if (answered) {
+            wait_for_completion(&kx->negotiated);
+            WRITE_ONCE(server->vers, kx->vers);
+        }
+    }
+
+    if (kx->vers == KFI_RPCRDMA_V2) {
+        kx->inline_wsize = kx->max_wsize;
+        if (kx->peer.rbsiz)
+            kx->inline_wsize = min(kx->inline_wsize, kx->peer.rbsiz);
+        kx->inline_rsize = kx->max_rsize;
+        if (kx->peer.sbsiz)
+            kx->inline_rsize = min(kx->inline_rsize, kx->peer.sbsiz);
+        kx->inline_wsize = max_t(u32, kx->inline_wsize, KFI_XPRT_INLINE_MIN);
+        kx->inline_rsize = max_t(u32, kx->inline_rsize, KFI_XPRT_INLINE_MIN);
+
+        /* The other queues are connections too; the server learns of them */
+        for (i = 1; i < kx->nr_queues; i++) {
+            q = &kx->queues[i];
+            if (q->kqp && !kfi_xprt_post_send(q, &q->connprop_cqe, &iov, 1))
+                kfi_xprt_kick(q);
+        }
+
+        /* Coalesce only toward a server that splits envelopes, on one queue */
+        if (kx->multi && kx->peer.multi > 1 && kx->nr_queues == 1)
+            kx->multi_max = min(READ_ONCE(send_coalesce), kx->peer.multi);
+        if (kx->multi_max < 2)
+            kx->multi_max = 0;
+    } else {
+        kx->inline_wsize = kx->v1_wsize;
+        kx->inline_rsize = kx->v1_rsize;
+    }
+}
+
+/*
+ * Connect a queue on @kdev with its lane's traffic class. The endpoint
+ * comes from the pool for the mount's VNI and the lane's traffic class,
+ * as both are fixed once it is open. The first queue of each rail
+ * registers the buffers on its device; pooled endpoints share the
+ * device's domain, so @owner's registration serves the rail's other
+ * queues.
+ */
+static int kfi_xprt_queue_connect(struct kfi_xprt *kx, struct kfi_xprt_queue *q,
+                                  struct kfi_device *kdev,
+                                  struct kfi_xprt_queue *owner)
+{
+    struct kfi_sched_flow *flow = NULL;
+    struct kfi_ep_bundle *bundle;
+    u8 tc = KFI_TC_BEST_EFFORT;
+    struct kfi_qp *kqp;
+    struct ib_mr *mr;
+    u16 vni = 0;
+    int ret;
+
+    if (mount_options)
+        kfi_parse_vni_from_options(mount_options, &vni);
+    if (kx->lanes)
+        tc = kx->lanes->lanes[q->lane].traffic_class;
+
+    if (kdev->sched) {
+        flow = kfi_sched_flow_get(kdev->sched, kx->sched_key, NULL);
+        if (IS_ERR(flow))
+            return PTR_ERR(flow);
+    }
+
+    bundle = kfi_ep_pool_get(kdev, vni, tc);
+    if (IS_ERR(bundle)) {
+        kfi_sched_flow_put(flow);
+        return PTR_ERR(bundle);
+    }
+    kqp = ibqp_to_kfi(bundle->qp);
+    kfi_qp_apply_mount_options(kqp, mount_options);
+
+    ret = kfi_connect_ep(kqp, (struct sockaddr *)&kx->xprt.addr);
+    if (ret) {
+        kfi_ep_pool_put(bundle);
+        kfi_sched_flow_put(flow);
+        return ret;
+    }
+
+    if (owner) {
+        q->desc = owner->desc;
+    } else {
+        mr = kfi_get_dma_mr(bundle->pd, IB_ACCESS_LOCAL_WRITE);
+        if (IS_ERR(mr)) {
+            kfi_ep_pool_put(bundle);
+            kfi_sched_flow_put(flow);
+            return PTR_ERR(mr);
+        }
+        q->dma_mr = mr;
+        q->desc = kfi_mr_desc(ibmr_to_kfi(mr)->kfi_mr);
+    }
+
+    q->bundle = bundle;
+    q->flow = flow;
+    q->cpu = cpumask_local_spread(q - kx->queues, kdev->numa_node);
+    WRITE_ONCE(q->kqp, kqp);
+    return 0;
+}
+
+static int kfi_xprt_connect_ep(struct kfi_xprt *kx)
+{
+    struct kfi_device *kdevs[KFI_MAX_RAILS];
+    struct rpc_xprt *xprt = &kx->xprt;
+    int i, n, up = 0, ret;
+
+    n = kfi_xprt_pick_devices(kdevs, kx->nr_rails);
+    if (!n)
+        return -ENODEV;
+    memcpy(kx->kdevs, kdevs, n * sizeof(*kdevs));
+    kx->nr_kdevs = n;
+    kx->kdev = kdevs[0];
+    kx->node = kx->kdev->numa_node;
+
+    if (kx->rails) {
+        kfi_rail_set_clear(kx->rails);
+        for (i = 0; i < n; i++)
+            kfi_rail_add(kx->rails, kdevs[i]->numa_node);
+    }
+
+    /*
+     * Queue i is on rail i % n, and each lane has a queue on every rail;
+     * rails other than the first may fail
+     */
+    for (i = 0; i < kx->nr_queues; i++) {
+        struct kfi_xprt_queue *q = &kx->queues[i];
+        int r = i % n;
+
+        q->rail = kx->rails ? &kx->rails->rails[r] : NULL;
+        q->lane = kx->lanes ? (i / kx->nr_rails) % kx->lanes->nr_lanes :
+                              KFI_LANE_META;
+        if (q->rail && test_bit(KFI_RAIL_F_FAILED, &q->rail->flags))
+            continue;
+
+        ret = kfi_xprt_queue_connect(kx, q, kdevs[r],
+                                     i < n ? NULL : &kx->queues[r]);
+        if (ret && !r)
+            goto out_disconnect;
+        if (ret) {
+            pr_warn_ratelimited("kfi: xprt %s: rail %d on %s left out: %d\n",
+                                xprt->address_strings[RPC_DISPLAY_ADDR], r,
+                                kdevs[r]->name, ret);
+            kfi_rail_fail(kx->rails, q->rail);
+        }
+    }
+
+    /* Enough for the first grant; more follow as the server grants them */
+    for (i = 0; i < kx->nr_queues; i++) {
+        struct kfi_xprt_queue *q = &kx->queues[i];
+
+        if (!q->kqp)
+            continue;
+
+        q->credits = 1;
+        kfi_xprt_post_recvs(q, 1, GFP_KERNEL);
+        if (q->nr_posted < 1 + KFI_XPRT_EXTRA_RECVS) {
+            ret = -ENOMEM;
+            goto out_disconnect;
+        }
+        up++;
+    }
+
+    /* One RPC per queue until the server grants credits */
+    kfi_cwnd_init(&kx->cwnd);
+    kfi_cwnd_grant(&kx->cwnd, up);
+    spin_lock(&xprt->transport_lock);
+    xprt->cwnd = kx->cwnd.window << RPC_CWNDSHIFT;
+    spin_unlock(&xprt->transport_lock);
+
+    kfi_xprt_negotiate(kx);
+
+    pr_debug("kfi: xprt %s connected on %s, %d/%d queues over %d rails, version %u, inline %u/%u\n",
+             xprt->address_strings[RPC_DISPLAY_ADDR], kx->kdev->name, up,
+             kx->nr_queues, n, kx->vers, kx->inline_wsize, kx->inline_rsize);
+    return 0;
+
+out_disconnect:
+    kfi_xprt_disconnect(kx);
+    return ret;
+}
+
+static void kfi_xprt_connect_worker(struct work_struct *work)
+{
+    struct kfi_xprt *kx = container_of(work, struct kfi_xprt,
+                                       connect_worker.work);
+    struct rpc_xprt *xprt = &kx->xprt;
+    int rc;
+
+    rc = kfi_xprt_connect_ep(kx);
+    xprt_clear_connecting(xprt);
+    if (!rc) {
+        kx->connect_status = 0;
+        xprt->connect_cookie++;
+        xprt->stat.connect_count++;
+        xprt->stat.connect_time += (long)jiffies - xprt->stat.connect_start;
+        xprt_set_connected(xprt);
+        rc = -EAGAIN;
+    } else {
+        pr_warn_ratelimited("kfi: connect to %s failed: %d\n",
+                            xprt->address_strings[RPC_DISPLAY_ADDR], rc);
+        kx->connect_status = rc;
+    }
+
+    xprt_unlock_connect(xprt, kx);
+    xprt_wake_pending_tasks(xprt, rc);
+}
+
+static void kfi_xprt_connect(struct rpc_xprt *xprt, struct rpc_task *task)
+{
+    struct kfi_xprt *kx = kfi_xprt(xprt);
+    unsigned long delay = 0;
+
+    WARN_ON_ONCE(!xprt_lock_connect(xprt, task, kx));
+
+    if (kx->connect_status) {
+        delay = xprt_reconnect_delay(xprt);
+        xprt_reconnect_backoff(xprt, KFI_XPRT_INIT_REEST_TO);
+    }
+
+    queue_delayed_work(kfi_xprt_wq, &kx->connect_worker, delay);
+}
+
+/*
+ * Release the buffers of free slots, and of the receives the next
+ * connection does not post at once. Both are allocated again as the
+ * window grows.
+ */
+static void kfi_xprt_trim(struct kfi_xprt *kx)
+{
+    struct kfi_xprt_queue *q;
+    int i;
+
+    for (i = 0; i < kx->max_requests; i++) {
+        struct kfi_req *req = &kx->reqs[i];
+
+        /* Hold the slot so that it is not handed out meanwhile */
+        if (test_and_set_bit_lock(i, kx->slots_busy))
+            continue;
+
+        kfi_rpcrdma_unmap(req);
+        kfree(req->rchunk.segs);
+        req->rchunk.segs = NULL;
+        req->wchunk.segs = NULL;
+        kfree(req->hdr);
+        req->hdr = NULL;
+        req->hdr_size = 0;
+        kfree(req->sendbuf);
+        req->sendbuf = NULL;
+        req->sendbuf_size = 0;
+        kfree(req->recvbuf);
+        req->recvbuf = NULL;
+        req->recvbuf_size = 0;
+
+        clear_bit_unlock(i, kx->slots_busy);
+    }
+
+    for (q = kx->queues; q < kx->queues + kx->nr_queues; q++) {
+        for (i = 1 + KFI_XPRT_EXTRA_RECVS; i < kx->nr_reps; i++) {
+            kfree(q->reps[i].buf);
+            q->reps[i].buf = NULL;
+        }
+    }
+}
+
+static void kfi_xprt_close(struct rpc_xprt *xprt)
+{
+    struct kfi_xprt *kx = kfi_xprt(xprt);
+
+    kfi_xprt_disconnect(kx);
+
+    /* Closed for idleness (nothing awaits a reply): shrink the pool */
+    if (RB_EMPTY_ROOT(&xprt->recv_queue))
+        kfi_xprt_trim(kx);
+    xprt->reestablish_timeout = 0;
+    ++xprt->connect_cookie;
+    xprt_disconnect_done(xprt);
+}
+
+/* An RPC timed out: retransmit on a new connection, never on this one */
+static void kfi_xprt_timer(struct rpc_xprt *xprt, struct rpc_task *task)
+{
+    /* Moved off a failed rail: it goes again without a reconnect */
+    if (test_bit(KFI_REQ_F_RESEND, &kfi_req(task->tk_rqstp)->flags))
+        return;
+    xprt_force_disconnect(xprt);
+}
+
+static void kfi_xprt_inject_disconnect(struct rpc_xprt *xprt)
+{
+    xprt_force_disconnect(xprt);
+}
+
+static void kfi_xprt_set_port(struct rpc_xprt *xprt, u16 port)
+{
+    struct sockaddr *sap = (struct sockaddr *)&xprt->addr;
+    char buf[8];
+
+    rpc_set_port(sap, port);
+
+    kfree(xprt->address_strings[RPC_DISPLAY_PORT]);
+    snprintf(buf, sizeof(buf), "%u", port);
+    xprt->address_strings[RPC_DISPLAY_PORT] = kstrdup(buf, GFP_KERNEL);
+
+    kfree(xprt->address_strings[RPC_DISPLAY_HEX_PORT]);
+    snprintf(buf, sizeof(buf), "%4hx", port);
+    xprt->address_strings[RPC_DISPLAY_HEX_PORT] = kstrdup(buf, GFP_KERNEL);
+}
+
+/*
+ * ============================================================================
+ * SLOTS AND BUFFERS
+ * ============================================================================
+ */
+
+/*
+ * Slots are taken lowest index first from a bitmap, without a lock. The
+ * slots in use, and so the buffers kept warm, stay within the number of
+ * RPCs the mount actually runs concurrently.
+ */
+static void kfi_xprt_alloc_slot(struct rpc_xprt *xprt, struct rpc_task *task)
+{
+    struct kfi_xprt *kx = kfi_xprt(xprt);
+    unsigned long i;
+
+    do {
+        i = find_first_zero_bit(kx->slots_busy, kx->max_requests);
+        if (i >= kx->max_requests) {
+            task->tk_status = -ENOMEM;
+            xprt_add_backlog(xprt, task);
+            return;
+        }
+    } while (test_and_set_bit_lock(i, kx->slots_busy));
+
+    task->tk_rqstp = &kx->reqs[i].rqst;
+    task->tk_status = 0;
+}
+
+static void kfi_xprt_free_slot(struct rpc_xprt *xprt, struct rpc_rqst *rqst)
+{
+    struct kfi_xprt *kx = kfi_xprt(xprt);
+    struct kfi_req *req = kfi_req(rqst);
+
+    if (xprt_wake_up_backlog(xprt, rqst))
+        return;
+
+    memset(rqst, 0, sizeof(*rqst));
+    clear_bit_unlock(req - kx->reqs, kx->slots_busy);
+}
+
+/*
+ * Grow a per-slot buffer; slots keep their buffers between RPCs, so the
+ * inline path allocates nothing once a slot has been used. The buffers
+ * are covered by the connection's DMA registration, whose descriptor is
+ * cached in each queue's desc: nothing is registered per RPC either.
+ */
+static int kfi_xprt_grow(void **buf, size_t *size, size_t want, gfp_t gfp,
+                         int node)
+{
+    void *p;
+
+    if (*size >= want)
+        return 0;
+
+    p = kmalloc_node(want, gfp, node);
+    if (!p)
+        return -ENOMEM;
+
+    kfree(*buf);
+    *buf = p;
+    *size = want;
+    return 0;
+}
+
+static int kfi_xprt_buf_alloc(struct rpc_task *task)
+{
+    struct rpc_rqst *rqst = task->tk_rqstp;
+    struct kfi_req *req = kfi_req(rqst);
+    struct kfi_xprt *kx = req->kx;
+    gfp_t gfp = rpc_task_gfp_mask();
+
+    if (kfi_xprt_grow(&req->hdr, &req->hdr_size, kx->max_wsize, gfp,
+                      kx->node) ||
+        kfi_xprt_grow(&req->sendbuf, &req->sendbuf_size,
+                      rqst->rq_callsize, gfp, kx->node) ||
+        kfi_xprt_grow(&req->recvbuf, &req->recvbuf_size,
+                      rqst->rq_rcvsize, gfp, kx->node))
+        return -ENOMEM;
+
+    rqst->rq_buffer = req->sendbuf;
+    rqst->rq_rbuffer = req->recvbuf;
+    return 0;
+}
+
+static void kfi_xprt_buf_free(struct rpc_task *task)
+{
+    struct kfi_req *req = kfi_req(task->tk_rqstp);
+
+    kfi_xprt_unqueue(req);
+    clear_bit(KFI_REQ_F_RESEND, &req->flags);
+
+    /* Ended without a reply (signal, timeout): revoke the chunks */
+    if (test_and_clear_bit(KFI_REQ_F_REPLY_PENDING, &req->flags)) {
+        kfi_rpcrdma_unmap(req);
+        kfi_xprt_retire(req);
+    }
+}
+
+/**
+ * kfi_xprt_retire - The RPC no longer holds a credit on its queue
+ */
+void kfi_xprt_retire(struct kfi_req *req)
+{
+    kfi_xprt_uncharge(req);
+    if (!test_and_clear_bit(KFI_REQ_F_INFLIGHT, &req->flags))
+        return;
+
+    atomic_dec(&req->q->inflight);
+    if (req->q->rail)
+        kfi_rail_complete(req->q->rail, req->cost, true);
+}
+
+/* A queue takes new calls while it is connected and its rail is up */
+static bool kfi_xprt_queue_usable(const struct kfi_xprt_queue *q)
+{
+    return READ_ONCE(q->kqp) &&
+           (!q->rail || !test_bit(KFI_RAIL_F_FAILED, &q->rail->flags));
+}
+
+/* Node of an RPC's page data, which a rail on the same node moves best */
+static int kfi_xprt_buf_node(const struct rpc_rqst *rqst)
+{
+    const struct xdr_buf *buf = rqst->rq_snd_buf.page_len ?
+                                &rqst->rq_snd_buf : &rqst->rq_rcv_buf;
+
+    if (buf->page_len && buf->pages)
+        return page_to_nid(buf->pages[buf->page_base >> PAGE_SHIFT]);
+    return numa_node_id();
+}
+
+/*
+ * Each CPU sends on its own queue while the server has credit for it
+ * there, and otherwise on the queue with the most room. The window
+ * never exceeds the sum of the grants, so some queue always has room.
+ * On a multi-rail or dual-lane mount the CPU's queue must also be on
+ * @rail and @lane. Otherwise a queue with room wins, then one on @lane,
+ * then one on @rail, then the one with the most room: a lane or rail
+ * that is out of credit lends its traffic to the others.
+ */
+static struct kfi_xprt_queue *kfi_xprt_pick_queue(struct kfi_xprt *kx,
+                                                  const struct kfi_rail *rail,
+                                                  enum kfi_lane_id lane)
+{
+    struct kfi_xprt_queue *q, *best = NULL;
+    int room, rank, best_room = INT_MIN, best_rank = -1;
+
+    q = &kx->queues[raw_smp_processor_id() % kx->nr_queues];
+    if (kx->nr_queues == 1)
+        return q;
+    if (kfi_xprt_queue_usable(q) && (!rail || q->rail == rail) &&
+        q->lane == lane &&
+        atomic_read(&q->inflight) < (int)READ_ONCE(q->credits))
+        return q;
+
+    for (q = kx->queues; q < kx->queues + kx->nr_queues; q++) {
+        if (!kfi_xprt_queue_usable(q))
+            continue;
+
+        room = (int)READ_ONCE(q->credits) - atomic_read(&q->inflight);
+        rank = ((room > 0) << 2) | ((q->lane == lane) << 1) |
+               (!rail || q->rail == rail);
+        if (rank > best_rank || (rank == best_rank && room > best_room)) {
+            best = q;
+            best_rank = rank;
+            best_room = room;
+        }
+    }
+    return best ?: &kx->queues[0];
+}
+
+/*
+ * Queue a small inline call behind a Send that is still in flight; it
+ * goes, with whatever else queued meanwhile, in one envelope when that
+ * Send completes. With no Send in flight the call goes at once, so
+ * coalescing adds latency only where the Send queue is already busy.
+ *
+ * Returns: true if the call was taken into an envelope
+ */
+static bool kfi_xprt_coalesce(struct kfi_xprt *kx, struct kfi_req *req)
+{
+    struct kfi_multi *m;
+    int len;
+
+    if (!kx->multi_max || req->rtype != KFI_NOCH || req->wtype != KFI_NOCH)
+        return false;
+
+    spin_lock(&kx->coal_lock);
+again:
+    m = kx->coal;
+    if (!m) {
+        if (!atomic_read(&req->q->sends_pending) ||
+            list_empty(&kx->free_multi))
+            goto out_unlock;
+
+        m = list_first_entry(&kx->free_multi, struct kfi_multi, free);
+        list_del(&m->free);
+        m->len = kfi_rpcrdma_encode_multi(m->buf, kx->inline_wsize,
+                                          req->rqst.rq_xid, kx->queue_credits);
+        m->nr = 0;
+        kx->coal = m;
+    }
+
+    len = kfi_rpcrdma_multi_add(m->buf, kx->inline_wsize, m->len,
+                                &req->rqst.rq_snd_buf);
+    if (len < 0) {
+        if (!m->nr)
+            goto out_unlock;
+        /* Full: it goes now, and this call starts the next one */
+        kfi_xprt_flush(kx);
+        goto again;
+    }
+
+    m->len = len;
+    m->nr++;
+    kx->stats.pullup_copy_count += req->rqst.rq_snd_buf.len;
+
+    /* Copied: only the reply holds the slot now */
+    clear_bit(KFI_REQ_F_SEND_PENDING, &req->flags);
+    atomic_dec(&req->refs);
+
+    if (m->nr == kx->multi_max)
+        kfi_xprt_flush(kx);
+    spin_unlock(&kx->coal_lock);
+    return true;
+
+out_unlock:
+    spin_unlock(&kx->coal_lock);
+    return false;
+}
+
+/*
+ * Post a call's Send once the device's scheduler lets it go, possibly
+ * from another mount's completion. The call was already accepted, so a
+ * failure to post is handled like a lost connection: the reconnect
+ * retransmits it.
+ */
+static int kfi_xprt_sched_send(struct kfi_sched_req *sr)
+{
+    struct kfi_req *req = container_of(sr, struct kfi_req, sched);
+    struct kfi_xprt_queue *q = req->q;
+    int rc = -ENOTCONN;
+
+    set_bit(KFI_REQ_F_CHARGED, &req->flags);
+    if (!test_bit(KFI_XPRT_F_CLOSING, &q->kx->flags) && READ_ONCE(q->kqp))
+        rc = kfi_xprt_post_send(q, &req->send_cqe, req->iov, req->niov);
+    if (rc) {
+        /* kfi_sched_post() gives the cost back */
+        clear_bit(KFI_REQ_F_CHARGED, &req->flags);
+        clear_bit(KFI_REQ_F_SEND_PENDING, &req->flags);
+        clear_bit(KFI_REQ_F_REPLY_PENDING, &req->flags);
+        kfi_xprt_retire(req);
+        kfi_rpcrdma_unmap(req);
+    } else {
+        kfi_xprt_kick(q);
+    }
+
+    /* The slot may be reused, and the queue disconnected, from here on */
+    clear_bit_unlock(KFI_REQ_F_QUEUED, &req->flags);
+    smp_mb__after_atomic();
+    wake_up_bit(&req->flags, KFI_REQ_F_QUEUED);
+
+    if (rc)
+        kfi_xprt_queue_error(q);
+    return rc;
+}
+
+static int kfi_xprt_send_request(struct rpc_rqst *rqst)
+{
+    struct rpc_xprt *xprt = rqst->rq_xprt;
+    struct kfi_xprt *kx = kfi_xprt(xprt);
+    struct kfi_req *req = kfi_req(rqst);
+    enum kfi_lane_id lane = KFI_LANE_META;
+    struct kfi_rail *rail = NULL;
+    struct kfi_xprt_queue *q;
+    int rc;
+
+#if defined(CONFIG_SUNRPC_BACKCHANNEL)
+    /* Backchannel slots have no call buffer: this is a callback's reply */
+    if (unlikely(!rqst->rq_buffer))
+        return kfi_xprt_bc_send_reply(rqst);
+#endif
+
+    if (!xprt_connected(xprt))
+        return -ENOTCONN;
+
+    if (!xprt_request_get_cong(xprt, rqst))
+        return -EBADSLT;
+
+    /*
+     * A retransmit on the same connection would spend a credit twice,
+     * unless the call was stranded on a failed rail, whose credit is gone
+     */
+    if (rqst->rq_connect_cookie == xprt->connect_cookie &&
+        !test_and_clear_bit(KFI_REQ_F_RESEND, &req->flags))
+        goto drop_connection;
+
+    /* The queue comes first: chunks are registered on its device */
+    if (kx->rails) {
+        rail = kfi_rail_pick(kx->rails, kfi_xprt_buf_node(rqst));
+        if (IS_ERR(rail))
+            goto drop_connection;
+    }
+    if (kx->lanes)
+        lane = kfi_lane_select(kx->lanes, rqst) - kx->lanes->lanes;
+    q = kfi_xprt_pick_queue(kx, rail, lane);
+    req->q = q;
+    req->cost = rqst->rq_snd_buf.len + rqst->rq_rcv_buf.page_len;
+
+    rc = kfi_rpcrdma_marshal(kx, req, req->iov, &req->niov);
+    if (rc < 0) {
+        kx->stats.failed_marshal_count++;
+        return rc == -ENOBUFS || rc == -ENOMEM ? -ENOBUFS : rc;
+    }
+
+    atomic_set(&req->refs, 2);
+    set_bit(KFI_REQ_F_REPLY_PENDING, &req->flags);
+    set_bit(KFI_REQ_F_SEND_PENDING, &req->flags);
+    set_bit(KFI_REQ_F_INFLIGHT, &req->flags);
+    atomic_inc(&q->inflight);
+    if (q->rail)
+        kfi_rail_charge(q->rail, req->cost);
+
+    if (kfi_xprt_coalesce(kx, req)) {
+        rqst->rq_xmit_bytes_sent += rqst->rq_snd_buf.len;
+        return 0;
+    }
+
+    /* Accepted: the Send goes when the device's scheduler lets it */
+    if (q->flow) {
+        req->sched.cost = req->cost;
+        req->sched.submit = kfi_xprt_sched_send;
+        req->sched_dev = q->flow->sched;
+        set_bit(KFI_REQ_F_QUEUED, &req->flags);
+        kfi_sched_submit(q->flow, &req->sched);
+        rqst->rq_xmit_bytes_sent += rqst->rq_snd_buf.len;
+        return 0;
+    }
+
+    rc = kfi_xprt_post_send(q, &req->send_cqe, req->iov, req->niov);
+    if (rc) {
+        clear_bit(KFI_REQ_F_SEND_PENDING, &req->flags);
+        clear_bit(KFI_REQ_F_REPLY_PENDING, &req->flags);
+        kfi_xprt_retire(req);
+        kfi_rpcrdma_unmap(req);
+        if (rc == -EAGAIN) {
+            kfi_xprt_kick(q);
+            return -ENOBUFS;
+        }
+        goto drop_connection;
+    }
+
+    rqst->rq_xmit_bytes_sent += rqst->rq_snd_buf.len;
+    kfi_xprt_kick(q);
+    return 0;
+
+drop_connection:
+    kfi_xprt_close(xprt);
+    return -ENOTCONN;
+}
+
+static bool kfi_xprt_wait_done(void *arg)
+{
+    struct rpc_task *task = arg;
+    struct kfi_xprt *kx = kfi_xprt(task->tk_rqstp->rq_xprt);
+
+    return !test_bit(RPC_TASK_NEED_RECV, &task->tk_runstate) ||
+           test_bit(KFI_XPRT_F_CLOSING, &kx->flags);
+}
+
+/*
+ * A synchronous RPC reaps its queue's CQs for the busy_poll budget
+ * before it sleeps: a small metadata reply is then handled in the
+ * waiting task rather than by the poll worker and a wakeup. Async RPCs
+ * never poll, as they would hold up rpciod.
+ *
+ * SUNRPC calls this with queue_lock held, and the reply handler takes
+ * that lock, so it is dropped while polling. Whether the reply arrived
+ * is checked again under the lock, as SUNRPC does before it sleeps.
+ * Disconnect waits for pollers, so the queue's endpoint stays ours.
+ */
+static void kfi_xprt_wait_for_reply(struct rpc_task *task)
+    __must_hold(&task->tk_rqstp->rq_xprt->queue_lock)
+{
+    struct rpc_xprt *xprt = task->tk_rqstp->rq_xprt;
+    struct kfi_xprt *kx = kfi_xprt(xprt);
+    struct kfi_xprt_queue *q = kfi_req(task->tk_rqstp)->q;
+    struct kfi_qp *kqp;
+
+    if (RPC_IS_ASYNC(task) || !q)
+        goto sleep;
+
+    atomic_inc(&kx->busy_pollers);
+    smp_mb__after_atomic();
+    kqp = READ_ONCE(q->kqp);
+    if (!kqp || !kqp->busy_poll_usec ||
+        test_bit(KFI_XPRT_F_CLOSING, &kx->flags)) {
+        if (atomic_dec_and_test(&kx->busy_pollers))
+            wake_up_var(&kx->busy_pollers);
+        goto sleep;
+    }
+
+    spin_unlock(&xprt->queue_lock);
+    kfi_qp_busy_poll(&kqp->qp, kfi_xprt_wait_done, task);
+    if (atomic_dec_and_test(&kx->busy_pollers))
+        wake_up_var(&kx->busy_pollers);
+    spin_lock(&xprt->queue_lock);
+
+    if (!test_bit(RPC_TASK_NEED_RECV, &task->tk_runstate))
+        return;
+sleep:
+    xprt_wait_for_reply_request_def(task);
+}
+
+static void kfi_xprt_print_stats(struct rpc_xprt *xprt, struct seq_file *seq)
+{
+    struct kfi_xprt *kx = kfi_xprt(xprt);
+    long idle_time = 0;
+
+    if (xprt_connected(xprt))
+        idle_time = (long)(jiffies - xprt->last_used) / HZ;
+
+    /* Same layout as xprtrdma, so mountstats parses it unchanged */
+    seq_puts(seq, "\txprt:\trdma ");
+    seq_printf(seq, "%u %lu %lu %lu %ld %lu %lu %lu %llu %llu ",
+               0,   /* no local port */
+               xprt->stat.bind_count,
+               xprt->stat.connect_count,
+               xprt->stat.connect_time / HZ,
+               idle_time,
+               xprt->stat.sends,
+               xprt->stat.recvs,
+               xprt->stat.bad_xids,
+               xprt->stat.req_u,
+               xprt->stat.bklog_u);
+    seq_printf(seq, "%lu %lu %lu %llu %llu %llu %llu %lu %lu %lu %lu ",
+               kx->stats.read_chunk_count,
+               kx->stats.write_chunk_count,
+               kx->stats.reply_chunk_count,
+               kx->stats.total_rdma_request,
+               kx->stats.total_rdma_reply,
+               kx->stats.pullup_copy_count,
+               kx->stats.fixup_copy_count,
+               kx->stats.hardway_register_count,
+               kx->stats.failed_marshal_count,
+               kx->stats.bad_reply_count,
+               kx->stats.nomsg_call_count);
+    seq_printf(seq, "%lu %lu %lu %lu %lu %lu\n",
+               0UL, 0UL,    /* MRs are not recycled or orphaned */
+               kx->stats.mrs_allocated,
+               0UL, 0UL,    /* no invalidation, no send contexts */
+               kx->stats.reply_waits_for_send);
+}
+
+/*
+ * What mountstats has no room for: its parsers read every word after a
+ * line's tag as a number, so this lives in debugfs, in kfi_xprt/<n>.
+ */
+static int kfi_xprt_state_show(struct seq_file *seq, void *v)
+{
+    struct kfi_xprt *kx = seq->private;
+    int i;
+
+    seq_printf(seq, "server %s\n",
+               kx->xprt.address_strings[RPC_DISPLAY_ADDR]);
+
+    for (i = 0; kx->rails && i < kx->rails->nr_rails; i++) {
+        struct kfi_rail *rail = &kx->rails->rails[i];
+
+        seq_printf(seq, "rail %d node %d ops %lld bytes %lld inflight %lld errors %lld%s\n",
+                   i, rail->numa_node, atomic64_read(&rail->ops),
+                   atomic64_read(&rail->bytes),
+                   atomic64_read(&rail->outstanding_bytes),
+                   atomic64_read(&rail->errors),
+                   test_bit(KFI_RAIL_F_FAILED, &rail->flags) ? " failed" : "");
+    }
+
+    for (i = 0; kx->lanes && i < kx->lanes->nr_lanes; i++) {
+        struct kfi_lane *lane = &kx->lanes->lanes[i];
+
+        seq_printf(seq, "lane %d tc %u ops %lld bytes %lld\n",
+                   i, lane->traffic_class, atomic64_read(&lane->ops),
+                   atomic64_read(&lane->bytes));
+    }
+
+    spin_lock(&kx->cwnd_lock);
+    seq_printf(seq, "tune ddp_min %u rsize %u wsize %u segs %u\n",
+               kx->tune.ddp_min, kx->tune.rsize, kx->tune.wsize,
+               kx->tune.segs >> KFI_CWND_SRTT_SHIFT);
+    spin_unlock(&kx->cwnd_lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kfi_xprt_state);
+
+/* Swap over NFS would need reserves this transport does not keep */
+static int kfi_xprt_enable_swap(struct rpc_xprt *xprt)
+{
+    return -EINVAL;
+}
+
+static void kfi_xprt_disable_swap(struct rpc_xprt *xprt)
+{
+}
+
+static void kfi_xprt_free_buffers(struct kfi_xprt *kx)
+{
+    int i, j;
+
+    if (kx->reqs) {
+        for (i = 0; i < kx->max_requests; i++) {
+            struct kfi_req *req = &kx->reqs[i];
+
+            kfi_rpcrdma_unmap(req);
+            kfree(req->rchunk.segs);
+            kfree(req->hdr);
+            kfree(req->sendbuf);
+            kfree(req->recvbuf);
+        }
+        kfree(kx->reqs);
+    }
+
+    for (i = 0; kx->queues && i < kx->nr_queues; i++) {
+        struct kfi_xprt_queue *q = &kx->queues[i];
+
+        for (j = 0; q->reps && j < kx->nr_reps; j++)
+            kfree(q->reps[j].buf);
+        kfree(q->reps);
+    }
+    kfree(kx->queues);
+
+    if (kx->multi) {
+        for (i = 0; i < KFI_XPRT_MULTI_BUFS; i++)
+            kfree(kx->multi[i].buf);
+        kfree(kx->multi);
+    }
+
+    kfi_rail_set_destroy(kx->rails);
+    kfi_lane_set_destroy(kx->lanes);
+
+#if defined(CONFIG_SUNRPC_BACKCHANNEL)
+    kfi_xprt_bc_free(kx);
+#endif
+}
+
+static int kfi_xprt_alloc_buffers(struct kfi_xprt *kx)
+{
+    int i, j;
+
+    kx->reqs = kcalloc(kx->max_requests, sizeof(*kx->reqs), GFP_KERNEL);
+    if (!kx->reqs)
+        return -ENOMEM;
+
+    for (i = 0; i < kx->max_requests; i++) {
+        struct kfi_req *req = &kx->reqs[i];
+
+        req->kx = kx;
+        req->send_cqe.done = kfi_xprt_send_done;
+    }
+
+    kx->queues = kcalloc_node(kx->nr_queues, sizeof(*kx->queues),
+                              GFP_KERNEL, kx->node);
+    if (!kx->queues)
+        return -ENOMEM;
+
+    kx->nr_reps = kx->queue_credits + KFI_XPRT_EXTRA_RECVS + KFI_XPRT_BC_SLOTS;
+    for (i = 0; i < kx->nr_queues; i++) {
+        struct kfi_xprt_queue *q = &kx->queues[i];
+
+        q->kx = kx;
+        q->cpu = cpumask_local_spread(i, kx->node);
+        atomic_set(&q->inflight, 0);
+        atomic_set(&q->sends_pending, 0);
+        spin_lock_init(&q->recv_lock);
+        INIT_WORK(&q->poll_work, kfi_xprt_poll_worker);
+        q->connprop_cqe.done = kfi_xprt_connprop_done;
+
+        q->reps = kcalloc_node(kx->nr_reps, sizeof(*q->reps), GFP_KERNEL,
+                               kx->node);
+        if (!q->reps)
+            return -ENOMEM;
+
+        for (j = 0; j < kx->nr_reps; j++) {
+            struct kfi_rep *rep = &q->reps[j];
+
+            rep->kx = kx;
+            rep->q = q;
+            rep->cqe.done = kfi_xprt_recv_done;
+        }
+    }
+
+    /* Envelopes are a Version Two extension, on a single queue */
+    if (max_version < KFI_RPCRDMA_V2 || send_coalesce < 2 ||
+        kx->nr_queues > 1)
+        return 0;
+
+    kx->multi = kcalloc(KFI_XPRT_MULTI_BUFS, sizeof(*kx->multi), GFP_KERNEL);
+    if (!kx->multi)
+        return -ENOMEM;
+
+    for (i = 0; i < KFI_XPRT_MULTI_BUFS; i++) {
+        struct kfi_multi *m = &kx->multi[i];
+
+        m->kx = kx;
+        m->cqe.done = kfi_xprt_multi_done;
+        m->buf = kmalloc_node(kx->max_wsize, GFP_KERNEL, kx->node);
+        if (!m->buf)
+            return -ENOMEM;
+        list_add_tail(&m->free, &kx->free_multi);
+    }
+
+    return 0;
+}
+
+static void kfi_xprt_format_addresses(struct rpc_xprt *xprt)
+{
+    struct sockaddr *sap = (struct sockaddr *)&xprt->addr;
+    char buf[128];
+
+    switch (sap->sa_family) {
+    case AF_INET: {
+        struct sockaddr_in *sin = (struct sockaddr_in *)sap;
+
+        snprintf(buf, sizeof(buf), "%08x", ntohl(sin->sin_addr.s_addr));
+        xprt->address_strings[RPC_DISPLAY_NETID] = RPCBIND_NETID_RDMA;
+        break;
+    }
+    case AF_INET6: {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sap;
+
+        snprintf(buf, sizeof(buf), "%pi6", &sin6->sin6_addr);
+        xprt->address_strings[RPC_DISPLAY_NETID] = RPCBIND_NETID_RDMA6;
+        break;
+    }
+    default:
+        buf[0] = '\0';
+        break;
+    }
+    xprt->address_strings[RPC_DISPLAY_HEX_ADDR] = kstrdup(buf, GFP_KERNEL);
+
+    rpc_ntop(sap, buf, sizeof(buf));
+    xprt->address_strings[RPC_DISPLAY_ADDR] = kstrdup(buf, GFP_KERNEL);
+
+    snprintf(buf, sizeof(buf), "%u", rpc_get_port(sap));
+    xprt->address_strings[RPC_DISPLAY_PORT] = kstrdup(buf, GFP_KERNEL);
+
+    snprintf(buf, sizeof(buf), "%4hx", rpc_get_port(sap));
+    xprt->address_strings[RPC_DISPLAY_HEX_PORT] = kstrdup(buf, GFP_KERNEL);
+
+    xprt->address_strings[RPC_DISPLAY_PROTO] = "rdma";
+}
+
+static void kfi_xprt_free_addresses(struct rpc_xprt *xprt)
+{
+    int i;
+
+    for (i = 0; i < RPC_DISPLAY_MAX; i++) {
+        if (i == RPC_DISPLAY_PROTO || i == RPC_DISPLAY_NETID)
+            continue;
+        kfree(xprt->address_strings[i]);
+    }
+}
+
+static void kfi_xprt_destroy(struct rpc_xprt *xprt)
+{
+    struct kfi_xprt *kx = kfi_xprt(xprt);
+
+    debugfs_remove(kx->debugfs);
+    cancel_delayed_work_sync(&kx->connect_worker);
+    kfi_xprt_disconnect(kx);
+    cancel_work_sync(&kx->rail_work);
+    kfi_xprt_free_buffers(kx);
+    kfi_xprt_free_addresses(xprt);
+    xprt_free(xprt);
+    module_put(THIS_MODULE);
+}
+
+static const struct rpc_xprt_ops kfi_xprt_ops = {
+    .reserve_xprt           = xprt_reserve_xprt_cong,
+    .release_xprt           = xprt_release_xprt_cong,
+    .alloc_slot             = kfi_xprt_alloc_slot,
+    .free_slot              = kfi_xprt_free_slot,
+    .release_request        = xprt_release_rqst_cong,
+    .rpcbind                = rpcb_getport_async,
+    .set_port               = kfi_xprt_set_port,
+    .connect                = kfi_xprt_connect,
+    .buf_alloc              = kfi_xprt_buf_alloc,
+    .buf_free               = kfi_xprt_buf_free,
+    .send_request           = kfi_xprt_send_request,
+    .wait_for_reply_request = kfi_xprt_wait_for_reply,
+    .timer                  = kfi_xprt_timer,
+    .close                  = kfi_xprt_close,
+    .destroy                = kfi_xprt_destroy,
+    .print_stats            = kfi_xprt_print_stats,
+    .enable_swap            = kfi_xprt_enable_swap,
+    .disable_swap           = kfi_xprt_disable_swap,
+    .inject_disconnect      = kfi_xprt_inject_disconnect,
+#if defined(CONFIG_SUNRPC_BACKCHANNEL)
+    .bc_setup               = kfi_xprt_bc_setup,
+    .bc_maxpayload          = kfi_xprt_bc_maxpayload,
+    .bc_num_slots           = kfi_xprt_bc_num_slots,
+    .bc_free_rqst           = kfi_xprt_bc_free_rqst,
+    .bc_destroy             = kfi_xprt_bc_destroy,
+#endif
+};
+
 static struct rpc_xprt *xs_setup_rdma_kfi(struct xprt_create *args)
 {
-    pr_err("xs_setup_rdma_kfi: not yet implemented\n");
-    return ERR_PTR(-ENOSYS);
+    struct rpc_xprt *xprt;
+    struct kfi_device *kdev = NULL;
+    struct kfi_xprt *kx;
+    unsigned int slots, rails = 1, lanes = 1;
+    char name[24];
+    u64 id;
+    int ret;
+
+    if (args->addrlen > sizeof(xprt->addr))
+        return ERR_PTR(-EBADF);
+
+    if (!try_module_get(THIS_MODULE))
+        return ERR_PTR(-EIO);
+
+    slots = clamp_t(unsigned int, slot_table_entries, 2, KFI_XPRT_MAX_SLOTS);
+    xprt = xprt_alloc(args->net, sizeof(*kx), 0, slots);
+    if (!xprt) {
+        module_put(THIS_MODULE);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    xprt->timeout = &kfi_xprt_default_timeout;
+    xprt->connect_timeout = xprt->timeout->to_initval;
+    xprt->max_reconnect_timeout = KFI_XPRT_MAX_REEST_TO;
+    xprt->bind_timeout = KFI_XPRT_BIND_TO;
+    xprt->reestablish_timeout = KFI_XPRT_INIT_REEST_TO;
+    xprt->idle_timeout = (unsigned long)READ_ONCE(idle_timeout) * HZ;
+
+    xprt->resvport = 0;
+    xprt->prot = IPPROTO_TCP;
+    xprt->xprt_class = &xprt_rdma_kfi;
+    xprt->addrlen = args->addrlen;
+    memcpy(&xprt->addr, args->dstaddr, xprt->addrlen);
+    if (rpc_get_port((struct sockaddr *)&xprt->addr))
+        xprt_set_bound(xprt);
+    kfi_xprt_format_addresses(xprt);
+
+    xprt->ops = &kfi_xprt_ops;
+    xprt->max_payload = KFI_XPRT_MAX_SEGS << PAGE_SHIFT;
+
+    kx = kfi_xprt(xprt);
+    kx->max_requests = slots;
+    id = atomic64_inc_return(&kfi_xprt_ids);
+    kx->sched_key = kfi_sched_flow_key(id);
+
+    /*
+     * A queue per CPU up to the cap, and at least one per rail and lane,
+     * each worth at least two credits
+     */
+    if (mount_options) {
+        kfi_parse_rails_from_options(mount_options, &rails);
+        kfi_parse_lanes_from_options(mount_options, &lanes);
+    }
+    kx->nr_queues = min_t(unsigned int, max_queues, num_online_cpus());
+    kx->nr_queues = max_t(unsigned int, kx->nr_queues, rails * lanes);
+    kx->nr_queues = clamp_t(unsigned int, kx->nr_queues, 1,
+                            min_t(unsigned int, KFI_XPRT_MAX_QUEUES,
+                                  slots / 2));
+    kx->queue_credits = DIV_ROUND_UP(slots, kx->nr_queues);
+    kx->nr_rails = min_t(unsigned int, rails, kx->nr_queues);
+    if (kx->nr_queues < kx->nr_rails * lanes)
+        lanes = 1;
+
+    /* Slot buffers are allocated near the NIC the connection will use */
+    kx->node = NUMA_NO_NODE;
+    if (kfi_xprt_pick_devices(&kdev, 1)) {
+        kx->node = kdev->numa_node;
+        kfi_device_put(kdev);
+    }
+    kx->vers = RPCRDMA_VERSION;
+    kx->v1_wsize = clamp_t(u32, inline_write_size, KFI_XPRT_INLINE_MIN,
+                           PAGE_SIZE * 4);
+    kx->v1_rsize = clamp_t(u32, inline_read_size, KFI_XPRT_INLINE_MIN,
+                           PAGE_SIZE * 4);
+    kx->inline_wsize = kx->v1_wsize;
+    kx->inline_rsize = kx->v1_rsize;
+
+    /* Buffers sized for the Version Two offer serve Version One too */
+    kx->max_wsize = kx->v1_wsize;
+    kx->max_rsize = kx->v1_rsize;
+    if (max_version >= KFI_RPCRDMA_V2) {
+        u32 v2 = clamp_t(u32, inline_v2_size, KFI_XPRT_INLINE_SIZE,
+                         KFI_XPRT_INLINE_V2_MAX);
+
+        kx->max_wsize = max(kx->max_wsize, v2);
+        kx->max_rsize = max(kx->max_rsize, v2);
+    }
+    kfi_tune_init(&kx->tune, ddp_min_read, autotune);
+    init_completion(&kx->negotiated);
+    spin_lock_init(&kx->cwnd_lock);
+    spin_lock_init(&kx->coal_lock);
+    INIT_LIST_HEAD(&kx->free_multi);
+    atomic_set(&kx->busy_pollers, 0);
+    INIT_DELAYED_WORK(&kx->connect_worker, kfi_xprt_connect_worker);
+    INIT_WORK(&kx->rail_work, kfi_xprt_rail_requeue);
+
+    ret = kfi_xprt_alloc_buffers(kx);
+    if (!ret && kx->nr_rails > 1) {
+        kx->rails = kfi_rail_set_alloc();
+        if (IS_ERR(kx->rails)) {
+            ret = PTR_ERR(kx->rails);
+            kx->rails = NULL;
+        }
+    }
+    if (!ret && lanes > 1) {
+        kx->lanes = kfi_lane_set_alloc(lanes);
+        if (IS_ERR(kx->lanes)) {
+            ret = PTR_ERR(kx->lanes);
+            kx->lanes = NULL;
+        }
+    }
+    if (ret) {
+        kfi_xprt_free_buffers(kx);
+        kfi_xprt_free_addresses(xprt);
+        xprt_free(xprt);
+        module_put(THIS_MODULE);
+        return ERR_PTR(ret);
+    }
+
+    snprintf(name, sizeof(name), "%llu", id);
+    kx->debugfs = debugfs_create_file(name, 0444, kfi_xprt_debugfs, kx,
+                                      &kfi_xprt_state_fops);
+
+    pr_debug("kfi: xprt to %s: %u slots on %d queues over %d rails and %u lanes, buffers %u/%u\n",
+             xprt->address_strings[RPC_DISPLAY_ADDR], slots, kx->nr_queues,
+             kx->nr_rails, lanes, kx->max_wsize, kx->max_rsize);
+    return xprt;
 }
 
+/*
+ * ============================================================================
+ * MODULE INIT/EXIT
+ * ============================================================================
+ */
+
 /* Forward declarations */
 extern int kfi_verbs_compat_init(void);
 extern void kfi_verbs_compat_exit(void);
@@ -40,10 +1922,34 @@ static int __init xprt_rdma_kfi_init(void)
         return rc;
     }
 
+    /* Connect workers; may run on behalf of reclaim */
+    kfi_xprt_wq = alloc_workqueue("kfi_xprt",
+                                  WQ_UNBOUND | WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
+    if (!kfi_xprt_wq) {
+        kfi_verbs_compat_exit();
+        return -ENOMEM;
+    }
+
+    /* CQ pollers, pinned to their queue's CPU: not WQ_UNBOUND */
+    kfi_xprt_poll_wq = alloc_workqueue("kfi_xprt_poll",
+                                       WQ_MEM_RECLAIM | WQ_HIGHPRI |
+                                       WQ_CPU_INTENSIVE, 0);
+    if (!kfi_xprt_poll_wq) {
+        destroy_workqueue(kfi_xprt_wq);
+        kfi_verbs_compat_exit();
+        return -ENOMEM;
+    }
+
+    /* Per-transport state beyond mountstats; optional */
+    kfi_xprt_debugfs = debugfs_create_dir("kfi_xprt", NULL);
+
     /* Register with SUNRPC */
     rc = xprt_register_transport(&xprt_rdma_kfi);
     if (rc) {
         pr_err("xprt_register_transport failed: %d\n", rc);
+        debugfs_remove(kfi_xprt_debugfs);
+        destroy_workqueue(kfi_xprt_poll_wq);
+        destroy_workqueue(kfi_xprt_wq);
         kfi_verbs_compat_exit();
         return rc;
     }
@@ -55,6 +1961,9 @@ static int __init xprt_rdma_kfi_init(void)
 static void __exit xprt_rdma_kfi_exit(void)
 {
     xprt_unregister_transport(&xprt_rdma_kfi);
+    debugfs_remove(kfi_xprt_debugfs);
+    destroy_workqueue(kfi_xprt_poll_wq);
+    destroy_workqueue(kfi_xprt_wq);
     kfi_verbs_compat_exit();
     pr_info("NFS RDMA kfabric transport unloaded\n");
 }
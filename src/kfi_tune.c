@@ -0,0 +1,215 @@
+/*
+ * kfi_tune.c - Transfer sizes tuned from measured round trips
+ *
+ * What pays off on one fabric does not on the next: whether a small READ
+ * is cheaper copied out of a receive buffer or placed through a Write
+ * chunk depends on the registration cost, the server and the NIC, and
+ * so does the transfer size beyond which a larger rsize buys nothing.
+ * Each client transport therefore measures, per power-of-two size class
+ * of page payload:
+ *
+ *   - the round trip of READs answered inline and of READs placed
+ *     through a Write chunk, and moves the threshold between the two
+ *     (ddp_min) to where placement starts to win. Now and then a READ
+ *     goes the other way, so both estimates stay current;
+ *
+ *   - the bandwidth a single READ or WRITE achieves, from which the
+ *     smallest size reaching most of the best measured bandwidth is
+ *     reported as the preferred rsize and wsize;
+ *
+ *   - the segments each chunk takes, since every discontiguous range is
+ *     a registration of its own.
+ *
+ * Like the congestion window, these are plain computations on
+ * caller-owned state; the caller serializes updates.
+ */
+
+#include <linux/module.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+/* Size class of a payload: 1 KiB and below, ..., 1 MiB and above */
+static int kfi_tune_class(u32 len)
+{
+    int c = len ? ilog2(len) - KFI_TUNE_MIN_SHIFT : 0;
+
+    return clamp(c, 0, KFI_TUNE_CLASSES - 1);
+}
+
+/* Smallest payload of size class @c */
+static u32 kfi_tune_class_size(int c)
+{
+    return 1U << (KFI_TUNE_MIN_SHIFT + c);
+}
+
+/* Smoothed like srtt: 1/8 of each sample, kept scaled by 8 */
+static void kfi_tune_smooth(u32 *avg, u32 sample)
+{
+    if (!*avg)
+        *avg = sample << KFI_CWND_SRTT_SHIFT;
+    else
+        *avg = *avg - (*avg >> KFI_CWND_SRTT_SHIFT) + sample;
+}
+
+/*
+ * Placement starts at the lowest class from which it wins in every
+ * class measured both ways. Inline must win clearly, by an eighth, to
+ * move the threshold up: placement is what the server prefers for bulk
+ * data, and it is the default.
+ */
+static void kfi_tune_update_ddp(struct kfi_tune *t)
+{
+    bool measured = false;
+    u32 thr = 0;
+    int c;
+
+    for (c = KFI_TUNE_CLASSES - 1; c >= 0; c--) {
+        const struct kfi_tune_class *tc = &t->classes[c];
+
+        if (tc->nr_inline < KFI_TUNE_MIN_SAMPLES ||
+            tc->nr_ddp < KFI_TUNE_MIN_SAMPLES)
+            continue;
+
+        if (tc->ddp_us > tc->inline_us + tc->inline_us / 8) {
+            if (!measured)
+                thr = kfi_tune_class_size(c + 1);
+            measured = true;
+            break;
+        }
+        thr = kfi_tune_class_size(c);
+        measured = true;
+    }
+
+    if (measured)
+        WRITE_ONCE(t->ddp_min, thr);
+}
+
+/* Smallest class reaching KFI_TUNE_KNEE_PCT of the best bandwidth */
+static u32 kfi_tune_knee(const struct kfi_tune *t, bool read)
+{
+    u32 bw, best = 0;
+    int c;
+
+    for (c = 0; c < KFI_TUNE_CLASSES; c++) {
+        const struct kfi_tune_class *tc = &t->classes[c];
+
+        if ((read ? tc->nr_read : tc->nr_write) >= KFI_TUNE_MIN_SAMPLES)
+            best = max(best, read ? tc->read_bw : tc->write_bw);
+    }
+    if (!best)
+        return 0;
+
+    for (c = 0; c < KFI_TUNE_CLASSES; c++) {
+        const struct kfi_tune_class *tc = &t->classes[c];
+
+        if ((read ? tc->nr_read : tc->nr_write) < KFI_TUNE_MIN_SAMPLES)
+            continue;
+        bw = read ? tc->read_bw : tc->write_bw;
+        if ((u64)bw * 100 >= (u64)best * KFI_TUNE_KNEE_PCT)
+            return kfi_tune_class_size(c);
+    }
+    return 0;
+}
+
+static void kfi_tune_segs(struct kfi_tune *t, u32 segs)
+{
+    if (segs)
+        kfi_tune_smooth(&t->segs, segs);
+}
+
+/**
+ * kfi_tune_init - Start tuning from the configured threshold
+ * @t: Tuning state
+ * @ddp_min: Configured smallest READ payload placed through a Write chunk
+ * @enabled: Move the threshold; otherwise only measure and report
+ */
+void kfi_tune_init(struct kfi_tune *t, u32 ddp_min, bool enabled)
+{
+    memset(t, 0, sizeof(*t));
+    t->ddp_min = ddp_min;
+    t->enabled = enabled;
+}
+EXPORT_SYMBOL(kfi_tune_init);
+
+/**
+ * kfi_tune_ddp_min - Threshold for the next READ
+ * @t: Tuning state
+ *
+ * Every KFI_TUNE_PROBE-th READ is steered the other way around the
+ * current threshold. The count is not serialized; a lost increment only
+ * delays the next probe.
+ *
+ * Returns: the threshold to pass to kfi_rpcrdma_reply_type()
+ */
+u32 kfi_tune_ddp_min(struct kfi_tune *t)
+{
+    u32 ddp_min = READ_ONCE(t->ddp_min);
+    u32 probe;
+
+    if (!t->enabled)
+        return ddp_min;
+
+    probe = READ_ONCE(t->probe) + 1;
+    WRITE_ONCE(t->probe, probe);
+    if (probe % KFI_TUNE_PROBE)
+        return ddp_min;
+
+    /* Alternate: a placed READ below the threshold, an inline one above */
+    return probe / KFI_TUNE_PROBE % 2 ? 0 : U32_MAX;
+}
+EXPORT_SYMBOL(kfi_tune_ddp_min);
+
+/**
+ * kfi_tune_read - Account one completed READ
+ * @t: Tuning state
+ * @len: Page payload requested
+ * @ddp: Payload was placed through a Write chunk
+ * @rtt_us: Time from transmission to the reply
+ * @segs: Segments of the Write chunk (0 if inline)
+ */
+void kfi_tune_read(struct kfi_tune *t, u32 len, bool ddp, u32 rtt_us,
+                   u32 segs)
+{
+    struct kfi_tune_class *tc = &t->classes[kfi_tune_class(len)];
+
+    rtt_us = max(rtt_us, 1U);
+    if (ddp) {
+        kfi_tune_smooth(&tc->ddp_us, rtt_us);
+        tc->nr_ddp = min(tc->nr_ddp + 1, U32_MAX - 1);
+    } else {
+        kfi_tune_smooth(&tc->inline_us, rtt_us);
+        tc->nr_inline = min(tc->nr_inline + 1, U32_MAX - 1);
+    }
+
+    kfi_tune_smooth(&tc->read_bw, max(len / rtt_us, 1U));
+    tc->nr_read = min(tc->nr_read + 1, U32_MAX - 1);
+    kfi_tune_segs(t, segs);
+
+    if (t->enabled)
+        kfi_tune_update_ddp(t);
+    t->rsize = kfi_tune_knee(t, true);
+}
+EXPORT_SYMBOL(kfi_tune_read);
+
+/**
+ * kfi_tune_write - Account one completed WRITE
+ * @t: Tuning state
+ * @len: Page payload sent
+ * @rtt_us: Time from transmission to the reply
+ * @segs: Segments of the Read chunk (0 if inline)
+ */
+void kfi_tune_write(struct kfi_tune *t, u32 len, u32 rtt_us, u32 segs)
+{
+    struct kfi_tune_class *tc = &t->classes[kfi_tune_class(len)];
+
+    rtt_us = max(rtt_us, 1U);
+    kfi_tune_smooth(&tc->write_bw, max(len / rtt_us, 1U));
+    tc->nr_write = min(tc->nr_write + 1, U32_MAX - 1);
+    kfi_tune_segs(t, segs);
+
+    t->wsize = kfi_tune_knee(t, false);
+}
+EXPORT_SYMBOL(kfi_tune_write);
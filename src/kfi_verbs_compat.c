@@ -8,8 +8,14 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/list.h>
-#include <linux/idr.h>
+#include <linux/xarray.h>
+#include <linux/workqueue.h>
+#include <linux/wait_bit.h>
+#include <linux/netdevice.h>
+#include <linux/numa.h>
+#include <net/net_namespace.h>
 #include <rdma/ib_verbs.h>
+#include <rdma/ib_addr.h>
 #include <rdma/kfi/fabric.h>
 #include <rdma/kfi/domain.h>
 #include <rdma/kfi/endpoint.h>
@@ -17,11 +23,31 @@
 #include "kfi_verbs_compat.h"
 #include "kfi_internal.h"
 
-/* Global state */
+/* Global state - kfi_device_mutex protects the device list only */
 static LIST_HEAD(kfi_device_list);
 static DEFINE_MUTEX(kfi_device_mutex);
-static struct idr qp_idr;
-static DEFINE_SPINLOCK(qp_idr_lock);
+/* Bumped under kfi_device_mutex whenever a device finishes opening */
+static unsigned int kfi_device_gen;
+
+static void kfi_qp_enable_worker(struct work_struct *work);
+
+static int sep_mode = KFI_SEP_OFF;
+module_param(sep_mode, int, 0444);
+MODULE_PARM_DESC(sep_mode,
+                 "Scalable endpoints: 0=off, 1=tx context per CPU, 2=per NUMA node");
+
+static int sep_rx_contexts = 4;
+module_param(sep_rx_contexts, int, 0444);
+MODULE_PARM_DESC(sep_rx_contexts,
+                 "Receive contexts per scalable endpoint (must match peers)");
+
+static int nic_numa_node[KFI_MAX_DEVICES] = {
+    [0 ... KFI_MAX_DEVICES - 1] = NUMA_NO_NODE
+};
+static int nr_nic_numa_node;
+module_param_array(nic_numa_node, int, &nr_nic_numa_node, 0444);
+MODULE_PARM_DESC(nic_numa_node,
+                 "NUMA node of each CXI NIC, in enumeration order (default: from the NIC's PCI device)");
 
 /*
  * ============================================================================
@@ -29,6 +55,225 @@ static DEFINE_SPINLOCK(qp_idr_lock);
  * ============================================================================
  */
 
+/*
+ * NUMA node of a NIC: nic_numa_node= if given, otherwise the node of the
+ * PCI function behind the NIC's Ethernet interface (cxiN drives hsnN).
+ */
+static int kfi_device_numa_node(struct kfi_info *info, int index)
+{
+    const char *name = info->domain_attr && info->domain_attr->name ?
+                       info->domain_attr->name : info->fabric_attr->name;
+    struct net_device *ndev;
+    char ifname[IFNAMSIZ];
+    unsigned int unit;
+    int node = NUMA_NO_NODE;
+
+    if (index < nr_nic_numa_node && nic_numa_node[index] != NUMA_NO_NODE)
+        return nic_numa_node[index];
+
+    if (!name || sscanf(name, "cxi%u", &unit) != 1)
+        return NUMA_NO_NODE;
+    snprintf(ifname, sizeof(ifname), "hsn%u", unit);
+
+    ndev = dev_get_by_name(&init_net, ifname);
+    if (!ndev)
+        return NUMA_NO_NODE;
+    if (ndev->dev.parent)
+        node = dev_to_node(ndev->dev.parent);
+    dev_put(ndev);
+    return node;
+}
+
+/**
+ * kfi_device_setup - Bring up fabric, domain, AV and endpoint pool
+ * @kdev: Placeholder already on kfi_device_list with @opening set
+ * @info: Provider entry from kfi_getinfo()
+ * @index: Position of @info in the provider's list
+ *
+ * Called without kfi_device_mutex held: opening a CXI domain is slow and
+ * must not hold up lookups of devices that are already up. On failure
+ * everything but @kdev itself is released.
+ */
+static int kfi_device_setup(struct kfi_device *kdev, struct kfi_info *info,
+                            int index)
+{
+    int ret;
+
+    kdev->info = kfi_dupinfo(info);
+    if (!kdev->info)
+        return -ENOMEM;
+    refcount_set(&kdev->ref, 1);
+    xa_init_flags(&kdev->qps, XA_FLAGS_ALLOC1);
+
+    /* Before the pool fills: its endpoints and buffers are placed by it */
+    kdev->numa_node = kfi_device_numa_node(info, index);
+    pr_info("kfi: %s is on NUMA node %d\n", kdev->name, kdev->numa_node);
+
+    /* Fixed per device: the AV layout depends on it */
+    if (sep_mode == KFI_SEP_PER_CPU || sep_mode == KFI_SEP_PER_NODE) {
+        kdev->sep_mode = sep_mode;
+        kdev->sep_rx = clamp(sep_rx_contexts, 1, KFI_SEP_MAX_RX_CTX);
+    }
+
+    kfi_auth_key_cache_init(kdev);
+
+    /* Open fabric and domain */
+    ret = kfi_fabric(info->fabric_attr, &kdev->fabric, NULL);
+    if (ret) {
+        pr_err("kfi_fabric failed for %s: %d\n", kdev->name, ret);
+        goto err_free;
+    }
+
+    ret = kfi_domain(kdev->fabric, info, &kdev->domain, NULL);
+    if (ret) {
+        pr_err("kfi_domain failed for %s: %d\n", kdev->name, ret);
+        goto err_fabric;
+    }
+
+    /* One AV per domain, shared by every endpoint on the device */
+    kdev->av_cache = kfi_av_cache_create(kdev->domain, 0,
+                                         kdev->sep_mode ? KFI_SEP_RX_CTX_BITS : 0);
+    if (IS_ERR(kdev->av_cache)) {
+        ret = PTR_ERR(kdev->av_cache);
+        pr_err("kfi: AV setup failed for %s: %d\n", kdev->name, ret);
+        goto err_domain;
+    }
+
+    /* Pre-create endpoints so connection setup skips the slow path */
+    ret = kfi_ep_pool_init(kdev);
+    if (ret)
+        pr_warn("kfi: No endpoint pool for %s: %d\n", kdev->name, ret);
+
+    kdev->sched = kfi_sched_create(kdev->name);
+    if (IS_ERR(kdev->sched)) {
+        pr_warn("kfi: No submission scheduler for %s: %ld\n", kdev->name,
+                PTR_ERR(kdev->sched));
+        kdev->sched = NULL;
+    }
+    return 0;
+
+err_domain:
+    kfi_close(&kdev->domain->fid);
+err_fabric:
+    kfi_close(&kdev->fabric->fid);
+err_free:
+    kfi_auth_key_cache_destroy(kdev);
+    xa_destroy(&kdev->qps);
+    kfi_freeinfo(kdev->info);
+    return ret;
+}
+
+/**
+ * kfi_device_hold - Keep a device open
+ * @kdev: Device from kfi_get_devices()
+ */
+void kfi_device_hold(struct kfi_device *kdev)
+{
+    refcount_inc(&kdev->ref);
+}
+EXPORT_SYMBOL(kfi_device_hold);
+
+/**
+ * kfi_device_put - Let go of a device
+ * @kdev: Device held with kfi_device_hold()
+ *
+ * The last reference closes it. By then the endpoint pool, which holds
+ * the device until its last bundle is closed, is gone, so no endpoint
+ * is left on the domain.
+ */
+void kfi_device_put(struct kfi_device *kdev)
+{
+    if (!refcount_dec_and_test(&kdev->ref))
+        return;
+
+    kfi_sched_destroy(kdev->sched);
+    kfi_av_cache_destroy(kdev->av_cache);
+    kfi_close(&kdev->domain->fid);
+    kfi_close(&kdev->fabric->fid);
+    kfi_freeinfo(kdev->info);
+
+    kfi_auth_key_cache_destroy(kdev);
+    WARN_ON(!xa_empty(&kdev->qps));
+    xa_destroy(&kdev->qps);
+    kfree(kdev);
+}
+EXPORT_SYMBOL(kfi_device_put);
+
+/* Drop the device's list reference; endpoints still in use keep it open */
+static void kfi_device_close(struct kfi_device *kdev)
+{
+    kfi_ep_pool_destroy(kdev);
+    kfi_device_put(kdev);
+}
+
+/* Caller holds kfi_device_mutex */
+static struct kfi_device *kfi_device_find(const char *name)
+{
+    struct kfi_device *kdev;
+
+    list_for_each_entry(kdev, &kfi_device_list, list) {
+        if (!strncmp(kdev->name, name, sizeof(kdev->name) - 1))
+            return kdev;
+    }
+    return NULL;
+}
+
+/**
+ * kfi_device_get - Look up a device, opening it on first use
+ * @info: Provider entry from kfi_getinfo()
+ * @index: Position of @info in the provider's list
+ *
+ * Every mount enumerates devices, so after the first one this is a list
+ * lookup. The first caller publishes a placeholder before the slow setup;
+ * callers that race with it sleep until kfi_device_gen moves and look
+ * again, so each device is brought up exactly once.
+ */
+static struct kfi_device *kfi_device_get(struct kfi_info *info, int index)
+{
+    struct kfi_device *kdev, *found;
+    unsigned int gen;
+    int ret;
+
+    kdev = kzalloc(sizeof(*kdev), GFP_KERNEL);
+    if (!kdev)
+        return ERR_PTR(-ENOMEM);
+    strncpy(kdev->name, info->fabric_attr->name, sizeof(kdev->name) - 1);
+    kdev->opening = true;
+
+    mutex_lock(&kfi_device_mutex);
+    while ((found = kfi_device_find(kdev->name)) && found->opening) {
+        gen = kfi_device_gen;
+        mutex_unlock(&kfi_device_mutex);
+        wait_var_event(&kfi_device_gen, READ_ONCE(kfi_device_gen) != gen);
+        mutex_lock(&kfi_device_mutex);
+    }
+    if (!found)
+        list_add_tail(&kdev->list, &kfi_device_list);
+    mutex_unlock(&kfi_device_mutex);
+
+    if (found) {
+        kfree(kdev);
+        return found;
+    }
+
+    ret = kfi_device_setup(kdev, info, index);
+
+    mutex_lock(&kfi_device_mutex);
+    if (ret)
+        list_del(&kdev->list);
+    else
+        kdev->opening = false;
+    WRITE_ONCE(kfi_device_gen, kfi_device_gen + 1);
+    mutex_unlock(&kfi_device_mutex);
+    wake_up_var(&kfi_device_gen);
+
+    if (ret) {
+        kfree(kdev);
+        return ERR_PTR(ret);
+    }
+    return kdev;
+}
+
 /**
  * kfi_get_devices - Enumerate available kfabric devices
  * @num_devices: Returns number of devices found
@@ -41,7 +286,7 @@ struct ib_device **kfi_get_devices(int *num_devices)
     struct kfi_info *hints, *info, *cur;
     struct ib_device **devices = NULL;
     struct kfi_device *kdev;
-    int count = 0, i = 0;
+    int count = 0, i = 0, index = 0;
     int ret;
 
     /* Set up hints for CXI provider */
@@ -92,38 +337,14 @@ struct ib_device **kfi_get_devices(int *num_devices)
         return NULL;
     }
 
-    /* Create device structures */
-    mutex_lock(&kfi_device_mutex);
+    /* Look up or open each device; only the list itself is serialized */
     for (cur = info; cur; cur = cur->next) {
-        kdev = kzalloc(sizeof(*kdev), GFP_KERNEL);
-        if (!kdev)
-            continue;
-
-        kdev->info = kfi_dupinfo(cur);
-        strncpy(kdev->name, cur->fabric_attr->name, sizeof(kdev->name) - 1);
-        
-        /* Open fabric and domain */
-        ret = kfi_fabric(cur->fabric_attr, &kdev->fabric, NULL);
-        if (ret) {
-            pr_err("kfi_fabric failed for %s: %d\n", kdev->name, ret);
-            kfi_freeinfo(kdev->info);
-            kfree(kdev);
+        kdev = kfi_device_get(cur, index++);
+        if (IS_ERR(kdev))
             continue;
-        }
-
-        ret = kfi_domain(kdev->fabric, cur, &kdev->domain, NULL);
-        if (ret) {
-            pr_err("kfi_domain failed for %s: %d\n", kdev->name, ret);
-            kfi_close(&kdev->fabric->fid);
-            kfi_freeinfo(kdev->info);
-            kfree(kdev);
-            continue;
-        }
 
-        list_add_tail(&kdev->list, &kfi_device_list);
         devices[i++] = &kdev->ibdev;
     }
-    mutex_unlock(&kfi_device_mutex);
 
     kfi_freeinfo(info);
     *num_devices = i;
@@ -215,11 +436,18 @@ void kfi_cq_comp_worker(struct work_struct *work)
     ssize_t ret;
     int i;
 
-    /* Try to read completions */
+    /* Try to read completions (busy-polling tasks may own the CQ) */
+    spin_lock_bh(&kcq->poll_lock);
     ret = kfi_cq_read(kcq->kfi_cq, entries, 16);
+    spin_unlock_bh(&kcq->poll_lock);
     if (ret > 0) {
         pr_debug("kfi_cq_comp_worker: processed %zd completions\n", ret);
 
+        if (kcq->owner) {
+            for (i = 0; i < ret; i++)
+                kfi_cq_account(kcq, entries[i].flags);
+        }
+
         /* Call completion handler if registered */
         if (kcq->comp_handler) {
             for (i = 0; i < ret; i++) {
@@ -260,6 +488,10 @@ struct ib_cq *kfi_create_cq(struct ib_device *device,
     kcq->cqe = cq_attr->cqe;
     kcq->comp_handler = NULL; /* Set later by ib_req_notify_cq */
     atomic_set(&kcq->usecnt, 0);
+    spin_lock_init(&kcq->poll_lock);
+    mutex_init(&kcq->dispatch_lock);
+    atomic64_set(&kcq->busy_poll_hits, 0);
+    atomic64_set(&kcq->busy_poll_misses, 0);
 
     /* Create kfabric CQ */
     ret = kfi_cq_open(kdev->domain, &attr, &kcq->kfi_cq, NULL);
@@ -297,9 +529,11 @@ int kfi_destroy_cq(struct ib_cq *cq)
 
     destroy_workqueue(kcq->comp_wq);
     kfi_close(&kcq->kfi_cq->fid);
+
+    pr_debug("kfi: Destroyed CQ (busy-poll hits=%lld misses=%lld)\n",
+             atomic64_read(&kcq->busy_poll_hits),
+             atomic64_read(&kcq->busy_poll_misses));
     kfree(kcq);
-    
-    pr_debug("kfi: Destroyed CQ\n");
     return 0;
 }
 EXPORT_SYMBOL(kfi_destroy_cq);
@@ -310,6 +544,194 @@ EXPORT_SYMBOL(kfi_destroy_cq);
  * ============================================================================
  */
 
+/* Close a QP's endpoint and, for scalable endpoints, its contexts */
+static void kfi_qp_close_ep(struct kfi_qp *kqp)
+{
+    int i;
+
+    if (test_bit(KFI_QP_F_SCALABLE, &kqp->flags)) {
+        for (i = 0; i < kqp->nr_rx; i++)
+            kfi_close(&kqp->rx_ep[i]->fid);
+        for (i = 0; i < kqp->nr_tx; i++)
+            kfi_close(&kqp->tx_ctx[i].ep->fid);
+        kfree(kqp->rx_ep);
+        kfree(kqp->tx_ctx);
+    }
+
+    kfi_close(&kqp->ep->fid);
+}
+
+/* Regular endpoint: it is its own single tx and rx context */
+static int kfi_qp_open_ep(struct kfi_qp *kqp, struct kfi_info *hints,
+                          struct kfi_cq *ksend_cq, struct kfi_cq *krecv_cq)
+{
+    struct kfi_pd *kpd = kqp->pd;
+    int ret;
+
+    hints->ep_attr->tx_ctx_cnt = 1;
+    hints->ep_attr->rx_ctx_cnt = 1;
+
+    ret = kfi_endpoint(kpd->kfi_domain, hints, &kqp->ep, NULL);
+    if (ret) {
+        pr_err("kfi_endpoint failed: %d\n", ret);
+        return ret;
+    }
+
+    /* Bind CQs to endpoint */
+    ret = kfi_ep_bind(kqp->ep, &ksend_cq->kfi_cq->fid,
+                      KFI_TRANSMIT | KFI_SELECTIVE_COMPLETION);
+    if (ret) {
+        pr_err("kfi_ep_bind(send_cq) failed: %d\n", ret);
+        goto err_close_ep;
+    }
+
+    ret = kfi_ep_bind(kqp->ep, &krecv_cq->kfi_cq->fid, KFI_RECV);
+    if (ret) {
+        pr_err("kfi_ep_bind(recv_cq) failed: %d\n", ret);
+        goto err_close_ep;
+    }
+
+    /* Bind to the device's shared AV; peers are resolved at connect */
+    ret = kfi_ep_bind(kqp->ep, &kpd->device->av_cache->av->fid, 0);
+    if (ret) {
+        pr_err("kfi_ep_bind(av) failed: %d\n", ret);
+        goto err_close_ep;
+    }
+
+    kqp->tx_single.ep = kqp->ep;
+    spin_lock_init(&kqp->tx_single.lock);
+    kqp->tx_ctx = &kqp->tx_single;
+    kqp->nr_tx = 1;
+    kqp->rx_ep = &kqp->ep;
+    kqp->nr_rx = 1;
+    return 0;
+
+err_close_ep:
+    kfi_close(&kqp->ep->fid);
+    return ret;
+}
+
+/*
+ * Scalable endpoint: one tx context per CPU (or per NUMA node) so that
+ * submitting CPUs never share a hardware queue or a lock, and several
+ * rx contexts so incoming messages are spread over receive queues.
+ * All contexts report to the QP's two CQs.
+ */
+static int kfi_qp_open_sep(struct kfi_qp *kqp, struct kfi_info *hints,
+                           struct kfi_cq *ksend_cq, struct kfi_cq *krecv_cq)
+{
+    struct kfi_device *kdev = kqp->pd->device;
+    size_t max_tx = kdev->info->domain_attr->max_ep_tx_ctx;
+    size_t max_rx = kdev->info->domain_attr->max_ep_rx_ctx;
+    int nr_tx, nr_rx, i, ret;
+
+    if (kdev->sep_mode == KFI_SEP_PER_NODE) {
+        nr_tx = nr_node_ids;
+        set_bit(KFI_QP_F_SEP_PER_NODE, &kqp->flags);
+    } else {
+        nr_tx = num_possible_cpus();
+    }
+    nr_tx = min(nr_tx, KFI_SEP_MAX_TX_CTX);
+    if (max_tx)
+        nr_tx = min_t(int, nr_tx, max_tx);
+
+    nr_rx = kdev->sep_rx;
+    if (max_rx)
+        nr_rx = min_t(int, nr_rx, max_rx);
+
+    hints->ep_attr->tx_ctx_cnt = nr_tx;
+    hints->ep_attr->rx_ctx_cnt = nr_rx;
+
+    ret = kfi_scalable_ep(kdev->domain, hints, &kqp->ep, NULL);
+    if (ret) {
+        pr_err("kfi_scalable_ep failed: %d\n", ret);
+        return ret;
+    }
+
+    kqp->tx_ctx = kcalloc(nr_tx, sizeof(*kqp->tx_ctx), GFP_KERNEL);
+    kqp->rx_ep = kcalloc(nr_rx, sizeof(*kqp->rx_ep), GFP_KERNEL);
+    set_bit(KFI_QP_F_SCALABLE, &kqp->flags);
+    if (!kqp->tx_ctx || !kqp->rx_ep) {
+        ret = -ENOMEM;
+        goto err_close;
+    }
+
+    ret = kfi_scalable_ep_bind(kqp->ep, &kdev->av_cache->av->fid, 0);
+    if (ret) {
+        pr_err("kfi_scalable_ep_bind(av) failed: %d\n", ret);
+        goto err_close;
+    }
+
+    for (i = 0; i < nr_tx; i++) {
+        struct kfi_qp_ctx *ctx = &kqp->tx_ctx[i];
+
+        ret = kfi_tx_context(kqp->ep, i, hints->tx_attr, &ctx->ep, NULL);
+        if (ret) {
+            pr_err("kfi_tx_context(%d) failed: %d\n", i, ret);
+            goto err_close;
+        }
+        kqp->nr_tx++;
+
+        spin_lock_init(&ctx->lock);
+        ctx->peer_rx = i % nr_rx;
+
+        ret = kfi_ep_bind(ctx->ep, &ksend_cq->kfi_cq->fid,
+                          KFI_TRANSMIT | KFI_SELECTIVE_COMPLETION);
+        if (ret) {
+            pr_err("kfi_ep_bind(tx %d) failed: %d\n", i, ret);
+            goto err_close;
+        }
+    }
+
+    for (i = 0; i < nr_rx; i++) {
+        ret = kfi_rx_context(kqp->ep, i, hints->rx_attr, &kqp->rx_ep[i],
+                             NULL);
+        if (ret) {
+            pr_err("kfi_rx_context(%d) failed: %d\n", i, ret);
+            goto err_close;
+        }
+        kqp->nr_rx++;
+
+        ret = kfi_ep_bind(kqp->rx_ep[i], &krecv_cq->kfi_cq->fid, KFI_RECV);
+        if (ret) {
+            pr_err("kfi_ep_bind(rx %d) failed: %d\n", i, ret);
+            goto err_close;
+        }
+    }
+
+    return 0;
+
+err_close:
+    kfi_qp_close_ep(kqp);
+    return ret;
+}
+
+/*
+ * CXI fixes an endpoint's VNI and traffic class when it is opened, so
+ * the key is resolved first: the PD's key if it has one (pooled
+ * endpoints), else the device default. Without a VNI the endpoint is
+ * opened without a key and connecting it fails as before.
+ */
+static int kfi_qp_set_auth_key(struct kfi_qp *kqp, struct kfi_info *hints)
+{
+    struct kfi_pd *kpd = kqp->pd;
+    int ret;
+
+    if (kpd->auth_key) {
+        kqp->vni_from_mount = kpd->auth_key->vni;
+        kqp->service_id = kpd->auth_key->service_id;
+        kqp->traffic_class = kpd->auth_key->traffic_class;
+    } else if (!kpd->device->default_vni) {
+        return 0;
+    }
+
+    ret = kfi_get_auth_key(kqp);
+    if (ret)
+        return ret;
+
+    return kfi_ep_attr_set_auth_key(hints->ep_attr, kqp->auth_key);
+}
+
 /**
  * kfi_create_qp - Create queue pair
  * @pd: Protection domain
@@ -319,6 +741,10 @@ struct ib_qp *kfi_create_qp(struct ib_pd *pd,
                              struct ib_qp_init_attr *init_attr)
 {
     struct kfi_pd *kpd = container_of(pd, struct kfi_pd, pd);
+    struct kfi_cq *ksend_cq = container_of(init_attr->send_cq,
+                                            struct kfi_cq, cq);
+    struct kfi_cq *krecv_cq = container_of(init_attr->recv_cq,
+                                            struct kfi_cq, cq);
     struct kfi_qp *kqp;
     struct kfi_info *hints;
     int ret;
@@ -333,72 +759,61 @@ struct ib_qp *kfi_create_qp(struct ib_pd *pd,
     kqp->event_handler = init_attr->event_handler;
     kqp->qp_context = init_attr->qp_context;
     kqp->state = IB_QPS_RESET;
-    
-    spin_lock_init(&kqp->sq_lock);
+    kqp->dest_addr = KFI_ADDR_NOTAVAIL;
+    atomic_set(&kqp->sq_outstanding, 0);
+    atomic_set(&kqp->rq_outstanding, 0);
     spin_lock_init(&kqp->rq_lock);
+    atomic_set(&kqp->rx_next, 0);
 
-    /* Allocate synthetic QP number */
-    spin_lock(&qp_idr_lock);
-    kqp->qp_num = idr_alloc(&qp_idr, kqp, 1, 0, GFP_ATOMIC);
-    spin_unlock(&qp_idr_lock);
-    
-    if (kqp->qp_num < 0) {
-        ret = kqp->qp_num;
+    INIT_WORK(&kqp->enable_work, kfi_qp_enable_worker);
+
+    /* Allocate synthetic QP number (per device, no global lock) */
+    ret = xa_alloc(&kpd->device->qps, &kqp->qp_num, kqp, xa_limit_31b,
+                   GFP_KERNEL);
+    if (ret) {
         kfree(kqp);
         return ERR_PTR(ret);
     }
 
     /* Create kfabric endpoint */
     hints = kfi_dupinfo(kpd->device->info);
+    if (!hints) {
+        xa_erase(&kpd->device->qps, kqp->qp_num);
+        kfree(kqp);
+        return ERR_PTR(-ENOMEM);
+    }
     hints->tx_attr->size = init_attr->cap.max_send_wr;
+    /*
+     * The send CQ is bound for selective completion, so that a chain
+     * of RDMA Writes can go unsignaled; every other transmit still
+     * completes by default.
+     */
+    hints->tx_attr->op_flags |= KFI_COMPLETION;
     hints->rx_attr->size = init_attr->cap.max_recv_wr;
-    hints->ep_attr->tx_ctx_cnt = 1;
-    hints->ep_attr->rx_ctx_cnt = 1;
 
-    ret = kfi_endpoint(kpd->kfi_domain, hints, &kqp->ep, NULL);
+    ret = kfi_qp_set_auth_key(kqp, hints);
+    if (!ret) {
+        if (kpd->device->sep_mode)
+            ret = kfi_qp_open_sep(kqp, hints, ksend_cq, krecv_cq);
+        else
+            ret = kfi_qp_open_ep(kqp, hints, ksend_cq, krecv_cq);
+    }
     kfi_freeinfo(hints);
-    
+
     if (ret) {
-        pr_err("kfi_endpoint failed: %d\n", ret);
-        spin_lock(&qp_idr_lock);
-        idr_remove(&qp_idr, kqp->qp_num);
-        spin_unlock(&qp_idr_lock);
+        kfi_put_auth_key(kqp);
+        xa_erase(&kpd->device->qps, kqp->qp_num);
         kfree(kqp);
         return ERR_PTR(ret);
     }
 
-    /* Bind CQs to endpoint */
-    struct kfi_cq *ksend_cq = container_of(init_attr->send_cq, 
-                                            struct kfi_cq, cq);
-    struct kfi_cq *krecv_cq = container_of(init_attr->recv_cq,
-                                            struct kfi_cq, cq);
-
-    ret = kfi_ep_bind(kqp->ep, &ksend_cq->kfi_cq->fid, KFI_TRANSMIT);
-    if (ret) {
-        pr_err("kfi_ep_bind(send_cq) failed: %d\n", ret);
-        goto err_close_ep;
-    }
-
-    ret = kfi_ep_bind(kqp->ep, &krecv_cq->kfi_cq->fid, KFI_RECV);
-    if (ret) {
-        pr_err("kfi_ep_bind(recv_cq) failed: %d\n", ret);
-        goto err_close_ep;
-    }
-
     atomic_inc(&kpd->usecnt);
     atomic_inc(&ksend_cq->usecnt);
     atomic_inc(&krecv_cq->usecnt);
 
-    pr_debug("kfi: Created QP %d\n", kqp->qp_num);
+    pr_debug("kfi: Created QP %d (%u tx / %u rx contexts)\n", kqp->qp_num,
+             kqp->nr_tx, kqp->nr_rx);
     return &kqp->qp;
-
-err_close_ep:
-    kfi_close(&kqp->ep->fid);
-    spin_lock(&qp_idr_lock);
-    idr_remove(&qp_idr, kqp->qp_num);
-    spin_unlock(&qp_idr_lock);
-    kfree(kqp);
-    return ERR_PTR(ret);
 }
 EXPORT_SYMBOL(kfi_create_qp);
 
@@ -407,24 +822,39 @@ EXPORT_SYMBOL(kfi_create_qp);
  * @kqp: kfabric queue pair
  * @ah_attr: IB address handle attributes
  *
- * Returns: 0 on success, negative error on failure
+ * The destination GID is translated to an IP address and resolved
+ * through the device's shared AV, exactly as kfi_connect_ep() does.
  *
- * TODO: In production, this should properly translate IB address handle
- * attributes to kfabric address vector. For now, this is a stub.
+ * Returns: 0 on success, negative error on failure
  */
 int kfi_setup_av(struct kfi_qp *kqp, struct rdma_ah_attr *ah_attr)
 {
+    struct kfi_av_cache *av_cache;
+    const struct ib_global_route *grh;
+    struct kfi_av_entry *entry;
+    struct sockaddr_storage ss;
+
     if (!kqp || !ah_attr)
         return -EINVAL;
 
-    pr_debug("kfi_setup_av: stub implementation\n");
+    grh = rdma_ah_read_grh(ah_attr);
+    if (!(rdma_ah_get_ah_flags(ah_attr) & IB_AH_GRH) || !grh) {
+        pr_debug("kfi_setup_av: no GRH, peer resolved at connect\n");
+        return 0;
+    }
 
-    /* TODO: Implement proper AV setup:
-     * 1. Extract remote address from ah_attr
-     * 2. Insert into existing AV or create new one
-     * 3. Store the kfi_addr_t for future operations
-     */
+    memset(&ss, 0, sizeof(ss));
+    rdma_gid2ip((struct sockaddr *)&ss, &grh->dgid);
 
+    av_cache = kqp->pd->device->av_cache;
+    entry = kfi_av_get(av_cache, (struct sockaddr *)&ss);
+    if (IS_ERR(entry))
+        return PTR_ERR(entry);
+
+    if (kqp->av_entry)
+        kfi_av_put(av_cache, kqp->av_entry);
+    kqp->av_entry = entry;
+    kqp->dest_addr = entry->fi_addr;
     return 0;
 }
 
@@ -457,6 +887,15 @@ int kfi_modify_qp(struct ib_qp *qp, struct ib_qp_attr *attr,
                 return ret;
             }
             kqp->state = IB_QPS_INIT;
+
+            /*
+             * Bound and authorized, so the endpoint can be enabled now.
+             * Do it in the background: RTR (AV lookup) overlaps with it
+             * and RTS only waits if it has not finished yet.
+             */
+            if (!test_bit(KFI_QP_F_ENABLED, &kqp->flags) &&
+                !test_and_set_bit(KFI_QP_F_ENABLING, &kqp->flags))
+                queue_work(system_unbound_wq, &kqp->enable_work);
             break;
 
         case IB_QPS_RTR: /* Ready to Receive */
@@ -470,12 +909,10 @@ int kfi_modify_qp(struct ib_qp *qp, struct ib_qp_attr *attr,
             break;
 
         case IB_QPS_RTS: /* Ready to Send */
-            /* Enable endpoint - CRITICAL */
-            ret = kfi_enable(kqp->ep);
-            if (ret) {
-                pr_err("kfi_enable failed: %d\n", ret);
+            /* Enable endpoint - CRITICAL (no-op for pooled endpoints) */
+            ret = kfi_qp_enable(kqp);
+            if (ret)
                 return ret;
-            }
             kqp->state = IB_QPS_RTS;
             pr_info("kfi: QP %d is now active\n", kqp->qp_num);
             break;
@@ -494,6 +931,68 @@ int kfi_modify_qp(struct ib_qp *qp, struct ib_qp_attr *attr,
 }
 EXPORT_SYMBOL(kfi_modify_qp);
 
+static int kfi_qp_do_enable(struct kfi_qp *kqp)
+{
+    int i, ret;
+
+    if (test_bit(KFI_QP_F_ENABLED, &kqp->flags))
+        return 0;
+
+    ret = kfi_enable(kqp->ep);
+    if (ret) {
+        pr_err("kfi_enable failed: %d\n", ret);
+        return ret;
+    }
+
+    if (test_bit(KFI_QP_F_SCALABLE, &kqp->flags)) {
+        for (i = 0; i < kqp->nr_tx; i++) {
+            ret = kfi_enable(kqp->tx_ctx[i].ep);
+            if (ret) {
+                pr_err("kfi_enable(tx %d) failed: %d\n", i, ret);
+                return ret;
+            }
+        }
+        for (i = 0; i < kqp->nr_rx; i++) {
+            ret = kfi_enable(kqp->rx_ep[i]);
+            if (ret) {
+                pr_err("kfi_enable(rx %d) failed: %d\n", i, ret);
+                return ret;
+            }
+        }
+    }
+
+    set_bit(KFI_QP_F_ENABLED, &kqp->flags);
+    return 0;
+}
+
+static void kfi_qp_enable_worker(struct work_struct *work)
+{
+    struct kfi_qp *kqp = container_of(work, struct kfi_qp, enable_work);
+
+    kqp->enable_status = kfi_qp_do_enable(kqp);
+}
+
+/**
+ * kfi_qp_enable - Enable a QP's endpoint if not already enabled
+ * @kqp: kfabric queue pair
+ *
+ * The move to INIT starts enabling in the background once the auth key
+ * is in place; this waits for that to finish and returns its result. Endpoints handed out by the
+ * endpoint pool are already enabled, so connecting them only needs the
+ * peer resolved in the shared AV. A failed background enable is retried
+ * synchronously on the next call.
+ */
+int kfi_qp_enable(struct kfi_qp *kqp)
+{
+    if (test_and_clear_bit(KFI_QP_F_ENABLING, &kqp->flags)) {
+        flush_work(&kqp->enable_work);
+        return kqp->enable_status;
+    }
+
+    return kfi_qp_do_enable(kqp);
+}
+EXPORT_SYMBOL(kfi_qp_enable);
+
 /**
  * kfi_destroy_qp - Destroy queue pair
  */
@@ -503,18 +1002,19 @@ int kfi_destroy_qp(struct ib_qp *qp)
     struct kfi_cq *ksend_cq = container_of(kqp->send_cq, struct kfi_cq, cq);
     struct kfi_cq *krecv_cq = container_of(kqp->recv_cq, struct kfi_cq, cq);
 
-    kfi_close(&kqp->ep->fid);
+    cancel_work_sync(&kqp->enable_work);
+    kfi_qp_close_ep(kqp);
     
-    spin_lock(&qp_idr_lock);
-    idr_remove(&qp_idr, kqp->qp_num);
-    spin_unlock(&qp_idr_lock);
+    xa_erase(&kqp->pd->device->qps, kqp->qp_num);
+
+    if (kqp->av_entry)
+        kfi_av_put(kqp->pd->device->av_cache, kqp->av_entry);
 
     atomic_dec(&kqp->pd->usecnt);
     atomic_dec(&ksend_cq->usecnt);
     atomic_dec(&krecv_cq->usecnt);
 
-    if (kqp->auth_key)
-        kfree(kqp->auth_key);
+    kfi_put_auth_key(kqp);
 
     kfree(kqp);
     pr_debug("kfi: Destroyed QP\n");
@@ -530,10 +1030,16 @@ EXPORT_SYMBOL(kfi_destroy_qp);
 
 int __init kfi_verbs_compat_init(void)
 {
-    idr_init(&qp_idr);
-    
+    int ret;
+
     /* Initialize key mapping table - CHALLENGE 3 MITIGATION */
     kfi_key_mapping_init();
+
+    ret = kfi_sched_sysfs_init();
+    if (ret) {
+        kfi_key_mapping_cleanup();
+        return ret;
+    }
     
     pr_info("kfi_verbs_compat: Initialized\n");
     return 0;
@@ -546,16 +1052,13 @@ void kfi_verbs_compat_exit(void)
     /* Clean up all devices */
     mutex_lock(&kfi_device_mutex);
     list_for_each_entry_safe(kdev, tmp, &kfi_device_list, list) {
-        kfi_close(&kdev->domain->fid);
-        kfi_close(&kdev->fabric->fid);
-        kfi_freeinfo(kdev->info);
         list_del(&kdev->list);
-        kfree(kdev);
+        kfi_device_close(kdev);
     }
     mutex_unlock(&kfi_device_mutex);
 
+    kfi_sched_sysfs_exit();
     kfi_key_mapping_cleanup();
-    idr_destroy(&qp_idr);
     
     pr_info("kfi_verbs_compat: Cleaned up\n");
 }
@@ -2,183 +2,309 @@
 #include "kfi_internal.h"
 #include <linux/sunrpc/svc_rdma.h>
 #include <linux/slab.h>
+#include <linux/delay.h>
 
 /*
  * Server-side helper functions for kfabric operations
  * These handle incoming client requests and outgoing responses
  */
 
+/*
+ * Lock the local tx context of a server QP. It is posted on only by
+ * these helpers, from process context, so unlike kfi_qp_tx_lock() this
+ * leaves interrupts on; a CPU that moves after picking its context
+ * still posts correctly, only on a neighbour's.
+ */
+static struct kfi_qp_ctx *svc_kfi_tx_lock(struct kfi_qp *kqp)
+{
+    struct kfi_qp_ctx *ctx = kfi_qp_tx_ctx(kqp);
+
+    spin_lock(&ctx->lock);
+    return ctx;
+}
+
 /**
  * svc_kfi_post_recv - Post receive work request for incoming data
  * @kqp: kfabric queue pair
  * @buf: Buffer to receive into
  * @len: Buffer length
+ * @desc: Local descriptor covering @buf
  * @context: Context pointer for completion
  *
- * Returns: 0 on success, negative error on failure
+ * Returns: the receive context the buffer was posted on, needed to
+ * cancel it, or ERR_PTR (-EAGAIN when the receive queue is full)
  */
-static int __maybe_unused svc_kfi_post_recv(struct kfi_qp *kqp, void *buf, size_t len, void *context)
+struct kfid_ep *svc_kfi_post_recv(struct kfi_qp *kqp, void *buf, size_t len,
+                                  void *desc, void *context)
 {
-    struct kfi_mr *kmr;
-    void *desc;
+    struct kfid_ep *ep;
     ssize_t ret;
 
     if (!kqp || !kqp->ep || !buf) {
         pr_err("svc_kfi_post_recv: invalid parameters\n");
-        return -EINVAL;
+        return ERR_PTR(-EINVAL);
     }
 
-    /* Get memory region descriptor for the buffer */
-    kmr = (struct kfi_mr *)context; /* Assume context includes MR */
-    desc = kfi_mr_desc(kmr->kfi_mr);
-
-    ret = kfi_recv(kqp->ep, buf, len, desc, 0, context);
-    if (ret < 0 && ret != -KFI_EAGAIN) {
+    ep = kfi_qp_rx_ep(kqp);
+    ret = kfi_recv(ep, buf, len, desc, KFI_ADDR_UNSPEC, context);
+    if (ret) {
+        if (ret == -KFI_EAGAIN)
+            return ERR_PTR(-EAGAIN);
         pr_err("svc_kfi_post_recv: kfi_recv failed: %zd\n", ret);
-        return (int)ret;
+        return ERR_PTR((int)ret);
     }
 
-    return (ret == -KFI_EAGAIN) ? -EAGAIN : 0;
+    atomic_inc(&kqp->rq_outstanding);
+    return ep;
 }
 
 /**
- * svc_kfi_post_send - Send response data to client
+ * svc_kfi_rdma_read - Read data from client memory
  * @kqp: kfabric queue pair
- * @buf: Buffer to send
- * @len: Buffer length
+ * @peer: Provider address of the client
+ * @local_buf: Local buffer to read into
+ * @len: Length to read
+ * @desc: Local descriptor covering @local_buf
+ * @remote_addr: Remote address to read from
+ * @rkey: Remote key
  * @context: Context pointer for completion
  *
- * Returns: 0 on success, negative error on failure
+ * Returns: 0 on success, -EAGAIN when the send queue is full, or
+ * negative error on failure
  */
-static int __maybe_unused svc_kfi_post_send(struct kfi_qp *kqp, void *buf, size_t len, void *context)
+int svc_kfi_rdma_read(struct kfi_qp *kqp, kfi_addr_t peer, void *local_buf,
+                      size_t len, void *desc, u64 remote_addr, u32 rkey,
+                      void *context)
 {
-    struct kfi_mr *kmr;
-    void *desc;
+    struct kfi_qp_ctx *ctx;
     ssize_t ret;
 
-    if (!kqp || !kqp->ep || !buf) {
-        pr_err("svc_kfi_post_send: invalid parameters\n");
+    if (!kqp || !kqp->ep || !local_buf) {
+        pr_err("svc_kfi_rdma_read: invalid parameters\n");
         return -EINVAL;
     }
 
-    /* Get memory region descriptor for the buffer */
-    kmr = (struct kfi_mr *)context; /* Assume context includes MR */
-    desc = kfi_mr_desc(kmr->kfi_mr);
-
-    ret = kfi_send(kqp->ep, buf, len, desc, 0, context);
-    if (ret < 0 && ret != -KFI_EAGAIN) {
-        pr_err("svc_kfi_post_send: kfi_send failed: %zd\n", ret);
+    ctx = svc_kfi_tx_lock(kqp);
+    ret = kfi_read(ctx->ep, local_buf, len, desc,
+                   kfi_qp_peer_addr(kqp, ctx, peer), remote_addr, rkey,
+                   context);
+    spin_unlock(&ctx->lock);
+    if (ret) {
+        if (ret == -KFI_EAGAIN)
+            return -EAGAIN;
+        pr_err_ratelimited("svc_kfi_rdma_read: kfi_read failed: %zd\n", ret);
         return (int)ret;
     }
 
-    return (ret == -KFI_EAGAIN) ? -EAGAIN : 0;
+    atomic_inc(&kqp->sq_outstanding);
+    return 0;
 }
 
 /**
- * svc_kfi_rdma_read - Read data from client memory
+ * svc_kfi_post_chain - Post RDMA Writes and a Send as one chain
  * @kqp: kfabric queue pair
- * @local_buf: Local buffer to read into
- * @len: Length to read
- * @remote_addr: Remote address to read from
- * @rkey: Remote key
- * @context: Context pointer for completion
+ * @peer: Provider address of the client
+ * @desc: Local descriptor covering every source buffer
+ * @ops: RDMA Writes, in order
+ * @nops: Number of @ops
+ * @buf: Message to send after the Writes
+ * @len: Bytes to send from @buf
+ * @wcontext: Completion context of the Writes, seen only if one fails
+ * @context: Completion context of the Send
  *
- * Returns: 0 on success, negative error on failure
+ * The chain goes down one transmit context, in posting order, so the
+ * Writes are placed before the client sees the message. The Writes are
+ * posted without KFI_COMPLETION: only the Send is signaled, and its
+ * completion stands for the whole chain. A full send queue is waited
+ * out on that same context; the caller may sleep.
+ *
+ * Returns: 0 once the Send is posted, or negative error; Writes already
+ * posted stay posted, and no completion will report them
  */
-static int __maybe_unused svc_kfi_rdma_read(struct kfi_qp *kqp, void *local_buf, size_t len,
-                                            u64 remote_addr, u32 rkey, void *context)
+int svc_kfi_post_chain(struct kfi_qp *kqp, kfi_addr_t peer, void *desc,
+                       const struct svc_kfi_rw_op *ops, int nops,
+                       void *buf, size_t len, void *wcontext,
+                       void *context)
 {
-    struct kfi_mr *kmr;
-    void *desc;
-    ssize_t ret;
+    unsigned long deadline = jiffies + HZ;
+    struct kfi_rma_iov rma_iov;
+    struct kfi_msg_rma msg;
+    struct kfi_qp_ctx *ctx;
+    struct kvec iov;
+    kfi_addr_t addr;
+    ssize_t ret = 0;
+    int i = 0;
 
-    if (!kqp || !kqp->ep || !local_buf) {
-        pr_err("svc_kfi_rdma_read: invalid parameters\n");
+    if (!kqp || !kqp->ep || !buf) {
+        pr_err("svc_kfi_post_chain: invalid parameters\n");
         return -EINVAL;
     }
 
-    /* Get memory region descriptor for local buffer */
-    kmr = (struct kfi_mr *)context; /* Assume context includes MR */
-    desc = kfi_mr_desc(kmr->kfi_mr);
+    ctx = svc_kfi_tx_lock(kqp);
+    addr = kfi_qp_peer_addr(kqp, ctx, peer);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.desc = &desc;
+    msg.iov_count = 1;
+    msg.addr = addr;
+    msg.rma_iov = &rma_iov;
+    msg.rma_iov_count = 1;
+    msg.context = wcontext;
+    while (i <= nops) {
+        if (i < nops) {
+            iov.iov_base = ops[i].buf;
+            iov.iov_len = ops[i].len;
+            rma_iov.addr = ops[i].remote_addr;
+            rma_iov.len = ops[i].len;
+            rma_iov.key = ops[i].rkey;
+            ret = kfi_writemsg(ctx->ep, &msg, 0);
+        } else {
+            ret = kfi_send(ctx->ep, buf, len, desc, addr, context);
+            if (!ret)
+                atomic_inc(&kqp->sq_outstanding);
+        }
+        if (!ret) {
+            i++;
+            continue;
+        }
+        if (ret != -KFI_EAGAIN || time_after(jiffies, deadline))
+            break;
+
+        /* Another context would not keep the chain in order */
+        spin_unlock(&ctx->lock);
+        usleep_range(KFI_XPRT_POLL_MIN_USEC, KFI_XPRT_POLL_MIN_USEC * 2);
+        spin_lock(&ctx->lock);
+    }
+    spin_unlock(&ctx->lock);
 
-    ret = kfi_read(kqp->ep, local_buf, len, desc, 0,
-                   remote_addr, rkey, context);
-    if (ret < 0 && ret != -KFI_EAGAIN) {
-        pr_err("svc_kfi_rdma_read: kfi_read failed: %zd\n", ret);
+    if (ret) {
+        if (ret == -KFI_EAGAIN)
+            ret = -EAGAIN;
+        pr_err_ratelimited("svc_kfi_post_chain: op %d of %d failed: %zd\n",
+                           i, nops + 1, ret);
         return (int)ret;
     }
+    return 0;
+}
+
+/**
+ * svc_kfi_note_source - Record activity from a message's source
+ * @kqp: kfabric queue pair the message arrived on
+ * @src: Source address handle reported with the completion
+ *
+ * A server endpoint is shared by all of its clients; the source goes
+ * up with each receive, and keeps the client from being evicted as idle.
+ */
+static void svc_kfi_note_source(struct kfi_qp *kqp, kfi_addr_t src)
+{
+    if (src != KFI_ADDR_NOTAVAIL)
+        kfi_av_touch(kqp->pd->device->av_cache, src);
+}
 
-    return (ret == -KFI_EAGAIN) ? -EAGAIN : 0;
+/*
+ * The CXI provider reports a message from a source missing from the AV
+ * with the plain errno, EADDRNOTAVAIL; accept it negated as well, as
+ * kfabric returns errors from calls.
+ */
+static bool svc_kfi_err_unknown_source(int err)
+{
+    return err == EADDRNOTAVAIL || err == -EADDRNOTAVAIL;
 }
 
 /**
- * svc_kfi_rdma_write - Write data to client memory
- * @kqp: kfabric queue pair
- * @local_buf: Local buffer to write from
- * @len: Length to write
- * @remote_addr: Remote address to write to
- * @rkey: Remote key
- * @context: Context pointer for completion
+ * svc_kfi_resolve_unknown_source - Lazily insert a new client into the AV
+ * @kqp: kfabric queue pair the message arrived on
+ * @err: Error entry reporting EADDRNOTAVAIL
+ * @wc: Work completion to fill
+ * @src: Returns the source address handle
  *
- * Returns: 0 on success, negative error on failure
+ * The provider delivers messages from sources missing from the AV but
+ * reports them through the error path, with the raw source address in
+ * err_data. Insert that address now and hand the message up as a
+ * normal receive.
+ *
+ * Returns: 1 (one completion), or negative error
  */
-static int __maybe_unused svc_kfi_rdma_write(struct kfi_qp *kqp, void *local_buf, size_t len,
-                                             u64 remote_addr, u32 rkey, void *context)
+static int svc_kfi_resolve_unknown_source(struct kfi_qp *kqp,
+                                          struct kfi_cq_err_entry *err,
+                                          struct ib_wc *wc, kfi_addr_t *src)
 {
-    struct kfi_mr *kmr;
-    void *desc;
-    ssize_t ret;
+    struct sockaddr_storage ss;
+    int ret;
 
-    if (!kqp || !kqp->ep || !local_buf) {
-        pr_err("svc_kfi_rdma_write: invalid parameters\n");
+    if (!err->err_data || !err->err_data_size)
         return -EINVAL;
-    }
 
-    /* Get memory region descriptor for local buffer */
-    kmr = (struct kfi_mr *)context; /* Assume context includes MR */
-    desc = kfi_mr_desc(kmr->kfi_mr);
+    memset(&ss, 0, sizeof(ss));
+    memcpy(&ss, err->err_data, min_t(size_t, err->err_data_size, sizeof(ss)));
 
-    ret = kfi_write(kqp->ep, local_buf, len, desc, 0,
-                    remote_addr, rkey, context);
-    if (ret < 0 && ret != -KFI_EAGAIN) {
-        pr_err("svc_kfi_rdma_write: kfi_write failed: %zd\n", ret);
-        return (int)ret;
+    ret = kfi_av_resolve_src(kqp->pd->device->av_cache,
+                             (struct sockaddr *)&ss, src);
+    if (ret) {
+        pr_err("svc_kfi: failed to insert new client address: %d\n", ret);
+        return ret;
     }
 
-    return (ret == -KFI_EAGAIN) ? -EAGAIN : 0;
+    wc->wr_id = (u64)(uintptr_t)err->op_context;
+    wc->status = IB_WC_SUCCESS;
+    wc->byte_len = err->len;
+    wc->wc_flags = 0;
+    wc->opcode = IB_WC_RECV;
+    return 1;
 }
 
 /**
  * svc_kfi_poll_cq - Poll completion queue for completed operations
  * @kqp: kfabric queue pair
+ * @cq: Send or receive CQ of @kqp
  * @wc: Array of work completions to fill
+ * @src: Returns the source address of each receive (KFI_ADDR_NOTAVAIL
+ *       for other completions), one per entry of @wc
  * @num_entries: Maximum number of completions to poll
  *
  * Returns: Number of completions retrieved, or negative error
  */
-static int __maybe_unused svc_kfi_poll_cq(struct kfi_qp *kqp, struct ib_wc *wc, int num_entries)
+int svc_kfi_poll_cq(struct kfi_qp *kqp, struct ib_cq *cq, struct ib_wc *wc,
+                    kfi_addr_t *src, int num_entries)
 {
     struct kfi_cq_data_entry cq_entry[KFI_MAX_POLL_ENTRIES];
+    struct kfi_cq_err_entry err_entry;
     struct kfi_cq *kcq;
     int poll_count, i;
     ssize_t ret;
 
-    if (!kqp || !kqp->send_cq || !wc || num_entries <= 0) {
+    if (!kqp || !cq || !wc || !src || num_entries <= 0) {
         return -EINVAL;
     }
 
     /* Get the kfi_cq from the IB CQ */
-    kcq = container_of(kqp->send_cq, struct kfi_cq, cq);
+    kcq = ibcq_to_kfi(cq);
 
     /* Limit to max poll entries */
     poll_count = num_entries > KFI_MAX_POLL_ENTRIES ?
                  KFI_MAX_POLL_ENTRIES : num_entries;
 
-    ret = kfi_cq_read(kcq->kfi_cq, cq_entry, poll_count);
+    ret = kfi_cq_readfrom(kcq->kfi_cq, cq_entry, poll_count, src);
     if (ret < 0) {
         if (ret == -KFI_EAGAIN)
             return 0; /* No completions available */
-        pr_err("svc_kfi_poll_cq: kfi_cq_read failed: %zd\n", ret);
+
+        /* First message from a client not yet in the AV? */
+        memset(&err_entry, 0, sizeof(err_entry));
+        if (kfi_cq_readerr(kcq->kfi_cq, &err_entry, 0) == 1) {
+            kfi_cq_account(kcq, err_entry.flags);
+            src[0] = KFI_ADDR_NOTAVAIL;
+            if (svc_kfi_err_unknown_source(err_entry.err))
+                return svc_kfi_resolve_unknown_source(kqp, &err_entry, wc,
+                                                      src);
+
+            wc[0].wr_id = (u64)(uintptr_t)err_entry.op_context;
+            wc[0].status = kfi_errno_to_ib_status(err_entry.err);
+            wc[0].vendor_err = err_entry.prov_errno;
+            return 1;
+        }
+
+        pr_err("svc_kfi_poll_cq: kfi_cq_readfrom failed: %zd\n", ret);
         return (int)ret;
     }
 
@@ -188,6 +314,7 @@ static int __maybe_unused svc_kfi_poll_cq(struct kfi_qp *kqp, struct ib_wc *wc,
         wc[i].status = IB_WC_SUCCESS;
         wc[i].byte_len = cq_entry[i].len;
         wc[i].wc_flags = 0;
+        kfi_cq_account(kcq, cq_entry[i].flags);
 
         /* Determine operation type from flags */
         if (cq_entry[i].flags & KFI_SEND)
@@ -198,6 +325,11 @@ static int __maybe_unused svc_kfi_poll_cq(struct kfi_qp *kqp, struct ib_wc *wc,
             wc[i].opcode = IB_WC_RDMA_READ;
         else if (cq_entry[i].flags & KFI_WRITE)
             wc[i].opcode = IB_WC_RDMA_WRITE;
+
+        if (cq_entry[i].flags & KFI_RECV)
+            svc_kfi_note_source(kqp, src[i]);
+        else
+            src[i] = KFI_ADDR_NOTAVAIL;
     }
 
     return (int)ret;
@@ -0,0 +1,223 @@
+/*
+ * svc_kfi_recvfrom.c - Receiving calls on the server
+ *
+ * A call lands in one of the listener's shared receive buffers and is
+ * queued on its client's connection (svc_kfi_transport.c). A server
+ * thread takes it from there, as svcrdma does:
+ *
+ *   - an inline call is decoded in place, from the receive buffer;
+ *   - the data item of a call with a Read chunk (an NFS WRITE) is pulled
+ *     from the client with RDMA Reads into the thread's pages, where
+ *     nfsd hands it to the file system without a copy;
+ *   - a call sent whole as a position-zero Read chunk is pulled the same
+ *     way and decoded from those pages.
+ *
+ * Reads are pipelined. Every Read of a chunk (svc_kfi_rw.c) is posted
+ * before the thread waits, and the connection is handed back to SUNRPC
+ * first, so other threads take the client's next calls and pull their
+ * chunks meanwhile. A listener bounds the Reads in
+ * flight across all of its clients (max_reads), as an RDMA connection's
+ * outstanding-read limit would; a thread waits for room rather than
+ * overrunning the send queue.
+ */
+
+#include <linux/slab.h>
+#include <linux/sunrpc/svc_rdma.h>
+#include <linux/sunrpc/svc_xprt.h>
+
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+/*
+ * Pull @ch into @rqstp's pages, packing its segments back to back from
+ * the first page on. Returns once every posted Read has completed.
+ */
+static int svc_kfi_read_chunk(struct svc_kfi_xprt *sx, struct svc_rqst *rqstp,
+                              struct svc_kfi_recv_ctxt *ctxt)
+{
+    struct svc_kfi_rw_ctxt *rw = &ctxt->rw;
+    int ret;
+
+    svc_kfi_rw_init(rw, sx, false, NULL);
+    svc_kfi_rw_chunk(rw, &ctxt->rchunk);
+    ret = svc_kfi_rw_add_pages(rw, rqstp->rq_pages, 0, ctxt->rchunk.length);
+    if (ret)
+        return ret;
+
+    svc_kfi_rw_post(rw, NULL, 0);
+    return svc_kfi_rw_wait(rw);
+}
+
+/* Reject a Read chunk that does not fit the call or the thread's pages */
+static int svc_kfi_check_chunk(struct svc_rqst *rqstp,
+                               struct svc_kfi_recv_ctxt *ctxt, u32 inline_len)
+{
+    const struct kfi_chunk *ch = &ctxt->rchunk;
+
+    if (!ch->nsegs)
+        return ctxt->hdr.proc == RDMA_MSG ? 0 : -EINVAL;
+
+    /* Position zero carries the whole call, and only RDMA_NOMSG does */
+    if ((ch->position == 0) != (ctxt->hdr.proc == RDMA_NOMSG))
+        return -EINVAL;
+    if (ch->position > inline_len || ch->position & 3)
+        return -EINVAL;
+    if (ch->length > rqstp->rq_server->sv_max_mesg)
+        return -EMSGSIZE;
+    return 0;
+}
+
+/*
+ * Lay out rq_arg over the receive buffer and the pulled pages, the way
+ * svcrdma does, so nfsd finds a WRITE's payload in rq_arg's pages.
+ */
+static int svc_kfi_build_arg(struct svc_kfi_xprt *sx, struct svc_rqst *rqstp,
+                             struct svc_kfi_recv_ctxt *ctxt)
+{
+    const struct kfi_chunk *ch = &ctxt->rchunk;
+    struct xdr_buf *arg = &rqstp->rq_arg;
+    void *msg = ctxt->buf + ctxt->hdr.hdrlen;
+    u32 len = ctxt->len - ctxt->hdr.hdrlen;
+    unsigned int npages = 0;
+    int ret;
+
+    ret = svc_kfi_check_chunk(rqstp, ctxt, len);
+    if (ret)
+        return ret;
+
+    memset(arg, 0, sizeof(*arg));
+    arg->head[0].iov_base = msg;
+    arg->head[0].iov_len = len;
+    arg->pages = rqstp->rq_pages;
+    arg->len = len;
+
+    if (ch->nsegs) {
+        ret = svc_kfi_read_chunk(sx, rqstp, ctxt);
+        if (ret)
+            return ret;
+        npages = DIV_ROUND_UP(ch->length, PAGE_SIZE);
+
+        if (ch->position) {
+            /* The client leaves the item's XDR pad out of both parts */
+            u32 pad = xdr_pad_size(ch->length);
+
+            if (pad)
+                memset(page_address(rqstp->rq_pages[ch->length >> PAGE_SHIFT]) +
+                       offset_in_page(ch->length), 0, pad);
+            arg->head[0].iov_len = ch->position;
+            arg->page_len = ch->length + pad;
+            arg->tail[0].iov_base = msg + ch->position;
+            arg->tail[0].iov_len = len - ch->position;
+            arg->len = len + ch->length + pad;
+        } else {
+            arg->head[0].iov_base = page_address(rqstp->rq_pages[0]);
+            arg->head[0].iov_len = min_t(u32, ch->length, PAGE_SIZE);
+            arg->pages = rqstp->rq_pages + 1;
+            arg->page_len = ch->length - arg->head[0].iov_len;
+            arg->len = ch->length;
+        }
+    }
+    arg->buflen = arg->len;
+
+    /* The reply is built in the pages after the ones the call took */
+    rqstp->rq_respages = rqstp->rq_pages + npages;
+    rqstp->rq_next_page = rqstp->rq_respages + 1;
+    return 0;
+}
+
+/* Segment arrays are allocated the first time a buffer needs them */
+static int svc_kfi_alloc_segs(struct svc_kfi_xprt *sx, struct kfi_chunk *ch,
+                              u32 needed)
+{
+    if (!needed || ch->segs)
+        return 0;
+
+    ch->segs = kcalloc_node(KFI_XPRT_MAX_SEGS, sizeof(*ch->segs), GFP_KERNEL,
+                            sx->ep->node);
+    return ch->segs ? 0 : -ENOMEM;
+}
+
+/**
+ * svc_rdma_kfi_recvfrom - Receive the next call on a connection
+ * @rqstp: Server thread
+ *
+ * Called with the transport held busy; released as soon as a call is
+ * taken, before its Read chunk is pulled.
+ *
+ * Returns: the call's length, or 0 when there was none or it was dropped
+ */
+int svc_rdma_kfi_recvfrom(struct svc_rqst *rqstp)
+{
+    struct svc_xprt *xprt = rqstp->rq_xprt;
+    struct svc_kfi_xprt *sx = svc_kfi_xprt(xprt);
+    struct svc_kfi_recv_ctxt *ctxt;
+    int ret;
+
+    rqstp->rq_xprt_ctxt = NULL;
+
+    spin_lock(&sx->rq_lock);
+    ctxt = list_first_entry_or_null(&sx->rq_dto_q, struct svc_kfi_recv_ctxt,
+                                    list);
+    if (ctxt)
+        list_del_init(&ctxt->list);
+    else
+        clear_bit(XPT_DATA, &xprt->xpt_flags);
+    spin_unlock(&sx->rq_lock);
+
+    /* Another thread may take the next call while this one is pulled */
+    svc_xprt_received(xprt);
+    if (!ctxt)
+        return 0;
+
+    ret = kfi_rpcrdma_decode_hdr(ctxt->buf, ctxt->len, &ctxt->hdr);
+    if (!ret && ctxt->hdr.vers == KFI_RPCRDMA_V2 &&
+        ctxt->hdr.proc == KFI_RDMA2_CONNPROP) {
+        WRITE_ONCE(sx->credits, ctxt->hdr.credits);
+        ret = svc_kfi_send_connprop(sx, &ctxt->hdr);
+        if (ret)
+            pr_warn_ratelimited("kfi: svc cannot answer RDMA2_CONNPROP: %d\n",
+                                ret);
+        goto out_drop;
+    }
+    if (ret || (ctxt->hdr.proc != RDMA_MSG && ctxt->hdr.proc != RDMA_NOMSG)) {
+        pr_warn_ratelimited("kfi: svc dropped a call it cannot decode (%d)\n",
+                            ret);
+        goto out_drop;
+    }
+    WRITE_ONCE(sx->credits, ctxt->hdr.credits);
+
+    ctxt->pay_off = 0;
+    ctxt->pay_len = 0;
+    if (svc_kfi_alloc_segs(sx, &ctxt->rchunk, ctxt->hdr.nr_read) ||
+        svc_kfi_alloc_segs(sx, &ctxt->wchunk, ctxt->hdr.nr_write) ||
+        svc_kfi_alloc_segs(sx, &ctxt->rpchunk, ctxt->hdr.reply_chunk))
+        goto out_drop;
+    if (kfi_rpcrdma_decode_read_list(ctxt->buf, &ctxt->hdr, &ctxt->rchunk) ||
+        kfi_rpcrdma_decode_write_list(ctxt->buf, &ctxt->hdr, &ctxt->wchunk,
+                                      &ctxt->rpchunk)) {
+        pr_warn_ratelimited("kfi: svc dropped a call with bad chunk lists\n");
+        goto out_drop;
+    }
+
+    ret = svc_kfi_build_arg(sx, rqstp, ctxt);
+    if (ret == -EINVAL || ret == -EMSGSIZE) {
+        pr_warn_ratelimited("kfi: svc dropped a call with a bad Read chunk (%d)\n",
+                            ret);
+        goto out_drop;
+    }
+    if (ret)
+        goto out_close;
+
+    rqstp->rq_xprt_ctxt = ctxt;
+    rqstp->rq_prot = IPPROTO_MAX;
+    svc_xprt_copy_addrs(rqstp, xprt);
+    return rqstp->rq_arg.len;
+
+out_close:
+    /* A Read that failed leaves the client's memory in an unknown state */
+    svc_xprt_deferred_close(xprt);
+out_drop:
+    atomic_dec(&sx->calls);
+    svc_kfi_recv_ctxt_put(ctxt);
+    return 0;
+}
@@ -0,0 +1,410 @@
+/*
+ * svc_kfi_rw.c - Chunk transfers on the server
+ *
+ * The server's counterpart of the kernel's rdma_rw API: a transfer moves
+ * data between local memory and the segments of one or more client
+ * chunks, and reports back once, when its last operation completes.
+ *
+ *   1. svc_kfi_rw_init() starts a transfer of RDMA Reads or of RDMA
+ *      Writes;
+ *   2. svc_kfi_rw_chunk() names the client chunk, and
+ *      svc_kfi_rw_add_pages() / svc_kfi_rw_add_xdr() map local memory
+ *      onto its segments in order; each operation covers a run that is
+ *      contiguous on both sides, so pages of one folio going to one
+ *      segment take a single operation;
+ *   3. svc_kfi_rw_post() posts everything. Reads are pipelined under the
+ *      listener's read budget; Writes go out as one chain closed by the
+ *      reply's Send.
+ *
+ * Every operation is charged to the client's connection until it
+ * completes, which is what xpo_has_wspace judges the room to reply by.
+ *
+ * No registration is made per transfer. The listener's DMA registration
+ * covers every kernel page, so local memory needs no MR from a pool, and
+ * the remote side is described by the client's own handles.
+ */
+
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/sunrpc/svc_rdma.h>
+#include <linux/sunrpc/svc_xprt.h>
+
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+static void svc_kfi_rw_read_release(struct svc_kfi_ep *ep)
+{
+    atomic_inc(&ep->rd_avail);
+    if (wq_has_sleeper(&ep->rd_wait))
+        wake_up(&ep->rd_wait);
+}
+
+static void svc_kfi_rw_put(struct svc_kfi_rw_ctxt *rw)
+{
+    if (!atomic_dec_and_test(&rw->pending))
+        return;
+
+    if (rw->done)
+        rw->done(rw, READ_ONCE(rw->status));
+    else
+        complete(&rw->complete);
+}
+
+/**
+ * svc_kfi_wspace_wake - Enqueue a connection that was held back for room
+ * @sx: Connection whose operations have completed
+ */
+void svc_kfi_wspace_wake(struct svc_kfi_xprt *sx)
+{
+    if (test_bit(SVC_KFI_XPRT_F_WSPACE, &sx->flags) &&
+        test_and_clear_bit(SVC_KFI_XPRT_F_WSPACE, &sx->flags))
+        svc_xprt_enqueue(&sx->xprt);
+}
+
+static void svc_kfi_rw_op_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+    struct svc_kfi_rw_ctxt *rw = container_of(wc->wr_cqe,
+                                              struct svc_kfi_rw_ctxt, cqe);
+    struct svc_kfi_xprt *sx = rw->sx;
+
+    if (wc->status != IB_WC_SUCCESS) {
+        if (wc->status != IB_WC_WR_FLUSH_ERR)
+            pr_err_ratelimited("kfi: svc RDMA %s failed: status %d (vendor %u)\n",
+                               rw->write ? "Send" : "Read",
+                               wc->status, wc->vendor_err);
+        WRITE_ONCE(rw->status, -EIO);
+    }
+
+    /*
+     * Before the put, which may drop the last reference to @sx. A
+     * Send's completion also retires the unsignaled Writes before it.
+     */
+    atomic_sub(rw->write ? rw->nops + 1 : 1, &sx->sq_used);
+    if (!rw->write) {
+        atomic_dec(&sx->rd_used);
+        svc_kfi_rw_read_release(sx->ep);
+    }
+    svc_kfi_wspace_wake(sx);
+    svc_kfi_rw_put(rw);
+}
+
+/* An unsignaled Write completes only in error; the Send reports the chain */
+static void svc_kfi_rw_write_err(struct ib_cq *cq, struct ib_wc *wc)
+{
+    struct svc_kfi_rw_ctxt *rw = container_of(wc->wr_cqe,
+                                              struct svc_kfi_rw_ctxt, wcqe);
+
+    if (wc->status == IB_WC_SUCCESS)
+        return;
+    if (wc->status != IB_WC_WR_FLUSH_ERR)
+        pr_err_ratelimited("kfi: svc RDMA Write failed: status %d (vendor %u)\n",
+                           wc->status, wc->vendor_err);
+    WRITE_ONCE(rw->status, -EIO);
+}
+
+/**
+ * svc_kfi_rw_init - Start planning a transfer
+ * @rw: Transfer context; its operation array is kept across transfers
+ * @sx: Connection of the client owning the chunks
+ * @write: RDMA Writes (posted with a Send) rather than RDMA Reads
+ * @done: Called once when everything has completed, or NULL to wait
+ *        in svc_kfi_rw_wait()
+ */
+void svc_kfi_rw_init(struct svc_kfi_rw_ctxt *rw, struct svc_kfi_xprt *sx,
+                     bool write,
+                     void (*done)(struct svc_kfi_rw_ctxt *rw, int status))
+{
+    rw->cqe.done = svc_kfi_rw_op_done;
+    rw->wcqe.done = svc_kfi_rw_write_err;
+    rw->sx = sx;
+    rw->done = done;
+    rw->write = write;
+    atomic_set(&rw->pending, 1);
+    rw->status = 0;
+    init_completion(&rw->complete);
+    rw->nops = 0;
+    rw->ch = NULL;
+    rw->seg = 0;
+    rw->used = 0;
+}
+
+/**
+ * svc_kfi_rw_destroy - Free a transfer context's operation array
+ * @rw: Transfer context with nothing in flight
+ */
+void svc_kfi_rw_destroy(struct svc_kfi_rw_ctxt *rw)
+{
+    kvfree(rw->ops);
+    rw->ops = NULL;
+}
+
+/**
+ * svc_kfi_rw_chunk - Map the following memory onto a chunk
+ * @rw: Transfer context
+ * @ch: Client chunk, filled from (or drained from) its first segment
+ */
+void svc_kfi_rw_chunk(struct svc_kfi_rw_ctxt *rw, struct kfi_chunk *ch)
+{
+    rw->ch = ch;
+    rw->seg = 0;
+    rw->used = 0;
+}
+
+/* Map @len bytes at @buf onto the chunk, extending the last operation */
+static int svc_kfi_rw_add(struct svc_kfi_rw_ctxt *rw, void *buf, u32 len)
+{
+    struct kfi_chunk *ch = rw->ch;
+
+    while (len) {
+        struct svc_kfi_rw_op *prev;
+        struct kfi_seg *seg;
+        u64 remote;
+        u32 n;
+
+        if (!ch || rw->seg == ch->nsegs)
+            return -EMSGSIZE;
+        seg = &ch->segs[rw->seg];
+        if (rw->used == seg->length) {
+            rw->seg++;
+            rw->used = 0;
+            continue;
+        }
+
+        n = min(len, seg->length - rw->used);
+        remote = seg->offset + rw->used;
+        prev = rw->nops ? &rw->ops[rw->nops - 1] : NULL;
+
+        if (prev && prev->rkey == seg->handle &&
+            prev->buf + prev->len == buf &&
+            prev->remote_addr + prev->len == remote) {
+            prev->len += n;
+        } else {
+            if (!rw->ops) {
+                rw->ops = kvmalloc_node(array_size(KFI_SVC_RW_OPS,
+                                                   sizeof(*rw->ops)),
+                                        GFP_KERNEL, rw->sx->ep->node);
+                if (!rw->ops)
+                    return -ENOMEM;
+            }
+            if (rw->nops == KFI_SVC_RW_OPS)
+                return -EMSGSIZE;
+            rw->ops[rw->nops++] = (struct svc_kfi_rw_op) {
+                .buf = buf,
+                .len = n,
+                .remote_addr = remote,
+                .rkey = seg->handle,
+            };
+        }
+
+        rw->used += n;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * svc_kfi_rw_add_pages - Map a run of a page list onto the chunk
+ * @rw: Transfer context
+ * @pages: Page list
+ * @offset: Byte offset of the run in @pages
+ * @len: Length of the run
+ *
+ * Returns: 0, -EMSGSIZE when the chunk is too small, or -ENOMEM
+ */
+int svc_kfi_rw_add_pages(struct svc_kfi_rw_ctxt *rw, struct page **pages,
+                         unsigned int offset, u32 len)
+{
+    int ret;
+
+    while (len) {
+        u32 pgoff = offset_in_page(offset);
+        u32 n = min_t(u32, len, PAGE_SIZE - pgoff);
+
+        ret = svc_kfi_rw_add(rw, page_address(pages[offset >> PAGE_SHIFT]) +
+                             pgoff, n);
+        if (ret)
+            return ret;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Memory holding byte @off of @xdr, and the bytes that follow it there */
+static void *svc_kfi_xdr_ptr(const struct xdr_buf *xdr, u32 off, u32 *avail)
+{
+    const struct kvec *head = &xdr->head[0];
+    const struct kvec *tail = &xdr->tail[0];
+    u32 pgoff;
+
+    if (off < head->iov_len) {
+        *avail = head->iov_len - off;
+        return head->iov_base + off;
+    }
+    off -= head->iov_len;
+
+    if (off < xdr->page_len) {
+        pgoff = xdr->page_base + off;
+        *avail = min_t(u32, xdr->page_len - off,
+                       PAGE_SIZE - offset_in_page(pgoff));
+        return page_address(xdr->pages[pgoff >> PAGE_SHIFT]) +
+               offset_in_page(pgoff);
+    }
+    off -= xdr->page_len;
+
+    if (off < tail->iov_len) {
+        *avail = tail->iov_len - off;
+        return tail->iov_base + off;
+    }
+
+    *avail = 0;
+    return NULL;
+}
+
+/**
+ * svc_kfi_rw_add_xdr - Map a range of an XDR buffer onto the chunk
+ * @rw: Transfer context
+ * @xdr: Buffer, such as a reply under construction
+ * @offset: Byte offset of the range in @xdr
+ * @len: Length of the range
+ *
+ * Returns: 0, -EMSGSIZE when the chunk is too small, -EINVAL when @xdr
+ * is, or -ENOMEM
+ */
+int svc_kfi_rw_add_xdr(struct svc_kfi_rw_ctxt *rw, const struct xdr_buf *xdr,
+                       u32 offset, u32 len)
+{
+    u32 avail, n;
+    void *buf;
+    int ret;
+
+    while (len) {
+        buf = svc_kfi_xdr_ptr(xdr, offset, &avail);
+        if (!buf)
+            return -EINVAL;
+        n = min(len, avail);
+
+        ret = svc_kfi_rw_add(rw, buf, n);
+        if (ret)
+            return ret;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * svc_kfi_rw_trim - Trim the chunk's segments to the bytes mapped
+ * @rw: Transfer context
+ *
+ * For the reply header, which returns a Write or Reply chunk with the
+ * lengths actually written; unused segments are returned empty.
+ */
+void svc_kfi_rw_trim(struct svc_kfi_rw_ctxt *rw)
+{
+    struct kfi_chunk *ch = rw->ch;
+    int i;
+
+    ch->length = 0;
+    for (i = 0; i < ch->nsegs; i++) {
+        if (i == rw->seg)
+            ch->segs[i].length = rw->used;
+        else if (i > rw->seg)
+            ch->segs[i].length = 0;
+        ch->length += ch->segs[i].length;
+    }
+}
+
+/* 1 when a Read may be posted, -ENOTCONN once the listener is closing */
+static int svc_kfi_rw_read_slot(struct svc_kfi_ep *ep)
+{
+    if (test_bit(SVC_KFI_EP_F_CLOSING, &ep->flags))
+        return -ENOTCONN;
+    return atomic_add_unless(&ep->rd_avail, -1, 0);
+}
+
+static int svc_kfi_rw_read(struct svc_kfi_rw_ctxt *rw,
+                           const struct svc_kfi_rw_op *op)
+{
+    struct svc_kfi_xprt *sx = rw->sx;
+    struct svc_kfi_ep *ep = sx->ep;
+    int ret;
+
+    wait_event(ep->rd_wait, (ret = svc_kfi_rw_read_slot(ep)) != 0);
+    if (ret < 0)
+        return ret;
+
+    atomic_inc(&rw->pending);
+    atomic_inc(&sx->sq_used);
+    atomic_inc(&sx->rd_used);
+    for (;;) {
+        ret = svc_kfi_rdma_read(ep->kqp, sx->addr, op->buf, op->len, ep->desc,
+                                op->remote_addr, op->rkey, &rw->cqe);
+        if (ret != -EAGAIN)
+            break;
+        if (test_bit(SVC_KFI_EP_F_CLOSING, &ep->flags)) {
+            ret = -ENOTCONN;
+            break;
+        }
+        /* The send queue is full of other clients' Reads and replies */
+        usleep_range(KFI_XPRT_POLL_MIN_USEC, KFI_XPRT_POLL_MIN_USEC * 2);
+    }
+
+    if (ret) {
+        atomic_dec(&sx->rd_used);
+        atomic_dec(&sx->sq_used);
+        atomic_dec(&rw->pending);
+        svc_kfi_rw_read_release(ep);
+    }
+    return ret;
+}
+
+/**
+ * svc_kfi_rw_post - Post a planned transfer
+ * @rw: Transfer context
+ * @buf: For Writes, the message sent after them (the reply)
+ * @len: Bytes to send from @buf
+ *
+ * Every operation is posted before the caller waits, so Reads of
+ * several segments overlap. Completion, or the failure to post, is
+ * reported exactly once, through @rw's done callback or
+ * svc_kfi_rw_wait(). May sleep.
+ */
+void svc_kfi_rw_post(struct svc_kfi_rw_ctxt *rw, void *buf, size_t len)
+{
+    struct svc_kfi_xprt *sx = rw->sx;
+    struct svc_kfi_ep *ep = sx->ep;
+    int i, ret = 0;
+
+    if (rw->write) {
+        /* Only the Send completes, but every Write holds a queue slot */
+        atomic_inc(&rw->pending);
+        atomic_add(rw->nops + 1, &sx->sq_used);
+        ret = svc_kfi_post_chain(ep->kqp, sx->addr, ep->desc, rw->ops,
+                                 rw->nops, buf, len, &rw->wcqe, &rw->cqe);
+        if (ret) {
+            atomic_sub(rw->nops + 1, &sx->sq_used);
+            atomic_dec(&rw->pending);
+        }
+    } else {
+        for (i = 0; i < rw->nops && !ret; i++)
+            ret = svc_kfi_rw_read(rw, &rw->ops[i]);
+    }
+
+    if (ret)
+        WRITE_ONCE(rw->status, ret);
+    svc_kfi_rw_put(rw);
+}
+
+/**
+ * svc_kfi_rw_wait - Wait for a transfer posted without a done callback
+ * @rw: Transfer context
+ *
+ * Returns: 0, or the first error of the transfer
+ */
+int svc_kfi_rw_wait(struct svc_kfi_rw_ctxt *rw)
+{
+    wait_for_completion(&rw->complete);
+    return READ_ONCE(rw->status);
+}
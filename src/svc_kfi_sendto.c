@@ -0,0 +1,390 @@
+/*
+ * svc_kfi_sendto.c - Sending replies on the server
+ *
+ * A reply goes out as one chain on the connection's endpoint, as
+ * svcrdma sends it:
+ *
+ *   - the data item of an NFS READ is written into the client's Write
+ *     chunk with RDMA Writes straight from the reply pages, which nfsd
+ *     fills from the page cache; it is left out of the inline reply;
+ *   - a reply too large to send inline is written into the Reply chunk
+ *     the same way, and the Send carries the transport header alone;
+ *   - without a Reply chunk to take it, the client gets RDMA_ERROR with
+ *     ERR_CHUNK instead (RFC 8166, Section 4.5), so its RPC fails rather
+ *     than waiting for a reply that never comes;
+ *   - otherwise the reply is copied behind the header into the reply
+ *     buffer.
+ *
+ * Reply buffers are allocated once, on the NIC's node, and kept on the
+ * listener for reuse; its registration covers them. The Writes are
+ * planned and posted as one transfer (svc_kfi_rw.c) that the Send
+ * closes; once all of it has completed, the reply pages, the buffer and
+ * the connection are released. A failed Write or Send closes the
+ * connection, since the client cannot tell what reached it.
+ *
+ * A Version Two client's RDMA2_CONNPROP is answered with the server's
+ * own properties.
+ */
+
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sunrpc/svc_rdma.h>
+#include <linux/sunrpc/svc_xprt.h>
+
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+/*
+ * ============================================================================
+ * REPLY CONTEXTS
+ * ============================================================================
+ */
+
+static struct svc_kfi_send_ctxt *svc_kfi_send_ctxt_get(struct svc_kfi_ep *ep)
+{
+    struct svc_kfi_send_ctxt *sc;
+
+    spin_lock(&ep->sc_lock);
+    sc = list_first_entry_or_null(&ep->sc_free, struct svc_kfi_send_ctxt,
+                                  list);
+    if (sc)
+        list_del_init(&sc->list);
+    spin_unlock(&ep->sc_lock);
+    if (sc)
+        return sc;
+
+    sc = kzalloc_node(sizeof(*sc), GFP_KERNEL, ep->node);
+    if (!sc)
+        return NULL;
+    sc->buf = kmalloc_node(ep->inline_size, GFP_KERNEL, ep->node);
+    if (!sc->buf) {
+        kfree(sc);
+        return NULL;
+    }
+    INIT_LIST_HEAD(&sc->list);
+    return sc;
+}
+
+static void svc_kfi_send_ctxt_put(struct svc_kfi_ep *ep,
+                                  struct svc_kfi_send_ctxt *sc)
+{
+    if (sc->npages)
+        release_pages(sc->pages, sc->npages);
+    sc->npages = 0;
+
+    spin_lock(&ep->sc_lock);
+    list_add(&sc->list, &ep->sc_free);
+    spin_unlock(&ep->sc_lock);
+}
+
+/**
+ * svc_kfi_send_ctxts_destroy - Free a listener's reply contexts
+ * @ep: Listener endpoint, with no reply in flight
+ */
+void svc_kfi_send_ctxts_destroy(struct svc_kfi_ep *ep)
+{
+    struct svc_kfi_send_ctxt *sc, *next;
+
+    list_for_each_entry_safe(sc, next, &ep->sc_free, list) {
+        list_del(&sc->list);
+        svc_kfi_rw_destroy(&sc->rw);
+        kfree(sc->buf);
+        kfree(sc);
+    }
+}
+
+static void svc_kfi_reply_done(struct svc_kfi_rw_ctxt *rw, int status)
+{
+    struct svc_kfi_send_ctxt *sc = container_of(rw, struct svc_kfi_send_ctxt,
+                                                rw);
+    struct svc_kfi_xprt *sx = rw->sx;
+
+    if (status)
+        svc_xprt_deferred_close(&sx->xprt);
+
+    svc_kfi_send_ctxt_put(sx->ep, sc);
+    svc_xprt_put(&sx->xprt);
+}
+
+/*
+ * Post @sc's Writes and its Send of @len bytes. Whatever happens is
+ * reported to svc_kfi_reply_done(), which releases @sc.
+ */
+static void svc_kfi_send_reply(struct svc_kfi_xprt *sx,
+                               struct svc_kfi_send_ctxt *sc, size_t len)
+{
+    u32 ops = sc->rw.nops + 1;
+
+    /* What xpo_has_wspace expects the next reply to take */
+    WRITE_ONCE(sx->reply_ops, (3 * READ_ONCE(sx->reply_ops) + ops + 3) / 4);
+
+    svc_xprt_get(&sx->xprt);
+    svc_kfi_rw_post(&sc->rw, sc->buf, len);
+}
+
+/*
+ * ============================================================================
+ * CREDITS
+ * ============================================================================
+ */
+
+/*
+ * Credits to grant in a reply, from the connection and the thread pool.
+ * The shared receives are the listener's own count: a closing listener
+ * has none left to offer.
+ */
+static u32 svc_kfi_grant(struct svc_kfi_xprt *sx, struct svc_pool *pool)
+{
+    struct svc_kfi_ep *ep = sx->ep;
+    struct kfi_svc_credit_state st = {
+        .requested = READ_ONCE(sx->credits),
+        .granted = READ_ONCE(sx->granted),
+        .outstanding = atomic_read(&sx->calls),
+        .srq_free = atomic_read(&ep->rx_posted),
+        .srq_conns = max(atomic_read(&ep->nr_conns), 1),
+    };
+    u32 grant;
+
+    if (test_bit(SVC_KFI_EP_F_CLOSING, &ep->flags))
+        st.srq_free = 0;
+    if (pool) {
+        st.threads = pool->sp_nrthreads;
+        st.threads_idle = !llist_empty(&pool->sp_idle_threads);
+    }
+
+    grant = kfi_svc_credit_grant(&st);
+    WRITE_ONCE(sx->granted, grant);
+    return grant;
+}
+
+/**
+ * svc_kfi_send_connprop - Answer a client's RDMA2_CONNPROP
+ * @sx: Connection the message arrived on
+ * @hdr: Its decoded header, with the client's properties
+ *
+ * Returns: 0, or negative error
+ */
+int svc_kfi_send_connprop(struct svc_kfi_xprt *sx,
+                          const struct kfi_rpcrdma_hdr *hdr)
+{
+    struct svc_kfi_ep *ep = sx->ep;
+    const struct kfi_rpcrdma_props props = {
+        .sbsiz = ep->inline_size,
+        .rbsiz = ep->inline_size,
+        .rcsiz = KFI_XPRT_MAX_SEGS,
+    };
+    struct svc_kfi_send_ctxt *sc;
+    int len;
+
+    if (hdr->props.rbsiz)
+        WRITE_ONCE(sx->rbsiz, clamp_t(u32, hdr->props.rbsiz,
+                                      KFI_XPRT_INLINE_MIN, ep->inline_size));
+
+    sc = svc_kfi_send_ctxt_get(ep);
+    if (!sc)
+        return -ENOMEM;
+    svc_kfi_rw_init(&sc->rw, sx, true, svc_kfi_reply_done);
+
+    len = kfi_rpcrdma_encode_connprop(sc->buf, ep->inline_size,
+                                      svc_kfi_grant(sx, NULL), &props);
+    if (len < 0) {
+        svc_kfi_send_ctxt_put(ep, sc);
+        return len;
+    }
+
+    svc_kfi_send_reply(sx, sc, len);
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * REPLY CONSTRUCTION
+ * ============================================================================
+ */
+
+/*
+ * The Writes read from the reply pages after the thread has moved on:
+ * take the pages over, as svcrdma does, so they are released only when
+ * the Send completes. The thread gets fresh pages for its next call.
+ */
+static int svc_kfi_save_pages(struct svc_rqst *rqstp,
+                              struct svc_kfi_send_ctxt *sc)
+{
+    int i, n = rqstp->rq_next_page - rqstp->rq_respages;
+
+    if (n > KFI_SVC_MAX_PAGES)
+        return -EMSGSIZE;
+
+    for (i = 0; i < n; i++) {
+        sc->pages[i] = rqstp->rq_respages[i];
+        rqstp->rq_respages[i] = NULL;
+    }
+    sc->npages = n;
+    rqstp->rq_next_page = rqstp->rq_respages;
+    return 0;
+}
+
+/*
+ * Lay out the reply in @sc: Writes for the data item and, when it does
+ * not fit inline, for the rest of the reply; then the header, followed
+ * by the inline reply.
+ * Returns: bytes to send, -E2BIG when the reply fits neither inline nor
+ * in a Reply chunk, or another negative error
+ */
+static int svc_kfi_build_reply(struct svc_rqst *rqstp,
+                               struct svc_kfi_xprt *sx,
+                               struct svc_kfi_recv_ctxt *ctxt,
+                               struct svc_kfi_send_ctxt *sc)
+{
+    const struct xdr_buf *xdr = &rqstp->rq_res;
+    struct svc_kfi_rw_ctxt *rw = &sc->rw;
+    struct kfi_chunk *wchunk = NULL, *rpchunk = NULL;
+    u32 buflen = sx->ep->inline_size;
+    u32 pay_end, rest, inline_max;
+    int hdrlen, len, ret;
+
+    svc_kfi_rw_init(rw, sx, true, svc_kfi_reply_done);
+
+    /* The data item; its XDR pad is not sent at all */
+    if (ctxt->pay_len > xdr->len || ctxt->pay_off > xdr->len - ctxt->pay_len)
+        return -EINVAL;
+    pay_end = ctxt->pay_off + ctxt->pay_len;
+    if (ctxt->pay_len) {
+        pay_end = min(pay_end + xdr_pad_size(ctxt->pay_len), xdr->len);
+        wchunk = &ctxt->wchunk;
+        svc_kfi_rw_chunk(rw, wchunk);
+        ret = svc_kfi_rw_add_xdr(rw, xdr, ctxt->pay_off, ctxt->pay_len);
+        if (ret)
+            return ret;
+        svc_kfi_rw_trim(rw);
+    } else if (ctxt->wchunk.nsegs) {
+        /* Not used by this reply: returned empty */
+        wchunk = &ctxt->wchunk;
+        svc_kfi_rw_chunk(rw, wchunk);
+        svc_kfi_rw_trim(rw);
+    }
+    rest = xdr->len - (pay_end - ctxt->pay_off);
+
+    inline_max = min(READ_ONCE(sx->rbsiz), buflen);
+    hdrlen = kfi_rpcrdma_encode_reply(sc->buf, buflen, ctxt->hdr.vers,
+                                      ctxt->hdr.xid, 0, wchunk, NULL);
+    if (hdrlen < 0)
+        return hdrlen;
+
+    if (hdrlen + rest > inline_max) {
+        if (!ctxt->rpchunk.nsegs)
+            return -E2BIG;
+        rpchunk = &ctxt->rpchunk;
+        svc_kfi_rw_chunk(rw, rpchunk);
+        ret = svc_kfi_rw_add_xdr(rw, xdr, 0, ctxt->pay_off);
+        if (!ret)
+            ret = svc_kfi_rw_add_xdr(rw, xdr, pay_end, xdr->len - pay_end);
+        if (ret)
+            return ret;
+        svc_kfi_rw_trim(rw);
+    }
+
+    hdrlen = kfi_rpcrdma_encode_reply(sc->buf, buflen, ctxt->hdr.vers,
+                                      ctxt->hdr.xid,
+                                      svc_kfi_grant(sx, rqstp->rq_pool),
+                                      wchunk, rpchunk);
+    if (hdrlen < 0)
+        return hdrlen;
+    len = hdrlen;
+
+    if (!rpchunk) {
+        if (hdrlen + rest > inline_max)
+            return -E2BIG;
+        ret = read_bytes_from_xdr_buf(xdr, 0, sc->buf + hdrlen,
+                                      ctxt->pay_off);
+        if (!ret)
+            ret = read_bytes_from_xdr_buf(xdr, pay_end,
+                                          sc->buf + hdrlen + ctxt->pay_off,
+                                          xdr->len - pay_end);
+        if (ret)
+            return ret;
+        len += rest;
+    }
+
+    /* Last: the inline copy still reads through rq_res's page slots */
+    if (rw->nops) {
+        ret = svc_kfi_save_pages(rqstp, sc);
+        if (ret)
+            return ret;
+    }
+    return len;
+}
+
+/**
+ * svc_rdma_kfi_result_payload - Note the data item of a reply
+ * @rqstp: Server thread building the reply
+ * @offset: Offset of the item in rq_res
+ * @length: Its length, without the XDR pad
+ *
+ * Called by nfsd for the payload of a READ. When the client provided a
+ * Write chunk, the item is written there rather than sent inline.
+ *
+ * Returns: 0, or -EMSGSIZE when the item does not fit the Write chunk
+ */
+int svc_rdma_kfi_result_payload(struct svc_rqst *rqstp, unsigned int offset,
+                                unsigned int length)
+{
+    struct svc_kfi_recv_ctxt *ctxt = rqstp->rq_xprt_ctxt;
+
+    if (!ctxt || !ctxt->wchunk.nsegs)
+        return 0;
+
+    if (length > ctxt->wchunk.length)
+        return -EMSGSIZE;
+
+    ctxt->pay_off = offset;
+    ctxt->pay_len = length;
+    return 0;
+}
+
+/**
+ * svc_rdma_kfi_sendto - Send a reply to the client
+ * @rqstp: Server thread holding the reply in rq_res
+ *
+ * Returns: 0, or -ENOTCONN when the connection has been closed
+ */
+int svc_rdma_kfi_sendto(struct svc_rqst *rqstp)
+{
+    struct svc_xprt *xprt = rqstp->rq_xprt;
+    struct svc_kfi_xprt *sx = svc_kfi_xprt(xprt);
+    struct svc_kfi_recv_ctxt *ctxt = rqstp->rq_xprt_ctxt;
+    struct svc_kfi_send_ctxt *sc;
+    int len;
+
+    if (svc_xprt_is_dead(xprt) || !ctxt)
+        goto drop;
+
+    sc = svc_kfi_send_ctxt_get(sx->ep);
+    if (!sc)
+        goto drop;
+
+    len = svc_kfi_build_reply(rqstp, sx, ctxt, sc);
+    if (len == -E2BIG) {
+        /* Nothing was posted: the Writes planned for @sc are dropped */
+        svc_kfi_rw_init(&sc->rw, sx, true, svc_kfi_reply_done);
+        len = kfi_rpcrdma_encode_error(sc->buf, sx->ep->inline_size,
+                                       ctxt->hdr.vers, ctxt->hdr.xid,
+                                       svc_kfi_grant(sx, rqstp->rq_pool),
+                                       ERR_CHUNK);
+        pr_warn_ratelimited("kfi: svc reply to xid %08x too large without a Reply chunk\n",
+                            be32_to_cpu(ctxt->hdr.xid));
+    }
+    if (len < 0) {
+        pr_err_ratelimited("kfi: svc cannot build reply to xid %08x: %d\n",
+                           be32_to_cpu(ctxt->hdr.xid), len);
+        svc_kfi_send_ctxt_put(sx->ep, sc);
+        goto drop;
+    }
+
+    svc_kfi_send_reply(sx, sc, len);
+    return 0;
+
+drop:
+    svc_xprt_deferred_close(xprt);
+    return -ENOTCONN;
+}
@@ -1,26 +1,90 @@
+/*
+ * svc_kfi_transport.c - SUNRPC server transport over kfabric
+ *
+ * Registers the "rdma_kfi" server transport class. kfabric endpoints are
+ * connectionless, so a listener owns one pooled endpoint and a ring of
+ * receives that all of its clients send to, the way an RDMA server
+ * shares one receive queue among its connections. Each receive reports
+ * the client's provider address:
+ *
+ *   - a call from a client that has a connection transport is queued on
+ *     it, and the connection is handed to a server thread;
+ *   - a call from any other client is held on the listener's accept
+ *     queue until xpo_accept creates a connection transport for that
+ *     source, which then takes every call held for it, in order.
+ *
+ * To SUNRPC a client thus looks like an accepted TCP connection: it is
+ * closed when idle for long, and accepted again when the client comes
+ * back. A connection holds its client in the device's AV.
+ *
+ * Receive and reply buffers are sized for the inline threshold offered
+ * to Version Two clients (inline_size). A Version One client keeps the
+ * RFC 8166 default of 4KB until it says otherwise in RDMA2_CONNPROP, so
+ * the larger buffers only matter to clients that negotiated them.
+ *
+ * CXI endpoints make progress only when their CQs are read, so the
+ * listener runs a poll worker for as long as it lives; it naps when
+ * idle, as the client's workers do. The worker is pinned, on a per-CPU
+ * workqueue, to a CPU of the NIC's node. The thread pools themselves
+ * are left as nfsd set them up: SUNRPC queues a transport to the pool
+ * of the CPU that enqueues it, which is the worker's, so with per-node
+ * pools the calls of a listener are taken by threads on the NIC's node,
+ * next to its receive buffers and reply contexts, which are allocated
+ * there too.
+ *
+ * Decoding calls and pulling their Read chunks is in svc_kfi_recvfrom.c;
+ * replies go out from svc_kfi_sendto.c.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
 #include <linux/sunrpc/svc_rdma.h>
 #include <linux/sunrpc/svc_xprt.h>
-#include <linux/module.h>
+
 #include "kfi_verbs_compat.h"
 #include "kfi_internal.h"
 
+static unsigned int max_reads = KFI_SVC_MAX_READS;
+module_param(max_reads, uint, 0444);
+MODULE_PARM_DESC(max_reads,
+                 "RDMA Reads in flight per listener, shared by its clients");
+
+static unsigned int inline_size = KFI_XPRT_INLINE_V2_SIZE;
+module_param(inline_size, uint, 0444);
+MODULE_PARM_DESC(inline_size,
+                 "Inline threshold (bytes) offered to Version Two clients; sizes each listener's buffers");
+
+static struct workqueue_struct *svc_kfi_wq;
+
+/* Spreads the poll workers of listeners on one node over its CPUs */
+static atomic_t svc_kfi_nr_listeners = ATOMIC_INIT(0);
+
 /* Forward declarations */
 static struct svc_xprt *svc_rdma_kfi_create(struct svc_serv *serv,
                                             struct net *net,
                                             struct sockaddr *sa, int salen,
                                             int flags);
+static struct svc_xprt *svc_rdma_kfi_accept(struct svc_xprt *xprt);
 static void svc_rdma_kfi_close(struct svc_xprt *xprt);
-static int svc_rdma_kfi_recvfrom(struct svc_rqst *rqstp);
-static int svc_rdma_kfi_sendto(struct svc_rqst *rqstp);
 static void svc_rdma_kfi_detach(struct svc_xprt *xprt);
+static void svc_rdma_kfi_release_ctxt(struct svc_xprt *xprt, void *ctxt);
+static int svc_rdma_kfi_has_wspace(struct svc_xprt *xprt);
+static void svc_rdma_kfi_secure_port(struct svc_rqst *rqstp);
+static void svc_rdma_kfi_kill_temp_xprt(struct svc_xprt *xprt);
 
 static struct svc_xprt_ops svc_rdma_kfi_ops = {
     .xpo_create = svc_rdma_kfi_create,
+    .xpo_accept = svc_rdma_kfi_accept,
     .xpo_recvfrom = svc_rdma_kfi_recvfrom,
     .xpo_sendto = svc_rdma_kfi_sendto,
+    .xpo_release_ctxt = svc_rdma_kfi_release_ctxt,
     .xpo_detach = svc_rdma_kfi_detach,
     .xpo_free = svc_rdma_kfi_close,
-    .xpo_has_wspace = NULL,
+    .xpo_has_wspace = svc_rdma_kfi_has_wspace,
+    .xpo_secure_port = svc_rdma_kfi_secure_port,
+    .xpo_kill_temp_xprt = svc_rdma_kfi_kill_temp_xprt,
+    .xpo_result_payload = svc_rdma_kfi_result_payload,
 };
 
 static struct svc_xprt_class svc_rdma_kfi_class = {
@@ -31,37 +95,565 @@ static struct svc_xprt_class svc_rdma_kfi_class = {
     .xcl_ident = XPRT_TRANSPORT_RDMA,
 };
 
-/* Placeholder implementations */
+/*
+ * ============================================================================
+ * RECEIVES
+ * ============================================================================
+ */
+
+/**
+ * svc_kfi_recv_ctxt_put - Post a receive buffer again
+ * @ctxt: Buffer whose call has been handled or dropped
+ *
+ * Buffers of a closing listener are not posted again; they are freed
+ * with it.
+ */
+void svc_kfi_recv_ctxt_put(struct svc_kfi_recv_ctxt *ctxt)
+{
+    struct svc_kfi_ep *ep = ctxt->ep;
+    struct kfid_ep *rx;
+
+    if (test_bit(SVC_KFI_EP_F_CLOSING, &ep->flags))
+        return;
+
+    /* Counted first: the completion may beat us back from the post */
+    atomic_inc(&ep->rx_posted);
+    rx = svc_kfi_post_recv(ep->kqp, ctxt->buf, ep->inline_size, ep->desc,
+                           &ctxt->cqe);
+    if (IS_ERR(rx)) {
+        atomic_dec(&ep->rx_posted);
+        pr_err_ratelimited("kfi: svc recv post failed: %ld\n", PTR_ERR(rx));
+        return;
+    }
+    ctxt->rx = rx;
+}
+
+/* Hand a call to its client's connection, or to the listener to accept */
+static void svc_kfi_recv_done(struct svc_kfi_ep *ep, struct ib_wc *wc,
+                              kfi_addr_t src)
+{
+    struct svc_kfi_recv_ctxt *ctxt = container_of(wc->wr_cqe,
+                                                  struct svc_kfi_recv_ctxt,
+                                                  cqe);
+    struct svc_kfi_xprt *sx;
+
+    ctxt->rx = NULL;
+    atomic_dec(&ep->rx_posted);
+
+    if (wc->status != IB_WC_SUCCESS) {
+        if (wc->status == IB_WC_WR_FLUSH_ERR)
+            return;
+        pr_err_ratelimited("kfi: svc recv failed: status %d (vendor %u)\n",
+                           wc->status, wc->vendor_err);
+        svc_kfi_recv_ctxt_put(ctxt);
+        return;
+    }
+
+    /* A call we could not answer */
+    if (src == KFI_ADDR_NOTAVAIL) {
+        pr_warn_ratelimited("kfi: svc dropped a call from an unresolved source\n");
+        svc_kfi_recv_ctxt_put(ctxt);
+        return;
+    }
+
+    ctxt->len = wc->byte_len;
+    ctxt->src = src;
+
+    spin_lock(&ep->conn_lock);
+    sx = xa_load(&ep->conns, src);
+    if (sx) {
+        atomic_inc(&sx->calls);
+        spin_lock(&sx->rq_lock);
+        list_add_tail(&ctxt->list, &sx->rq_dto_q);
+        spin_unlock(&sx->rq_lock);
+        set_bit(XPT_DATA, &sx->xprt.xpt_flags);
+    } else {
+        sx = ep->listener;
+        list_add_tail(&ctxt->list, &ep->accept_q);
+        set_bit(XPT_CONN, &sx->xprt.xpt_flags);
+    }
+    svc_xprt_get(&sx->xprt);
+    spin_unlock(&ep->conn_lock);
+
+    svc_xprt_enqueue(&sx->xprt);
+    svc_xprt_put(&sx->xprt);
+}
+
+/*
+ * Reap a batch from one CQ. Receives are dispatched here with their
+ * source address; RDMA Read and Send completions go to their owners.
+ */
+static int svc_kfi_reap(struct svc_kfi_ep *ep, struct ib_cq *cq, bool recv)
+{
+    struct kfi_cq *kcq = ibcq_to_kfi(cq);
+    struct ib_wc wc[KFI_XPRT_POLL_BATCH];
+    kfi_addr_t src[KFI_XPRT_POLL_BATCH];
+    int n, i;
+
+    spin_lock_bh(&kcq->poll_lock);
+    n = svc_kfi_poll_cq(ep->kqp, cq, wc, src, ARRAY_SIZE(wc));
+    spin_unlock_bh(&kcq->poll_lock);
+
+    for (i = 0; i < n; i++) {
+        if (recv)
+            svc_kfi_recv_done(ep, &wc[i], src[i]);
+        else if (wc[i].wr_cqe && wc[i].wr_cqe->done)
+            wc[i].wr_cqe->done(cq, &wc[i]);
+    }
+
+    return max(n, 0);
+}
+
+/*
+ * Calls may arrive at any time, so the worker never exits on its own.
+ * While server threads wait for RDMA Reads it keeps its naps short.
+ */
+static void svc_kfi_poll_worker(struct work_struct *work)
+{
+    struct svc_kfi_ep *ep = container_of(work, struct svc_kfi_ep, poll_work);
+    unsigned int nap = KFI_XPRT_POLL_MIN_USEC;
+    int idle = 0, n;
+
+    while (!test_bit(SVC_KFI_EP_F_STOPPED, &ep->flags)) {
+        n = svc_kfi_reap(ep, ep->bundle->recv_cq, true);
+        n += svc_kfi_reap(ep, ep->bundle->send_cq, false);
+        if (n) {
+            idle = 0;
+            nap = KFI_XPRT_POLL_MIN_USEC;
+            cond_resched();
+            continue;
+        }
+
+        if (++idle < KFI_XPRT_POLL_SPIN) {
+            cpu_relax();
+            continue;
+        }
+
+        if (atomic_read(&ep->kqp->sq_outstanding))
+            nap = KFI_XPRT_POLL_MIN_USEC;
+        usleep_range(nap, nap * 2);
+        nap = min_t(unsigned int, nap * 2, KFI_XPRT_POLL_MAX_USEC);
+    }
+}
+
+/*
+ * ============================================================================
+ * LISTENER ENDPOINT
+ * ============================================================================
+ */
+
+/* Prefer a NIC on the local NUMA node; it is held for the listener */
+static struct kfi_device *svc_kfi_pick_device(void)
+{
+    struct ib_device **devices;
+    struct kfi_device *kdev = NULL;
+    int i, n = 0;
+
+    devices = kfi_get_devices(&n);
+    if (!devices)
+        return NULL;
+
+    for (i = 0; i < n; i++) {
+        struct kfi_device *cur = ibdev_to_kfi(devices[i]);
+
+        if (!kdev || cur->numa_node == numa_node_id())
+            kdev = cur;
+        if (cur->numa_node == numa_node_id())
+            break;
+    }
+    if (kdev)
+        kfi_device_hold(kdev);
+
+    kfi_free_devices(devices);
+    return kdev;
+}
+
+static void svc_kfi_xprt_init(struct svc_kfi_xprt *sx, struct svc_serv *serv,
+                              struct net *net)
+{
+    svc_xprt_init(net, &svc_rdma_kfi_class, &sx->xprt, serv);
+    spin_lock_init(&sx->rq_lock);
+    INIT_LIST_HEAD(&sx->rq_dto_q);
+    atomic_set(&sx->calls, 0);
+    sx->rbsiz = KFI_XPRT_INLINE_SIZE;
+    atomic_set(&sx->sq_used, 0);
+    atomic_set(&sx->rd_used, 0);
+    sx->reply_ops = 1;
+}
+
+/* Take an endpoint from the pool and post every receive buffer on it */
+static int svc_kfi_ep_open(struct svc_kfi_ep *ep)
+{
+    struct kfi_ep_bundle *bundle;
+    struct ib_mr *mr;
+    int i;
+
+    bundle = kfi_ep_pool_get(ep->kdev, 0, KFI_TC_BEST_EFFORT);
+    if (IS_ERR(bundle))
+        return PTR_ERR(bundle);
+    ep->bundle = bundle;
+    ep->kqp = ibqp_to_kfi(bundle->qp);
+
+    mr = kfi_get_dma_mr(bundle->pd, IB_ACCESS_LOCAL_WRITE);
+    if (IS_ERR(mr))
+        return PTR_ERR(mr);
+    ep->dma_mr = mr;
+    ep->desc = kfi_mr_desc(ibmr_to_kfi(mr)->kfi_mr);
+
+    ep->ctxts = kcalloc_node(KFI_SVC_RECVS, sizeof(*ep->ctxts), GFP_KERNEL,
+                             ep->node);
+    if (!ep->ctxts)
+        return -ENOMEM;
+
+    for (i = 0; i < KFI_SVC_RECVS; i++) {
+        struct svc_kfi_recv_ctxt *ctxt = &ep->ctxts[i];
+
+        ctxt->ep = ep;
+        INIT_LIST_HEAD(&ctxt->list);
+        ctxt->buf = kmalloc_node(ep->inline_size, GFP_KERNEL, ep->node);
+        if (!ctxt->buf)
+            return -ENOMEM;
+        svc_kfi_recv_ctxt_put(ctxt);
+        if (!ctxt->rx)
+            return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Stop taking calls: cancel the receives and close the connections,
+ * which could not get another call anyway. The endpoint and its poll
+ * worker stay until svc_kfi_ep_free(), after the last connection, so
+ * that the replies and Reads those still have in flight complete.
+ */
+static void svc_kfi_ep_close(struct svc_kfi_ep *ep)
+{
+    struct svc_kfi_recv_ctxt *ctxt, *next;
+    struct svc_kfi_xprt *sx;
+    unsigned long index;
+    int i;
+
+    set_bit(SVC_KFI_EP_F_CLOSING, &ep->flags);
+    wake_up_all(&ep->rd_wait);
+
+    for (i = 0; ep->ctxts && i < KFI_SVC_RECVS; i++) {
+        ctxt = &ep->ctxts[i];
+        if (ctxt->rx)
+            kfi_cancel(&ctxt->rx->fid, &ctxt->cqe);
+        ctxt->rx = NULL;
+    }
+
+    /* Calls from clients that were never accepted */
+    spin_lock(&ep->conn_lock);
+    list_for_each_entry_safe(ctxt, next, &ep->accept_q, list)
+        list_del_init(&ctxt->list);
+    xa_for_each(&ep->conns, index, sx)
+        svc_xprt_deferred_close(&sx->xprt);
+    spin_unlock(&ep->conn_lock);
+}
+
+/*
+ * The last connection has gone with the listener, so nothing is in
+ * flight: stop reaping, give the endpoint back and free the buffers.
+ */
+static void svc_kfi_ep_free(struct svc_kfi_ep *ep)
+{
+    int i;
+
+    set_bit(SVC_KFI_EP_F_STOPPED, &ep->flags);
+    cancel_work_sync(&ep->poll_work);
+
+    if (ep->bundle) {
+        kfi_ep_pool_put(ep->bundle);
+        ep->bundle = NULL;
+        ep->kqp = NULL;
+    }
+
+    if (ep->dma_mr) {
+        kfi_dereg_mr(ep->dma_mr);
+        ep->dma_mr = NULL;
+        ep->desc = NULL;
+    }
+
+    for (i = 0; ep->ctxts && i < KFI_SVC_RECVS; i++) {
+        kfree(ep->ctxts[i].rchunk.segs);
+        kfree(ep->ctxts[i].wchunk.segs);
+        kfree(ep->ctxts[i].rpchunk.segs);
+        svc_kfi_rw_destroy(&ep->ctxts[i].rw);
+        kfree(ep->ctxts[i].buf);
+    }
+    kfree(ep->ctxts);
+    svc_kfi_send_ctxts_destroy(ep);
+    xa_destroy(&ep->conns);
+    kfi_device_put(ep->kdev);
+    kfree(ep);
+}
 
 static struct svc_xprt *svc_rdma_kfi_create(struct svc_serv *serv,
                                             struct net *net,
                                             struct sockaddr *sa, int salen,
                                             int flags)
 {
-    pr_err("svc_rdma_kfi_create: not yet implemented\n");
-    return ERR_PTR(-ENOSYS);
+    struct kfi_device *kdev;
+    struct svc_kfi_xprt *sx;
+    struct svc_kfi_ep *ep;
+    int ret;
+
+    kdev = svc_kfi_pick_device();
+    if (!kdev)
+        return ERR_PTR(-ENODEV);
+
+    sx = kzalloc_node(sizeof(*sx), GFP_KERNEL, kdev->numa_node);
+    ep = kzalloc_node(sizeof(*ep), GFP_KERNEL, kdev->numa_node);
+    if (!sx || !ep) {
+        kfree(ep);
+        kfree(sx);
+        kfi_device_put(kdev);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    sx->ep = ep;
+    ep->listener = sx;
+    ep->kdev = kdev;
+    ep->node = kdev->numa_node;
+    ep->inline_size = clamp_t(u32, inline_size, KFI_XPRT_INLINE_SIZE,
+                              KFI_XPRT_INLINE_V2_MAX);
+    ep->cpu = cpumask_local_spread(atomic_inc_return(&svc_kfi_nr_listeners) - 1,
+                                   ep->node);
+    xa_init(&ep->conns);
+    spin_lock_init(&ep->conn_lock);
+    INIT_LIST_HEAD(&ep->accept_q);
+    ep->rd_max = clamp_t(unsigned int, max_reads, 1, KFI_DEFAULT_QP_DEPTH);
+    atomic_set(&ep->rd_avail, ep->rd_max);
+    init_waitqueue_head(&ep->rd_wait);
+    atomic_set(&ep->nr_conns, 0);
+    atomic_set(&ep->rx_posted, 0);
+    spin_lock_init(&ep->sc_lock);
+    INIT_LIST_HEAD(&ep->sc_free);
+    INIT_WORK(&ep->poll_work, svc_kfi_poll_worker);
+
+    ret = svc_kfi_ep_open(ep);
+    if (ret) {
+        pr_err("kfi: svc listener on %s failed: %d\n", kdev->name, ret);
+        svc_kfi_ep_close(ep);
+        svc_kfi_ep_free(ep);
+        kfree(sx);
+        return ERR_PTR(ret);
+    }
+
+    /* Only now: svc_xprt_init() takes references that kfree() would leak */
+    svc_kfi_xprt_init(sx, serv, net);
+    set_bit(XPT_LISTENER, &sx->xprt.xpt_flags);
+    svc_xprt_set_local(&sx->xprt, sa, salen);
+    queue_work_on(cpu_online(ep->cpu) ? ep->cpu : WORK_CPU_UNBOUND,
+                  svc_kfi_wq, &ep->poll_work);
+
+    pr_info("kfi: svc listening on %s, %d receives, polled on cpu %d (node %d)\n",
+            kdev->name, KFI_SVC_RECVS, ep->cpu, ep->node);
+    if (serv->sv_nrpools == 1 && num_online_nodes() > 1)
+        pr_info("kfi: svc thread pools are global; calls are not kept on node %d\n",
+                ep->node);
+    return &sx->xprt;
+}
+
+/*
+ * ============================================================================
+ * CONNECTIONS
+ * ============================================================================
+ */
+
+/*
+ * Create a connection for the client of the first call waiting to be
+ * accepted. The connection takes every call of that client held so far;
+ * later ones are queued on it directly.
+ */
+static struct svc_xprt *svc_rdma_kfi_accept(struct svc_xprt *xprt)
+{
+    struct svc_kfi_ep *ep = svc_kfi_xprt(xprt)->ep;
+    struct svc_kfi_recv_ctxt *ctxt, *next;
+    struct kfi_av_entry *entry;
+    struct svc_kfi_xprt *sx;
+    kfi_addr_t src;
+
+    clear_bit(XPT_CONN, &xprt->xpt_flags);
+
+    spin_lock(&ep->conn_lock);
+    ctxt = list_first_entry_or_null(&ep->accept_q, struct svc_kfi_recv_ctxt,
+                                    list);
+    if (ctxt)
+        list_del_init(&ctxt->list);
+    spin_unlock(&ep->conn_lock);
+    if (!ctxt)
+        return NULL;
+    src = ctxt->src;
+
+    /* Evicted from the AV since the call arrived: it cannot be answered */
+    entry = kfi_av_get_addr(ep->kdev->av_cache, src);
+    if (!entry)
+        goto out_drop;
+
+    sx = kzalloc_node(sizeof(*sx), GFP_KERNEL, ep->node);
+    if (!sx)
+        goto out_put;
+    if (xa_reserve(&ep->conns, src, GFP_KERNEL)) {
+        kfree(sx);
+        goto out_put;
+    }
+
+    svc_kfi_xprt_init(sx, xprt->xpt_server, xprt->xpt_net);
+    sx->ep = ep;
+    sx->addr = src;
+    sx->av_entry = entry;
+    set_bit(XPT_CONG_CTRL, &sx->xprt.xpt_flags);
+    svc_xprt_set_local(&sx->xprt, (struct sockaddr *)&xprt->xpt_local,
+                       xprt->xpt_locallen);
+    svc_xprt_set_remote(&sx->xprt, (struct sockaddr *)&entry->key,
+                        entry->keylen);
+
+    /* The endpoint outlives the connections on it */
+    svc_xprt_get(xprt);
+    atomic_inc(&ep->nr_conns);
+
+    list_add_tail(&ctxt->list, &sx->rq_dto_q);
+    atomic_inc(&sx->calls);
+    spin_lock(&ep->conn_lock);
+    xa_store(&ep->conns, src, sx, GFP_ATOMIC);
+    list_for_each_entry_safe(ctxt, next, &ep->accept_q, list) {
+        if (ctxt->src == src) {
+            list_move_tail(&ctxt->list, &sx->rq_dto_q);
+            atomic_inc(&sx->calls);
+        }
+    }
+    if (!list_empty(&ep->accept_q))
+        set_bit(XPT_CONN, &xprt->xpt_flags);
+    spin_unlock(&ep->conn_lock);
+
+    /* Handed to a server thread once SUNRPC has added the connection */
+    set_bit(XPT_DATA, &sx->xprt.xpt_flags);
+
+    pr_debug("kfi: svc accepted %pISpc\n", &entry->key);
+    return &sx->xprt;
+
+out_put:
+    kfi_av_put(ep->kdev->av_cache, entry);
+out_drop:
+    svc_kfi_recv_ctxt_put(ctxt);
+    spin_lock(&ep->conn_lock);
+    if (!list_empty(&ep->accept_q))
+        set_bit(XPT_CONN, &xprt->xpt_flags);
+    spin_unlock(&ep->conn_lock);
+    return NULL;
+}
+
+/* Calls of a closed connection go back to the endpoint unanswered */
+static void svc_kfi_conn_detach(struct svc_kfi_xprt *sx)
+{
+    struct svc_kfi_ep *ep = sx->ep;
+    struct svc_kfi_recv_ctxt *ctxt, *next;
+    LIST_HEAD(calls);
+
+    /* Later calls from the client are accepted on a new connection */
+    spin_lock(&ep->conn_lock);
+    if (xa_load(&ep->conns, sx->addr) == sx)
+        xa_erase(&ep->conns, sx->addr);
+    spin_unlock(&ep->conn_lock);
+    atomic_dec(&ep->nr_conns);
+
+    spin_lock(&sx->rq_lock);
+    list_splice_init(&sx->rq_dto_q, &calls);
+    spin_unlock(&sx->rq_lock);
+
+    list_for_each_entry_safe(ctxt, next, &calls, list) {
+        list_del_init(&ctxt->list);
+        atomic_dec(&sx->calls);
+        svc_kfi_recv_ctxt_put(ctxt);
+    }
+}
+
+static void svc_rdma_kfi_detach(struct svc_xprt *xprt)
+{
+    struct svc_kfi_xprt *sx = svc_kfi_xprt(xprt);
+
+    if (test_bit(XPT_LISTENER, &xprt->xpt_flags))
+        svc_kfi_ep_close(sx->ep);
+    else
+        svc_kfi_conn_detach(sx);
 }
 
 static void svc_rdma_kfi_close(struct svc_xprt *xprt)
 {
-    pr_debug("svc_rdma_kfi_close: called\n");
+    struct svc_kfi_xprt *sx = svc_kfi_xprt(xprt);
+    struct svc_kfi_ep *ep = sx->ep;
+
+    if (test_bit(XPT_LISTENER, &xprt->xpt_flags)) {
+        svc_kfi_ep_free(ep);
+    } else {
+        kfi_av_put(ep->kdev->av_cache, sx->av_entry);
+        svc_xprt_put(&ep->listener->xprt);
+    }
+    kfree(sx);
 }
 
-static int svc_rdma_kfi_recvfrom(struct svc_rqst *rqstp)
+/* The thread is done with a call: its receive buffer goes back */
+static void svc_rdma_kfi_release_ctxt(struct svc_xprt *xprt, void *ctxt)
 {
-    pr_err("svc_rdma_kfi_recvfrom: not yet implemented\n");
-    return -ENOSYS;
+    if (!ctxt)
+        return;
+
+    atomic_dec(&svc_kfi_xprt(xprt)->calls);
+    svc_kfi_recv_ctxt_put(ctxt);
 }
 
-static int svc_rdma_kfi_sendto(struct svc_rqst *rqstp)
+static bool svc_kfi_wspace(struct svc_kfi_xprt *sx)
 {
-    pr_err("svc_rdma_kfi_sendto: not yet implemented\n");
-    return -ENOSYS;
+    struct svc_kfi_ep *ep = sx->ep;
+    struct kfi_qp *kqp = READ_ONCE(ep->kqp);
+    struct kfi_svc_wspace_state st = {
+        .sq_depth = KFI_DEFAULT_QP_DEPTH,
+        .sq_used = kqp ? atomic_read(&kqp->sq_outstanding) : 0,
+        .conn_sq_used = atomic_read(&sx->sq_used),
+        .reply_ops = READ_ONCE(sx->reply_ops),
+        .rd_max = ep->rd_max,
+        .conn_rd_used = atomic_read(&sx->rd_used),
+        .conns = atomic_read(&ep->nr_conns),
+    };
+
+    return kfi_svc_has_wspace(&st);
 }
 
-static void svc_rdma_kfi_detach(struct svc_xprt *xprt)
+/*
+ * A connection is handed to a server thread only when the reply can be
+ * posted without waiting for the shared send queue. One held back is
+ * enqueued again by the completion that makes room
+ * (svc_kfi_wspace_wake); the flag is set before the second look so that
+ * completion cannot be missed.
+ */
+static int svc_rdma_kfi_has_wspace(struct svc_xprt *xprt)
+{
+    struct svc_kfi_xprt *sx = svc_kfi_xprt(xprt);
+
+    if (test_bit(XPT_LISTENER, &xprt->xpt_flags))
+        return 1;
+    if (svc_kfi_wspace(sx))
+        return 1;
+
+    set_bit(SVC_KFI_XPRT_F_WSPACE, &sx->flags);
+    smp_mb__after_atomic();
+    if (svc_kfi_wspace(sx)) {
+        clear_bit(SVC_KFI_XPRT_F_WSPACE, &sx->flags);
+        return 1;
+    }
+    return 0;
+}
+
+static void svc_rdma_kfi_secure_port(struct svc_rqst *rqstp)
+{
+    __set_bit(RQ_SECURE, &rqstp->rq_flags);
+}
+
+static void svc_rdma_kfi_kill_temp_xprt(struct svc_xprt *xprt)
 {
-    pr_debug("svc_rdma_kfi_detach: called\n");
 }
 
 /* Module initialization */
@@ -71,10 +663,21 @@ static int __init svc_rdma_kfi_init(void)
 
     pr_info("NFS/RDMA server kfabric transport module loading\n");
 
+    /*
+     * Listener poll workers; they run for as long as a listener lives.
+     * Per-CPU (not WQ_UNBOUND), so queue_work_on() pins them.
+     */
+    svc_kfi_wq = alloc_workqueue("svc_kfi",
+                                 WQ_MEM_RECLAIM | WQ_HIGHPRI |
+                                 WQ_CPU_INTENSIVE, 0);
+    if (!svc_kfi_wq)
+        return -ENOMEM;
+
     /* Register the transport class */
     rc = svc_reg_xprt_class(&svc_rdma_kfi_class);
     if (rc) {
         pr_err("svc_reg_xprt_class failed: %d\n", rc);
+        destroy_workqueue(svc_kfi_wq);
         return rc;
     }
 
@@ -85,6 +688,7 @@ static int __init svc_rdma_kfi_init(void)
 static void __exit svc_rdma_kfi_exit(void)
 {
     svc_unreg_xprt_class(&svc_rdma_kfi_class);
+    destroy_workqueue(svc_kfi_wq);
     pr_info("NFS/RDMA server kfabric transport unloaded\n");
 }
 
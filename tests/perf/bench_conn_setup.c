@@ -0,0 +1,284 @@
+/*
+ * Benchmark - endpoint bring-up cost, pooled vs. unpooled
+ *
+ * Measures how many connection setups per second a device sustains when
+ * every connect builds its endpoint from scratch (CQ pair, endpoint, AV
+ * bind, kfi_enable) versus taking a pre-enabled one from the device's
+ * endpoint pool. Each mode runs with 1, 16 and 128 concurrent connector
+ * threads to show how well bring-up scales under a mount storm.
+ * Requires a CXI device; results appear in dmesg.
+ *
+ *   insmod bench_conn_setup.ko iterations=2000 peer=10.0.0.2
+ */
+
+#include <linux/module.h>
+#include <linux/in.h>
+#include <linux/inet.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Connection setup benchmark");
+
+static int iterations = 1000;
+module_param(iterations, int, 0444);
+MODULE_PARM_DESC(iterations, "Connect/disconnect cycles per mode and concurrency");
+
+static char *peer;
+module_param(peer, charp, 0444);
+MODULE_PARM_DESC(peer, "IPv4 peer to connect to (default: endpoint setup only)");
+
+static struct sockaddr_in bench_peer;
+
+static const int bench_connectors[] = { 1, 16, 128 };
+
+/**
+ * struct bench_run - One mode at one concurrency level
+ * @kdev: Device under test
+ * @pd: PD for unpooled endpoints
+ * @pooled: Take endpoints from the pool instead of building them
+ * @remaining: Connection setups not yet claimed by a connector
+ * @running: Connectors still working
+ * @errors: Failed setups
+ * @done: Signalled when the last connector finishes
+ */
+struct bench_run {
+    struct kfi_device *kdev;
+    struct ib_pd *pd;
+    bool pooled;
+    atomic_t remaining;
+    atomic_t running;
+    atomic_t errors;
+    struct completion done;
+};
+
+static int bench_connect(struct ib_qp *qp)
+{
+    if (!peer)
+        return 0;
+    return kfi_connect_ep(ibqp_to_kfi(qp), (struct sockaddr *)&bench_peer);
+}
+
+/* The slow path every connect paid before endpoints were pooled */
+static int bench_one_unpooled(struct kfi_device *kdev, struct ib_pd *pd)
+{
+    struct ib_cq_init_attr cq_attr = { .cqe = KFI_DEFAULT_CQ_SIZE };
+    struct ib_qp_init_attr qp_attr;
+    struct ib_cq *send_cq, *recv_cq;
+    struct ib_qp *qp;
+    int ret;
+
+    send_cq = kfi_create_cq(kfi_to_ibdev(kdev), &cq_attr, NULL, NULL);
+    if (IS_ERR(send_cq))
+        return PTR_ERR(send_cq);
+
+    recv_cq = kfi_create_cq(kfi_to_ibdev(kdev), &cq_attr, NULL, NULL);
+    if (IS_ERR(recv_cq)) {
+        ret = PTR_ERR(recv_cq);
+        goto out_send_cq;
+    }
+
+    memset(&qp_attr, 0, sizeof(qp_attr));
+    qp_attr.send_cq = send_cq;
+    qp_attr.recv_cq = recv_cq;
+    qp_attr.cap.max_send_wr = KFI_DEFAULT_QP_DEPTH;
+    qp_attr.cap.max_recv_wr = KFI_DEFAULT_QP_DEPTH;
+    qp_attr.qp_type = IB_QPT_RC;
+
+    qp = kfi_create_qp(pd, &qp_attr);
+    if (IS_ERR(qp)) {
+        ret = PTR_ERR(qp);
+        goto out_recv_cq;
+    }
+
+    ret = kfi_qp_enable(ibqp_to_kfi(qp));
+    if (!ret)
+        ret = bench_connect(qp);
+
+    kfi_destroy_qp(qp);
+out_recv_cq:
+    kfi_destroy_cq(recv_cq);
+out_send_cq:
+    kfi_destroy_cq(send_cq);
+    return ret;
+}
+
+static int bench_one_pooled(struct kfi_device *kdev)
+{
+    struct kfi_ep_bundle *b;
+    int ret;
+
+    b = kfi_ep_pool_get(kdev, 0, KFI_TC_BEST_EFFORT);
+    if (IS_ERR(b))
+        return PTR_ERR(b);
+
+    ret = bench_connect(b->qp);
+    kfi_ep_pool_put(b);
+    return ret;
+}
+
+static int bench_connector(void *arg)
+{
+    struct bench_run *run = arg;
+    int ret;
+
+    while (atomic_dec_if_positive(&run->remaining) >= 0) {
+        if (run->pooled)
+            ret = bench_one_pooled(run->kdev);
+        else
+            ret = bench_one_unpooled(run->kdev, run->pd);
+        if (ret) {
+            atomic_inc(&run->errors);
+            break;
+        }
+    }
+
+    if (atomic_dec_and_test(&run->running))
+        complete(&run->done);
+
+    /* Stay around until reaped so module text outlives the thread */
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (kthread_should_stop())
+            break;
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+/* Run @iterations setups spread over @nthreads connectors */
+static int bench_run_concurrent(struct bench_run *run, int nthreads)
+{
+    struct task_struct **tasks;
+    u64 start_ns, elapsed_ns;
+    int i, started = 0;
+
+    tasks = kcalloc(nthreads, sizeof(*tasks), GFP_KERNEL);
+    if (!tasks)
+        return -ENOMEM;
+
+    atomic_set(&run->remaining, iterations);
+    atomic_set(&run->running, nthreads);
+    atomic_set(&run->errors, 0);
+    init_completion(&run->done);
+
+    for (i = 0; i < nthreads; i++) {
+        tasks[i] = kthread_create(bench_connector, run, "kfi_bench/%d", i);
+        if (IS_ERR(tasks[i])) {
+            tasks[i] = NULL;
+            break;
+        }
+        started++;
+    }
+
+    if (started < nthreads &&
+        atomic_sub_return(nthreads - started, &run->running) == 0)
+        complete(&run->done);
+
+    start_ns = ktime_get_ns();
+    for (i = 0; i < started; i++)
+        wake_up_process(tasks[i]);
+    wait_for_completion(&run->done);
+    elapsed_ns = ktime_get_ns() - start_ns;
+
+    for (i = 0; i < started; i++)
+        kthread_stop(tasks[i]);
+    kfree(tasks);
+
+    i = iterations - max(atomic_read(&run->remaining), 0) -
+        atomic_read(&run->errors);
+    pr_info("  %-9s %3d connectors: %d setups in %llu us, %llu conn/s\n",
+            run->pooled ? "pooled" : "unpooled", started, i,
+            elapsed_ns / NSEC_PER_USEC,
+            elapsed_ns ? (u64)i * NSEC_PER_SEC / elapsed_ns : 0);
+
+    if (started < nthreads) {
+        pr_warn("bench: only %d of %d connectors started\n",
+                started, nthreads);
+        return -ENOMEM;
+    }
+    return atomic_read(&run->errors) ? -EIO : 0;
+}
+
+static int __init bench_conn_setup_init(void)
+{
+    struct ib_device **devices;
+    struct bench_run run = {};
+    int num_devices = 0;
+    int i, ret = 0;
+
+    if (iterations <= 0)
+        return -EINVAL;
+
+    if (peer) {
+        memset(&bench_peer, 0, sizeof(bench_peer));
+        bench_peer.sin_family = AF_INET;
+        bench_peer.sin_port = htons(20049);
+        if (!in4_pton(peer, -1, (u8 *)&bench_peer.sin_addr.s_addr, -1, NULL)) {
+            pr_err("bench: invalid peer address %s\n", peer);
+            return -EINVAL;
+        }
+    }
+
+    devices = kfi_get_devices(&num_devices);
+    if (!devices || !num_devices) {
+        pr_warn("bench: no kfabric device, skipping\n");
+        kfi_free_devices(devices);
+        return -ENODEV;
+    }
+    run.kdev = ibdev_to_kfi(devices[0]);
+
+    pr_info("=== Connection setup benchmark on %s (%d iterations%s%s) ===\n",
+            run.kdev->name, iterations, peer ? ", peer " : "",
+            peer ? peer : "");
+
+    run.pd = kfi_alloc_pd(devices[0], NULL, NULL);
+    if (IS_ERR(run.pd)) {
+        ret = PTR_ERR(run.pd);
+        goto out;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(bench_connectors) && !ret; i++)
+        ret = bench_run_concurrent(&run, bench_connectors[i]);
+    kfi_dealloc_pd(run.pd);
+
+    if (ret) {
+        pr_err("bench: unpooled setup failed: %d\n", ret);
+        goto out;
+    }
+
+    if (!run.kdev->ep_pool) {
+        pr_warn("bench: device has no endpoint pool, skipping pooled run\n");
+        goto out;
+    }
+
+    run.pooled = true;
+    for (i = 0; i < ARRAY_SIZE(bench_connectors) && !ret; i++)
+        ret = bench_run_concurrent(&run, bench_connectors[i]);
+
+    if (ret)
+        pr_err("bench: pooled setup failed: %d\n", ret);
+
+    pr_info("  Pool: hits=%lld misses=%lld recycled=%lld discarded=%lld\n",
+            atomic64_read(&run.kdev->ep_pool->hits),
+            atomic64_read(&run.kdev->ep_pool->misses),
+            atomic64_read(&run.kdev->ep_pool->recycled),
+            atomic64_read(&run.kdev->ep_pool->discarded));
+
+out:
+    kfi_free_devices(devices);
+
+    /* Return error to prevent module staying loaded */
+    return ret ? ret : -EAGAIN;
+}
+
+static void __exit bench_conn_setup_exit(void)
+{
+}
+
+module_init(bench_conn_setup_init);
+module_exit(bench_conn_setup_exit);
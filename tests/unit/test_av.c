@@ -0,0 +1,341 @@
+/*
+ * Unit tests for the shared address vector cache
+ *
+ * The cache runs in bookkeeping-only mode (no provider AV), so these
+ * tests need neither kfabric devices nor CXI hardware.
+ */
+
+#include <linux/module.h>
+#include <linux/in.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Address vector cache unit tests");
+
+static void make_sin(struct sockaddr_in *sin, u32 ip, u16 port)
+{
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(ip);
+    sin->sin_port = htons(port);
+}
+
+static int test_av_reconnect_hit(void)
+{
+    struct kfi_av_cache *cache;
+    struct kfi_av_entry *a, *b;
+    struct sockaddr_in sin;
+    int ret = 0;
+
+    pr_info("TEST: AV cache reconnect hit\n");
+
+    cache = kfi_av_cache_create(NULL, 0, 0);
+    if (IS_ERR(cache)) {
+        pr_err("FAIL: kfi_av_cache_create: %ld\n", PTR_ERR(cache));
+        return -1;
+    }
+
+    make_sin(&sin, 0x0a000001, 20049);
+    a = kfi_av_get(cache, (struct sockaddr *)&sin);
+    if (IS_ERR(a)) {
+        pr_err("FAIL: first kfi_av_get: %ld\n", PTR_ERR(a));
+        kfi_av_cache_destroy(cache);
+        return -1;
+    }
+
+    /* Same peer, different padding bytes - must still hit */
+    sin.sin_zero[0] = 0xff;
+    b = kfi_av_get(cache, (struct sockaddr *)&sin);
+    if (IS_ERR(b) || b != a) {
+        pr_err("FAIL: second lookup did not return cached entry\n");
+        ret = -1;
+    } else if (atomic64_read(&cache->hits) != 1 ||
+               atomic64_read(&cache->misses) != 1) {
+        pr_err("FAIL: hits=%lld misses=%lld (expected 1/1)\n",
+               atomic64_read(&cache->hits), atomic64_read(&cache->misses));
+        ret = -1;
+    }
+    pr_info("  Reconnect reused fi_addr %llu\n", (unsigned long long)a->fi_addr);
+
+    if (!IS_ERR(b))
+        kfi_av_put(cache, b);
+    kfi_av_put(cache, a);
+    kfi_av_cache_destroy(cache);
+
+    if (!ret)
+        pr_info("PASS: AV cache reconnect hit\n");
+    return ret;
+}
+
+static int test_av_refcount_removal(void)
+{
+    struct kfi_av_cache *cache;
+    struct kfi_av_entry *a, *b;
+    struct sockaddr_in sin_a, sin_b;
+    int ret = 0;
+
+    pr_info("TEST: AV cache refcounted removal\n");
+
+    cache = kfi_av_cache_create(NULL, 0, 0);
+    if (IS_ERR(cache))
+        return -1;
+
+    make_sin(&sin_a, 0x0a000001, 20049);
+    make_sin(&sin_b, 0x0a000002, 20049);
+
+    a = kfi_av_get(cache, (struct sockaddr *)&sin_a);
+    b = kfi_av_get(cache, (struct sockaddr *)&sin_b);
+    if (IS_ERR(a) || IS_ERR(b) || a == b || a->fi_addr == b->fi_addr) {
+        pr_err("FAIL: distinct peers must get distinct entries\n");
+        kfi_av_cache_destroy(cache);
+        return -1;
+    }
+
+    if (atomic_read(&cache->entries) != 2) {
+        pr_err("FAIL: entries=%d (expected 2)\n",
+               atomic_read(&cache->entries));
+        ret = -1;
+    }
+
+    kfi_av_put(cache, a);
+    if (atomic_read(&cache->entries) != 1) {
+        pr_err("FAIL: unused entry not removed (entries=%d)\n",
+               atomic_read(&cache->entries));
+        ret = -1;
+    }
+    pr_info("  Unused peer removed, entries=%d\n",
+            atomic_read(&cache->entries));
+
+    kfi_av_put(cache, b);
+    if (atomic_read(&cache->entries) != 0) {
+        pr_err("FAIL: entries=%d after all puts\n",
+               atomic_read(&cache->entries));
+        ret = -1;
+    }
+
+    kfi_av_cache_destroy(cache);
+
+    if (!ret)
+        pr_info("PASS: AV cache refcounted removal\n");
+    return ret;
+}
+
+static int test_av_linger(void)
+{
+    struct kfi_av_cache *cache;
+    struct kfi_av_entry *a, *b;
+    struct sockaddr_in sin;
+    kfi_addr_t fi_addr;
+    int ret = 0;
+
+    pr_info("TEST: AV server lingers between connections\n");
+
+    cache = kfi_av_cache_create(NULL, 0, 0);
+    if (IS_ERR(cache))
+        return -1;
+
+    /* A data server's connection comes and goes */
+    make_sin(&sin, 0x0a000003, 20049);
+    a = kfi_av_get(cache, (struct sockaddr *)&sin);
+    if (IS_ERR(a)) {
+        kfi_av_cache_destroy(cache);
+        return -1;
+    }
+    kfi_av_linger(cache, a);
+    a->vers = 1;
+    fi_addr = a->fi_addr;
+    kfi_av_put(cache, a);
+    if (atomic_read(&cache->entries) != 1) {
+        pr_err("FAIL: server dropped with its last connection\n");
+        ret = -1;
+    }
+
+    /* The next connection finds it resolved, with what it learned */
+    b = kfi_av_get(cache, (struct sockaddr *)&sin);
+    if (IS_ERR(b) || b->fi_addr != fi_addr || b->vers != 1 ||
+        atomic64_read(&cache->misses) != 1) {
+        pr_err("FAIL: reconnect did not reuse the lingering entry\n");
+        ret = -1;
+    }
+    if (!IS_ERR(b)) {
+        kfi_av_linger(cache, b);
+        if (kfi_av_reap_idle(cache, 0)) {
+            pr_err("FAIL: reaper evicted a server in use\n");
+            ret = -1;
+        }
+        kfi_av_put(cache, b);
+    }
+
+    /* Idle with no connections: reaped */
+    if (kfi_av_reap_idle(cache, 0) != 1 ||
+        atomic_read(&cache->entries) != 0) {
+        pr_err("FAIL: idle server not reaped (entries=%d)\n",
+               atomic_read(&cache->entries));
+        ret = -1;
+    }
+
+    kfi_av_cache_destroy(cache);
+
+    if (!ret)
+        pr_info("PASS: AV server lingers between connections\n");
+    return ret;
+}
+
+#define SIM_CLIENTS         10000
+#define SIM_ACTIVE_CLIENTS  1000
+
+/*
+ * Simulate a server seeing one message from each of 10k clients, after
+ * which only a tenth stay active. Reports AV footprint and insertion
+ * rate, and checks that eviction brings memory back to the active set.
+ */
+static int test_av_server_scale(void)
+{
+    struct kfi_av_entry **held;
+    struct kfi_av_cache *cache;
+    struct sockaddr_in sin;
+    kfi_addr_t fi_addr, max_addr = 0;
+    size_t peak, settled;
+    u64 start_ns, elapsed_ns;
+    int i, evicted, ret = 0;
+
+    pr_info("TEST: AV server scale (%d simulated clients)\n", SIM_CLIENTS);
+
+    held = kcalloc(SIM_ACTIVE_CLIENTS, sizeof(*held), GFP_KERNEL);
+    if (!held)
+        return -1;
+
+    cache = kfi_av_cache_create(NULL, 0, 0);
+    if (IS_ERR(cache)) {
+        kfree(held);
+        return -1;
+    }
+
+    start_ns = ktime_get_ns();
+    for (i = 0; i < SIM_CLIENTS; i++) {
+        make_sin(&sin, 0x0a000000 + i, 20049);
+        if (kfi_av_resolve_src(cache, (struct sockaddr *)&sin, &fi_addr)) {
+            pr_err("FAIL: lazy insert of client %d failed\n", i);
+            ret = -1;
+            goto out;
+        }
+        max_addr = max(max_addr, fi_addr);
+    }
+    elapsed_ns = ktime_get_ns() - start_ns;
+
+    peak = kfi_av_cache_footprint(cache);
+    pr_info("  Inserted %d clients in %llu us (%llu inserts/s)\n",
+            SIM_CLIENTS, elapsed_ns / NSEC_PER_USEC,
+            elapsed_ns ? (u64)SIM_CLIENTS * NSEC_PER_SEC / elapsed_ns : 0);
+    pr_info("  Peak footprint: %zu bytes (%zu bytes/client)\n",
+            peak, peak / SIM_CLIENTS);
+
+    /* Index must stay compact (no holes on a fresh table) */
+    if (max_addr != SIM_CLIENTS - 1) {
+        pr_err("FAIL: index not compact (max fi_addr %llu)\n",
+               (unsigned long long)max_addr);
+        ret = -1;
+    }
+
+    /* Repeat messages from known clients must not insert again */
+    make_sin(&sin, 0x0a000000, 20049);
+    kfi_av_resolve_src(cache, (struct sockaddr *)&sin, &fi_addr);
+    if (atomic_read(&cache->entries) != SIM_CLIENTS) {
+        pr_err("FAIL: repeat message inserted a duplicate\n");
+        ret = -1;
+    }
+
+    /* Active clients are held (as a connected QP would) */
+    for (i = 0; i < SIM_ACTIVE_CLIENTS; i++) {
+        make_sin(&sin, 0x0a000000 + i, 20049);
+        held[i] = kfi_av_get(cache, (struct sockaddr *)&sin);
+        if (IS_ERR(held[i])) {
+            held[i] = NULL;
+            ret = -1;
+        }
+    }
+
+    evicted = kfi_av_reap_idle(cache, 0);
+    settled = kfi_av_cache_footprint(cache);
+    pr_info("  Evicted %d idle clients, footprint now %zu bytes\n",
+            evicted, settled);
+
+    if (evicted != SIM_CLIENTS - SIM_ACTIVE_CLIENTS ||
+        atomic_read(&cache->entries) != SIM_ACTIVE_CLIENTS) {
+        pr_err("FAIL: evicted=%d entries=%d (expected %d/%d)\n",
+               evicted, atomic_read(&cache->entries),
+               SIM_CLIENTS - SIM_ACTIVE_CLIENTS, SIM_ACTIVE_CLIENTS);
+        ret = -1;
+    }
+
+    /* A server connection finds its client by the completion's handle */
+    if (held[0]) {
+        struct kfi_av_entry *entry = kfi_av_get_addr(cache, held[0]->fi_addr);
+
+        make_sin(&sin, 0x0a000000, 20049);
+        if (entry != held[0] ||
+            ((struct sockaddr_in *)&entry->key)->sin_addr.s_addr !=
+            sin.sin_addr.s_addr) {
+            pr_err("FAIL: handle did not lead back to the client\n");
+            ret = -1;
+        }
+        kfi_av_put(cache, entry);
+    }
+    if (kfi_av_get_addr(cache, SIM_CLIENTS - 1)) {
+        pr_err("FAIL: evicted client still referenced by handle\n");
+        ret = -1;
+    }
+
+    /* Freed slots are reused, keeping the index dense */
+    make_sin(&sin, 0x0b000000, 20049);
+    kfi_av_resolve_src(cache, (struct sockaddr *)&sin, &fi_addr);
+    if (fi_addr >= SIM_CLIENTS) {
+        pr_err("FAIL: new client got sparse index %llu\n",
+               (unsigned long long)fi_addr);
+        ret = -1;
+    }
+
+    for (i = 0; i < SIM_ACTIVE_CLIENTS; i++)
+        kfi_av_put(cache, held[i]);
+
+out:
+    kfi_av_cache_destroy(cache);
+    kfree(held);
+
+    if (!ret)
+        pr_info("PASS: AV server scale\n");
+    return ret;
+}
+
+static int __init test_av_init(void)
+{
+    int failures = 0;
+
+    pr_info("=== Running AV unit tests ===\n");
+
+    if (test_av_reconnect_hit())
+        failures++;
+    if (test_av_refcount_removal())
+        failures++;
+    if (test_av_linger())
+        failures++;
+    if (test_av_server_scale())
+        failures++;
+
+    pr_info("=== AV tests: %d failures ===\n", failures);
+
+    /* Return error to prevent module staying loaded */
+    return failures ? -EINVAL : -EAGAIN;
+}
+
+static void __exit test_av_exit(void)
+{
+    pr_info("AV tests unloaded\n");
+}
+
+module_init(test_av_init);
+module_exit(test_av_exit);
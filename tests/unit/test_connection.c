@@ -4,6 +4,7 @@
 
 #include <linux/module.h>
 #include <linux/string.h>
+#include <linux/slab.h>
 #include "kfi_verbs_compat.h"
 #include "kfi_internal.h"
 
@@ -96,6 +97,55 @@ static int test_vni_parse_invalid(void)
     return 0;
 }
 
+static int test_busy_poll_parse(void)
+{
+    uint16_t vni;
+    u32 usec;
+    int ret;
+
+    pr_info("TEST: busy_poll parsing\n");
+
+    ret = kfi_parse_busy_poll_from_options("vni=1000,busy_poll=50", &usec);
+    if (ret || usec != 50) {
+        pr_err("FAIL: 'vni=1000,busy_poll=50' -> %u (ret=%d)\n", usec, ret);
+        return -1;
+    }
+    pr_info("  'vni=1000,busy_poll=50' -> %u OK\n", usec);
+
+    ret = kfi_parse_busy_poll_from_options("busy_poll=0", &usec);
+    if (ret || usec != 0) {
+        pr_err("FAIL: 'busy_poll=0' -> %u (ret=%d)\n", usec, ret);
+        return -1;
+    }
+    pr_info("  'busy_poll=0' -> %u OK\n", usec);
+
+    /* Budgets beyond the cap are rejected, not clamped */
+    ret = kfi_parse_busy_poll_from_options("busy_poll=1000000", &usec);
+    if (ret != -ERANGE) {
+        pr_err("FAIL: oversized busy_poll should be -ERANGE (ret=%d)\n", ret);
+        return -1;
+    }
+    pr_info("  Oversized budget -> -ERANGE (expected)\n");
+
+    ret = kfi_parse_busy_poll_from_options("vni=1000", &usec);
+    if (ret == 0) {
+        pr_err("FAIL: Should fail with no busy_poll\n");
+        return -1;
+    }
+    pr_info("  No busy_poll -> error (expected)\n");
+
+    /* VNI out of range must not be silently accepted */
+    ret = kfi_parse_vni_from_options("vni=65536", &vni);
+    if (ret == 0) {
+        pr_err("FAIL: 'vni=65536' should fail\n");
+        return -1;
+    }
+    pr_info("  'vni=65536' -> error (expected)\n");
+
+    pr_info("PASS: busy_poll parsing\n");
+    return 0;
+}
+
 static int test_auth_key_structure(void)
 {
     struct kfi_cxi_auth_key auth_key;
@@ -124,6 +174,141 @@ static int test_auth_key_structure(void)
     return 0;
 }
 
+static int test_auth_key_cache(void)
+{
+    struct kfi_cxi_auth_key *a, *b, *c, *first;
+    struct kfi_device *kdev;
+    static struct kfi_pd kpd;
+    static struct kfi_qp kqp;
+    int ret = 0;
+
+    pr_info("TEST: Auth key cache\n");
+
+    kdev = kzalloc(sizeof(*kdev), GFP_KERNEL);
+    if (!kdev)
+        return -1;
+    kfi_auth_key_cache_init(kdev);
+
+    a = kfi_auth_key_get(kdev, 1000, 1, 0);
+    b = kfi_auth_key_get(kdev, 1000, 1, 0);
+    c = kfi_auth_key_get(kdev, 1000, 1, 2);
+    if (IS_ERR(a) || IS_ERR(b) || IS_ERR(c) || a != b || a == c ||
+        atomic_read(&kdev->nr_auth_keys) != 2) {
+        pr_err("FAIL: tuples not shared/separated (keys=%d)\n",
+               atomic_read(&kdev->nr_auth_keys));
+        kfree(kdev);
+        return -1;
+    }
+    pr_info("  Same tuple shared, new traffic class gets its own key\n");
+
+    kfi_auth_key_put(kdev, a);
+    kfi_auth_key_put(kdev, c);
+    if (atomic_read(&kdev->nr_auth_keys) != 1) {
+        pr_err("FAIL: unused key not freed\n");
+        ret = -1;
+    }
+    kfi_auth_key_put(kdev, b);
+
+    /* INIT then connect must not allocate a second key */
+    memset(&kpd, 0, sizeof(kpd));
+    memset(&kqp, 0, sizeof(kqp));
+    kpd.device = kdev;
+    kqp.pd = &kpd;
+    kqp.vni_from_mount = 1234;
+
+    if (kfi_get_auth_key(&kqp)) {
+        pr_err("FAIL: kfi_get_auth_key\n");
+        ret = -1;
+        goto out;
+    }
+    first = kqp.auth_key;
+    kfi_get_auth_key(&kqp);
+    if (kqp.auth_key != first || kqp.auth_key->vni != 1234 ||
+        atomic_read(&kdev->nr_auth_keys) != 1) {
+        pr_err("FAIL: second kfi_get_auth_key re-resolved the key\n");
+        ret = -1;
+    }
+    pr_info("  INIT + connect resolve VNI %u once\n", kqp.auth_key->vni);
+
+    kfi_put_auth_key(&kqp);
+    if (atomic_read(&kdev->nr_auth_keys) != 0) {
+        pr_err("FAIL: key leaked after last put\n");
+        ret = -1;
+    }
+
+out:
+    kfi_auth_key_cache_destroy(kdev);
+    kfree(kdev);
+    if (!ret)
+        pr_info("PASS: Auth key cache\n");
+    return ret;
+}
+
+static int test_auth_key_open(void)
+{
+    struct kfi_cxi_auth_key *key;
+    struct kfi_ep_attr attr = {};
+    struct kfi_device *kdev;
+    static struct kfi_pd kpd;
+    static struct kfi_qp kqp;
+    int ret = 0;
+
+    pr_info("TEST: Endpoint opened with a non-default VNI\n");
+
+    kdev = kzalloc(sizeof(*kdev), GFP_KERNEL);
+    if (!kdev)
+        return -1;
+    kfi_auth_key_cache_init(kdev);
+
+    memset(&kpd, 0, sizeof(kpd));
+    memset(&kqp, 0, sizeof(kqp));
+    kpd.device = kdev;
+    kqp.pd = &kpd;
+    kqp.vni_from_mount = 4321;
+    kqp.traffic_class = KFI_TC_LOW_LATENCY;
+
+    if (kfi_get_auth_key(&kqp) ||
+        kfi_ep_attr_set_auth_key(&attr, kqp.auth_key)) {
+        pr_err("FAIL: could not set the auth key\n");
+        ret = -1;
+        goto out;
+    }
+
+    key = (struct kfi_cxi_auth_key *)attr.auth_key;
+    if (attr.auth_key_size != sizeof(*key) || key == kqp.auth_key ||
+        key->vni != 4321 || key->traffic_class != KFI_TC_LOW_LATENCY) {
+        pr_err("FAIL: endpoint attributes carry the wrong key\n");
+        ret = -1;
+    }
+    pr_info("  kfi_endpoint() gets VNI %u tc %u\n", key->vni,
+            key->traffic_class);
+    kfree(attr.auth_key);
+
+    /* Once open, the key is fixed */
+    kqp.ep = (struct kfid_ep *)0x1000;
+    if (kfi_get_auth_key(&kqp)) {
+        pr_err("FAIL: same tuple refused on an open endpoint\n");
+        ret = -1;
+    }
+    kqp.vni_from_mount = 1234;
+    if (kfi_get_auth_key(&kqp) != -EINVAL || kqp.auth_key->vni != 4321) {
+        pr_err("FAIL: open endpoint switched to VNI %u\n",
+               kqp.auth_key->vni);
+        ret = -1;
+    }
+    pr_info("  Open endpoint refuses VNI 1234\n");
+
+    kqp.ep = NULL;
+    kfi_put_auth_key(&kqp);
+
+out:
+    kfi_auth_key_cache_destroy(kdev);
+    kfree(kdev);
+    if (!ret)
+        pr_info("PASS: Endpoint opened with a non-default VNI\n");
+    return ret;
+}
+
 static int test_qp_state_transitions(void)
 {
     pr_info("TEST: QP state constants\n");
@@ -142,6 +327,56 @@ static int test_qp_state_transitions(void)
     return 0;
 }
 
+static int test_qp_context_selection(void)
+{
+    static struct kfi_qp kqp;
+    struct kfi_qp_ctx tx[4];
+    struct kfid_ep *rx[3];
+    struct kfi_qp_ctx *ctx;
+    unsigned long flags;
+    int i, hits[3] = {};
+
+    pr_info("TEST: QP tx/rx context selection\n");
+
+    memset(&kqp, 0, sizeof(kqp));
+    memset(tx, 0, sizeof(tx));
+    for (i = 0; i < ARRAY_SIZE(tx); i++)
+        spin_lock_init(&tx[i].lock);
+    for (i = 0; i < ARRAY_SIZE(rx); i++)
+        rx[i] = (struct kfid_ep *)(uintptr_t)(0x1000 + i);
+
+    kqp.tx_ctx = tx;
+    kqp.nr_tx = ARRAY_SIZE(tx);
+    kqp.rx_ep = rx;
+    kqp.nr_rx = ARRAY_SIZE(rx);
+
+    /* Each CPU lands on its own context */
+    ctx = kfi_qp_tx_lock(&kqp, &flags);
+    i = smp_processor_id();
+    kfi_qp_tx_unlock(ctx, flags);
+    if (ctx != &tx[i % ARRAY_SIZE(tx)]) {
+        pr_err("FAIL: CPU %d got tx context %td\n", i, ctx - tx);
+        return -1;
+    }
+    pr_info("  CPU %d -> tx context %td\n", i, ctx - tx);
+
+    /* Receives are spread evenly over rx contexts */
+    for (i = 0; i < 30; i++) {
+        struct kfid_ep *ep = kfi_qp_rx_ep(&kqp);
+
+        hits[(uintptr_t)ep - 0x1000]++;
+    }
+    if (hits[0] != 10 || hits[1] != 10 || hits[2] != 10) {
+        pr_err("FAIL: rx spread %d/%d/%d\n", hits[0], hits[1], hits[2]);
+        return -1;
+    }
+    pr_info("  30 receives -> %d/%d/%d per rx context\n",
+            hits[0], hits[1], hits[2]);
+
+    pr_info("PASS: QP tx/rx context selection\n");
+    return 0;
+}
+
 static int __init test_connection_init(void)
 {
     int failures = 0;
@@ -152,10 +387,18 @@ static int __init test_connection_init(void)
         failures++;
     if (test_vni_parse_invalid())
         failures++;
+    if (test_busy_poll_parse())
+        failures++;
     if (test_auth_key_structure())
         failures++;
+    if (test_auth_key_cache())
+        failures++;
+    if (test_auth_key_open())
+        failures++;
     if (test_qp_state_transitions())
         failures++;
+    if (test_qp_context_selection())
+        failures++;
 
     pr_info("=== Connection tests: %d failures ===\n", failures);
 
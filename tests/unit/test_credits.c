@@ -0,0 +1,311 @@
+/*
+ * Unit tests for credit grants and the client congestion window
+ *
+ * Both are pure computations, driven here with synthetic grants, RTT
+ * samples and server state; no kfabric devices or CXI hardware needed.
+ */
+
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/time64.h>
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Credit and congestion window unit tests");
+
+static int test_cwnd_slow_start(void)
+{
+    struct kfi_cwnd cw;
+    int i;
+
+    pr_info("TEST: window grows to the grant\n");
+
+    kfi_cwnd_init(&cw);
+    if (cw.window != 1 || cw.credits != 1) {
+        pr_err("FAIL: new window is %u/%u, expected 1/1\n", cw.window,
+               cw.credits);
+        return -1;
+    }
+
+    /* Nothing to grow into until the server grants more */
+    if (kfi_cwnd_complete(&cw, 0, 0)) {
+        pr_err("FAIL: window grew beyond a grant of 1\n");
+        return -1;
+    }
+
+    kfi_cwnd_grant(&cw, 64);
+    for (i = 0; i < 63; i++)
+        kfi_cwnd_complete(&cw, 0, 0);
+    if (cw.window != 64) {
+        pr_err("FAIL: window %u after 63 completions, expected 64\n",
+               cw.window);
+        return -1;
+    }
+
+    if (kfi_cwnd_complete(&cw, 0, 0) || cw.window != 64) {
+        pr_err("FAIL: window exceeded the grant\n");
+        return -1;
+    }
+
+    /* A smaller grant caps the window immediately */
+    if (!kfi_cwnd_grant(&cw, 16) || cw.window != 16) {
+        pr_err("FAIL: window %u after grant 16\n", cw.window);
+        return -1;
+    }
+
+    pr_info("PASS: window grows to the grant\n");
+    return 0;
+}
+
+static int test_cwnd_rtt(void)
+{
+    struct kfi_cwnd cw;
+    u64 now = 1000;
+    u32 win;
+    int i;
+
+    pr_info("TEST: window backs off when round trips grow\n");
+
+    kfi_cwnd_init(&cw);
+    kfi_cwnd_grant(&cw, 64);
+
+    /* Uncongested: 100us round trips, the window opens fully */
+    for (i = 0; i < 100; i++, now += 10)
+        kfi_cwnd_complete(&cw, 100, now);
+    if (cw.window != 64 || cw.min_rtt_us != 100) {
+        pr_err("FAIL: window %u min_rtt %u at 100us\n", cw.window,
+               cw.min_rtt_us);
+        return -1;
+    }
+
+    /* Server queueing: round trips quadruple until the window shrinks */
+    for (i = 0; i < 20 && cw.window == 64; i++, now += 10)
+        kfi_cwnd_complete(&cw, 400, now);
+    if (cw.window != 48 || cw.ssthresh != 48) {
+        pr_err("FAIL: window %u ssthresh %u after RTT growth, expected 48\n",
+               cw.window, cw.ssthresh);
+        return -1;
+    }
+
+    /* Not again within the same round trip */
+    kfi_cwnd_complete(&cw, 400, now);
+    if (cw.window != 48) {
+        pr_err("FAIL: window shrank twice in one round trip\n");
+        return -1;
+    }
+
+    /* A couple of round trips later it shrinks again */
+    now += 2 * (cw.srtt_us >> KFI_CWND_SRTT_SHIFT);
+    kfi_cwnd_complete(&cw, 400, now);
+    if (cw.window != 36) {
+        pr_err("FAIL: window %u a round trip later, expected 36\n",
+               cw.window);
+        return -1;
+    }
+
+    /* Congestion clears: additive growth, one per window of completions */
+    for (i = 0; i < 200; i++, now += 10)
+        kfi_cwnd_complete(&cw, 100, now);
+    win = cw.window;
+    if (win <= 36 || win >= 64) {
+        pr_err("FAIL: window %u after recovery, expected slow growth\n", win);
+        return -1;
+    }
+    pr_info("  window 64 -> 48 -> 36 -> %u\n", win);
+
+    /* Never below one */
+    kfi_cwnd_grant(&cw, 1);
+    for (i = 0; i < 10; i++, now += 100000)
+        kfi_cwnd_complete(&cw, 100000, now);
+    if (cw.window != 1) {
+        pr_err("FAIL: window %u, expected 1\n", cw.window);
+        return -1;
+    }
+
+    /* The baseline is forgotten after a while */
+    kfi_cwnd_init(&cw);
+    kfi_cwnd_complete(&cw, 100, 0);
+    kfi_cwnd_complete(&cw, 300, KFI_CWND_MIN_RTT_WIN_US + 1);
+    if (cw.min_rtt_us != 300) {
+        pr_err("FAIL: stale min_rtt %u kept\n", cw.min_rtt_us);
+        return -1;
+    }
+
+    pr_info("PASS: window backs off when round trips grow\n");
+    return 0;
+}
+
+static int test_svc_grant(void)
+{
+    struct kfi_svc_credit_state st = {
+        .requested = 128,
+        .granted = 1,
+        .posted = 128,
+        .threads = 16,
+        .threads_idle = 16,
+    };
+    u32 grant;
+    int i;
+
+    pr_info("TEST: server credit grant\n");
+
+    /* A new connection ramps up a step at a time */
+    grant = kfi_svc_credit_grant(&st);
+    if (grant != 1 + KFI_SVC_CREDIT_STEP) {
+        pr_err("FAIL: first grant %u\n", grant);
+        return -1;
+    }
+    for (i = 0; i < 32; i++) {
+        st.granted = grant;
+        grant = kfi_svc_credit_grant(&st);
+    }
+    if (grant != 128) {
+        pr_err("FAIL: grant %u after ramp, expected 128\n", grant);
+        return -1;
+    }
+
+    /* Never more than the client asked for */
+    st.requested = 32;
+    if (kfi_svc_credit_grant(&st) != 32) {
+        pr_err("FAIL: grant exceeds request\n");
+        return -1;
+    }
+    st.requested = 128;
+
+    /* Shared receive queue: a fair share of the free buffers */
+    st.posted = 0;
+    st.srq_free = 256;
+    st.srq_conns = 8;
+    st.outstanding = 4;
+    grant = kfi_svc_credit_grant(&st);
+    if (grant != 4 + 32) {
+        pr_err("FAIL: SRQ grant %u, expected 36\n", grant);
+        return -1;
+    }
+
+    /* All threads busy: hold, and shrink once calls queue behind them */
+    st.granted = 64;
+    st.srq_free = 1024;
+    st.threads_idle = 0;
+    st.outstanding = 8;
+    grant = kfi_svc_credit_grant(&st);
+    if (grant != 64) {
+        pr_err("FAIL: saturated grant %u, expected 64\n", grant);
+        return -1;
+    }
+    st.outstanding = 20;
+    grant = kfi_svc_credit_grant(&st);
+    if (grant != 48) {
+        pr_err("FAIL: backlogged grant %u, expected 48\n", grant);
+        return -1;
+    }
+
+    /* Out of buffers: still one, so the client is never stuck */
+    st.srq_free = 0;
+    st.outstanding = 0;
+    st.threads_idle = 4;
+    if (kfi_svc_credit_grant(&st) != 1) {
+        pr_err("FAIL: exhausted server does not grant 1\n");
+        return -1;
+    }
+
+    pr_info("PASS: server credit grant\n");
+    return 0;
+}
+
+static int test_svc_wspace(void)
+{
+    struct kfi_svc_wspace_state st = {
+        .sq_depth = 256,
+        .reply_ops = 1,
+        .rd_max = 64,
+        .conns = 4,
+    };
+
+    pr_info("TEST: server room to reply\n");
+
+    /* Nothing posted: always room, even on a full queue */
+    st.sq_used = 256;
+    if (!kfi_svc_has_wspace(&st)) {
+        pr_err("FAIL: idle connection held back\n");
+        return -1;
+    }
+
+    /* The queue lacks room for a typical reply */
+    st.conn_sq_used = 8;
+    st.sq_used = 250;
+    st.reply_ops = 9;
+    if (kfi_svc_has_wspace(&st)) {
+        pr_err("FAIL: reply taken with 6 slots free, 9 needed\n");
+        return -1;
+    }
+    st.sq_used = 100;
+    if (!kfi_svc_has_wspace(&st)) {
+        pr_err("FAIL: connection held back with room to reply\n");
+        return -1;
+    }
+
+    /* Within its fair share of the queue (64 of 256) and no further */
+    st.conn_sq_used = 56;
+    st.reply_ops = 8;
+    if (!kfi_svc_has_wspace(&st)) {
+        pr_err("FAIL: connection held back within its share\n");
+        return -1;
+    }
+    st.conn_sq_used = 57;
+    if (kfi_svc_has_wspace(&st)) {
+        pr_err("FAIL: connection exceeds its share of the queue\n");
+        return -1;
+    }
+
+    /* Its Reads hold its share of the read budget (16 of 64) */
+    st.conn_sq_used = 16;
+    st.conn_rd_used = 16;
+    if (kfi_svc_has_wspace(&st)) {
+        pr_err("FAIL: connection over its read budget takes a call\n");
+        return -1;
+    }
+
+    /* A lone connection may use the whole queue */
+    st.conns = 1;
+    st.conn_rd_used = 0;
+    st.conn_sq_used = 200;
+    st.sq_used = 200;
+    if (!kfi_svc_has_wspace(&st)) {
+        pr_err("FAIL: lone connection held to a share\n");
+        return -1;
+    }
+
+    pr_info("PASS: server room to reply\n");
+    return 0;
+}
+
+static int __init test_credits_init(void)
+{
+    int failures = 0;
+
+    pr_info("=== Running credit unit tests ===\n");
+
+    if (test_cwnd_slow_start())
+        failures++;
+    if (test_cwnd_rtt())
+        failures++;
+    if (test_svc_grant())
+        failures++;
+    if (test_svc_wspace())
+        failures++;
+
+    pr_info("=== Credit tests: %d failures ===\n", failures);
+
+    /* Return error to prevent module staying loaded */
+    return failures ? -EINVAL : -EAGAIN;
+}
+
+static void __exit test_credits_exit(void)
+{
+    pr_info("Credit tests unloaded\n");
+}
+
+module_init(test_credits_init);
+module_exit(test_credits_exit);
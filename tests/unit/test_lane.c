@@ -0,0 +1,183 @@
+/*
+ * Unit tests for metadata/data lane classification
+ *
+ * Lane sets are allocated without endpoints, so these tests need
+ * neither kfabric devices nor CXI hardware.
+ */
+
+#include <linux/module.h>
+#include <linux/sunrpc/xprt.h>
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Metadata/data lane unit tests");
+
+static int test_lane_classify(void)
+{
+    struct kfi_lane_set *set;
+    int ret = 0;
+
+    pr_info("TEST: Lane classification by payload\n");
+
+    set = kfi_lane_set_alloc(KFI_NR_LANES);
+    if (IS_ERR(set))
+        return -1;
+
+    /* GETATTR, LOOKUP, ...: no page data */
+    if (kfi_lane_classify(set, 0, 0) != KFI_LANE_META) {
+        pr_err("FAIL: metadata RPC not on the meta lane\n");
+        ret = -1;
+    }
+
+    /* 1 MiB WRITE and READ */
+    if (kfi_lane_classify(set, 1024 * 1024, 0) != KFI_LANE_BULK ||
+        kfi_lane_classify(set, 0, 1024 * 1024) != KFI_LANE_BULK) {
+        pr_err("FAIL: large READ/WRITE not on the bulk lane\n");
+        ret = -1;
+    }
+
+    /* Small READ stays with the metadata traffic */
+    if (kfi_lane_classify(set, 0, set->meta_max) != KFI_LANE_META) {
+        pr_err("FAIL: %zu-byte READ left the meta lane\n", set->meta_max);
+        ret = -1;
+    }
+
+    if (set->lanes[KFI_LANE_META].traffic_class ==
+        set->lanes[KFI_LANE_BULK].traffic_class) {
+        pr_err("FAIL: both lanes share traffic class %u\n",
+               set->lanes[KFI_LANE_META].traffic_class);
+        ret = -1;
+    }
+    pr_info("  meta tc=%u, bulk tc=%u, meta_max=%zu\n",
+            set->lanes[KFI_LANE_META].traffic_class,
+            set->lanes[KFI_LANE_BULK].traffic_class, set->meta_max);
+
+    kfi_lane_set_destroy(set);
+
+    if (!ret)
+        pr_info("PASS: Lane classification\n");
+    return ret;
+}
+
+static int test_lane_single(void)
+{
+    struct kfi_lane_set *set;
+    int ret = 0;
+
+    pr_info("TEST: Single-lane set\n");
+
+    set = kfi_lane_set_alloc(1);
+    if (IS_ERR(set))
+        return -1;
+
+    if (kfi_lane_classify(set, 0, 1024 * 1024) != KFI_LANE_META ||
+        set->lanes[KFI_LANE_META].traffic_class != KFI_TC_BEST_EFFORT) {
+        pr_err("FAIL: single-lane set must keep everything on one endpoint\n");
+        ret = -1;
+    }
+
+    kfi_lane_set_destroy(set);
+
+    if (PTR_ERR(kfi_lane_set_alloc(0)) != -EINVAL ||
+        PTR_ERR(kfi_lane_set_alloc(KFI_NR_LANES + 1)) != -EINVAL) {
+        pr_err("FAIL: invalid lane counts accepted\n");
+        ret = -1;
+    }
+
+    if (!ret)
+        pr_info("PASS: Single-lane set\n");
+    return ret;
+}
+
+static int test_lane_select_accounting(void)
+{
+    static struct rpc_rqst getattr, read;
+    struct kfi_lane_set *set;
+    struct kfi_lane *lane;
+    int i, ret = 0;
+
+    pr_info("TEST: Lane selection accounting\n");
+
+    set = kfi_lane_set_alloc(KFI_NR_LANES);
+    if (IS_ERR(set))
+        return -1;
+
+    read.rq_rcv_buf.page_len = 1024 * 1024;
+
+    /* A burst of streaming reads must not pull GETATTR off its lane */
+    for (i = 0; i < 64; i++)
+        kfi_lane_select(set, &read);
+    lane = kfi_lane_select(set, &getattr);
+
+    if (lane != &set->lanes[KFI_LANE_META] ||
+        atomic64_read(&set->lanes[KFI_LANE_BULK].ops) != 64 ||
+        atomic64_read(&set->lanes[KFI_LANE_BULK].bytes) != 64LL * 1024 * 1024 ||
+        atomic64_read(&set->lanes[KFI_LANE_META].ops) != 1) {
+        pr_err("FAIL: meta ops=%lld bulk ops=%lld bytes=%lld\n",
+               atomic64_read(&set->lanes[KFI_LANE_META].ops),
+               atomic64_read(&set->lanes[KFI_LANE_BULK].ops),
+               atomic64_read(&set->lanes[KFI_LANE_BULK].bytes));
+        ret = -1;
+    }
+
+    kfi_lane_set_destroy(set);
+
+    if (!ret)
+        pr_info("PASS: Lane selection accounting\n");
+    return ret;
+}
+
+static int test_lanes_parse(void)
+{
+    unsigned int lanes = 0;
+
+    pr_info("TEST: lanes= mount option parsing\n");
+
+    if (kfi_parse_lanes_from_options("vni=10,lanes=2", &lanes) || lanes != 2) {
+        pr_err("FAIL: 'lanes=2' parsed as %u\n", lanes);
+        return -1;
+    }
+
+    if (kfi_parse_lanes_from_options("lanes=0", &lanes) != -EINVAL) {
+        pr_err("FAIL: 'lanes=0' should be rejected\n");
+        return -1;
+    }
+
+    if (kfi_parse_lanes_from_options("lanes=3", &lanes) != -ERANGE) {
+        pr_err("FAIL: 'lanes=3' should be -ERANGE\n");
+        return -1;
+    }
+
+    pr_info("PASS: lanes= parsing\n");
+    return 0;
+}
+
+static int __init test_lane_init(void)
+{
+    int failures = 0;
+
+    pr_info("=== Running lane unit tests ===\n");
+
+    if (test_lane_classify())
+        failures++;
+    if (test_lane_single())
+        failures++;
+    if (test_lane_select_accounting())
+        failures++;
+    if (test_lanes_parse())
+        failures++;
+
+    pr_info("=== Lane tests: %d failures ===\n", failures);
+
+    /* Return error to prevent module staying loaded */
+    return failures ? -EINVAL : -EAGAIN;
+}
+
+static void __exit test_lane_exit(void)
+{
+    pr_info("Lane tests unloaded\n");
+}
+
+module_init(test_lane_init);
+module_exit(test_lane_exit);
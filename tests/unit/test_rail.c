@@ -0,0 +1,263 @@
+/*
+ * Unit tests for multi-rail selection
+ *
+ * Rails are added without endpoints (bookkeeping only), so these tests
+ * need neither kfabric devices nor CXI hardware.
+ */
+
+#include <linux/module.h>
+#include <linux/numa.h>
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Multi-rail unit tests");
+
+static int test_rail_load_balance(void)
+{
+    struct kfi_rail_set *set;
+    struct kfi_rail *a, *b, *c;
+    int ret = 0;
+
+    pr_info("TEST: Rail load balancing by outstanding bytes\n");
+
+    set = kfi_rail_set_alloc();
+    if (IS_ERR(set))
+        return -1;
+
+    kfi_rail_add(set, NUMA_NO_NODE);
+    kfi_rail_add(set, NUMA_NO_NODE);
+
+    a = kfi_rail_select(set, 1024 * 1024, NUMA_NO_NODE);
+    b = kfi_rail_select(set, 4096, NUMA_NO_NODE);
+    if (IS_ERR(a) || IS_ERR(b) || a == b) {
+        pr_err("FAIL: second op should go to the idle rail\n");
+        ret = -1;
+        goto out;
+    }
+
+    /* b carries fewer bytes, so it keeps winning until it catches up */
+    c = kfi_rail_select(set, 4096, NUMA_NO_NODE);
+    if (c != b) {
+        pr_err("FAIL: op went to the busier rail\n");
+        ret = -1;
+    }
+
+    kfi_rail_complete(a, 1024 * 1024, true);
+    kfi_rail_complete(b, 4096, true);
+    kfi_rail_complete(c, 4096, false);
+
+    if (atomic64_read(&a->outstanding_bytes) ||
+        atomic64_read(&b->outstanding_bytes) ||
+        atomic64_read(&b->errors) != 1) {
+        pr_err("FAIL: completion accounting is off\n");
+        ret = -1;
+    }
+    pr_info("  Rail 0: ops=%lld, rail 1: ops=%lld errors=%lld\n",
+            atomic64_read(&a->ops), atomic64_read(&b->ops),
+            atomic64_read(&b->errors));
+
+out:
+    kfi_rail_set_destroy(set);
+    if (!ret)
+        pr_info("PASS: Rail load balancing\n");
+    return ret;
+}
+
+static int test_rail_numa_preference(void)
+{
+    struct kfi_rail_set *set;
+    struct kfi_rail *r;
+    int ret = 0;
+
+    pr_info("TEST: Rail NUMA preference\n");
+
+    set = kfi_rail_set_alloc();
+    if (IS_ERR(set))
+        return -1;
+
+    kfi_rail_add(set, 0);
+    kfi_rail_add(set, 1);
+
+    /* Buffer on node 1 goes to the node 1 NIC while it is not overloaded */
+    r = kfi_rail_select(set, 65536, 1);
+    if (r != &set->rails[1]) {
+        pr_err("FAIL: node 1 buffer not sent on node 1 rail\n");
+        ret = -1;
+    } else {
+        kfi_rail_complete(r, 65536, true);
+    }
+
+    /* ...but spills to the remote NIC once the local one is backed up */
+    atomic64_set(&set->rails[1].outstanding_bytes,
+                 2 * KFI_RAIL_REMOTE_PENALTY);
+    r = kfi_rail_select(set, 65536, 1);
+    if (r != &set->rails[0]) {
+        pr_err("FAIL: busy local rail should spill to remote rail\n");
+        ret = -1;
+    }
+    pr_info("  Local rail preferred, remote rail used under load\n");
+
+    kfi_rail_set_destroy(set);
+    if (!ret)
+        pr_info("PASS: Rail NUMA preference\n");
+    return ret;
+}
+
+static int test_rail_failover(void)
+{
+    struct kfi_rail_set *set;
+    struct kfi_rail *r;
+    int i, ret = 0;
+
+    pr_info("TEST: Rail failover\n");
+
+    set = kfi_rail_set_alloc();
+    if (IS_ERR(set))
+        return -1;
+
+    for (i = 0; i < 4; i++)
+        kfi_rail_add(set, NUMA_NO_NODE);
+
+    /* A failed rail is never selected again */
+    if (kfi_rail_fail(set, &set->rails[0]) != 3) {
+        pr_err("FAIL: active count after failure\n");
+        ret = -1;
+    }
+    for (i = 0; i < 16; i++) {
+        r = kfi_rail_select(set, 4096, NUMA_NO_NODE);
+        if (IS_ERR(r) || r == &set->rails[0]) {
+            pr_err("FAIL: failed rail still selected\n");
+            ret = -1;
+            break;
+        }
+        kfi_rail_complete(r, 4096, true);
+    }
+
+    /* Failing it again changes nothing */
+    if (kfi_rail_fail(set, &set->rails[0]) != 3) {
+        pr_err("FAIL: second failure of a rail counted again\n");
+        ret = -1;
+    }
+
+    kfi_rail_fail(set, &set->rails[1]);
+    kfi_rail_fail(set, &set->rails[2]);
+    kfi_rail_fail(set, &set->rails[3]);
+    r = kfi_rail_select(set, 4096, NUMA_NO_NODE);
+    if (PTR_ERR(r) != -ENOTCONN) {
+        pr_err("FAIL: select with no rails should be -ENOTCONN\n");
+        ret = -1;
+    }
+    pr_info("  Failed rails skipped, -ENOTCONN when none left\n");
+
+    kfi_rail_set_destroy(set);
+    if (!ret)
+        pr_info("PASS: Rail failover\n");
+    return ret;
+}
+
+static int test_rail_pick_and_clear(void)
+{
+    struct kfi_rail_set *set;
+    struct kfi_rail *r;
+    int ret = 0;
+
+    pr_info("TEST: Rail pick without charge, and clear\n");
+
+    set = kfi_rail_set_alloc();
+    if (IS_ERR(set))
+        return -1;
+
+    kfi_rail_add(set, 0);
+    kfi_rail_add(set, 1);
+
+    /* Picking alone charges nothing, so the same rail comes back */
+    r = kfi_rail_pick(set, 1);
+    if (r != &set->rails[1] || kfi_rail_pick(set, 1) != r ||
+        atomic64_read(&r->outstanding_bytes)) {
+        pr_err("FAIL: pick should be stable and free\n");
+        ret = -1;
+    }
+
+    /* Charging the rail actually used moves the next pick */
+    kfi_rail_charge(&set->rails[1], 2 * KFI_RAIL_REMOTE_PENALTY);
+    if (kfi_rail_pick(set, 1) != &set->rails[0]) {
+        pr_err("FAIL: charged rail still picked\n");
+        ret = -1;
+    }
+    kfi_rail_complete(&set->rails[1], 2 * KFI_RAIL_REMOTE_PENALTY, true);
+
+    /* A reconnect starts over with fresh rails */
+    kfi_rail_fail(set, &set->rails[0]);
+    kfi_rail_set_clear(set);
+    kfi_rail_add(set, NUMA_NO_NODE);
+    if (set->nr_rails != 1 || atomic_read(&set->nr_active) != 1 ||
+        test_bit(KFI_RAIL_F_FAILED, &set->rails[0].flags)) {
+        pr_err("FAIL: cleared set keeps old rails\n");
+        ret = -1;
+    }
+    pr_info("  Pick is side-effect free, clear resets the set\n");
+
+    kfi_rail_set_destroy(set);
+    if (!ret)
+        pr_info("PASS: Rail pick and clear\n");
+    return ret;
+}
+
+static int test_rails_parse(void)
+{
+    unsigned int rails;
+    int ret;
+
+    pr_info("TEST: rails= parsing\n");
+
+    ret = kfi_parse_rails_from_options("vni=1000,rails=4", &rails);
+    if (ret || rails != 4) {
+        pr_err("FAIL: 'vni=1000,rails=4' -> %u (ret=%d)\n", rails, ret);
+        return -1;
+    }
+
+    if (kfi_parse_rails_from_options("rails=0", &rails) == 0) {
+        pr_err("FAIL: 'rails=0' should fail\n");
+        return -1;
+    }
+
+    if (kfi_parse_rails_from_options("rails=99", &rails) != -ERANGE) {
+        pr_err("FAIL: 'rails=99' should be -ERANGE\n");
+        return -1;
+    }
+
+    pr_info("PASS: rails= parsing\n");
+    return 0;
+}
+
+static int __init test_rail_init(void)
+{
+    int failures = 0;
+
+    pr_info("=== Running multi-rail unit tests ===\n");
+
+    if (test_rail_load_balance())
+        failures++;
+    if (test_rail_numa_preference())
+        failures++;
+    if (test_rail_failover())
+        failures++;
+    if (test_rail_pick_and_clear())
+        failures++;
+    if (test_rails_parse())
+        failures++;
+
+    pr_info("=== Multi-rail tests: %d failures ===\n", failures);
+
+    /* Return error to prevent module staying loaded */
+    return failures ? -EINVAL : -EAGAIN;
+}
+
+static void __exit test_rail_exit(void)
+{
+    pr_info("Multi-rail tests unloaded\n");
+}
+
+module_init(test_rail_init);
+module_exit(test_rail_exit);
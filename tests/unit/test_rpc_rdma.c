@@ -0,0 +1,903 @@
+/*
+ * Unit tests for RPC-over-RDMA marshalling
+ *
+ * Covers the Version One and Two header codecs, property exchange,
+ * multi-call envelopes, callback detection, the server's chunk list
+ * decoding and reply headers, chunk construction and the chunk decisions made for typical
+ * NFS calls. Nothing is registered or sent, so these tests need neither
+ * kfabric devices nor CXI hardware.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/highmem.h>
+#include <linux/sunrpc/xprt.h>
+#include <linux/sunrpc/rpc_rdma.h>
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("RPC-over-RDMA marshalling unit tests");
+
+#define TEST_HDR_SIZE   4096
+
+static struct kfi_seg rsegs[KFI_XPRT_MAX_SEGS];
+static struct kfi_seg wsegs[KFI_XPRT_MAX_SEGS];
+
+static void make_chunk(struct kfi_chunk *ch, struct kfi_seg *segs, int nsegs,
+                       u32 seglen)
+{
+    int i;
+
+    memset(ch, 0, sizeof(*ch));
+    ch->segs = segs;
+    for (i = 0; i < nsegs; i++) {
+        segs[i].handle = 0x1000 + i;
+        segs[i].length = seglen;
+        segs[i].offset = 0xffff888000000000ULL + (u64)i * 2 * seglen;
+        ch->length += seglen;
+    }
+    ch->nsegs = nsegs;
+}
+
+static int test_hdr_roundtrip(void)
+{
+    struct kfi_chunk rchunk, wchunk;
+    struct kfi_rpcrdma_hdr hdr;
+    __be32 xid = cpu_to_be32(0xdeadbeef);
+    void *buf;
+    int len, ret = 0;
+
+    pr_info("TEST: transport header round trip\n");
+
+    buf = kzalloc(TEST_HDR_SIZE, GFP_KERNEL);
+    if (!buf)
+        return -1;
+
+    /* WRITE with a Read chunk, READ-style Write chunk for the reply */
+    make_chunk(&rchunk, rsegs, 2, 65536);
+    rchunk.position = 120;
+    make_chunk(&wchunk, wsegs, 3, 4096);
+
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, RPCRDMA_VERSION, xid, 128,
+                                 KFI_READCH, &rchunk, KFI_WRITECH, &wchunk);
+    if (len != kfi_rpcrdma_hdr_len(RPCRDMA_VERSION, KFI_READCH, &rchunk,
+                                   KFI_WRITECH, &wchunk)) {
+        pr_err("FAIL: encoded %d bytes, expected %u\n", len,
+               kfi_rpcrdma_hdr_len(RPCRDMA_VERSION, KFI_READCH, &rchunk,
+                                   KFI_WRITECH, &wchunk));
+        ret = -1;
+        goto out;
+    }
+
+    if (kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        hdr.xid != xid || hdr.credits != 128 || hdr.proc != RDMA_MSG ||
+        hdr.nr_read != 2 || hdr.nr_write != 1 || hdr.write_len != 3 * 4096 ||
+        hdr.reply_chunk || hdr.hdrlen != len) {
+        pr_err("FAIL: READCH/WRITECH header did not decode back\n");
+        ret = -1;
+        goto out;
+    }
+    pr_info("  Read+Write chunk header: %d bytes\n", len);
+
+    /* Long call and long reply: RDMA_NOMSG with a Reply chunk */
+    rchunk.position = 0;
+    make_chunk(&wchunk, wsegs, 2, 8192);
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, RPCRDMA_VERSION, xid, 32,
+                                 KFI_AREADCH, &rchunk, KFI_REPLYCH, &wchunk);
+    if (len < 0 || kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        hdr.proc != RDMA_NOMSG || !hdr.reply_chunk ||
+        hdr.reply_len != 2 * 8192 || hdr.nr_write) {
+        pr_err("FAIL: AREADCH/REPLYCH header did not decode back\n");
+        ret = -1;
+        goto out;
+    }
+
+    /* Inline both ways is the minimal header */
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, RPCRDMA_VERSION, xid, 1,
+                                 KFI_NOCH, &rchunk, KFI_NOCH, &wchunk);
+    if (len != RPCRDMA_HDRLEN_MIN) {
+        pr_err("FAIL: inline header is %d bytes, expected %zu\n", len,
+               RPCRDMA_HDRLEN_MIN);
+        ret = -1;
+    }
+
+    /* A header that does not fit must not be written */
+    if (kfi_rpcrdma_encode_hdr(buf, 16, RPCRDMA_VERSION, xid, 1, KFI_NOCH,
+                               &rchunk, KFI_NOCH, &wchunk) != -EMSGSIZE) {
+        pr_err("FAIL: short buffer not rejected\n");
+        ret = -1;
+    }
+
+out:
+    kfree(buf);
+    if (!ret)
+        pr_info("PASS: transport header round trip\n");
+    return ret;
+}
+
+static int test_hdr_decode_errors(void)
+{
+    struct kfi_rpcrdma_hdr hdr;
+    __be32 msg[16];
+    int ret = 0;
+
+    pr_info("TEST: transport header error handling\n");
+
+    /* RDMA_ERROR / ERR_VERS with the server's version range */
+    msg[0] = cpu_to_be32(1);
+    msg[1] = rpcrdma_version;
+    msg[2] = cpu_to_be32(1);
+    msg[3] = rdma_error;
+    msg[4] = err_vers;
+    msg[5] = rpcrdma_version;
+    msg[6] = rpcrdma_version;
+    if (kfi_rpcrdma_decode_hdr(msg, 7 * sizeof(__be32), &hdr) ||
+        hdr.proc != RDMA_ERROR || hdr.err != ERR_VERS ||
+        hdr.hdrlen != 7 * sizeof(__be32) || hdr.vers_low != 1 ||
+        hdr.vers_high != 1) {
+        pr_err("FAIL: ERR_VERS not decoded\n");
+        ret = -1;
+    }
+
+    /* Truncated */
+    if (kfi_rpcrdma_decode_hdr(msg, 12, &hdr) != -EIO) {
+        pr_err("FAIL: truncated header accepted\n");
+        ret = -1;
+    }
+
+    /* Unknown version */
+    msg[1] = cpu_to_be32(7);
+    if (kfi_rpcrdma_decode_hdr(msg, 7 * sizeof(__be32), &hdr) !=
+        -EPROTONOSUPPORT) {
+        pr_err("FAIL: version 7 accepted\n");
+        ret = -1;
+    }
+
+    /* Write chunk claiming more segments than the message holds */
+    msg[1] = rpcrdma_version;
+    msg[3] = rdma_msg;
+    msg[4] = xdr_zero;              /* empty Read list */
+    msg[5] = xdr_one;               /* Write chunk ... */
+    msg[6] = cpu_to_be32(1000);     /* ... of 1000 segments */
+    if (kfi_rpcrdma_decode_hdr(msg, 7 * sizeof(__be32), &hdr) != -EIO) {
+        pr_err("FAIL: oversized Write chunk accepted\n");
+        ret = -1;
+    }
+
+    /* Missing Reply chunk discriminator */
+    msg[5] = xdr_zero;
+    if (kfi_rpcrdma_decode_hdr(msg, 6 * sizeof(__be32), &hdr) != -EIO) {
+        pr_err("FAIL: header without Reply chunk word accepted\n");
+        ret = -1;
+    }
+
+    if (!ret)
+        pr_info("PASS: transport header error handling\n");
+    return ret;
+}
+
+static int check_read_list(const char *what, const void *buf, int len,
+                           const struct kfi_chunk *sent)
+{
+    static struct kfi_seg segs[KFI_XPRT_MAX_SEGS];
+    struct kfi_rpcrdma_hdr hdr;
+    struct kfi_chunk ch = { .segs = segs };
+    int i;
+
+    if (len < 0 || kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        kfi_rpcrdma_decode_read_list(buf, &hdr, &ch)) {
+        pr_err("FAIL: %s: Read list not decoded\n", what);
+        return -1;
+    }
+
+    if (ch.position != sent->position || ch.length != sent->length ||
+        ch.nsegs != sent->nsegs) {
+        pr_err("FAIL: %s: position %u length %u segs %d\n", what,
+               ch.position, ch.length, ch.nsegs);
+        return -1;
+    }
+
+    for (i = 0; i < ch.nsegs; i++) {
+        if (segs[i].handle != sent->segs[i].handle ||
+            segs[i].length != sent->segs[i].length ||
+            segs[i].offset != sent->segs[i].offset) {
+            pr_err("FAIL: %s: segment %d differs\n", what, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int test_read_list(void)
+{
+    static struct kfi_seg segs[KFI_XPRT_MAX_SEGS];
+    struct kfi_chunk rchunk, wchunk, ch = { .segs = segs };
+    struct kfi_rpcrdma_hdr hdr;
+    __be32 xid = cpu_to_be32(0x2468ace0);
+    __be32 *p;
+    void *buf;
+    int len, ret = 0;
+
+    pr_info("TEST: server Read list decoding\n");
+
+    buf = kzalloc(TEST_HDR_SIZE, GFP_KERNEL);
+    if (!buf)
+        return -1;
+
+    /* NFS WRITE: the data item at position 148, in three segments */
+    make_chunk(&rchunk, rsegs, 3, 65536);
+    rchunk.position = 148;
+    make_chunk(&wchunk, wsegs, 1, 4096);
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, RPCRDMA_VERSION, xid, 64,
+                                 KFI_READCH, &rchunk, KFI_WRITECH, &wchunk);
+    if (check_read_list("Version One", buf, len, &rchunk))
+        ret = -1;
+
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, KFI_RPCRDMA_V2, xid, 64,
+                                 KFI_READCH, &rchunk, KFI_NOCH, &wchunk);
+    if (check_read_list("Version Two", buf, len, &rchunk))
+        ret = -1;
+
+    /* Long call: everything in a position-zero chunk */
+    rchunk.position = 0;
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, RPCRDMA_VERSION, xid, 64,
+                                 KFI_AREADCH, &rchunk, KFI_NOCH, &wchunk);
+    if (check_read_list("position zero", buf, len, &rchunk))
+        ret = -1;
+
+    /* No Read list: an empty chunk */
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, RPCRDMA_VERSION, xid, 64,
+                                 KFI_NOCH, &rchunk, KFI_NOCH, &wchunk);
+    ch.nsegs = 7;
+    if (kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        kfi_rpcrdma_decode_read_list(buf, &hdr, &ch) || ch.nsegs ||
+        ch.length) {
+        pr_err("FAIL: inline call has a Read chunk\n");
+        ret = -1;
+    }
+
+    /* Entries at two positions are refused */
+    rchunk.position = 148;
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, RPCRDMA_VERSION, xid, 64,
+                                 KFI_READCH, &rchunk, KFI_NOCH, &wchunk);
+    p = (__be32 *)buf + 4 + 6 + 1;      /* second entry's position */
+    *p = cpu_to_be32(300);
+    if (kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        kfi_rpcrdma_decode_read_list(buf, &hdr, &ch) != -EIO) {
+        pr_err("FAIL: Read chunks at two positions accepted\n");
+        ret = -1;
+    }
+
+    kfree(buf);
+    if (!ret)
+        pr_info("PASS: server Read list decoding\n");
+    return ret;
+}
+
+static int test_server_reply(void)
+{
+    static struct kfi_seg segs[KFI_XPRT_MAX_SEGS];
+    static struct kfi_seg rpsegs[KFI_XPRT_MAX_SEGS];
+    struct kfi_chunk rchunk, wchunk;
+    struct kfi_chunk wch = { .segs = segs }, rpch = { .segs = rpsegs };
+    struct kfi_rpcrdma_hdr hdr;
+    __be32 xid = cpu_to_be32(0x13572468);
+    void *buf;
+    int len, ret = 0;
+
+    pr_info("TEST: server Write list decoding and reply headers\n");
+
+    buf = kzalloc(TEST_HDR_SIZE, GFP_KERNEL);
+    if (!buf)
+        return -1;
+
+    /* NFS READ behind a Read chunk: the Write chunk is found past it */
+    make_chunk(&rchunk, rsegs, 2, 4096);
+    rchunk.position = 100;
+    make_chunk(&wchunk, wsegs, 2, 65536);
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, RPCRDMA_VERSION, xid, 32,
+                                 KFI_READCH, &rchunk, KFI_WRITECH, &wchunk);
+    if (len < 0 || kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        kfi_rpcrdma_decode_write_list(buf, &hdr, &wch, &rpch) ||
+        wch.nsegs != 2 || wch.length != 131072 || rpch.nsegs ||
+        segs[1].handle != wsegs[1].handle ||
+        segs[1].offset != wsegs[1].offset) {
+        pr_err("FAIL: Write chunk not decoded\n");
+        ret = -1;
+    }
+
+    /* Version Two call with a Reply chunk */
+    make_chunk(&wchunk, wsegs, 3, 8192);
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, KFI_RPCRDMA_V2, xid, 32,
+                                 KFI_NOCH, &rchunk, KFI_REPLYCH, &wchunk);
+    if (len < 0 || kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        kfi_rpcrdma_decode_write_list(buf, &hdr, &wch, &rpch) ||
+        wch.nsegs || rpch.nsegs != 3 || rpch.length != 3 * 8192) {
+        pr_err("FAIL: Reply chunk not decoded\n");
+        ret = -1;
+    }
+
+    /* READ reply: the Write chunk trimmed to the bytes written */
+    make_chunk(&wchunk, wsegs, 2, 65536);
+    wsegs[1].length = 1000;
+    wchunk.length = 65536 + 1000;
+    len = kfi_rpcrdma_encode_reply(buf, TEST_HDR_SIZE, RPCRDMA_VERSION, xid,
+                                   17, &wchunk, NULL);
+    if (len < 0 || kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        hdr.hdrlen != len || hdr.xid != xid || hdr.credits != 17 ||
+        hdr.proc != RDMA_MSG || hdr.nr_write != 1 ||
+        hdr.write_len != 66536 || hdr.reply_chunk) {
+        pr_err("FAIL: READ reply header (len %d)\n", len);
+        ret = -1;
+    }
+
+    /* Long Version Two reply: RDMA_NOMSG, marked as a response */
+    make_chunk(&wchunk, wsegs, 3, 8192);
+    len = kfi_rpcrdma_encode_reply(buf, TEST_HDR_SIZE, KFI_RPCRDMA_V2, xid,
+                                   8, NULL, &wchunk);
+    if (len < 0 || kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        hdr.hdrlen != len || hdr.proc != RDMA_NOMSG ||
+        hdr.flags != KFI_RDMA2_F_RESPONSE || hdr.nr_write ||
+        !hdr.reply_chunk || hdr.reply_len != 3 * 8192 ||
+        kfi_rpcrdma_is_bcall(&hdr, buf, len)) {
+        pr_err("FAIL: Reply chunk reply header (len %d)\n", len);
+        ret = -1;
+    }
+
+    /* Reply too large for the call's chunks: ERR_CHUNK in either version */
+    len = kfi_rpcrdma_encode_error(buf, TEST_HDR_SIZE, RPCRDMA_VERSION, xid,
+                                   5, ERR_CHUNK);
+    if (len != 5 * sizeof(__be32) || kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        hdr.xid != xid || hdr.credits != 5 || hdr.proc != RDMA_ERROR ||
+        hdr.err != ERR_CHUNK) {
+        pr_err("FAIL: ERR_CHUNK header (len %d)\n", len);
+        ret = -1;
+    }
+    len = kfi_rpcrdma_encode_error(buf, TEST_HDR_SIZE, KFI_RPCRDMA_V2, xid,
+                                   5, ERR_CHUNK);
+    if (len != 6 * sizeof(__be32) || kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        hdr.proc != RDMA_ERROR || hdr.err != ERR_CHUNK ||
+        hdr.flags != KFI_RDMA2_F_RESPONSE) {
+        pr_err("FAIL: Version Two ERR_CHUNK header (len %d)\n", len);
+        ret = -1;
+    }
+
+    if (kfi_rpcrdma_encode_reply(buf, 16, RPCRDMA_VERSION, xid, 1, NULL,
+                                 NULL) != -EMSGSIZE ||
+        kfi_rpcrdma_encode_error(buf, 16, RPCRDMA_VERSION, xid, 1,
+                                 ERR_CHUNK) != -EMSGSIZE) {
+        pr_err("FAIL: reply header overran its buffer\n");
+        ret = -1;
+    }
+
+    kfree(buf);
+    if (!ret)
+        pr_info("PASS: server Write list decoding and reply headers\n");
+    return ret;
+}
+
+static int test_v2_hdr(void)
+{
+    struct kfi_rpcrdma_props props = {
+        .sbsiz = 32768,
+        .rbsiz = 65536,
+        .rcsiz = 64,
+        .multi = 16,
+    };
+    struct kfi_chunk rchunk, wchunk;
+    struct kfi_rpcrdma_hdr hdr;
+    __be32 *p;
+    void *buf;
+    int len, ret = 0;
+
+    pr_info("TEST: Version Two header and properties\n");
+
+    buf = kzalloc(TEST_HDR_SIZE, GFP_KERNEL);
+    if (!buf)
+        return -1;
+    p = buf;
+
+    /* Chunk lists as in Version One, behind a flags word */
+    make_chunk(&rchunk, rsegs, 1, 65536);
+    make_chunk(&wchunk, wsegs, 2, 4096);
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, KFI_RPCRDMA_V2,
+                                 cpu_to_be32(7), 64, KFI_NOCH, &rchunk,
+                                 KFI_WRITECH, &wchunk);
+    if (len != kfi_rpcrdma_hdr_len(RPCRDMA_VERSION, KFI_NOCH, &rchunk,
+                                   KFI_WRITECH, &wchunk) + sizeof(__be32) ||
+        kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        hdr.vers != KFI_RPCRDMA_V2 || hdr.proc != RDMA_MSG || hdr.flags ||
+        hdr.nr_write != 1 || hdr.write_len != 8192 || hdr.hdrlen != len) {
+        pr_err("FAIL: Version Two header did not decode back\n");
+        ret = -1;
+    }
+
+    /* Our properties come back as sent */
+    len = kfi_rpcrdma_encode_connprop(buf, TEST_HDR_SIZE, 128, &props);
+    if (len < 0 || kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        hdr.proc != KFI_RDMA2_CONNPROP || hdr.credits != 128 ||
+        hdr.props.sbsiz != 32768 || hdr.props.rbsiz != 65536 ||
+        hdr.props.rcsiz != 64 || hdr.props.rssiz || hdr.props.brs ||
+        hdr.props.multi != 16 || hdr.hdrlen != len) {
+        pr_err("FAIL: RDMA2_CONNPROP did not decode back\n");
+        ret = -1;
+    }
+
+    /* A property with a longer value is skipped as a whole */
+    p[5] = cpu_to_be32(2);
+    p[6] = cpu_to_be32(99);         /* unknown property ... */
+    p[7] = cpu_to_be32(8);          /* ... with an 8-byte value */
+    p[10] = cpu_to_be32(KFI_RDMA2_PROP_RBSIZ);
+    p[11] = cpu_to_be32(4);
+    p[12] = cpu_to_be32(16384);
+    if (kfi_rpcrdma_decode_hdr(buf, 13 * sizeof(__be32), &hdr) ||
+        hdr.props.rbsiz != 16384 || hdr.props.sbsiz) {
+        pr_err("FAIL: unknown property not skipped\n");
+        ret = -1;
+    }
+
+    /* Property list running past the message */
+    if (kfi_rpcrdma_decode_hdr(buf, 10 * sizeof(__be32), &hdr) != -EIO) {
+        pr_err("FAIL: truncated property list accepted\n");
+        ret = -1;
+    }
+
+    /* RDMA2_ERROR is reported as RDMA_ERROR; v1's number is not valid */
+    p[0] = cpu_to_be32(7);
+    p[1] = cpu_to_be32(KFI_RPCRDMA_V2);
+    p[2] = cpu_to_be32(1);
+    p[3] = cpu_to_be32(KFI_RDMA2_ERROR);
+    p[4] = cpu_to_be32(KFI_RDMA2_F_RESPONSE);
+    p[5] = err_chunk;
+    if (kfi_rpcrdma_decode_hdr(buf, 6 * sizeof(__be32), &hdr) ||
+        hdr.proc != RDMA_ERROR || hdr.err != ERR_CHUNK ||
+        hdr.flags != KFI_RDMA2_F_RESPONSE) {
+        pr_err("FAIL: RDMA2_ERROR not decoded\n");
+        ret = -1;
+    }
+    p[3] = rdma_error;
+    if (kfi_rpcrdma_decode_hdr(buf, 6 * sizeof(__be32), &hdr) != -EIO) {
+        pr_err("FAIL: Version One RDMA_ERROR accepted in Version Two\n");
+        ret = -1;
+    }
+
+    kfree(buf);
+    if (!ret)
+        pr_info("PASS: Version Two header and properties\n");
+    return ret;
+}
+
+static int test_chunk_coalesce(void)
+{
+    struct kfi_chunk ch;
+    char *buf;
+    int i, ret = 0;
+
+    pr_info("TEST: chunk segment coalescing\n");
+
+    buf = kmalloc(4 * PAGE_SIZE, GFP_KERNEL);
+    if (!buf)
+        return -1;
+
+    memset(&ch, 0, sizeof(ch));
+    ch.segs = rsegs;
+
+    /* Virtually contiguous pieces share one segment (one registration) */
+    for (i = 0; i < 4; i++)
+        kfi_chunk_add_range(&ch, buf + i * PAGE_SIZE, PAGE_SIZE);
+    if (ch.nsegs != 1 || ch.length != 4 * PAGE_SIZE) {
+        pr_err("FAIL: contiguous pages gave %d segments\n", ch.nsegs);
+        ret = -1;
+    }
+
+    /* A gap starts a new one; empty pieces are ignored */
+    kfi_chunk_add_range(&ch, buf + 8 * PAGE_SIZE, 100);
+    kfi_chunk_add_range(&ch, buf, 0);
+    if (ch.nsegs != 2 || ch.length != 4 * PAGE_SIZE + 100) {
+        pr_err("FAIL: gap not split (nsegs=%d len=%u)\n", ch.nsegs,
+               ch.length);
+        ret = -1;
+    }
+
+    /* Running out of segments is reported, not overrun */
+    memset(&ch, 0, sizeof(ch));
+    ch.segs = rsegs;
+    for (i = 0; i < KFI_XPRT_MAX_SEGS; i++)
+        kfi_chunk_add_range(&ch, buf + 2 * i, 1);
+    if (kfi_chunk_add_range(&ch, buf + 2 * i, 1) != -EMSGSIZE ||
+        ch.nsegs != KFI_XPRT_MAX_SEGS) {
+        pr_err("FAIL: segment limit not enforced\n");
+        ret = -1;
+    }
+
+    kfree(buf);
+    if (!ret)
+        pr_info("PASS: chunk segment coalescing\n");
+    return ret;
+}
+
+static void make_xdr(struct xdr_buf *xdr, size_t head, size_t pages,
+                     size_t tail, unsigned int flags)
+{
+    memset(xdr, 0, sizeof(*xdr));
+    xdr->head[0].iov_len = head;
+    xdr->page_len = pages;
+    xdr->tail[0].iov_len = tail;
+    xdr->len = head + pages + tail;
+    xdr->buflen = xdr->len;
+    xdr->flags = flags;
+}
+
+static const char * const type_names[] = {
+    [KFI_NOCH] = "inline",
+    [KFI_READCH] = "read",
+    [KFI_AREADCH] = "position-zero read",
+    [KFI_WRITECH] = "write",
+    [KFI_REPLYCH] = "reply",
+};
+
+static int check_types(const char *what, struct rpc_rqst *rqst, u32 ddp_min,
+                       enum kfi_chunk_type want_r, enum kfi_chunk_type want_w)
+{
+    enum kfi_chunk_type r, w;
+
+    w = kfi_rpcrdma_reply_type(rqst, KFI_XPRT_INLINE_SIZE, ddp_min);
+    r = kfi_rpcrdma_call_type(rqst, RPCRDMA_HDRLEN_MIN, KFI_XPRT_INLINE_SIZE);
+    pr_info("  %-16s call %s, reply %s\n", what, type_names[r],
+            type_names[w]);
+
+    if (r != want_r || w != want_w) {
+        pr_err("FAIL: %s: expected call %s, reply %s\n", what,
+               type_names[want_r], type_names[want_w]);
+        return -1;
+    }
+    return 0;
+}
+
+static int test_chunk_types(void)
+{
+    struct rpc_rqst *rqst;
+    int ret = 0;
+
+    pr_info("TEST: chunk decisions\n");
+
+    rqst = kzalloc(sizeof(*rqst), GFP_KERNEL);
+    if (!rqst)
+        return -1;
+
+    /* GETATTR */
+    make_xdr(&rqst->rq_snd_buf, 180, 0, 0, 0);
+    make_xdr(&rqst->rq_rcv_buf, 400, 0, 0, 0);
+    ret |= check_types("GETATTR", rqst, 0, KFI_NOCH, KFI_NOCH);
+
+    /* 1 MiB READ: page cache filled directly by the server */
+    make_xdr(&rqst->rq_snd_buf, 200, 0, 0, 0);
+    make_xdr(&rqst->rq_rcv_buf, 200, 1 << 20, 0, XDRBUF_READ);
+    ret |= check_types("READ 1M", rqst, 0, KFI_NOCH, KFI_WRITECH);
+
+    /* Small READ: placed directly too, unless below ddp_min_read */
+    make_xdr(&rqst->rq_rcv_buf, 200, 2048, 0, XDRBUF_READ);
+    ret |= check_types("READ 2K", rqst, 0, KFI_NOCH, KFI_WRITECH);
+    ret |= check_types("READ 2K copied", rqst, 4096, KFI_NOCH, KFI_NOCH);
+
+    /* A READ whose header part does not fit inline needs a Reply chunk */
+    make_xdr(&rqst->rq_rcv_buf, 4000, 2048, 200, XDRBUF_READ);
+    ret |= check_types("READ big head", rqst, 0, KFI_NOCH, KFI_REPLYCH);
+
+    /* 1 MiB WRITE: server pulls the page cache */
+    make_xdr(&rqst->rq_snd_buf, 220, 1 << 20, 0, XDRBUF_WRITE);
+    make_xdr(&rqst->rq_rcv_buf, 300, 0, 0, 0);
+    ret |= check_types("WRITE 1M", rqst, 0, KFI_READCH, KFI_NOCH);
+
+    /* 2 KiB WRITE still fits inline */
+    make_xdr(&rqst->rq_snd_buf, 220, 2048, 0, XDRBUF_WRITE);
+    ret |= check_types("WRITE 2K", rqst, 0, KFI_NOCH, KFI_NOCH);
+
+    /* Large READDIR reply is not READ data: Reply chunk */
+    make_xdr(&rqst->rq_snd_buf, 200, 0, 0, 0);
+    make_xdr(&rqst->rq_rcv_buf, 200, 32768, 0, 0);
+    ret |= check_types("READDIR 32K", rqst, 0, KFI_NOCH, KFI_REPLYCH);
+
+    /* Large non-WRITE call (e.g. SETACL): position-zero Read chunk */
+    make_xdr(&rqst->rq_snd_buf, 8000, 0, 0, 0);
+    make_xdr(&rqst->rq_rcv_buf, 200, 0, 0, 0);
+    ret |= check_types("SETACL 8K", rqst, 0, KFI_AREADCH, KFI_NOCH);
+
+    kfree(rqst);
+    if (!ret)
+        pr_info("PASS: chunk decisions\n");
+    return ret ? -1 : 0;
+}
+
+static int test_multi_envelope(void)
+{
+    static const u32 lens[] = { 120, 61, 300 };
+    struct rpc_rqst *rqst;
+    struct kfi_rpcrdma_hdr hdr;
+    const void *call;
+    char *calls, *buf;
+    u32 off, pos, call_len;
+    int i, len, ret = 0;
+
+    pr_info("TEST: multi-call envelope\n");
+
+    rqst = kzalloc(sizeof(*rqst), GFP_KERNEL);
+    calls = kmalloc(1024, GFP_KERNEL);
+    buf = kzalloc(TEST_HDR_SIZE, GFP_KERNEL);
+    if (!rqst || !calls || !buf) {
+        ret = -1;
+        goto out;
+    }
+    for (i = 0; i < 1024; i++)
+        calls[i] = i * 7;
+
+    len = kfi_rpcrdma_encode_multi(buf, 1024, cpu_to_be32(42), 64);
+    off = 0;
+    for (i = 0; i < ARRAY_SIZE(lens); i++) {
+        make_xdr(&rqst->rq_snd_buf, lens[i], 0, 0, 0);
+        rqst->rq_snd_buf.head[0].iov_base = calls + off;
+        len = kfi_rpcrdma_multi_add(buf, 1024, len, &rqst->rq_snd_buf);
+        off += lens[i];
+    }
+    if (len != 6 * 4 + (4 + 120) + (4 + 64) + (4 + 300)) {
+        pr_err("FAIL: envelope length %d\n", len);
+        ret = -1;
+        goto out;
+    }
+
+    /* Full: the envelope is left as it was */
+    make_xdr(&rqst->rq_snd_buf, 1024 - len - 3, 0, 0, 0);
+    rqst->rq_snd_buf.head[0].iov_base = calls;
+    if (kfi_rpcrdma_multi_add(buf, 1024, len, &rqst->rq_snd_buf) !=
+        -EMSGSIZE) {
+        pr_err("FAIL: overfull envelope accepted\n");
+        ret = -1;
+    }
+
+    /* The server's view: the same calls, in order */
+    if (kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        hdr.proc != KFI_RDMA2_MULTI || hdr.nr_calls != ARRAY_SIZE(lens) ||
+        hdr.credits != 64 || hdr.hdrlen != 6 * 4) {
+        pr_err("FAIL: envelope header did not decode back\n");
+        ret = -1;
+        goto out;
+    }
+    off = hdr.hdrlen;
+    pos = 0;
+    for (i = 0; i < hdr.nr_calls; i++) {
+        if (kfi_rpcrdma_multi_next(buf, len, &off, &call, &call_len) ||
+            call_len != lens[i] || memcmp(call, calls + pos, call_len)) {
+            pr_err("FAIL: call %d not split back\n", i);
+            ret = -1;
+            break;
+        }
+        pos += call_len;
+    }
+    if (off != len) {
+        pr_err("FAIL: split ended at %u of %d\n", off, len);
+        ret = -1;
+    }
+
+    /* A truncated envelope is refused, not overrun */
+    off = hdr.hdrlen;
+    kfi_rpcrdma_multi_next(buf, len - 302, &off, &call, &call_len);
+    kfi_rpcrdma_multi_next(buf, len - 302, &off, &call, &call_len);
+    if (kfi_rpcrdma_multi_next(buf, len - 302, &off, &call, &call_len) !=
+        -EIO) {
+        pr_err("FAIL: truncated envelope accepted\n");
+        ret = -1;
+    }
+
+out:
+    kfree(buf);
+    kfree(calls);
+    kfree(rqst);
+    if (!ret)
+        pr_info("PASS: multi-call envelope\n");
+    return ret;
+}
+
+static int test_bcall(void)
+{
+    struct kfi_chunk wchunk;
+    struct kfi_rpcrdma_hdr hdr;
+    __be32 *p, *msg;
+    void *buf;
+    int len, ret = 0;
+
+    pr_info("TEST: callback detection\n");
+
+    buf = kzalloc(TEST_HDR_SIZE, GFP_KERNEL);
+    if (!buf)
+        return -1;
+    p = buf;
+
+    /* A reverse-direction call: RDMA_MSG, no chunks, an RPC CALL */
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, RPCRDMA_VERSION,
+                                 cpu_to_be32(9), 8, KFI_NOCH, NULL,
+                                 KFI_NOCH, NULL);
+    msg = buf + len;
+    msg[0] = cpu_to_be32(9);
+    msg[1] = cpu_to_be32(RPC_CALL);
+    len += 8 * sizeof(__be32);
+    if (kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        !kfi_rpcrdma_is_bcall(&hdr, buf, len)) {
+        pr_err("FAIL: callback not recognized\n");
+        ret = -1;
+    }
+
+    /* Too short to hold an RPC header */
+    if (kfi_rpcrdma_is_bcall(&hdr, buf, hdr.hdrlen + sizeof(__be32))) {
+        pr_err("FAIL: truncated callback accepted\n");
+        ret = -1;
+    }
+
+    /* The XID in the RPC message must be the transport's */
+    msg[0] = cpu_to_be32(10);
+    if (kfi_rpcrdma_is_bcall(&hdr, buf, len)) {
+        pr_err("FAIL: callback with mismatched XID accepted\n");
+        ret = -1;
+    }
+    msg[0] = cpu_to_be32(9);
+
+    /* Our own replies */
+    msg[1] = cpu_to_be32(RPC_REPLY);
+    if (kfi_rpcrdma_is_bcall(&hdr, buf, len)) {
+        pr_err("FAIL: reply taken for a callback\n");
+        ret = -1;
+    }
+    msg[1] = cpu_to_be32(RPC_CALL);
+
+    /* Version Two: a message marked as a response is never a call */
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, KFI_RPCRDMA_V2,
+                                 cpu_to_be32(9), 8, KFI_NOCH, NULL,
+                                 KFI_NOCH, NULL);
+    msg = buf + len;
+    msg[0] = cpu_to_be32(9);
+    msg[1] = cpu_to_be32(RPC_CALL);
+    len += 8 * sizeof(__be32);
+    if (kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        !kfi_rpcrdma_is_bcall(&hdr, buf, len)) {
+        pr_err("FAIL: Version Two callback not recognized\n");
+        ret = -1;
+    }
+    p[4] = cpu_to_be32(KFI_RDMA2_F_RESPONSE);
+    if (kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        kfi_rpcrdma_is_bcall(&hdr, buf, len)) {
+        pr_err("FAIL: Version Two response taken for a callback\n");
+        ret = -1;
+    }
+
+    /* Callbacks carry no chunks */
+    make_chunk(&wchunk, wsegs, 1, 4096);
+    len = kfi_rpcrdma_encode_hdr(buf, TEST_HDR_SIZE, RPCRDMA_VERSION,
+                                 cpu_to_be32(9), 8, KFI_NOCH, NULL,
+                                 KFI_WRITECH, &wchunk);
+    msg = buf + len;
+    msg[0] = cpu_to_be32(9);
+    msg[1] = cpu_to_be32(RPC_CALL);
+    len += 8 * sizeof(__be32);
+    if (kfi_rpcrdma_decode_hdr(buf, len, &hdr) ||
+        kfi_rpcrdma_is_bcall(&hdr, buf, len)) {
+        pr_err("FAIL: message with a Write chunk taken for a callback\n");
+        ret = -1;
+    }
+
+    kfree(buf);
+    if (!ret)
+        pr_info("PASS: callback detection\n");
+    return ret;
+}
+
+static int test_reply_fixup(void)
+{
+    struct rpc_rqst *rqst;
+    struct page *page;
+    char head[16], tail[32], src[128];
+    char *p;
+    int i, ret = 0;
+
+    pr_info("TEST: inline reply fixup\n");
+
+    rqst = kzalloc(sizeof(*rqst), GFP_KERNEL);
+    page = alloc_page(GFP_KERNEL);
+    if (!rqst || !page) {
+        kfree(rqst);
+        if (page)
+            __free_page(page);
+        return -1;
+    }
+
+    for (i = 0; i < sizeof(src); i++)
+        src[i] = i;
+
+    make_xdr(&rqst->rq_rcv_buf, sizeof(head), 100, sizeof(tail), 0);
+    rqst->rq_rcv_buf.head[0].iov_base = head;
+    rqst->rq_rcv_buf.tail[0].iov_base = tail;
+    rqst->rq_rcv_buf.pages = &page;
+
+    /* Inline reply: head, then page data, then tail */
+    if (kfi_rpcrdma_fixup(rqst, 0, src, 124, 0, false) != 100) {
+        pr_err("FAIL: page data not copied\n");
+        ret = -1;
+    }
+    p = page_address(page);
+    if (memcmp(head, src, 16) || memcmp(p, src + 16, 100) ||
+        memcmp(tail, src + 116, 8)) {
+        pr_err("FAIL: inline reply misplaced\n");
+        ret = -1;
+    }
+
+    /* Write chunk delivered the pages; the tail follows the XDR pad */
+    memset(tail, 0xff, sizeof(tail));
+    if (kfi_rpcrdma_fixup(rqst, 0, src, 24, 3, true) != 0) {
+        pr_err("FAIL: placed pages were overwritten\n");
+        ret = -1;
+    }
+    if (tail[0] || tail[1] || tail[2] || memcmp(tail + 3, src + 16, 8)) {
+        pr_err("FAIL: tail not realigned behind the pad\n");
+        ret = -1;
+    }
+
+    /* A reply continued over three Sends lands where one Send would */
+    memset(head, 0, sizeof(head));
+    memset(tail, 0, sizeof(tail));
+    memset(p, 0, PAGE_SIZE);
+    kfi_rpcrdma_fixup(rqst, 0, src, 10, 0, false);
+    kfi_rpcrdma_fixup(rqst, 10, src + 10, 60, 0, false);
+    kfi_rpcrdma_fixup(rqst, 70, src + 70, 54, 0, false);
+    if (memcmp(head, src, 16) || memcmp(p, src + 16, 100) ||
+        memcmp(tail, src + 116, 8)) {
+        pr_err("FAIL: continued reply misplaced\n");
+        ret = -1;
+    }
+
+    __free_page(page);
+    kfree(rqst);
+    if (!ret)
+        pr_info("PASS: inline reply fixup\n");
+    return ret;
+}
+
+static int __init test_rpc_rdma_init(void)
+{
+    int failures = 0;
+
+    pr_info("=== Running RPC-over-RDMA unit tests ===\n");
+
+    if (test_hdr_roundtrip())
+        failures++;
+    if (test_hdr_decode_errors())
+        failures++;
+    if (test_read_list())
+        failures++;
+    if (test_server_reply())
+        failures++;
+    if (test_v2_hdr())
+        failures++;
+    if (test_chunk_coalesce())
+        failures++;
+    if (test_chunk_types())
+        failures++;
+    if (test_multi_envelope())
+        failures++;
+    if (test_bcall())
+        failures++;
+    if (test_reply_fixup())
+        failures++;
+
+    pr_info("=== RPC-over-RDMA tests: %d failures ===\n", failures);
+
+    /* Return error to prevent module staying loaded */
+    return failures ? -EINVAL : -EAGAIN;
+}
+
+static void __exit test_rpc_rdma_exit(void)
+{
+    pr_info("RPC-over-RDMA tests unloaded\n");
+}
+
+module_init(test_rpc_rdma_init);
+module_exit(test_rpc_rdma_exit);
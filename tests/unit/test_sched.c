@@ -0,0 +1,363 @@
+/*
+ * Unit tests for the weighted fair submission scheduler
+ *
+ * Submissions are recorded instead of posted, and completions are fed
+ * back by hand, so these tests need neither kfabric devices nor CXI
+ * hardware.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Submission scheduler unit tests");
+
+#define NR_REQS         256
+
+struct test_req {
+    struct kfi_sched_req req;
+    int flow;
+};
+
+/* Dispatch order, as seen by the "provider" */
+static struct test_req *dispatched[2 * NR_REQS + 1];
+static int nr_dispatched;
+
+static int test_submit(struct kfi_sched_req *req)
+{
+    dispatched[nr_dispatched++] = container_of(req, struct test_req, req);
+    return 0;
+}
+
+static void fill(struct test_req *reqs, int n, int flow, u32 cost)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        reqs[i].flow = flow;
+        reqs[i].req.cost = cost;
+        reqs[i].req.submit = test_submit;
+    }
+}
+
+/* Let everything still queued out, so the flows can be put */
+static void drain(struct kfi_sched *s)
+{
+    s->max_inflight = U64_MAX;
+    kfi_sched_complete(s, 0);
+}
+
+/*
+ * Two flows stay backlogged while the device has room for exactly one
+ * submission. Complete @rounds submissions in order and count what
+ * each flow got.
+ */
+static void run_backlogged(struct kfi_sched *s, int rounds, u64 *bytes)
+{
+    int done;
+
+    bytes[0] = bytes[1] = 0;
+    for (done = 0; done < rounds && done < nr_dispatched; done++) {
+        struct test_req *t = dispatched[done];
+
+        bytes[t->flow] += t->req.cost;
+        kfi_sched_complete(s, t->req.cost);
+    }
+}
+
+static int test_sched_weights(void)
+{
+    struct kfi_sched_flow *a, *b;
+    struct test_req *reqs;
+    struct kfi_sched *s;
+    u64 bytes[2];
+    int i, ret = 0;
+
+    pr_info("TEST: Scheduler shares follow weights\n");
+
+    reqs = kcalloc(2 * NR_REQS, sizeof(*reqs), GFP_KERNEL);
+    if (!reqs)
+        return -1;
+
+    s = kfi_sched_create("test_sched_weights");
+    if (IS_ERR(s)) {
+        kfree(reqs);
+        return -1;
+    }
+    s->max_inflight = 1;
+
+    a = kfi_sched_flow_get(s, 1, "a");
+    b = kfi_sched_flow_get(s, 2, "b");
+    if (IS_ERR(a) || IS_ERR(b) || kfi_sched_set_weight(b, 300)) {
+        pr_err("FAIL: flow setup\n");
+        ret = -1;
+        goto out;
+    }
+
+    if (kfi_sched_set_weight(a, 0) != -EINVAL ||
+        kfi_sched_set_weight(a, KFI_SCHED_WEIGHT_MAX + 1) != -EINVAL) {
+        pr_err("FAIL: out-of-range weight accepted\n");
+        ret = -1;
+    }
+
+    fill(reqs, NR_REQS, 0, 64 * 1024);
+    fill(reqs + NR_REQS, NR_REQS, 1, 64 * 1024);
+
+    nr_dispatched = 0;
+    for (i = 0; i < NR_REQS; i++) {
+        kfi_sched_submit(a, &reqs[i].req);
+        kfi_sched_submit(b, &reqs[NR_REQS + i].req);
+    }
+
+    /* Only the very first submission found the device idle */
+    if (nr_dispatched != 1) {
+        pr_err("FAIL: %d submissions bypassed the queue\n", nr_dispatched);
+        ret = -1;
+    }
+
+    run_backlogged(s, NR_REQS, bytes);
+    pr_info("  weight 100: %llu KiB, weight 300: %llu KiB\n",
+            bytes[0] / 1024, bytes[1] / 1024);
+
+    /* 1:3, within a couple of quanta */
+    if (bytes[1] < 2 * bytes[0] || bytes[1] > 4 * bytes[0]) {
+        pr_err("FAIL: share ratio off\n");
+        ret = -1;
+    }
+
+out:
+    drain(s);
+    kfi_sched_flow_put(a);
+    kfi_sched_flow_put(b);
+    kfi_sched_destroy(s);
+    kfree(reqs);
+
+    if (!ret)
+        pr_info("PASS: Scheduler shares follow weights\n");
+    return ret;
+}
+
+static int test_sched_sizes(void)
+{
+    struct kfi_sched_flow *big, *small;
+    struct test_req *reqs;
+    struct kfi_sched *s;
+    u64 bytes[2];
+    int i, ret = 0;
+
+    pr_info("TEST: Scheduler is fair in bytes, not requests\n");
+
+    reqs = kcalloc(2 * NR_REQS, sizeof(*reqs), GFP_KERNEL);
+    if (!reqs)
+        return -1;
+
+    s = kfi_sched_create("test_sched_sizes");
+    if (IS_ERR(s)) {
+        kfree(reqs);
+        return -1;
+    }
+    s->max_inflight = 1;
+
+    big = kfi_sched_flow_get(s, 1, NULL);
+    small = kfi_sched_flow_get(s, 2, NULL);
+    if (IS_ERR(big) || IS_ERR(small)) {
+        ret = -1;
+        goto out;
+    }
+
+    /* A streaming job and a job issuing small RPCs, equal weights */
+    fill(reqs, NR_REQS, 0, 1024 * 1024);
+    fill(reqs + NR_REQS, NR_REQS, 1, 4096);
+
+    nr_dispatched = 0;
+    for (i = 0; i < NR_REQS; i++) {
+        kfi_sched_submit(big, &reqs[i].req);
+        kfi_sched_submit(small, &reqs[NR_REQS + i].req);
+    }
+
+    /* Stop while the small flow is still backlogged */
+    run_backlogged(s, NR_REQS / 2, bytes);
+    pr_info("  1 MiB flow: %llu KiB, 4 KiB flow: %llu KiB\n",
+            bytes[0] / 1024, bytes[1] / 1024);
+
+    if (!bytes[1] || bytes[0] > bytes[1] + 2 * 1024 * 1024) {
+        pr_err("FAIL: large requests starved the small flow\n");
+        ret = -1;
+    }
+
+    if (kfi_sched_flow_get(s, 1, NULL) != big) {
+        pr_err("FAIL: same key returned a different flow\n");
+        ret = -1;
+    } else {
+        kfi_sched_flow_put(big);
+    }
+
+out:
+    drain(s);
+    kfi_sched_flow_put(big);
+    kfi_sched_flow_put(small);
+    kfi_sched_destroy(s);
+    kfree(reqs);
+
+    if (!ret)
+        pr_info("PASS: Scheduler is fair in bytes\n");
+    return ret;
+}
+
+static int test_sched_delay(void)
+{
+    struct kfi_sched_flow *flow;
+    struct test_req reqs[2];
+    struct kfi_sched *s;
+    int ret = 0;
+
+    pr_info("TEST: Scheduler queueing delay accounting\n");
+
+    s = kfi_sched_create("test_sched_delay");
+    if (IS_ERR(s))
+        return -1;
+    s->max_inflight = 1;
+
+    flow = kfi_sched_flow_get(s, 1, NULL);
+    if (IS_ERR(flow)) {
+        kfi_sched_destroy(s);
+        return -1;
+    }
+
+    fill(reqs, 2, 0, 4096);
+    nr_dispatched = 0;
+
+    kfi_sched_submit(flow, &reqs[0].req);
+    if (flow->delay_max_ns) {
+        pr_err("FAIL: direct dispatch recorded a delay\n");
+        ret = -1;
+    }
+
+    kfi_sched_submit(flow, &reqs[1].req);
+    if (nr_dispatched != 1 || flow->nr_queued != 1) {
+        pr_err("FAIL: second submission should wait for the first\n");
+        ret = -1;
+    }
+
+    udelay(50);
+    kfi_sched_complete(s, 4096);
+
+    if (nr_dispatched != 2 || flow->delay_max_ns < 50 * NSEC_PER_USEC) {
+        pr_err("FAIL: dispatched=%d max delay=%lluns\n", nr_dispatched,
+               flow->delay_max_ns);
+        ret = -1;
+    }
+    pr_info("  queued submission waited %llu us\n",
+            flow->delay_max_ns / NSEC_PER_USEC);
+
+    kfi_sched_complete(s, 4096);
+    if (s->inflight) {
+        pr_err("FAIL: %llu bytes still in flight\n", s->inflight);
+        ret = -1;
+    }
+
+    kfi_sched_flow_put(flow);
+    kfi_sched_destroy(s);
+
+    if (!ret)
+        pr_info("PASS: Scheduler queueing delay accounting\n");
+    return ret;
+}
+
+static int test_sched_cancel(void)
+{
+    struct kfi_sched_flow *flow;
+    struct test_req reqs[3];
+    struct kfi_sched *s;
+    int ret = 0;
+
+    pr_info("TEST: Scheduler cancel\n");
+
+    s = kfi_sched_create("test_sched_cancel");
+    if (IS_ERR(s))
+        return -1;
+    s->max_inflight = 1;
+
+    flow = kfi_sched_flow_get(s, 1, NULL);
+    if (IS_ERR(flow)) {
+        kfi_sched_destroy(s);
+        return -1;
+    }
+
+    fill(reqs, 3, 0, 4096);
+    nr_dispatched = 0;
+
+    kfi_sched_submit(flow, &reqs[0].req);
+    kfi_sched_submit(flow, &reqs[1].req);
+    kfi_sched_submit(flow, &reqs[2].req);
+
+    /* Dispatched already: too late to take it back */
+    if (kfi_sched_cancel(s, &reqs[0].req)) {
+        pr_err("FAIL: cancelled a dispatched submission\n");
+        ret = -1;
+    }
+
+    if (!kfi_sched_cancel(s, &reqs[1].req) ||
+        kfi_sched_cancel(s, &reqs[1].req) || flow->nr_queued != 1) {
+        pr_err("FAIL: queued submission not cancelled once\n");
+        ret = -1;
+    }
+
+    /* The rest still goes, and the emptied flow leaves the round */
+    kfi_sched_complete(s, 4096);
+    if (nr_dispatched != 2 || dispatched[1] != &reqs[2] ||
+        kfi_sched_cancel(s, &reqs[2].req)) {
+        pr_err("FAIL: dispatched=%d after cancel\n", nr_dispatched);
+        ret = -1;
+    }
+    if (s->nr_active) {
+        pr_err("FAIL: %d flows still active\n", s->nr_active);
+        ret = -1;
+    }
+    kfi_sched_complete(s, 4096);
+
+    if (s->inflight || !list_empty(&flow->queue)) {
+        pr_err("FAIL: %llu bytes in flight after cancel\n", s->inflight);
+        ret = -1;
+    }
+    pr_info("  cancelled 1 of 3, dispatched %d\n", nr_dispatched);
+
+    kfi_sched_flow_put(flow);
+    kfi_sched_destroy(s);
+
+    if (!ret)
+        pr_info("PASS: Scheduler cancel\n");
+    return ret;
+}
+
+static int __init test_sched_init(void)
+{
+    int failures = 0;
+
+    pr_info("=== Running scheduler unit tests ===\n");
+
+    if (test_sched_weights())
+        failures++;
+    if (test_sched_sizes())
+        failures++;
+    if (test_sched_delay())
+        failures++;
+    if (test_sched_cancel())
+        failures++;
+
+    pr_info("=== Scheduler tests: %d failures ===\n", failures);
+
+    /* Return error to prevent module staying loaded */
+    return failures ? -EINVAL : -EAGAIN;
+}
+
+static void __exit test_sched_exit(void)
+{
+    pr_info("Scheduler tests unloaded\n");
+}
+
+module_init(test_sched_init);
+module_exit(test_sched_exit);
@@ -0,0 +1,185 @@
+/*
+ * Unit tests for transfer size tuning
+ *
+ * The tuner is a pure computation, driven here with synthetic READ and
+ * WRITE round trips; no kfabric devices or CXI hardware needed.
+ */
+
+#include <linux/module.h>
+#include <linux/string.h>
+#include "kfi_verbs_compat.h"
+#include "kfi_internal.h"
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Transfer size tuning unit tests");
+
+static int test_tune_threshold(void)
+{
+    struct kfi_tune t;
+    int i;
+
+    pr_info("TEST: READ threshold follows round trips\n");
+
+    kfi_tune_init(&t, 0, true);
+
+    /* Too few samples: the configured threshold stands */
+    for (i = 0; i < KFI_TUNE_MIN_SAMPLES - 1; i++) {
+        kfi_tune_read(&t, 4096, false, 20, 0);
+        kfi_tune_read(&t, 4096, true, 40, 1);
+    }
+    if (t.ddp_min != 0) {
+        pr_err("FAIL: threshold %u moved on %d samples\n", t.ddp_min, i);
+        return -1;
+    }
+
+    /* Small READs are cheaper copied, large ones placed */
+    for (i = 0; i < 2 * KFI_TUNE_MIN_SAMPLES; i++) {
+        kfi_tune_read(&t, 4096, false, 20, 0);
+        kfi_tune_read(&t, 4096, true, 40, 1);
+        kfi_tune_read(&t, 32768, false, 100, 0);
+        kfi_tune_read(&t, 32768, true, 60, 8);
+    }
+    if (t.ddp_min != 32768) {
+        pr_err("FAIL: threshold %u, expected 32768\n", t.ddp_min);
+        return -1;
+    }
+
+    /* Copying wins everywhere measured: placement starts above */
+    kfi_tune_init(&t, 0, true);
+    for (i = 0; i < KFI_TUNE_MIN_SAMPLES; i++) {
+        kfi_tune_read(&t, 8192, false, 20, 0);
+        kfi_tune_read(&t, 8192, true, 40, 2);
+    }
+    if (t.ddp_min != 16384) {
+        pr_err("FAIL: threshold %u, expected 16384\n", t.ddp_min);
+        return -1;
+    }
+
+    /* Disabled: measured and reported, never moved */
+    kfi_tune_init(&t, 1234, false);
+    for (i = 0; i < KFI_TUNE_MIN_SAMPLES; i++) {
+        kfi_tune_read(&t, 8192, false, 20, 0);
+        kfi_tune_read(&t, 8192, true, 40, 2);
+    }
+    if (t.ddp_min != 1234 || !t.rsize) {
+        pr_err("FAIL: disabled threshold %u rsize %u\n", t.ddp_min, t.rsize);
+        return -1;
+    }
+
+    pr_info("PASS: READ threshold follows round trips\n");
+    return 0;
+}
+
+static int test_tune_sizes(void)
+{
+    struct kfi_tune t;
+    int i;
+
+    pr_info("TEST: preferred sizes at the bandwidth knee\n");
+
+    kfi_tune_init(&t, 0, true);
+    if (t.rsize || t.wsize) {
+        pr_err("FAIL: sizes %u/%u before any sample\n", t.rsize, t.wsize);
+        return -1;
+    }
+
+    /* 1 GB/s at 64K, 2.6 GB/s at 256K, 2.8 GB/s at 1M */
+    for (i = 0; i < KFI_TUNE_MIN_SAMPLES; i++) {
+        kfi_tune_read(&t, 65536, true, 64, 16);
+        kfi_tune_read(&t, 262144, true, 100, 64);
+        kfi_tune_read(&t, 1048576, true, 380, 128);
+    }
+    if (t.rsize != 262144) {
+        pr_err("FAIL: rsize %u, expected 262144\n", t.rsize);
+        return -1;
+    }
+    if (t.wsize) {
+        pr_err("FAIL: wsize %u without WRITEs\n", t.wsize);
+        return -1;
+    }
+
+    /* WRITEs scale all the way */
+    for (i = 0; i < KFI_TUNE_MIN_SAMPLES; i++) {
+        kfi_tune_write(&t, 65536, 64, 16);
+        kfi_tune_write(&t, 1048576, 400, 128);
+    }
+    if (t.wsize != 1048576) {
+        pr_err("FAIL: wsize %u, expected 1048576\n", t.wsize);
+        return -1;
+    }
+
+    if (!(t.segs >> KFI_CWND_SRTT_SHIFT)) {
+        pr_err("FAIL: no segment count\n");
+        return -1;
+    }
+    pr_info("  rsize %u wsize %u segs %u\n", t.rsize, t.wsize,
+            t.segs >> KFI_CWND_SRTT_SHIFT);
+
+    pr_info("PASS: preferred sizes at the bandwidth knee\n");
+    return 0;
+}
+
+static int test_tune_probe(void)
+{
+    struct kfi_tune t;
+    int i, placed = 0, copied = 0;
+    u32 thr;
+
+    pr_info("TEST: READs probe the other side of the threshold\n");
+
+    kfi_tune_init(&t, 16384, true);
+    for (i = 0; i < 2 * KFI_TUNE_PROBE; i++) {
+        thr = kfi_tune_ddp_min(&t);
+        if (thr == 0)
+            placed++;
+        else if (thr == U32_MAX)
+            copied++;
+        else if (thr != 16384) {
+            pr_err("FAIL: threshold %u\n", thr);
+            return -1;
+        }
+    }
+    if (placed != 1 || copied != 1) {
+        pr_err("FAIL: %d placed and %d copied probes in %d READs\n",
+               placed, copied, i);
+        return -1;
+    }
+
+    kfi_tune_init(&t, 16384, false);
+    for (i = 0; i < 2 * KFI_TUNE_PROBE; i++) {
+        if (kfi_tune_ddp_min(&t) != 16384) {
+            pr_err("FAIL: disabled tuner probed\n");
+            return -1;
+        }
+    }
+
+    pr_info("PASS: READs probe the other side of the threshold\n");
+    return 0;
+}
+
+static int __init test_tune_init(void)
+{
+    int failures = 0;
+
+    pr_info("=== Running tuning unit tests ===\n");
+
+    if (test_tune_threshold())
+        failures++;
+    if (test_tune_sizes())
+        failures++;
+    if (test_tune_probe())
+        failures++;
+
+    pr_info("=== Tuning tests: %d failures ===\n", failures);
+
+    /* Return error to prevent module staying loaded */
+    return failures ? -EINVAL : -EAGAIN;
+}
+
+static void __exit test_tune_exit(void)
+{
+    pr_info("Tuning tests unloaded\n");
+}
+
+module_init(test_tune_init);
+module_exit(test_tune_exit);